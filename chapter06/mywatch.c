@@ -0,0 +1,539 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+/*
+ * stdio.h / stdlib.h / string.h:
+ *   fprintf(), printf(), malloc(), strcmp() などを使用。
+ *
+ * dirent.h:
+ *   起動時にディレクトリツリーを走査するために使用（myls.c と同じ API）。
+ *
+ * poll.h:
+ *   inotify の FD を「タイムアウト付き」で待つために使用。
+ *
+ * sys/inotify.h:
+ *   inotify_init1(), inotify_add_watch(), struct inotify_event を使用。
+ *
+ * このプログラムは chapter06 の他のツール（myls, mystat, mydf）が
+ * 「1回調べて終わり」なのに対して、
+ * ディレクトリツリーを監視し続け、変更があったパスを通知する。
+ *
+ * --------------------------------------------------------------------
+ * 【全体の流れ】
+ *
+ *   1) inotify_init1() で inotify インスタンス（FD）を作る
+ *   2) 指定ディレクトリ以下のすべてのディレクトリに inotify_add_watch()
+ *      （inotify はディレクトリ単位なので、再帰監視は自分で行う必要がある）
+ *   3) poll() で FD を待ち、read() でイベントをまとめて読み出す
+ *   4) イベントは「パスごと」に保留表へ溜め、マスクを OR で合成する（合体）
+ *   5) 最初のイベントから window ミリ秒たったら、保留表をまとめて出力する（バッチ）
+ *
+ * エディタの保存やビルドでは、同じファイルに対して
+ *   CREATE → MODIFY → MODIFY → ... → CLOSE_WRITE
+ * のようなイベントが短時間に大量に届く。
+ * これを1件ずつ下流（インデクサなど）に流すと、同じファイルを何度も処理してしまう。
+ * window の間に届いたイベントを 1 パス 1 レコードへまとめることで、
+ * 下流は「変わったパスの一覧」だけを受け取り、差分だけを処理できる。
+ *
+ * ツリーの中でディレクトリを移動（rename）すると、その下の監視もまとめて新しいパスに付け替える。
+ * ツリーの外へ出ていったディレクトリは監視をやめる。
+ *
+ * --------------------------------------------------------------------
+ * 【出力形式】（標準出力、1バッチごと）
+ *
+ *   batch <バッチ番号> <レコード数>
+ *   <イベント名|イベント名...> <パス>
+ *   ...
+ *   end
+ *
+ *   例:
+ *     batch 3 2
+ *     CREATE|MODIFY|CLOSE_WRITE /tmp/w/a.txt
+ *     DELETE /tmp/w/b.txt
+ *     end
+ *
+ * カーネルのイベントキューが溢れた場合（IN_Q_OVERFLOW）は
+ *   OVERFLOW -
+ * を出力する。このときイベントは失われているので、下流は全体を再走査する必要がある。
+ *
+ * --------------------------------------------------------------------
+ * 【fanotify について】
+ * fanotify(FAN_REPORT_FID) を使うとファイルシステム全体をまとめて監視できるが、
+ * CAP_SYS_ADMIN（root 権限）が必要になる。
+ * 一般ユーザーでも使えるよう、ここでは inotify で実装している。
+ *
+ * 使い方:
+ *   $ ./mywatch [-w window_ms] <dir>
+ *   （window_ms の既定値は 200）
+ *
+ * 【コンパイル】
+ *   gcc mywatch.c -o mywatch
+ */
+
+#define WD_HASH_N 1024      // wd → パス の表（ハッシュ表）のバケット数
+#define HASH_N 1024         // 保留表（ハッシュ表）のバケット数
+#define EV_BUF_SIZE 65536   // read() 1回で読み出すイベントバッファ
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*
+ * 監視ディスクリプタ(wd) → ディレクトリパス の対応表。
+ * inotify_event には wd と「ディレクトリ内の名前」しか入っていないので、
+ * フルパスを組み立てるためにこの表を引く。
+ *
+ * wd は増える一方で、消えたディレクトリの番号もすぐには使い回されない。
+ * wd をそのまま添字にした固定長の配列だと「これまでに作られたディレクトリの数」で
+ * 溢れてしまうので、今監視しているものだけを持つハッシュ表にする。
+ * 数の上限はカーネルの max_user_watches だけになる（超えると inotify_add_watch() が ENOSPC）。
+ */
+struct watch {
+   int wd;
+   int moving;               // MOVED_FROM を見て、まだ MOVED_TO を見ていない
+   char *path;               // ディレクトリのパス
+   struct watch *next;       // 同じバケットの次の監視
+};
+
+struct watch *watches[WD_HASH_N];
+
+/*
+ * 保留レコード:
+ *   window の間に届いたイベントをパスごとに1件へまとめたもの。
+ */
+struct pending {
+   char *path;               // 変更されたパス
+   unsigned int mask;        // 届いたイベントの OR
+   struct pending *next;     // 同じバケットの次のレコード
+};
+
+struct pending *table[HASH_N];
+int pending_n = 0;           // 現在保留中のレコード数
+
+int add_tree(int ifd, const char *path);
+struct watch *find_watch(int wd);
+struct watch *find_watch_path(const char *path);
+void set_watch(int wd, const char *path);
+void move_watches(const char *from, const char *to);
+void drop_watches(int ifd, const char *path);
+void del_watch(int wd);
+void add_pending(const char *path, unsigned int mask);
+void flush_batch(void);
+long now_ms(void);
+
+int main(int argc, char *argv[]){
+   int ifd, ret, opt, window = 200, timeout, overflow;
+   long first = 0;           // 保留表が空でなくなった時刻（ミリ秒）
+   ssize_t len;
+   char *p, path[PATH_MAX];
+   struct pollfd pfd;
+   struct inotify_event *ev;
+   struct watch *w, *mv;
+   /*
+    * イベントバッファは struct inotify_event の境界に揃えておく。
+    */
+   char buf[EV_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+   while((opt = getopt(argc, argv, "w:")) != -1){
+      if(opt == 'w'){
+         window = atoi(optarg);
+      }
+      else{
+         fprintf(stderr, "Usage: $ ./mywatch [-w window_ms] <dir>\n");
+         exit(1);
+      }
+   }
+   if(optind != argc - 1 || window < 0){
+      fprintf(stderr, "Usage: $ ./mywatch [-w window_ms] <dir>\n");
+      exit(1);
+   }
+
+   ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   /*
+    * inotify_init1():
+    *   inotify インスタンスを作り、その FD を返す。
+    *   IN_NONBLOCK にしておくと、読み出すイベントが無いとき read() は EAGAIN で戻る。
+    */
+   if(ifd < 0){
+      perror("inotify_init1");
+      exit(1);
+   }
+
+   if(add_tree(ifd, argv[optind]) < 0){
+      exit(1);
+   }
+   fprintf(stderr, "watching %s (window=%dms)\n", argv[optind], window);
+
+   pfd.fd = ifd;
+   pfd.events = POLLIN;
+
+   while(1){
+      /*
+       * 保留が無ければ無期限に待つ。
+       * 保留があれば「最初のイベント + window」までの残り時間だけ待つ。
+       */
+      if(pending_n == 0){
+         timeout = -1;
+      }
+      else{
+         timeout = (int)(first + window - now_ms());
+         if(timeout < 0) timeout = 0;
+      }
+
+      ret = poll(&pfd, 1, timeout);
+      if(ret < 0){
+         if(errno == EINTR) continue;
+         perror("poll");
+         break;
+      }
+
+      if(ret == 0){
+         /*
+          * タイムアウト = window が経過したので、保留表をまとめて出力する。
+          */
+         flush_batch();
+         continue;
+      }
+
+      /*
+       * read() 1回で複数のイベントがまとめて返ってくる。
+       * 各イベントは可変長（name の長さ len が付く）なので、順にたどる。
+       */
+      while((len = read(ifd, buf, sizeof(buf))) > 0){
+         overflow = 0;
+         for(p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len){
+            ev = (struct inotify_event *)p;
+
+            if(ev->mask & IN_Q_OVERFLOW){
+               overflow = 1;
+               continue;
+            }
+            w = find_watch(ev->wd);
+            if(w == NULL){
+               continue;
+            }
+
+            if(ev->len > 0){
+               snprintf(path, sizeof(path), "%s/%s", w->path, ev->name);
+            }
+            else{
+               snprintf(path, sizeof(path), "%s", w->path);
+            }
+
+            /*
+             * 新しくできたサブディレクトリは、その場で監視対象に加える。
+             * （作成とほぼ同時に中へ書き込まれたファイルは取りこぼす可能性があるが、
+             *   ディレクトリ自身の CREATE レコードが出るので下流はそこで走査できる）
+             */
+            if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))){
+               add_tree(ifd, path);
+            }
+
+            /*
+             * ディレクトリの移動は、元の親に MOVED_FROM、先の親に MOVED_TO、
+             * 動いたディレクトリ自身に MOVE_SELF の順で届く。
+             * ツリーの中での移動なら MOVED_TO で（add_tree() が同じ wd を受け取って）パスを付け替える。
+             * MOVED_TO が来ないまま MOVE_SELF が来たら、ツリーの外へ出ていったので監視をやめる。
+             */
+            if((ev->mask & IN_ISDIR) && (ev->mask & IN_MOVED_FROM)){
+               mv = find_watch_path(path);
+               if(mv != NULL) mv->moving = 1;
+            }
+
+            /*
+             * 監視中のディレクトリ自体が消えたら対応表から外す。
+             */
+            if(ev->mask & IN_IGNORED){
+               del_watch(ev->wd);
+               continue;
+            }
+
+            if(pending_n == 0) first = now_ms();
+            add_pending(path, ev->mask);
+
+            if((ev->mask & IN_MOVE_SELF) && w->moving){
+               drop_watches(ifd, path);
+            }
+         }
+
+         if(overflow){
+            /*
+             * キュー溢れ: 保留中のレコードを出したうえで、再走査が必要なことを通知する。
+             */
+            flush_batch();
+            printf("OVERFLOW -\n");
+            fflush(stdout);
+         }
+      }
+      if(len < 0 && errno != EAGAIN){
+         perror("read");
+         break;
+      }
+
+      if(pending_n > 0 && now_ms() - first >= window){
+         flush_batch();
+      }
+   }
+
+   close(ifd);
+   return 0;
+}
+
+/*
+ * path 以下のすべてのディレクトリに inotify の監視を付ける。
+ */
+int add_tree(int ifd, const char *path){
+   int wd;
+   DIR *dir;
+   struct dirent *de;
+   struct stat st;
+   char child[PATH_MAX];
+
+   wd = inotify_add_watch(ifd, path, WATCH_MASK | IN_ONLYDIR);
+   if(wd < 0){
+      perror(path);
+      return -1;
+   }
+   set_watch(wd, path);
+
+   dir = opendir(path);
+   if(dir == NULL){
+      return 0;
+   }
+   while((de = readdir(dir)) != NULL){
+      if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+      snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+      if(lstat(child, &st) == 0 && S_ISDIR(st.st_mode)){
+         add_tree(ifd, child);
+      }
+   }
+   closedir(dir);
+
+   return 0;
+}
+
+/*
+ * wd の監視を引く（無ければ NULL）。
+ */
+struct watch *find_watch(int wd){
+   struct watch *w;
+
+   for(w = watches[wd % WD_HASH_N]; w != NULL; w = w->next){
+      if(w->wd == wd) return w;
+   }
+   return NULL;
+}
+
+/*
+ * パスで監視を引く（MOVED_FROM は親の wd と名前でしか届かないので、表全体を探す）。
+ */
+struct watch *find_watch_path(const char *path){
+   int i;
+   struct watch *w;
+
+   for(i = 0; i < WD_HASH_N; i++){
+      for(w = watches[i]; w != NULL; w = w->next){
+         if(strcmp(w->path, path) == 0) return w;
+      }
+   }
+   return NULL;
+}
+
+/*
+ * wd → path を表に入れる。
+ * 同じ inode にはカーネルが同じ wd を返すので、すでにあってパスが違えば
+ * ツリーの中で移動してきたディレクトリ。その下の監視のパスもまとめて付け替える。
+ */
+void set_watch(int wd, const char *path){
+   struct watch *w = find_watch(wd);
+
+   if(w != NULL){
+      w->moving = 0;
+      if(strcmp(w->path, path) != 0) move_watches(w->path, path);
+      return;
+   }
+
+   w = malloc(sizeof(*w));
+   if(w == NULL){
+      perror("malloc");
+      exit(1);
+   }
+   w->wd = wd;
+   w->moving = 0;
+   w->path = strdup(path);
+   w->next = watches[wd % WD_HASH_N];
+   watches[wd % WD_HASH_N] = w;
+}
+
+/*
+ * p が dir 自身かその下なら 1。
+ */
+static int under(const char *p, const char *dir, size_t n){
+   return strncmp(p, dir, n) == 0 && (p[n] == '\0' || p[n] == '/');
+}
+
+/*
+ * from 以下を監視しているもののパスの先頭を to に書き換える。
+ */
+void move_watches(const char *from, const char *to){
+   int i;
+   size_t n;
+   char *old, *path;
+   struct watch *w;
+
+   old = strdup(from);          // from は書き換える監視自身のパスかもしれない
+   n = strlen(old);
+   for(i = 0; i < WD_HASH_N; i++){
+      for(w = watches[i]; w != NULL; w = w->next){
+         if(!under(w->path, old, n)) continue;
+
+         path = malloc(strlen(to) + strlen(w->path + n) + 1);
+         if(path == NULL){
+            perror("malloc");
+            exit(1);
+         }
+         strcpy(path, to);
+         strcat(path, w->path + n);
+         free(w->path);
+         w->path = path;
+      }
+   }
+   free(old);
+}
+
+/*
+ * path 以下の監視をすべて外す（ツリーの外へ出ていったディレクトリ）。
+ * 後から届く IN_IGNORED は、表に無い wd として読み捨てる。
+ */
+void drop_watches(int ifd, const char *path){
+   int i;
+   size_t n = strlen(path);
+   struct watch **pp, *w;
+
+   for(i = 0; i < WD_HASH_N; i++){
+      for(pp = &watches[i]; (w = *pp) != NULL; ){
+         if(!under(w->path, path, n)){
+            pp = &w->next;
+            continue;
+         }
+         inotify_rm_watch(ifd, w->wd);
+         *pp = w->next;
+         free(w->path);
+         free(w);
+      }
+   }
+}
+
+/*
+ * wd を表から外す。
+ */
+void del_watch(int wd){
+   struct watch **pp, *w;
+
+   for(pp = &watches[wd % WD_HASH_N]; (w = *pp) != NULL; pp = &w->next){
+      if(w->wd == wd){
+         *pp = w->next;
+         free(w->path);
+         free(w);
+         return;
+      }
+   }
+}
+
+/*
+ * 保留表に (path, mask) を追加する。
+ * 同じパスがすでにあれば、マスクを OR で合成するだけにする（イベントの合体）。
+ */
+void add_pending(const char *path, unsigned int mask){
+   unsigned int h = 5381;
+   const char *s;
+   struct pending *pe;
+
+   for(s = path; *s != '\0'; s++){
+      h = h * 33 + (unsigned char)*s;   // djb2 ハッシュ
+   }
+   h %= HASH_N;
+
+   for(pe = table[h]; pe != NULL; pe = pe->next){
+      if(strcmp(pe->path, path) == 0){
+         pe->mask |= mask;
+         return;
+      }
+   }
+
+   pe = malloc(sizeof(*pe));
+   if(pe == NULL){
+      perror("malloc");
+      exit(1);
+   }
+   pe->path = strdup(path);
+   pe->mask = mask;
+   pe->next = table[h];
+   table[h] = pe;
+   pending_n++;
+}
+
+/*
+ * 保留表の内容を1バッチとして出力し、表を空にする。
+ */
+void flush_batch(void){
+   static unsigned long seq = 0;
+   static const struct { unsigned int bit; const char *name; } names[] = {
+      { IN_CREATE, "CREATE" },         { IN_MODIFY, "MODIFY" },
+      { IN_ATTRIB, "ATTRIB" },         { IN_CLOSE_WRITE, "CLOSE_WRITE" },
+      { IN_MOVED_FROM, "MOVED_FROM" }, { IN_MOVED_TO, "MOVED_TO" },
+      { IN_DELETE, "DELETE" },         { IN_DELETE_SELF, "DELETE_SELF" },
+      { IN_MOVE_SELF, "MOVE_SELF" },
+   };
+   int i, j, sep;
+   struct pending *pe, *next;
+
+   if(pending_n == 0) return;
+
+   printf("batch %lu %d\n", ++seq, pending_n);
+   for(i = 0; i < HASH_N; i++){
+      for(pe = table[i]; pe != NULL; pe = next){
+         next = pe->next;
+
+         sep = 0;
+         for(j = 0; j < (int)(sizeof(names) / sizeof(names[0])); j++){
+            if(pe->mask & names[j].bit){
+               printf("%s%s", sep ? "|" : "", names[j].name);
+               sep = 1;
+            }
+         }
+         printf("%s %s\n", (pe->mask & IN_ISDIR) ? "|ISDIR" : "", pe->path);
+
+         free(pe->path);
+         free(pe);
+      }
+      table[i] = NULL;
+   }
+   printf("end\n");
+
+   /*
+    * 下流がパイプで読んでいる場合、stdout は全バッファリングになるので、
+    * バッチ単位で明示的に flush する。
+    */
+   fflush(stdout);
+   pending_n = 0;
+}
+
+/*
+ * 単調増加時計（CLOCK_MONOTONIC）の現在値をミリ秒で返す。
+ * time() と違い、システム時刻の変更に影響されない。
+ */
+long now_ms(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "aclient.h"
+
+/*
+ * aclient.h の実装。
+ */
+
+#define ACL_BATCH 64                 // sendmmsg 1回で送る要求の数の上限
+#define EV_MAX 64
+
+static void conn_start(struct acl_conn *c);
+static void conn_fail(struct acl_conn *c);
+static void conn_send(struct acl_conn *c);
+static void conn_recv(struct acl_conn *c);
+static void on_retry(struct twtimer *t, void *arg);
+static void on_deadline(struct twtimer *t, void *arg);
+
+static uint64_t now_ns(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * 双方向リスト（待ち行列と、接続ごとの応答待ちの列）。
+ */
+static void list_push_tail(struct acl_list *l, struct acl_req *r){
+   r->next = NULL;
+   r->prev = l->tail;
+   if(l->tail != NULL) l->tail->next = r;
+   else l->head = r;
+   l->tail = r;
+   l->n++;
+}
+
+static void list_push_head(struct acl_list *l, struct acl_req *r){
+   r->prev = NULL;
+   r->next = l->head;
+   if(l->head != NULL) l->head->prev = r;
+   else l->tail = r;
+   l->head = r;
+   l->n++;
+}
+
+static void list_remove(struct acl_list *l, struct acl_req *r){
+   if(r->prev != NULL) r->prev->next = r->next;
+   else l->head = r->next;
+   if(r->next != NULL) r->next->prev = r->prev;
+   else l->tail = r->prev;
+   r->next = r->prev = NULL;
+   l->n--;
+}
+
+/*
+ * 要求を完了させる（どの列にも入っていないこと）。コールバックがあれば呼んで解放する。
+ */
+static void complete(struct aclient *cl, struct acl_req *r, int status){
+   twheel_cancel(&cl->wheel, &r->timer);
+   r->status = status;
+   r->t_done = now_ns();
+   cl->pending--;
+   if(status == ACL_OK) cl->n_ok++;
+   else cl->n_fail++;
+   if(r->cb != NULL){
+      r->cb(r, r->arg);
+      slab_free(&cl->req_pool, r);
+   }
+}
+
+/*
+ * epoll に登録するイベントを変える。
+ */
+static void set_events(struct acl_conn *c, uint32_t events){
+   struct epoll_event ev;
+
+   if(c->events == events) return;
+   ev.events = events;
+   ev.data.ptr = c;
+   if(epoll_ctl(c->cl->efd, c->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, c->fd, &ev) < 0){
+      perror("epoll_ctl");
+   }
+   c->events = events;
+}
+
+int acl_init(struct aclient *cl, const struct sockaddr *addr, socklen_t addr_len, int type, int nconns, int depth){
+   int i;
+
+   memset(cl, 0, sizeof(*cl));
+   if(addr_len > sizeof(cl->addr) || nconns < 1){
+      errno = EINVAL;
+      return -1;
+   }
+   memcpy(&cl->addr, addr, addr_len);
+   cl->addr_len = addr_len;
+   cl->type = type;
+   cl->depth = type == SOCK_SEQPACKET && depth > 1 ? depth : 1;
+   cl->reply_size = sizeof(int);
+   cl->timeout_ms = 5000;
+   cl->max_tries = 3;
+   cl->backoff_min_ms = 10;
+   cl->backoff_max_ms = 2000;
+   cl->seed = (unsigned int)now_ns();
+
+   cl->efd = epoll_create1(EPOLL_CLOEXEC);
+   if(cl->efd < 0) return -1;
+   twheel_init(&cl->wheel, ACL_TICK_MS, twheel_now_ms());
+   slab_init(&cl->req_pool, sizeof(struct acl_req), 256);
+
+   cl->conns = calloc(nconns, sizeof(cl->conns[0]));
+   if(cl->conns == NULL){
+      close(cl->efd);
+      return -1;
+   }
+   cl->nconns = nconns;
+   for(i = 0; i < nconns; i++){
+      cl->conns[i].fd = -1;
+      cl->conns[i].cl = cl;
+      cl->conns[i].backoff_ms = cl->backoff_min_ms;
+      twtimer_init(&cl->conns[i].retry, on_retry, &cl->conns[i]);
+      conn_start(&cl->conns[i]);
+   }
+   return 0;
+}
+
+/*
+ * ノンブロッキングで接続を始める。完了は EPOLLOUT で分かる。
+ */
+static void conn_start(struct acl_conn *c){
+   struct aclient *cl = c->cl;
+   int on = 1;
+
+   c->fd = socket(cl->addr.ss_family, cl->type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if(c->fd < 0){
+      conn_fail(c);
+      return;
+   }
+   /*
+    * 要求は小さいので、Nagle で溜めずにすぐ送る。
+    */
+   if(cl->addr.ss_family == AF_INET) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+   c->events = 0;
+   c->rlen = 0;
+   if(connect(c->fd, (struct sockaddr *)&cl->addr, cl->addr_len) == 0){
+      c->state = ACL_UP;
+      c->backoff_ms = cl->backoff_min_ms;
+      cl->n_connects++;
+      set_events(c, EPOLLIN);
+      return;
+   }
+   if(errno != EINPROGRESS){
+      conn_fail(c);
+      return;
+   }
+   c->state = ACL_CONNECTING;
+   set_events(c, EPOLLOUT);
+}
+
+/*
+ * 接続が切れた（またはつながらなかった）: 閉じて、応答を待っていた要求を待ち行列の先頭へ戻し、
+ * バックオフの後でつなぎ直す。送り直しの回数を使い切った要求は失敗にする。
+ */
+static void conn_fail(struct acl_conn *c){
+   struct aclient *cl = c->cl;
+   struct acl_req *r;
+   long delay;
+
+   if(c->fd >= 0) close(c->fd);            // close すると epoll からも外れる
+   c->fd = -1;
+   c->events = 0;
+   c->state = ACL_DOWN;
+   c->rlen = 0;
+
+   /*
+    * 後ろから順に先頭へ戻すと、送った順のまま待ち行列の先頭に並ぶ。
+    */
+   while((r = c->inflight.tail) != NULL){
+      list_remove(&c->inflight, r);
+      r->conn = NULL;
+      if(r->tries >= cl->max_tries){
+         complete(cl, r, -ECONNRESET);
+         continue;
+      }
+      list_push_head(&cl->queue, r);
+      cl->n_resent++;
+   }
+
+   /*
+    * 間隔は [backoff/2, backoff) の間で揺らす（全部の接続が同時につなぎ直しに行かないように）。
+    */
+   delay = c->backoff_ms / 2 + rand_r(&cl->seed) % (c->backoff_ms / 2 + 1);
+   c->backoff_ms *= 2;
+   if(c->backoff_ms > cl->backoff_max_ms) c->backoff_ms = cl->backoff_max_ms;
+   twheel_add(&cl->wheel, &c->retry, delay);
+}
+
+static void on_retry(struct twtimer *t, void *arg){
+   (void)t;
+   conn_start(arg);
+}
+
+/*
+ * 待ち行列の先頭から、この接続で応答を待てる数だけ送る。
+ * SOCK_SEQPACKET では sendmmsg で1回にまとめて送る。
+ */
+static void conn_send(struct acl_conn *c){
+   struct aclient *cl = c->cl;
+   struct mmsghdr msgs[ACL_BATCH];
+   struct iovec iov[ACL_BATCH];
+   struct acl_req *r;
+   int n, i, k;
+
+   while(c->state == ACL_UP && cl->queue.n > 0){
+      n = cl->depth - c->inflight.n;
+      if(n > cl->queue.n) n = cl->queue.n;
+      if(n > ACL_BATCH) n = ACL_BATCH;
+      if(n <= 0) break;
+
+      memset(msgs, 0, sizeof(msgs[0]) * n);
+      for(i = 0, r = cl->queue.head; i < n; i++, r = r->next){
+         iov[i].iov_base = r->data;
+         iov[i].iov_len = r->len;
+         msgs[i].msg_hdr.msg_iov = &iov[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+      k = sendmmsg(c->fd, msgs, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if(k < 0){
+         if(errno == EAGAIN || errno == EWOULDBLOCK){
+            set_events(c, EPOLLIN | EPOLLOUT);    // 送れるようになったら続きを送る
+            return;
+         }
+         conn_fail(c);
+         return;
+      }
+      cl->n_batches++;
+
+      /*
+       * 送れた分を応答待ちの列へ移す。
+       */
+      for(i = 0; i < k; i++){
+         r = cl->queue.head;
+         list_remove(&cl->queue, r);
+         list_push_tail(&c->inflight, r);
+         r->conn = c;
+         r->tries++;
+         /*
+          * SOCK_STREAM で一部しか送れなかったら、要求の区切りが崩れるのでつなぎ直す
+          * （小さな要求を1つずつ送るので、普通は起きない）。
+          */
+         if((int)msgs[i].msg_len != r->len){
+            conn_fail(c);
+            return;
+         }
+      }
+      if(k < n){
+         set_events(c, EPOLLIN | EPOLLOUT);
+         return;
+      }
+   }
+   if(c->state == ACL_UP) set_events(c, EPOLLIN);
+}
+
+/*
+ * 届いている応答をすべて読み、応答待ちの列の先頭から順に完了させる。
+ */
+static void conn_recv(struct acl_conn *c){
+   struct aclient *cl = c->cl;
+   struct acl_req *r;
+   char buf[4096];
+   ssize_t ret;
+   int off, n;
+
+   while(1){
+      ret = recv(c->fd, buf, cl->type == SOCK_SEQPACKET ? ACL_REPLY_MAX : (int)sizeof(buf), MSG_DONTWAIT);
+      if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+      if(ret <= 0){
+         conn_fail(c);
+         return;
+      }
+
+      for(off = 0; off < ret; off += n){
+         r = c->inflight.head;
+         if(r == NULL){
+            /*
+             * 頼んでいない応答: 対応が崩れているので、つなぎ直す。
+             */
+            conn_fail(c);
+            return;
+         }
+         if(cl->type == SOCK_SEQPACKET){
+            n = ret;                          // 1通が応答1つ
+            memcpy(r->reply, buf, n);
+            r->reply_len = n;
+         }
+         else{
+            n = cl->reply_size - c->rlen;    // 応答1つの残り
+            if(n > ret - off) n = ret - off;
+            memcpy(c->rbuf + c->rlen, buf + off, n);
+            c->rlen += n;
+            if(c->rlen < cl->reply_size) continue;
+            memcpy(r->reply, c->rbuf, c->rlen);
+            r->reply_len = c->rlen;
+            c->rlen = 0;
+         }
+         list_remove(&c->inflight, r);
+         r->conn = NULL;
+         complete(cl, r, ACL_OK);
+      }
+   }
+   conn_send(c);
+}
+
+/*
+ * 要求の締め切り: 失敗にする。応答を待っていた接続は、この要求の応答が後から届くと
+ * 次の要求の応答と取り違えるので、切ってつなぎ直す（他の要求は送り直す）。
+ */
+static void on_deadline(struct twtimer *t, void *arg){
+   struct acl_req *r = arg;
+   struct aclient *cl = r->cl;
+   struct acl_conn *c = r->conn;
+
+   (void)t;
+   if(c != NULL){
+      list_remove(&c->inflight, r);
+      r->conn = NULL;
+      complete(cl, r, -ETIMEDOUT);
+      conn_fail(c);
+      return;
+   }
+   list_remove(&cl->queue, r);
+   complete(cl, r, -ETIMEDOUT);
+}
+
+struct acl_req *acl_call(struct aclient *cl, const void *data, size_t len, acl_cb cb, void *arg){
+   struct acl_req *r;
+
+   if(len > ACL_REQ_MAX){
+      errno = EMSGSIZE;
+      return NULL;
+   }
+   r = slab_alloc(&cl->req_pool);
+   if(r == NULL) return NULL;
+
+   r->id = cl->next_id++;
+   r->status = ACL_PENDING;
+   r->tries = 0;
+   r->t_start = now_ns();
+   r->t_done = 0;
+   r->cb = cb;
+   r->arg = arg;
+   r->conn = NULL;
+   r->cl = cl;
+   r->len = len;
+   r->reply_len = 0;
+   memcpy(r->data, data, len);
+   twtimer_init(&r->timer, on_deadline, r);
+   if(cl->timeout_ms > 0) twheel_add(&cl->wheel, &r->timer, cl->timeout_ms);
+
+   list_push_tail(&cl->queue, r);
+   cl->pending++;
+   return r;
+}
+
+/*
+ * 待ち行列の要求を、つながっている接続に割り当てて送る。
+ * 毎回同じ接続から埋めないよう、始める接続を1つずつずらす。
+ */
+static void flush_queue(struct aclient *cl){
+   int i;
+
+   for(i = 0; i < cl->nconns && cl->queue.n > 0; i++){
+      conn_send(&cl->conns[(cl->rr + i) % cl->nconns]);
+   }
+   cl->rr = (cl->rr + 1) % cl->nconns;
+}
+
+void acl_run(struct aclient *cl, int timeout_ms){
+   struct epoll_event evs[EV_MAX];
+   struct acl_conn *c;
+   int nev, i, err;
+   long to;
+   socklen_t len;
+
+   flush_queue(cl);
+
+   to = twheel_timeout(&cl->wheel, twheel_now_ms());
+   if(to < 0 || (timeout_ms >= 0 && timeout_ms < to)) to = timeout_ms;
+   nev = epoll_wait(cl->efd, evs, EV_MAX, (int)to);
+
+   for(i = 0; i < nev; i++){
+      c = evs[i].data.ptr;
+      if(c->fd < 0) continue;                  // この周回で既に閉じた
+
+      if(c->state == ACL_CONNECTING){
+         /*
+          * ノンブロッキングの connect の結果は SO_ERROR で分かる。
+          */
+         err = 0;
+         len = sizeof(err);
+         getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+         if(err != 0){
+            conn_fail(c);
+            continue;
+         }
+         c->state = ACL_UP;
+         c->backoff_ms = cl->backoff_min_ms;
+         cl->n_connects++;
+         conn_send(c);
+         continue;
+      }
+
+      if(evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) conn_recv(c);
+      else if(evs[i].events & EPOLLOUT) conn_send(c);
+   }
+
+   twheel_advance(&cl->wheel, twheel_now_ms());
+   flush_queue(cl);
+}
+
+int acl_wait(struct aclient *cl, struct acl_req *req){
+   while(req->status == ACL_PENDING) acl_run(cl, -1);
+   return req->status;
+}
+
+void acl_release(struct aclient *cl, struct acl_req *req){
+   slab_free(&cl->req_pool, req);
+}
+
+void acl_destroy(struct aclient *cl){
+   struct acl_req *r;
+   struct acl_conn *c;
+   int i;
+
+   while((r = cl->queue.head) != NULL){
+      list_remove(&cl->queue, r);
+      complete(cl, r, -ECANCELED);
+   }
+   for(i = 0; i < cl->nconns; i++){
+      c = &cl->conns[i];
+      while((r = c->inflight.head) != NULL){
+         list_remove(&c->inflight, r);
+         r->conn = NULL;
+         complete(cl, r, -ECANCELED);
+      }
+      twheel_cancel(&cl->wheel, &c->retry);
+      if(c->fd >= 0) close(c->fd);
+   }
+   free(cl->conns);
+   close(cl->efd);
+   slab_destroy(&cl->req_pool);
+}
@@ -0,0 +1,185 @@
+#ifndef ACLIENT_H
+#define ACLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "twheel.h"
+#include "slab.h"
+
+/*
+ * aclient: 非同期で多重化するクライアントのライブラリ（接続プールつき）
+ *
+ * client_socket.c は接続1本で「送って、応答が来るまで待つ」を繰り返すので、
+ * 同時に出せる要求は1つだけで、1往復ぶんの待ち時間がそのまま1要求の時間になる。
+ * ここでは:
+ *
+ *   - 接続を nconns 本持ち（接続プール）、要求を空いている接続に振り分ける
+ *   - 要求を出すと（acl_call()）すぐに戻り、応答はコールバック、または acl_wait() で受け取る（future）
+ *   - 要求には通し番号（id）を付ける。応答はプロトコル上 id を持たないので、
+ *     接続ごとに「送った順の列」を持ち、届いた応答を列の先頭の要求に対応させる
+ *   - 接続が切れたら、指数的に間隔を延ばしながら（バックオフ）つなぎ直す。
+ *     その接続で応答を待っていた要求は、他の接続（またはつなぎ直した接続）で送り直す
+ *   - 要求ごとに締め切りを付ける。応答が来ないまま締め切りを過ぎたら、その要求は失敗にし、
+ *     接続は（応答の順番が分からなくなるので）切ってつなぎ直す
+ *
+ * 1つの接続で応答を待たずに続けて送れる要求の数（depth）はソケットの種類で決まる:
+ *   SOCK_STREAM（TCP / -u）   : 1。続けて送ると、サーバの recv 1回に複数の要求がまとまって届き、
+ *                               応答の数が合わなくなる（TCP にはメッセージの境界が無い）
+ *   SOCK_SEQPACKET（-q）      : acl_init() の depth まで。送った1通がそのまま1要求になる。
+ *                               溜まっている要求は sendmmsg でまとめて送る（バッチ）
+ *
+ * 要求は、空いている接続が無ければ待ち行列に入り、acl_run() の中で接続が空くたびに送られる。
+ * 同じ周回で出した要求は、まとめて送る（1要求ごとにシステムコールを呼ばない）。
+ *
+ * struct aclient はスレッドをまたいで使えない（ロックしていない）。
+ * 複数のスレッドから使うときは、スレッドごとに struct aclient を1つ作る
+ * （それぞれが自分の接続プールと epoll を持つ。client_async.c を参照）。
+ *
+ * 使い方:
+ *   struct aclient cl;
+ *   acl_init(&cl, (struct sockaddr *)&addr, sizeof(addr), SOCK_STREAM, 8, 1);
+ *
+ *   // コールバック: 応答（または失敗）で呼ばれ、その後 req は解放される
+ *   acl_call(&cl, "hello", 5, on_reply, arg);
+ *
+ *   // future: cb を NULL にすると、完了しても req は残る。acl_wait() で待ち、acl_release() で返す
+ *   req = acl_call(&cl, "hello", 5, NULL, NULL);
+ *   acl_wait(&cl, req);
+ *   if(req->status == 0) n = acl_reply_int(req);
+ *   acl_release(&cl, req);
+ *
+ *   while(cl.pending > 0) acl_run(&cl, -1);        // 全部終わるまでイベントループを回す
+ *   acl_destroy(&cl);
+ *
+ * 【コンパイル】
+ *   gcc prog.c aclient.c twheel.c slab.c -o prog
+ */
+
+#define ACL_REQ_MAX 255              // 要求の最大長（サーバの受信バッファ - 1）
+#define ACL_REPLY_MAX 256            // 応答の最大長（SOCK_SEQPACKET。handler の出力の上限）
+#define ACL_TICK_MS 10               // 締め切りとバックオフのタイマーの刻み
+
+/*
+ * 要求の状態。
+ */
+#define ACL_PENDING 1                // まだ終わっていない
+#define ACL_OK 0                     // 応答を受け取った
+/* 失敗は負の errno（-ETIMEDOUT: 締め切り、-ECONNRESET: 送り直しの回数を使い切った、-ECANCELED: acl_destroy） */
+
+struct aclient;
+struct acl_req;
+struct acl_conn;
+
+typedef void (*acl_cb)(struct acl_req *r, void *arg);
+
+struct acl_req {
+   uint64_t id;                      // 通し番号
+   int status;                       // ACL_PENDING / ACL_OK / 負の errno
+   int tries;                        // 送った回数
+   uint64_t t_start;                 // acl_call() した時刻（ns）
+   uint64_t t_done;                  // 終わった時刻（ns）
+   acl_cb cb;
+   void *arg;
+   struct acl_req *next, *prev;      // 待ち行列、または接続の応答待ちの列
+   struct acl_conn *conn;            // 応答を待っている接続（待ち行列にいれば NULL）
+   struct twtimer timer;             // 締め切り
+   struct aclient *cl;
+   int len;
+   int reply_len;
+   char data[ACL_REQ_MAX];
+   char reply[ACL_REPLY_MAX];
+};
+
+struct acl_list {
+   struct acl_req *head, *tail;
+   int n;
+};
+
+/*
+ * 接続プールの1本。
+ */
+#define ACL_DOWN 0                   // つながっていない（retry のタイマーでつなぎ直す）
+#define ACL_CONNECTING 1             // ノンブロッキングの connect の完了待ち
+#define ACL_UP 2
+
+struct acl_conn {
+   int fd;
+   int state;
+   uint32_t events;                  // 今 epoll に登録しているイベント
+   int backoff_ms;                   // 次につなぎ直すまでの間隔
+   struct acl_list inflight;         // 送って応答を待っている要求（送った順）
+   struct twtimer retry;             // つなぎ直し
+   struct aclient *cl;
+   int rlen;                         // SOCK_STREAM: 途中まで受け取った応答の長さ
+   char rbuf[ACL_REPLY_MAX];
+};
+
+struct aclient {
+   int efd;
+   struct twheel wheel;
+   struct sockaddr_storage addr;     // 接続先
+   socklen_t addr_len;
+   int type;                         // SOCK_STREAM / SOCK_SEQPACKET
+   int depth;                        // 1つの接続で応答を待てる要求の数
+   int reply_size;                   // SOCK_STREAM の応答1つの大きさ（既定 4 = strlen の int）
+   long timeout_ms;                  // 要求の締め切り（0 なら無し。既定 5000）
+   int max_tries;                    // 接続が切れたときに送り直す回数の上限（既定 3）
+   int backoff_min_ms, backoff_max_ms;   // つなぎ直す間隔（既定 10 〜 2000）
+   struct acl_conn *conns;
+   int nconns;
+   struct acl_list queue;            // まだ送っていない要求
+   long pending;                     // 終わっていない要求の数
+   uint64_t next_id;
+   unsigned int seed;                // バックオフの揺らぎ用の乱数の種
+   int rr;                           // 次に要求を割り当て始める接続
+   struct slab_pool req_pool;
+   long n_ok, n_fail, n_resent, n_connects, n_batches;   // 統計
+};
+
+/*
+ * addr へ nconns 本の接続プールを作る（接続はすぐ始めるが、完了は待たない）。
+ * type は SOCK_STREAM か SOCK_SEQPACKET。depth は SOCK_SEQPACKET のときだけ使う。失敗で -1。
+ */
+int acl_init(struct aclient *cl, const struct sockaddr *addr, socklen_t addr_len, int type, int nconns, int depth);
+
+/*
+ * 要求を出す（len バイト、ACL_REQ_MAX まで）。送るのは acl_run() の中。
+ * cb が NULL でなければ、完了したときに cb(req, arg) を呼び、戻ったら req を解放する。
+ * cb が NULL なら req は完了後も残るので、acl_release() で返すこと。
+ * 要求を作れなければ NULL。
+ */
+struct acl_req *acl_call(struct aclient *cl, const void *data, size_t len, acl_cb cb, void *arg);
+
+/*
+ * イベントループを1回まわす: 溜まっている要求を送り、届いた応答を処理し、期限の来たタイマーを実行する。
+ * 何も起きなければ最大 timeout_ms 待つ（-1 なら何か起きるまで）。
+ */
+void acl_run(struct aclient *cl, int timeout_ms);
+
+/*
+ * req が完了するまで acl_run() を回す。req->status を返す。
+ */
+int acl_wait(struct aclient *cl, struct acl_req *req);
+
+/*
+ * cb を NULL にして出した要求を返す（完了していること）。
+ */
+void acl_release(struct aclient *cl, struct acl_req *req);
+
+/*
+ * 終わっていない要求を -ECANCELED で完了させ、接続を閉じる。
+ */
+void acl_destroy(struct aclient *cl);
+
+/*
+ * strlen の応答（int）を取り出す。
+ */
+static inline int acl_reply_int(const struct acl_req *r){
+   int n = 0;
+
+   if(r->reply_len >= (int)sizeof(n)) __builtin_memcpy(&n, r->reply, sizeof(n));
+   return n;
+}
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "aclient.h"
+
+#define T_MAX 64
+
+#define USAGE "Usage: $ ./client_async [-t threads] [-c conns] [-n requests] [-w window] [-d depth] [-T timeout_ms] (ip port | -u path | -q path)\n"
+
+/*
+ * aclient.h のライブラリを使って、strlen サービスへ大量の要求を並行に出すクライアント。
+ *
+ * スレッドを threads 個作り、それぞれが自分の struct aclient（conns 本の接続プール）で
+ * requests 個の要求を出す。同時に応答を待っている要求は、スレッドあたり最大 window 個。
+ * 応答が来るたびにコールバックで次の要求を出す（window 個の要求が常に流れている）。
+ * 応答が strlen(要求) と一致するかも確かめる。
+ *
+ *   -t <数> : スレッド数（既定 2）
+ *   -c <数> : スレッドあたりの接続数（既定 8）
+ *   -n <数> : スレッドあたりの要求数（既定 100000）
+ *   -w <数> : スレッドあたりの同時に出しておく要求数（既定 256）
+ *   -d <数> : -q のとき、1つの接続で応答を待てる要求数（既定 16。TCP / -u では常に 1）
+ *   -T <ミリ秒> : 要求の締め切り（既定 5000）
+ *
+ * 途中でサーバを再起動すると、切れた接続はバックオフしながらつなぎ直され、
+ * 応答を待っていた要求は送り直される（resent に数えられる）。
+ *
+ * 使い方:
+ *   $ ./server_m_sockets -c 200 -q @strlen 5000
+ *   $ ./client_async -t 4 -c 8 -n 100000 127.0.0.1 5000
+ *   $ ./client_async -t 4 -c 2 -d 32 -q @strlen
+ *
+ * 【コンパイル】
+ *   gcc client_async.c aclient.c twheel.c slab.c -pthread -o client_async
+ */
+
+struct worker {
+   pthread_t th;
+   struct aclient cl;
+   long issued;                  // 出した要求の数
+   long bad;                     // 応答の値が違った数
+   uint64_t *lat;                // 要求ごとの遅延（ns）
+   long nlat;
+};
+
+struct sockaddr_storage addr;
+socklen_t addr_len;
+int type = SOCK_STREAM;
+int nconns = 8, depth = 16, window = 256;
+long nreq = 100000, timeout_ms = 5000;
+
+void issue(struct worker *w);
+
+/*
+ * 応答（または失敗）のコールバック: 確かめて、次の要求を出す。
+ */
+void on_reply(struct acl_req *r, void *arg){
+   struct worker *w = arg;
+
+   if(r->status == ACL_OK){
+      if(acl_reply_int(r) != (int)strnlen(r->data, r->len)) w->bad++;
+      w->lat[w->nlat++] = r->t_done - r->t_start;
+   }
+   if(w->issued < nreq) issue(w);
+}
+
+void issue(struct worker *w){
+   char buf[64];
+   int len;
+
+   /*
+    * 長さが要求ごとに変わるよう、通し番号を入れる。
+    */
+   len = snprintf(buf, sizeof(buf), "request-%ld", w->issued * 7919 % 100000);
+   if(acl_call(&w->cl, buf, len, on_reply, w) == NULL){
+      perror("acl_call");
+      exit(1);
+   }
+   w->issued++;
+}
+
+void *run(void *arg){
+   struct worker *w = arg;
+   struct acl_req *r;
+   int i;
+
+   if(acl_init(&w->cl, (struct sockaddr *)&addr, addr_len, type, nconns, depth) < 0){
+      perror("acl_init");
+      exit(1);
+   }
+   w->cl.timeout_ms = timeout_ms;
+
+   /*
+    * future の使い方の例: 1つ出して、応答が来るまで待つ（つながるまでの時間も含む）。
+    */
+   r = acl_call(&w->cl, "hello", 5, NULL, NULL);
+   if(r != NULL){
+      acl_wait(&w->cl, r);
+      if(r->status != ACL_OK || acl_reply_int(r) != 5){
+         fprintf(stderr, "first request failed: %s\n", strerror(-r->status));
+      }
+      acl_release(&w->cl, r);
+   }
+
+   for(i = 0; i < window && w->issued < nreq; i++) issue(w);
+   while(w->cl.pending > 0) acl_run(&w->cl, -1);
+   return NULL;
+}
+
+int cmp_u64(const void *a, const void *b){
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]){
+   struct worker *ws;
+   struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+   struct sockaddr_un *sun = (struct sockaddr_un *)&addr;
+   struct timespec t0, t1;
+   char *upath = NULL;
+   int opt, nthreads = 2, i;
+   long ok = 0, fail = 0, resent = 0, connects = 0, batches = 0, bad = 0, nlat = 0;
+   uint64_t *lat;
+   double sec;
+
+   while((opt = getopt(argc, argv, "t:c:n:w:d:T:u:q:")) != -1){
+      if(opt == 't') nthreads = atoi(optarg);
+      else if(opt == 'c') nconns = atoi(optarg);
+      else if(opt == 'n') nreq = atol(optarg);
+      else if(opt == 'w') window = atoi(optarg);
+      else if(opt == 'd') depth = atoi(optarg);
+      else if(opt == 'T') timeout_ms = atol(optarg);
+      else if(opt == 'u' || opt == 'q'){
+         upath = optarg;
+         type = opt == 'u' ? SOCK_STREAM : SOCK_SEQPACKET;
+      }
+      else{
+         fprintf(stderr, USAGE);
+         exit(1);
+      }
+   }
+   if(argc - optind != (upath != NULL ? 0 : 2) || nthreads < 1 || nthreads > T_MAX || nconns < 1 || window < 1 ||
+      (upath != NULL && strlen(upath) >= sizeof(sun->sun_path))){
+      fprintf(stderr, USAGE);
+      exit(1);
+   }
+
+   /*
+    * 接続先のアドレス（client_socket.c と同じ作り方。"@name" は抽象名前空間）。
+    */
+   memset(&addr, 0, sizeof(addr));
+   if(upath == NULL){
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons((unsigned short)atoi(argv[optind + 1]));
+      sin->sin_addr.s_addr = inet_addr(argv[optind]);
+      addr_len = sizeof(*sin);
+   }
+   else{
+      sun->sun_family = AF_UNIX;
+      if(upath[0] == '@'){
+         memcpy(sun->sun_path + 1, upath + 1, strlen(upath + 1));
+         addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(upath);
+      }
+      else{
+         strcpy(sun->sun_path, upath);
+         addr_len = sizeof(*sun);
+      }
+   }
+
+   ws = calloc(nthreads, sizeof(ws[0]));
+   if(ws == NULL){
+      perror("calloc");
+      exit(1);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for(i = 0; i < nthreads; i++){
+      ws[i].lat = malloc(sizeof(uint64_t) * nreq);
+      if(ws[i].lat == NULL){
+         perror("malloc");
+         exit(1);
+      }
+      if(pthread_create(&ws[i].th, NULL, run, &ws[i]) != 0){
+         fprintf(stderr, "pthread_create failed\n");
+         exit(1);
+      }
+   }
+   for(i = 0; i < nthreads; i++) pthread_join(ws[i].th, NULL);
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+   /*
+    * 全スレッドの結果をまとめる。
+    */
+   lat = malloc(sizeof(uint64_t) * nreq * nthreads);
+   if(lat == NULL){
+      perror("malloc");
+      exit(1);
+   }
+   for(i = 0; i < nthreads; i++){
+      ok += ws[i].cl.n_ok;
+      fail += ws[i].cl.n_fail;
+      resent += ws[i].cl.n_resent;
+      connects += ws[i].cl.n_connects;
+      batches += ws[i].cl.n_batches;
+      bad += ws[i].bad;
+      memcpy(lat + nlat, ws[i].lat, sizeof(uint64_t) * ws[i].nlat);
+      nlat += ws[i].nlat;
+      acl_destroy(&ws[i].cl);
+   }
+
+   printf("%d threads x %d conns (%s, depth %d), window %d: %ld ok, %ld failed, %ld wrong in %.3f s (%.0f req/s)\n",
+          nthreads, nconns, type == SOCK_SEQPACKET ? "seqpacket" : "stream",
+          type == SOCK_SEQPACKET ? depth : 1, window, ok, fail, bad, sec, ok / sec);
+   printf("  connects %ld, resent %ld, send batches %ld (%.1f requests per batch)\n",
+          connects, resent, batches, batches ? (double)(ok + fail) / batches : 0.0);
+   if(nlat > 0){
+      qsort(lat, nlat, sizeof(lat[0]), cmp_u64);
+      printf("  latency (us): p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+             lat[nlat / 2] / 1e3, lat[nlat * 90 / 100] / 1e3, lat[nlat * 99 / 100] / 1e3, lat[nlat - 1] / 1e3);
+   }
+   return fail > 0 || bad > 0;
+}
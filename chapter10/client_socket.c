@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -7,8 +8,27 @@
 #include <netdb.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include "shmring.h"
 
 #define BUF_SIZE 256
+#define WARMUP 1000              // 計測前に捨てる往復の回数
+#define CYCLE_WARMUP 100         // -C で計測前に捨てる接続の回数（TFO のクッキーもここで受け取る）
+#define BUSY_POLL_US 50
+#define SHM_SPIN 2000            // -m で応答を待つとき、寝る前にリングを見る回数（CPU が2つ以上のとき）
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+#define USAGE "Usage:$ ./client_socket [-l count [-b] [-k] [-p cpu]] [-C count] [-F] [ip_address] [port] | [-m] -u path | [-m] -q path\n"
 
 /*
  * このプログラムは TCP ソケットを使った “クライアント側” の最小例である。
@@ -43,35 +63,483 @@
  *    - これはサーバ側が recv で受け取れる。
  *
  * 2) recv で int を受け取る設計
- *    - ret = recv(myfd, &n, BUF_SIZE, 0) となっているが、
- *      本来 n は int なので sizeof(n) だけ受け取るのが自然。
+ *    - 元は ret = recv(myfd, &n, BUF_SIZE, 0) となっていたが、
+ *      n は int なので sizeof(n) だけ受け取るように直した。
  *    - BUF_SIZE で受け取ると「int 以上のサイズで読み込みに行く」ので、
- *      サーバ側の send の実装次第では余計なデータを読もうとしてしまう可能性がある。
+ *      サーバ側の send の実装次第では n を越えてスタックを書き潰してしまう。
  *
  * 3) TCP は “メッセージ境界がない”
  *    - send/recv 1回ずつで文字列と応答が必ず対応する保証は本来ない。
  *      ただし教材として短いデータであれば成立する、という前提で書かれている。
+ *
+ * --------------------------------------------------------------------
+ * 【Unix ドメインソケットで接続する（-u / -q）】
+ *
+ * server_m_sockets を -u / -q 付きで起動していれば、
+ * 同じホストからは TCP の代わりに AF_UNIX で接続できる。
+ *
+ *   -u <path> : SOCK_STREAM で接続
+ *   -q <path> : SOCK_SEQPACKET で接続（send 1回 = 1メッセージ。3) の問題が起きない）
+ *
+ * path が '@' で始まる場合は抽象名前空間の名前として扱う（サーバと同じ規則）。
+ *
+ * --------------------------------------------------------------------
+ * 【往復遅延の計測（-l）】
+ *
+ * -l count を付けると、標準入力は読まずに短い文字列を count 回送り、
+ * 1往復ごとの時間（send の直前から応答を受け取るまで）を CLOCK_MONOTONIC で測って
+ * 分布（min / 平均 / p50 / p90 / p99 / p99.9 / max）を表示する。
+ * 最初の WARMUP 回はキャッシュや CPU の周波数が落ち着くまでの分として捨てる。
+ *
+ *   -b     : サーバの -b と同じく、非ブロッキング + スピンで応答を待つ
+ *            （TCP_NODELAY / SO_BUSY_POLL / SO_PREFER_BUSY_POLL も設定する）
+ *   -k     : 応答を受け取るたびに TCP_QUICKACK を設定し直す
+ *   -p cpu : 指定した CPU に固定する（サーバとは別の CPU を指定する）
+ *
+ * 平均だけでなく p99 / p99.9 を見るのは、眠って起こされる経路のばらつき
+ * （起床の遅れ、他のタスクとの取り合い）が裾に出るため。
+ *
+ * --------------------------------------------------------------------
+ * 【接続ごとに1要求（-C）と TCP Fast Open（-F）】
+ *
+ * -C count を付けると「接続 → 要求を1つ送る → 応答を受け取る → 閉じる」を count 回繰り返し、
+ * 1回ごとの時間（socket から応答を受け取るまで）の分布を表示する。
+ * 普通の TCP では、要求を送れるのは 3ウェイハンドシェイクが終わってから（SYN → SYN-ACK の1往復の後）。
+ *
+ * -F を付けると TCP Fast Open を使う:
+ *   -C のとき   : connect の代わりに sendto(..., MSG_FASTOPEN) で接続し、要求を SYN に載せる
+ *   対話のとき  : connect の前に TCP_FASTOPEN_CONNECT を設定する。connect はすぐ戻り、
+ *                 最初の send のデータが SYN に載る（send / recv の書き方は変わらない）
+ * 最初の接続ではまだクッキーが無いので普通のハンドシェイクになり、その SYN-ACK でクッキーを受け取る
+ * （以降の接続で使う。-C では最初の CYCLE_WARMUP 回は計測から外す）。
+ * サーバが TFO を受け付けなければ（server_m_sockets の -F、sysctl）普通のハンドシェイクに戻る。
+ * 実際に SYN のデータが受け取られた接続の数は、TCP_INFO の TCPI_OPT_SYN_DATA で数えて表示する。
+ *
+ * 1回あたりの差は、ほぼネットワークの往復時間1つぶん。ループバックでは往復が数マイクロ秒なので差は小さく、
+ * 往復が長い（遠い）ほど効いてくる。tc qdisc add dev lo root netem delay 1ms などで遅延を足すと分かりやすい。
+ * 1 CPU のマシンのループバックで 2000 回測った例（マイクロ秒）:
+ *   connect  : p50 49.6  p99 147.8  p99.9 2446.6
+ *   fastopen : p50 46.1  p99 110.7  p99.9 209.5（2000/2000 回で SYN のデータが受け取られた）
+ * クライアントから閉じるので、接続ごとにクライアント側のポートが TIME_WAIT で残る。count は数千程度にすること。
+ *
+ * --------------------------------------------------------------------
+ * 【共有メモリに切り替える（-m）】
+ *
+ * -u / -q で接続した後、SHM_UPGRADE を送って server_m_sockets から共有メモリのリングを受け取り
+ * （shmring.h）、以降の要求と応答はリングでやり取りする。ソケットは開いたままにして、
+ * サーバが閉じたことを知るのに使う。サーバが断れば（-3）、そのままソケットを使う。
+ *
+ * 応答を待つときは、CPU が2つ以上あれば SHM_SPIN 回だけリングを見てから、
+ * 応答の eventfd とソケットを poll で待つ（-b ならずっとリングを見続ける）。
+ * 要求を書くときは、サーバが寝ているときだけ eventfd を鳴らす。
+ * -l と一緒に使うと、ソケットの場合と往復遅延を比べられる:
+ *   $ ./client_socket -l 100000 -q @strlen
+ *   $ ./client_socket -l 100000 -m -q @strlen
+ * 1 CPU のマシンで測った例（マイクロ秒）:
+ *   -q          : p50 8.3  p99 10.2    -m -q : p50 5.0  p99 5.5
+ *   -u          : p50 5.9  p99 12.1    -m -u : p50 5.5  p99 7.0
+ *   TCP（比較） : p50 12.4 p99 14.7
+ * 1 CPU ではサーバとクライアントが交互にしか動けないので、毎回 eventfd で起こし合うことになり、
+ * 差はソケット層を通らないぶんだけになる（-b も 1 CPU ではサーバから CPU を奪うだけで、裾が悪くなる）。
+ * CPU が2つあれば、スピンの間に応答が来てシステムコールが0回になる。
+ *
+ * 使い方:
+ *   $ ./client_socket 127.0.0.1 5000
+ *   $ ./client_socket -u /tmp/strlen.sock
+ *   $ ./client_socket -q @strlen
+ *   $ ./client_socket -l 100000 -b -k -p 3 127.0.0.1 5000
+ *   $ ./client_socket -C 5000 127.0.0.1 5000         （server_m_sockets -F 64 5000 に対して）
+ *   $ ./client_socket -C 5000 -F 127.0.0.1 5000
+ *   $ ./client_socket -m -q @strlen
+ *
+ * 【コンパイル】
+ *   gcc client_socket.c shmring.c -o client_socket
+ */
+
+static struct shm_peer shm;      // -m で切り替えたリング（shm.ch が NULL なら使っていない）
+
+static void pin_cpu(int cpu){
+   cpu_set_t set;
+
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   if(sched_setaffinity(0, sizeof(set), &set) < 0){
+      perror("sched_setaffinity");
+      exit(1);
+   }
+}
+
+/*
+ * server_socket.c の set_busy() と同じ設定。
+ */
+static void set_busy(int fd){
+   int on = 1, us = BUSY_POLL_US;
+
+   if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0){
+      perror("fcntl");
+      exit(1);
+   }
+   if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0){
+      perror("setsockopt(TCP_NODELAY)");
+      exit(1);
+   }
+   if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0){
+      perror("setsockopt(SO_BUSY_POLL)");
+   }
+   if(setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0){
+      perror("setsockopt(SO_PREFER_BUSY_POLL)");
+   }
+}
+
+/*
+ * len バイト揃うまで受信する。busy なら EAGAIN でも眠らずに繰り返す。
+ * 揃えば 0、切断やエラーなら -1。
+ */
+static int recv_all(int fd, void *buf, int len, int busy){
+   int ret, got = 0;
+
+   while(got < len){
+      ret = recv(fd, (char *)buf + got, len - got, 0);
+      if(ret > 0){
+         got += ret;
+         continue;
+      }
+      if(ret == 0) return -1;
+      if(busy && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+      if(errno == EINTR) continue;
+      return -1;
+   }
+   return 0;
+}
+
+static long long now_ns(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b){
+   long long x = *(const long long *)a, y = *(const long long *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+/*
+ * 遅延（ns）の分布を表示する。lat は並べ替える。
+ */
+static void print_dist(long long *lat, int count){
+   long long sum = 0;
+   int i;
+
+   qsort(lat, count, sizeof(*lat), cmp_ll);
+   for(i = 0; i < count; i++) sum += lat[i];
+
+   printf("  min %.1f  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+          lat[0] / 1e3, (double)sum / count / 1e3,
+          lat[count / 2] / 1e3, lat[(long)count * 90 / 100] / 1e3,
+          lat[(long)count * 99 / 100] / 1e3, lat[(long)count * 999 / 1000] / 1e3,
+          lat[count - 1] / 1e3);
+}
+
+/*
+ * 共有メモリへの切り替えを頼む。SHM_UPGRADE を送り、応答 int と一緒に FD を3つ受け取る。
+ * 切り替えられれば 0、断られれば -1（ソケットをそのまま使う）。
+ */
+static int shm_upgrade(int fd){
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cmsg;
+   char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+   int n = -1, fds[3];
+
+   if(send(fd, SHM_UPGRADE, sizeof(SHM_UPGRADE) - 1, MSG_NOSIGNAL) < 0){
+      perror("send");
+      exit(1);
+   }
+   memset(&msg, 0, sizeof(msg));
+   iov.iov_base = &n;
+   iov.iov_len = sizeof(n);
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf;
+   msg.msg_controllen = sizeof(cbuf);
+   if(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(n)){
+      fprintf(stderr, "connection closed\n");
+      exit(1);
+   }
+   cmsg = CMSG_FIRSTHDR(&msg);
+   if(n != 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))){
+      fprintf(stderr, "upgrade refused (%d), keep using the socket\n", n);
+      return -1;
+   }
+   memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+   if(shm_attach(&shm, fds) < 0){
+      perror("mmap");
+      exit(1);
+   }
+   fprintf(stderr, "switched to shared memory\n");
+   return 0;
+}
+
+/*
+ * リングで1往復する。要求を書いて（サーバが寝ていれば鳴らして）、応答を待つ。
+ * 応答を受け取れば 0、サーバが閉じたなら -1。
+ */
+static int shm_call(int fd, const char *req, int len, int *n, int busy){
+   static int spin = -1;
+   struct shm_slot *s;
+   const struct shm_slot *r;
+   struct pollfd pfd[2];
+   int i;
+
+   if(spin < 0) spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+
+   /*
+    * 1つずつ応答を待つので、要求のリングが一杯になることは無い。
+    */
+   s = shm_reserve(&shm.ch->req);
+   if(s == NULL) return -1;
+   if(len > SHM_DATA_MAX) len = SHM_DATA_MAX;
+   memcpy(s->data, req, len);
+   shm_publish(&shm.ch->req, len);
+   shm_kick(&shm.ch->req, shm.efd_req);
+
+   for(i = 0; (r = shm_front(&shm.ch->resp)) == NULL; i++){
+      if(busy || i < spin) continue;
+      /*
+       * 寝ることを知らせてから、もう一度見る。空なら応答の eventfd を待つ。
+       * ソケットが読める（閉じられた）ときも起きる。
+       */
+      if(shm_sleep(&shm.ch->resp)){
+         shm_awake(&shm.ch->resp, -1);
+         continue;
+      }
+      pfd[0].fd = shm.efd_resp;
+      pfd[0].events = POLLIN;
+      pfd[1].fd = fd;
+      pfd[1].events = POLLIN;
+      if(poll(pfd, 2, -1) < 0 && errno != EINTR){
+         perror("poll");
+         exit(1);
+      }
+      shm_awake(&shm.ch->resp, pfd[0].revents ? shm.efd_resp : -1);
+      if(pfd[1].revents && shm_front(&shm.ch->resp) == NULL) return -1;
+   }
+   *n = -1;
+   if(r->len >= sizeof(*n)) memcpy(n, r->data, sizeof(*n));
+   shm_pop(&shm.ch->resp);
+   return 0;
+}
+
+/*
+ * count 回往復して、遅延の分布を表示する。
  */
+static void latency(int fd, int count, int busy, int quickack){
+   const char *msg = "hello";
+   long long *lat, t0;
+   int i, n, on = 1;
+
+   lat = malloc(sizeof(*lat) * count);
+   if(lat == NULL){
+      perror("malloc");
+      exit(1);
+   }
+
+   for(i = -WARMUP; i < count; i++){
+      t0 = now_ns();
+      if(shm.ch != NULL){
+         if(shm_call(fd, msg, strlen(msg), &n, busy) < 0){
+            fprintf(stderr, "connection closed\n");
+            exit(1);
+         }
+      }
+      else if(send(fd, msg, strlen(msg), MSG_NOSIGNAL) < 0){
+         perror("send");
+         exit(1);
+      }
+      else if(recv_all(fd, &n, sizeof(n), busy) < 0){
+         fprintf(stderr, "connection closed\n");
+         exit(1);
+      }
+      if(i >= 0) lat[i] = now_ns() - t0;
+      if(quickack) setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+   }
+
+   printf("%s%s%s: %d round trips (us)\n", shm.ch != NULL ? "shm " : "",
+          busy ? "busy-poll" : "blocking", quickack ? "+quickack" : "", count);
+   print_dist(lat, count);
+
+   /*
+    * サーバのループを終わらせる。
+    */
+   send(fd, "exit", 4, MSG_NOSIGNAL);
+   free(lat);
+}
+
+/*
+ * 「接続 → 要求 → 応答 → 閉じる」を count 回繰り返して、1回ごとの時間の分布を表示する。
+ * fastopen なら要求を SYN に載せる（MSG_FASTOPEN）。
+ */
+static void cycles(const struct sockaddr_in *addr, int count, int fastopen){
+   const char *msg = "hello";
+   long long *lat, t0;
+   int i, fd, n, syn_data = 0;
+   struct tcp_info ti;
+   socklen_t len;
+
+   lat = malloc(sizeof(*lat) * count);
+   if(lat == NULL){
+      perror("malloc");
+      exit(1);
+   }
+
+   for(i = -CYCLE_WARMUP; i < count; i++){
+      t0 = now_ns();
+      fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      if(fd < 0){
+         perror("socket");
+         exit(1);
+      }
+      if(fastopen){
+         /*
+          * connect + send を1回で行う。クッキーがあればデータは SYN に載り、
+          * 無ければ普通のハンドシェイクの後で送られる（どちらでも戻り値は送ったバイト数）。
+          */
+         if(sendto(fd, msg, strlen(msg), MSG_FASTOPEN | MSG_NOSIGNAL,
+                   (const struct sockaddr *)addr, sizeof(*addr)) < 0){
+            perror("sendto(MSG_FASTOPEN)");
+            exit(1);
+         }
+      }
+      else{
+         if(connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0){
+            perror("connect");
+            exit(1);
+         }
+         if(send(fd, msg, strlen(msg), MSG_NOSIGNAL) < 0){
+            perror("send");
+            exit(1);
+         }
+      }
+      if(recv_all(fd, &n, sizeof(n), 0) < 0){
+         fprintf(stderr, "connection closed\n");
+         exit(1);
+      }
+      if(i >= 0){
+         lat[i] = now_ns() - t0;
+         len = sizeof(ti);
+         if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 && (ti.tcpi_options & TCPI_OPT_SYN_DATA)){
+            syn_data++;
+         }
+      }
+      close(fd);
+   }
+
+   printf("%s: %d connect-request-close cycles (us), data in SYN accepted %d/%d\n",
+          fastopen ? "fastopen" : "connect", count, syn_data, count);
+   print_dist(lat, count);
+   free(lat);
+}
 
 int main(int argc, char *argv[]){
    char *server_ip;
    unsigned short port;
-   int myfd = -1, ret, ret_rcv, n;
+   int myfd = -1, ret, ret_rcv, n, opt, utype = 0;
+   int count = 0, busy = 0, quickack = 0, cpu = -1, ncycles = 0, fastopen = 0, on = 1, upgrade = 0;
+   char *upath = NULL;
    struct sockaddr_in my_addr;
+   struct sockaddr_un u_addr;
+   socklen_t addr_len;
    char word[BUF_SIZE];
 
+   while((opt = getopt(argc, argv, "u:q:l:bkp:C:Fm")) != -1){
+      if(opt == 'u'){
+         upath = optarg;
+         utype = SOCK_STREAM;
+      }
+      else if(opt == 'q'){
+         upath = optarg;
+         utype = SOCK_SEQPACKET;
+      }
+      else if(opt == 'l') count = atoi(optarg);
+      else if(opt == 'b') busy = 1;
+      else if(opt == 'k') quickack = 1;
+      else if(opt == 'p') cpu = atoi(optarg);
+      else if(opt == 'C') ncycles = atoi(optarg);
+      else if(opt == 'F') fastopen = 1;
+      else if(opt == 'm') upgrade = 1;
+      else{
+         fprintf(stderr, USAGE);
+         exit(1);
+      }
+   }
+   if(count < 0 || (count == 0 && (busy || quickack || cpu >= 0)) || (upath != NULL && (quickack || (busy && !upgrade)))
+      || ncycles < 0 || (ncycles > 0 && (count > 0 || upath != NULL)) || (fastopen && (count > 0 || upath != NULL))
+      || (upgrade && upath == NULL)){
+      /*
+       * -b / -k / -p は計測（-l）のときだけ。-C / -F / -k は TCP のみ、-m は Unix ドメインのみ。
+       * Unix ドメインの -l で -b を使えるのは -m のとき（リングを見続ける）だけ。
+       */
+      fprintf(stderr, USAGE);
+      exit(1);
+   }
+   if(cpu >= 0) pin_cpu(cpu);
+   if(busy && sysconf(_SC_NPROCESSORS_ONLN) < 2){
+      fprintf(stderr, "warning: only one CPU online; busy polling will fight the peer for it\n");
+   }
+
+   if(upath != NULL){
+      /*
+       * Unix ドメインソケットで接続する。
+       * アドレスの作り方はサーバの listen_unix() と同じ。
+       */
+      if(optind != argc || strlen(upath) >= sizeof(u_addr.sun_path)){
+         fprintf(stderr, USAGE);
+         exit(1);
+      }
+      myfd = socket(AF_UNIX, utype, 0);
+      if(myfd < 0){
+         perror("socket");
+         exit(1);
+      }
+      memset(&u_addr, 0, sizeof(u_addr));
+      u_addr.sun_family = AF_UNIX;
+      if(upath[0] == '@'){
+         memcpy(u_addr.sun_path + 1, upath + 1, strlen(upath + 1));
+         addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(upath);
+      }
+      else{
+         strcpy(u_addr.sun_path, upath);
+         addr_len = sizeof(u_addr);
+      }
+
+      fprintf(stderr, "Connecting to %s:\n", upath);
+      if(connect(myfd, (struct sockaddr *)&u_addr, addr_len) < 0){
+         perror("connect");
+         exit(1);
+      }
+      if(upgrade) shm_upgrade(myfd);
+      if(count > 0){
+         latency(myfd, count, busy, quickack);
+         close(myfd);
+         return 0;
+      }
+      goto loop;
+   }
+
    /*
     * 引数:
     *   argv[1] = サーバIPアドレス（例 "127.0.0.1"）
     *   argv[2] = ポート番号（例 "5000"）
     */
-   if(argc != 3){
-      fprintf(stderr, "Usage:$ ./client_socket [ip_address] [port]\n");
+   if(argc - optind != 2){
+      fprintf(stderr, USAGE);
       exit(1);
    }
 
-   server_ip = argv[1];
-   port = (unsigned short)atoi(argv[2]);
+   server_ip = argv[optind];
+   port = (unsigned short)atoi(argv[optind + 1]);
    /*
     * atoi でポート番号を数値化している。
     * 実務なら 1〜65535 の範囲チェックが欲しい。
@@ -111,20 +579,49 @@ int main(int argc, char *argv[]){
     *   実務では inet_pton を使うことが多い。
     */
 
+   if(ncycles > 0){
+      /*
+       * 接続ごとに1要求の計測。ソケットは1回ごとに作る。
+       */
+      close(myfd);
+      cycles(&my_addr, ncycles, fastopen);
+      return 0;
+   }
+
+   /*
+    * TCP Fast Open: connect はハンドシェイクを待たずに戻り、最初の send のデータが SYN に載る。
+    */
+   if(fastopen && setsockopt(myfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) < 0){
+      perror("setsockopt(TCP_FASTOPEN_CONNECT)");
+   }
+
    fprintf(stderr, "Connecting to %s:\n", server_ip);
 
    // サーバのソケットに接続する
-   connect(myfd, (struct sockaddr *)&my_addr, sizeof(my_addr));
+   if(connect(myfd, (struct sockaddr *)&my_addr, sizeof(my_addr)) < 0){
+      perror("connect");
+      exit(1);
+   }
    /*
     * connect(fd, addr, addrlen):
     *   指定したサーバへ TCP 接続を確立する（能動オープン）。
     *
     * 成功すると以降 myfd に対して send/recv が可能になる。
-    *
-    * 本来は connect の戻り値をチェックし、失敗時は perror するのが安全。
     */
 
+   if(count > 0){
+      /*
+       * 計測モード。非ブロッキングにするのは接続が確立してから
+       * （先にすると connect が EINPROGRESS で戻ってしまう）。
+       */
+      if(busy) set_busy(myfd);
+      latency(myfd, count, busy, quickack);
+      close(myfd);
+      return 0;
+   }
+
    // サーバとの送受信ループ
+loop:
    while(1){
       memset(word, 0, BUF_SIZE);
       /*
@@ -147,6 +644,16 @@ int main(int argc, char *argv[]){
        *   教材としては「必ず何か入力される」前提。
        */
 
+      if(shm.ch != NULL){
+         /*
+          * 共有メモリに切り替えていれば、リングで送って受け取る。
+          * "exit" はリングでは送らず、ソケットを閉じて終わる（サーバは切断として扱う）。
+          */
+         if(strcmp(word, "exit") == 0 || shm_call(myfd, word, strlen(word), &n, 0) < 0) break;
+         fprintf(stderr, "from server: %d\n", n);
+         continue;
+      }
+
       send(myfd, word, strlen(word), 0);
       /*
        * send(fd, buf, len, flags):
@@ -164,16 +671,13 @@ int main(int argc, char *argv[]){
        */
       if(ret == 0) break;
 
-      ret = recv(myfd, &n, BUF_SIZE, 0);
+      ret = recv(myfd, &n, sizeof(n), 0);
       /*
        * サーバから応答（文字数）を受信する。
        *
        * 重要:
        *   ここは「int n を受け取る」設計なので、
-       *   本来は BUF_SIZE ではなく sizeof(n) だけ受け取るのが自然。
-       *
-       *   正しくは概念的に:
-       *     recv(myfd, &n, sizeof(n), 0);
+       *   BUF_SIZE ではなく sizeof(n) だけ受け取る。
        *
        * また、TCP はストリームのため、1回の recv で必ず sizeof(n) が揃う保証は本来ない。
        * 教材では短い応答で揃う前提になっている。
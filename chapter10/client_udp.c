@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#define BUF_SIZE 256
+#define BATCH 64             // sendmmsg / recvmmsg 1回で扱う要素数
+#define SEG_MAX 64           // GSO 1要素に詰めるデータグラム数
+#define RBUF_SIZE 65536      // GRO 有効時の受信バッファ
+#define UDP_PAYLOAD_MAX 65507 // UDP の1送信（GSO でまとめた全体）のデータの上限
+
+/*
+ * server_udp.c の相手をするクライアント。
+ *
+ * 2つのモードがある。
+ *
+ * 1) 対話モード（引数なし）:
+ *      client_socket.c と同じく、標準入力の1行を送り、文字数を受け取って表示する。
+ *      UDP なので返信が来ないこともある。1秒待って来なければ "(timeout)" と表示する。
+ *
+ * 2) ベンチマークモード（-b count）:
+ *      size バイトのデータグラムを count 個、sendmmsg でまとめて送り、
+ *      返信を recvmmsg でまとめて受け取って、1秒あたりの件数を表示する。
+ *
+ *        -s size : 1データグラムの大きさ（既定 16 バイト）
+ *        -w win  : 返信を待たずに送ってよい最大個数（既定 4096）
+ *        -g      : 送信に UDP GSO を使う（64個を1つのバッファにまとめて渡す。
+ *                  まとめた全体が 65507 バイトを超える大きさなら、超えない個数に減らす）
+ *        -f      : 返信を待たない（投げっぱなし。server_udp -q と組み合わせる）
+ *
+ *      UDP は取りこぼしがあり得るので、100ms 返信が来なければ
+ *      飛んでいる分は失われたものとして数え、送信を続ける。
+ *
+ * --------------------------------------------------------------------
+ * 【connect() した UDP ソケット】
+ *
+ * UDP でも connect() できる。TCP のような接続は作られないが、
+ *   - send() で宛先を毎回指定しなくてよくなる
+ *   - その相手以外からのデータグラムは受け取らなくなる
+ * という効果がある。
+ *
+ * 使い方:
+ *   $ ./client_udp <ip_address> <port>
+ *   $ ./client_udp -b 1000000 [-s size] [-w window] [-g] [-f] <ip_address> <port>
+ *
+ * 【コンパイル】
+ *   gcc -O2 client_udp.c -o client_udp
+ */
+
+int interactive(int fd);
+int bench(int fd, long count, int size, int window, int gso, int ff);
+long drain(int fd, int wait_ms);
+double now_sec(void);
+
+int main(int argc, char *argv[]){
+   int fd, opt, on = 1, size = 16, window = 4096, gso = 0, ff = 0;
+   long count = 0;
+   struct sockaddr_in addr;
+
+   while((opt = getopt(argc, argv, "b:s:w:gf")) != -1){
+      switch(opt){
+      case 'b': count = atol(optarg); break;
+      case 's': size = atoi(optarg); break;
+      case 'w': window = atoi(optarg); break;
+      case 'g': gso = 1; break;
+      case 'f': ff = 1; break;
+      default:
+         fprintf(stderr, "Usage: $ ./client_udp [-b count [-s size] [-w window] [-g] [-f]] <ip_address> <port>\n");
+         exit(1);
+      }
+   }
+   if(optind != argc - 2 || size < 1 || size > 1400 || window < 1){
+      fprintf(stderr, "Usage: $ ./client_udp [-b count [-s size] [-w window] [-g] [-f]] <ip_address> <port>\n");
+      exit(1);
+   }
+
+   fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+   if(fd < 0){
+      perror("socket");
+      exit(1);
+   }
+
+   /*
+    * 返信もまとめて受け取れるよう、クライアント側でも GRO を有効にしておく（失敗しても続行）。
+    */
+   setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on));
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons((unsigned short)atoi(argv[optind + 1]));
+   if(inet_pton(AF_INET, argv[optind], &addr.sin_addr) != 1){
+      fprintf(stderr, "invalid address: %s\n", argv[optind]);
+      exit(1);
+   }
+   if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+      perror("connect");
+      exit(1);
+   }
+
+   if(count > 0) bench(fd, count, size, window, gso, ff);
+   else interactive(fd);
+
+   close(fd);
+   return 0;
+}
+
+int interactive(int fd){
+   int n;
+   char word[BUF_SIZE];
+   struct pollfd pfd;
+
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+
+   while(1){
+      fprintf(stderr, "> ");
+      if(fgets(word, sizeof(word), stdin) == NULL) break;
+      word[strcspn(word, "\n")] = '\0';
+      if(strcmp(word, "exit") == 0) break;
+
+      if(send(fd, word, strlen(word), 0) < 0){
+         perror("send");
+         continue;
+      }
+
+      /*
+       * UDP は返信が失われることがあるので、無期限には待たない。
+       */
+      if(poll(&pfd, 1, 1000) <= 0){
+         fprintf(stderr, "(timeout)\n");
+         continue;
+      }
+      if(recv(fd, &n, sizeof(n), 0) == sizeof(n)){
+         fprintf(stderr, "from server: %d\n", n);
+      }
+   }
+   return 0;
+}
+
+int bench(int fd, long count, int size, int window, int gso, int ff){
+   int i, k, nmsg, per, ret, done;
+   long sent = 0, recvd = 0, lost = 0, inflight = 0, calls = 0, got;
+   double t0, t1;
+   char *payload;
+   struct mmsghdr msgs[BATCH];
+   struct iovec iov[BATCH];
+   char ctl[BATCH][CMSG_SPACE(sizeof(uint16_t))];
+   struct cmsghdr *cm;
+
+   /*
+    * 送信データ: GSO で1要素に最大 SEG_MAX 個並べるので、その大きさぶん用意する。
+    */
+   payload = malloc((size_t)size * SEG_MAX);
+   if(payload == NULL){
+      perror("malloc");
+      exit(1);
+   }
+   memset(payload, 'a', (size_t)size * SEG_MAX);
+
+   t0 = now_sec();
+   while(sent < count){
+      if(!ff && inflight >= window){
+         /*
+          * 窓が一杯: 返信を待つ。100ms 何も来なければ、飛んでいる分は失われたとみなす。
+          */
+         got = drain(fd, 100);
+         if(got == 0){
+            lost += inflight;
+            inflight = 0;
+         }
+         recvd += got;
+         inflight -= got < inflight ? got : inflight;
+         continue;
+      }
+
+      /*
+       * 今回送る個数 k（窓の残り、残り件数、1回の sendmmsg で送れる最大数の小さい方）。
+       */
+      per = gso ? SEG_MAX : 1;
+      if(per > UDP_PAYLOAD_MAX / size) per = UDP_PAYLOAD_MAX / size;   // まとめた全体が上限を超えると EMSGSIZE
+      k = BATCH * per;
+      if(count - sent < k) k = (int)(count - sent);
+      if(!ff && window - inflight < k) k = (int)(window - inflight);
+
+      nmsg = (k + per - 1) / per;
+      memset(msgs, 0, sizeof(msgs[0]) * nmsg);
+      for(i = 0; i < nmsg; i++){
+         int segs = (i == nmsg - 1) ? k - per * i : per;
+
+         iov[i].iov_base = payload;
+         iov[i].iov_len = (size_t)size * segs;
+         msgs[i].msg_hdr.msg_iov = &iov[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+         if(gso && segs > 1){
+            /*
+             * UDP_SEGMENT: このバッファを size バイトずつのデータグラムに分けて送らせる。
+             */
+            msgs[i].msg_hdr.msg_control = ctl[i];
+            msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+            cm->cmsg_level = IPPROTO_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *)CMSG_DATA(cm) = (uint16_t)size;
+         }
+      }
+
+      done = 0;
+      while(done < nmsg){
+         ret = sendmmsg(fd, msgs + done, nmsg - done, 0);
+         if(ret < 0){
+            if(errno == EINTR) continue;
+            if(errno == ENOBUFS || errno == EAGAIN) continue;   // 送信キューが空くまで再試行
+            if(gso && (errno == EIO || errno == EINVAL)){
+               fprintf(stderr, "UDP GSO unavailable, retry without -g\n");
+            }
+            else{
+               perror("sendmmsg");
+            }
+            free(payload);
+            return -1;
+         }
+         done += ret;
+         calls++;
+      }
+      sent += k;
+
+      if(!ff){
+         inflight += k;
+         got = drain(fd, 0);
+         recvd += got;
+         inflight -= got < inflight ? got : inflight;
+      }
+   }
+
+   /*
+    * 送り終わったら、残りの返信を待つ。
+    */
+   while(!ff && inflight > 0){
+      got = drain(fd, 100);
+      if(got == 0){
+         lost += inflight;
+         break;
+      }
+      recvd += got;
+      inflight -= got < inflight ? got : inflight;
+   }
+   t1 = now_sec();
+
+   fprintf(stderr, "sent %ld datagrams in %.3f s: %.0f msgs/s, %.1f msgs per sendmmsg\n",
+           sent, t1 - t0, sent / (t1 - t0), (double)sent / (calls > 0 ? calls : 1));
+   if(!ff){
+      fprintf(stderr, "replies %ld (%.0f/s), lost %ld\n", recvd, recvd / (t1 - t0), lost);
+   }
+
+   free(payload);
+   return 0;
+}
+
+/*
+ * 届いている返信をまとめて受け取り、返信の個数を返す。
+ * wait_ms > 0 なら、最初の1個が届くまで最大 wait_ms ミリ秒待つ。
+ * GRO でまとめて届いた場合は、長さ / sizeof(int) 個の返信が入っている。
+ */
+long drain(int fd, int wait_ms){
+   static char bufs[BATCH][RBUF_SIZE];
+   int i, ret;
+   long got = 0;
+   struct mmsghdr msgs[BATCH];
+   struct iovec iov[BATCH];
+   struct pollfd pfd;
+
+   if(wait_ms > 0){
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      if(poll(&pfd, 1, wait_ms) <= 0) return 0;
+   }
+
+   while(1){
+      memset(msgs, 0, sizeof(msgs));
+      for(i = 0; i < BATCH; i++){
+         iov[i].iov_base = bufs[i];
+         iov[i].iov_len = RBUF_SIZE;
+         msgs[i].msg_hdr.msg_iov = &iov[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+      ret = recvmmsg(fd, msgs, BATCH, MSG_DONTWAIT, NULL);
+      if(ret <= 0) break;
+      for(i = 0; i < ret; i++){
+         got += msgs[i].msg_len / sizeof(int);
+      }
+      if(ret < BATCH) break;
+   }
+   return got;
+}
+
+double now_sec(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
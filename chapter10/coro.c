@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "coro.h"
+
+/*
+ * coro.h の実装。
+ *
+ * epoll には各タスクの FD を data.ptr = タスクとして登録しておき、
+ * 登録するイベントは「今そのタスクが待っているもの」だけにする（co_want()）。
+ * レベルトリガなので、待っていないイベント（例えば async_sleep 中の EPOLLIN）を
+ * 登録したままにすると、epoll_wait が毎回すぐ戻って空回りする。
+ *
+ * 終わったタスクはすぐには解放せず zombies につなぎ、epoll_wait 1回分の処理が済んでから解放する。
+ * 同じ epoll_wait の結果の後ろの方に、そのタスク宛てのイベントが残っていることがあるため。
+ */
+
+#define TICK_MS 10            // async_sleep の刻み
+#define EV_MAX 64
+
+static void resume(struct task *t);
+
+int coloop_init(struct coloop *l){
+   l->efd = epoll_create1(EPOLL_CLOEXEC);
+   if(l->efd < 0) return -1;
+   twheel_init(&l->wheel, TICK_MS, twheel_now_ms());
+   l->tasks = NULL;
+   l->zombies = NULL;
+   l->ntasks = 0;
+   l->stop = 0;
+   return 0;
+}
+
+/*
+ * async_sleep のタイマーが発火した: そのタスクを再開する。
+ */
+static void on_timer(struct twtimer *tm, void *arg){
+   struct task *t = arg;
+
+   (void)tm;
+   t->fired = 1;
+   resume(t);
+}
+
+struct task *task_spawn(struct coloop *l, int fd, int (*fn)(struct task *t), size_t state_size){
+   struct task *t;
+   struct epoll_event ev;
+
+   t = calloc(1, sizeof(*t) + state_size);
+   if(t == NULL) return NULL;
+   t->fd = fd;
+   t->fn = fn;
+   t->loop = l;
+   twtimer_init(&t->timer, on_timer, t);
+
+   if(fd >= 0){
+      if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0){
+         free(t);
+         return NULL;
+      }
+      /*
+       * まずはイベント無しで登録しておき、待つときに co_want() で変える。
+       */
+      ev.events = 0;
+      ev.data.ptr = t;
+      if(epoll_ctl(l->efd, EPOLL_CTL_ADD, fd, &ev) < 0){
+         free(t);
+         return NULL;
+      }
+   }
+
+   t->next = l->tasks;
+   if(t->next != NULL) t->next->prev = t;
+   l->tasks = t;
+   l->ntasks++;
+
+   resume(t);
+   return t;
+}
+
+/*
+ * タスクを生きているリストから外して、FD を閉じ、解放待ちにする。
+ */
+static void finish(struct task *t){
+   struct coloop *l = t->loop;
+
+   t->done = 1;
+   twheel_cancel(&l->wheel, &t->timer);
+   if(t->fd >= 0) close(t->fd);          // close すれば epoll からも外れる
+
+   if(t->prev != NULL) t->prev->next = t->next;
+   else l->tasks = t->next;
+   if(t->next != NULL) t->next->prev = t->prev;
+   l->ntasks--;
+
+   t->next = l->zombies;
+   l->zombies = t;
+}
+
+/*
+ * handler を呼び、中断した位置から続きを実行する。
+ */
+static void resume(struct task *t){
+   if(t->done) return;
+   if(t->fn(t) == CO_DONE) finish(t);
+}
+
+void co_want(struct task *t, uint32_t events){
+   struct epoll_event ev;
+
+   if(t->events == events || t->fd < 0) return;
+   ev.events = events;
+   ev.data.ptr = t;
+   if(epoll_ctl(t->loop->efd, EPOLL_CTL_MOD, t->fd, &ev) < 0) perror("epoll_ctl");
+   t->events = events;
+}
+
+int co_wait_try(struct task *t, uint32_t events){
+   /*
+    * エラーや切断も「待つのをやめる」理由にする（続く accept / recv がエラーを返す）。
+    */
+   if(t->revents & (events | EPOLLERR | EPOLLHUP)){
+      co_want(t, 0);
+      return 1;
+   }
+   co_want(t, events);
+   return 0;
+}
+
+int co_read_try(struct task *t){
+   ssize_t ret;
+
+   /*
+    * recv ではなく read にしておくと、signalfd や pipe のタスクにも async_read が使える。
+    */
+   ret = read(t->fd, t->buf, t->len);
+   if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+      co_want(t, EPOLLIN);
+      return 0;
+   }
+   t->result = ret;
+   return 1;
+}
+
+int co_write_try(struct task *t){
+   ssize_t ret;
+
+   while(t->off < t->len){
+      ret = send(t->fd, t->buf + t->off, t->len - t->off, MSG_NOSIGNAL);
+      if(ret < 0){
+         if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+            co_want(t, EPOLLOUT);
+            return 0;
+         }
+         t->result = -1;
+         return 1;
+      }
+      t->off += ret;
+   }
+   t->result = t->len;
+   return 1;
+}
+
+void co_sleep_start(struct task *t, long ms){
+   co_want(t, 0);
+   t->fired = 0;
+   twheel_add(&t->loop->wheel, &t->timer, ms);
+}
+
+void coloop_run(struct coloop *l){
+   struct epoll_event evs[EV_MAX];
+   struct task *t;
+   int nev, i;
+   long to;
+
+   while(l->ntasks > 0 && !l->stop){
+      to = twheel_timeout(&l->wheel, twheel_now_ms());
+      nev = epoll_wait(l->efd, evs, EV_MAX, (int)to);
+      if(nev < 0){
+         if(errno == EINTR) continue;
+         perror("epoll_wait");
+         break;
+      }
+
+      for(i = 0; i < nev; i++){
+         t = evs[i].data.ptr;
+         t->revents = evs[i].events;
+         resume(t);
+      }
+      twheel_advance(&l->wheel, twheel_now_ms());
+
+      while((t = l->zombies) != NULL){
+         l->zombies = t->next;
+         free(t);
+      }
+   }
+}
+
+void coloop_stop(struct coloop *l){
+   l->stop = 1;
+}
+
+void coloop_destroy(struct coloop *l){
+   struct task *t;
+
+   while(l->tasks != NULL) finish(l->tasks);
+   while((t = l->zombies) != NULL){
+      l->zombies = t->next;
+      free(t);
+   }
+   close(l->efd);
+}
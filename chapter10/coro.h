@@ -0,0 +1,191 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include "twheel.h"
+
+/*
+ * coro: スタックを持たないコルーチンと、それを動かす epoll のイベントループ
+ *
+ * server_m_sockets.c では、接続ごとの処理を select ループの中に直接書いている。
+ * 「1回の recv で1要求、すぐ応答」なら単純だが、
+ *   要求を読む → 少し待つ → 応答を書く（書ききれなければ続きを待つ） → 次の要求を読む
+ * のように何段階もあるプロトコルだと、「今どこまで進んだか」を接続ごとに覚えておく
+ * 状態機械を手で書くことになり、処理の流れがコードから読み取れなくなる。
+ *
+ * コルーチンを使うと、接続ごとの処理を上から順に書ける。
+ *
+ *   int client(struct task *t){
+ *      struct cstate *s = task_state(t);
+ *
+ *      co_begin(t);
+ *      while(1){
+ *         async_read(t, s->buf, sizeof(s->buf));      // データが来るまで、ここで中断
+ *         if(t->result <= 0) break;
+ *         async_sleep(t, 100);                        // 100ms 後に、ここから再開
+ *         async_write(t, s->buf, t->result);          // 全部送れるまで中断/再開を繰り返す
+ *      }
+ *      co_end(t);
+ *   }
+ *
+ * async_* は、すぐに終わらなければ handler から return して（中断して）イベントループに戻る。
+ * 待っていたこと（FD が読める/書ける、タイマー）が起きると、ループが handler をもう一度呼び、
+ * 中断した async_* の行から続きが実行される。
+ * 1つのスレッドで何千もの接続を、それぞれ上から順に書いたコードで扱える。
+ *
+ * --------------------------------------------------------------------
+ * 【スタックを持たない（stackless）ということ】
+ *
+ * スレッドやスタックフルなコルーチン（ucontext など）は、中断した関数のスタックを丸ごと残すため、
+ * 接続ごとに数十 KB〜数 MB のスタックが要る。
+ * ここでのコルーチンは「どこまで進んだか（行番号）」だけを struct task に覚えておき、
+ * 再開するときは co_begin の switch でその行の case ラベルへ飛ぶ（Duff's device。protothreads と同じ手法）。
+ * 接続ごとのメモリは struct task と、自分で決めた状態（task_state()）だけで済む。
+ *
+ * その代わり、次の制約がある:
+ *   - 中断をまたいで値を残したい変数は、ローカル変数ではなく task_state() に置く
+ *     （再開すると関数の頭から呼び直されるので、ローカル変数の値は失われる）
+ *   - async_* に渡すバッファも task_state() に置く（中断中も有効でなければならない）
+ *   - handler の中で switch 文を使うなら、その中に async_* を書かない
+ *     （co_begin の switch の case ラベルと混ざってしまう）
+ *   - async_* を呼べるのは handler 本体だけ（handler から呼んだ関数の中では中断できない）
+ *   - 1行に async_* は1つまで（行番号 __LINE__ を再開位置に使うため）
+ *
+ * --------------------------------------------------------------------
+ * 【使い方】
+ *
+ *   struct coloop loop;
+ *
+ *   coloop_init(&loop);
+ *   task_spawn(&loop, listen_fd, acceptor, 0);            // FD と handler を登録する
+ *   coloop_run(&loop);                                   // 全タスクが終わるか coloop_stop() まで
+ *   coloop_destroy(&loop);
+ *
+ * handler は中断するとき CO_WAIT、終わったとき CO_DONE を返す（co_end() が返す）。
+ * 終わったタスクの FD はループが close する。
+ *
+ * 【コンパイル】
+ *   gcc prog.c coro.c twheel.c -o prog
+ */
+
+#define CO_WAIT 0
+#define CO_DONE 1
+
+struct coloop;
+
+struct task {
+   int line;                            // 再開する位置（co_begin の switch の case）
+   int fd;                              // このタスクの FD（無ければ -1）
+   int (*fn)(struct task *t);           // handler
+   struct coloop *loop;
+   uint32_t events;                     // epoll に登録しているイベント
+   uint32_t revents;                    // 最後に起こされたときのイベント
+   ssize_t result;                      // 直前の async_read / async_write の結果
+   char *buf;                           // async_read / async_write のバッファ
+   size_t len, off;
+   struct twtimer timer;                // async_sleep 用
+   int fired;                           // async_sleep のタイマーが発火したら 1
+   int done;                            // 終わったら 1（解放待ち）
+   struct task *prev, *next;            // ループの全タスクのリスト
+   char state[] __attribute__((aligned(16)));   // handler の状態（task_spawn の state_size バイト）
+};
+
+struct coloop {
+   int efd;                             // epoll
+   struct twheel wheel;                 // async_sleep のタイマー
+   struct task *tasks;                  // 生きているタスク
+   struct task *zombies;                // 終わったが、まだ解放していないタスク
+   int ntasks;
+   int stop;
+};
+
+/*
+ * ループを初期化する。失敗で -1。
+ */
+int coloop_init(struct coloop *l);
+
+/*
+ * タスクがすべて終わるか、coloop_stop() が呼ばれるまでイベントを処理する。
+ */
+void coloop_run(struct coloop *l);
+
+/*
+ * coloop_run() を（今処理しているイベントが済んだところで）戻らせる。
+ */
+void coloop_stop(struct coloop *l);
+
+/*
+ * 残っているタスクの FD を閉じて、すべて解放する。
+ */
+void coloop_destroy(struct coloop *l);
+
+/*
+ * fd（-1 なら無し）を受け持つタスクを作り、最初の中断まで handler を実行する。
+ * fd はノンブロッキングにされる。handler の状態として state_size バイト（0 で初期化）を確保する。
+ * 失敗で NULL。
+ */
+struct task *task_spawn(struct coloop *l, int fd, int (*fn)(struct task *t), size_t state_size);
+
+static inline void *task_state(struct task *t){
+   return t->state;
+}
+
+/*
+ * 以下は async_* の中身。handler から直接呼ぶものではない。
+ */
+void co_want(struct task *t, uint32_t events);
+int co_wait_try(struct task *t, uint32_t events);
+int co_read_try(struct task *t);
+int co_write_try(struct task *t);
+void co_sleep_start(struct task *t, long ms);
+
+/*
+ * --------------------------------------------------------------------
+ * handler の中で使うマクロ
+ */
+
+#define co_begin(t) switch((t)->line){ case 0:
+#define co_end(t) } return CO_DONE
+
+/*
+ * start を1回だけ実行し、done が真になるまで中断する。
+ * 中断するときに行番号を覚え、再開するとその行の case ラベルから done を評価し直す。
+ */
+#define co_await(t, start, done) \
+   do{ \
+      start; \
+      (t)->line = __LINE__; \
+      __attribute__((fallthrough)); \
+      case __LINE__: \
+      if(!(done)) return CO_WAIT; \
+   }while(0)
+
+/*
+ * FD が events（EPOLLIN / EPOLLOUT）の状態になるまで待つ。
+ * accept のように recv / send 以外の操作の前に使う。
+ */
+#define async_wait(t, ev) \
+   co_await(t, (t)->revents = 0, co_wait_try(t, ev))
+
+/*
+ * 最大 n バイト読む。t->result に受け取ったバイト数（0 は相手が閉じた、-1 はエラー）。
+ */
+#define async_read(t, b, n) \
+   co_await(t, ((t)->buf = (char *)(b), (t)->len = (n)), co_read_try(t))
+
+/*
+ * n バイトすべて送る。t->result は n（-1 はエラー）。FD はソケットであること（send を使う）。
+ */
+#define async_write(t, b, n) \
+   co_await(t, ((t)->buf = (char *)(b), (t)->len = (n), (t)->off = 0), co_write_try(t))
+
+/*
+ * ms ミリ秒待つ（その間、他のタスクは動き続ける）。
+ */
+#define async_sleep(t, ms) \
+   co_await(t, co_sleep_start(t, ms), (t)->fired)
+
+#endif
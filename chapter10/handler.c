@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dlfcn.h>
+#include "handler.h"
+
+/*
+ * handler.h の実装と、組み込みの handler。
+ */
+
+#define HANDLER_MAX 64
+
+/*
+ * 元のサーバと同じ処理: 文字数を int で返す。
+ */
+static int h_strlen(const char *req, size_t len, char *out, size_t cap){
+   int n = strnlen(req, len);
+
+   if(cap < sizeof(n)) return -1;
+   memcpy(out, &n, sizeof(n));
+   return sizeof(n);
+}
+
+/*
+ * 要求をそのまま返す。
+ */
+static int h_echo(const char *req, size_t len, char *out, size_t cap){
+   if(len > cap) len = cap;
+   memcpy(out, req, len);
+   return len;
+}
+
+/*
+ * 英字を大文字にして返す。
+ */
+static int h_upper(const char *req, size_t len, char *out, size_t cap){
+   size_t i;
+
+   if(len > cap) len = cap;
+   for(i = 0; i < len; i++) out[i] = toupper((unsigned char)req[i]);
+   return len;
+}
+
+static const struct handler builtins[] = {
+   { "strlen", "文字数を int で返す（既定）", h_strlen },
+   { "echo", "要求をそのまま返す", h_echo },
+   { "upper", "英字を大文字にして返す", h_upper },
+};
+
+/*
+ * 登録表。後から登録したものを先に探す（プラグインで組み込みを置き換えられる）。
+ */
+static const struct handler *table[HANDLER_MAX];
+static int ntable;
+
+static void init_builtins(void){
+   size_t i;
+
+   if(ntable > 0) return;
+   for(i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) table[ntable++] = &builtins[i];
+}
+
+const struct handler *handler_find(const char *name){
+   int i;
+
+   init_builtins();
+   for(i = ntable - 1; i >= 0; i--){
+      if(strcmp(table[i]->name, name) == 0) return table[i];
+   }
+   return NULL;
+}
+
+int handler_load(const char *path){
+   void *dl;
+   const struct handler *h;
+   int n = 0;
+
+   init_builtins();
+
+   /*
+    * RTLD_NOW: 未解決のシンボルがあれば、要求を処理している最中ではなく読み込み時に失敗させる。
+    * プラグインは閉じない（登録した表と関数は終了まで使う）。
+    */
+   dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+   if(dl == NULL){
+      fprintf(stderr, "dlopen: %s\n", dlerror());
+      return -1;
+   }
+   h = dlsym(dl, "handlers");
+   if(h == NULL){
+      fprintf(stderr, "%s: no handlers[] table\n", path);
+      dlclose(dl);
+      return -1;
+   }
+
+   for(; h->name != NULL; h++){
+      if(ntable == HANDLER_MAX || h->fn == NULL){
+         fprintf(stderr, "%s: cannot register %s\n", path, h->name);
+         continue;
+      }
+      table[ntable++] = h;
+      n++;
+   }
+   return n;
+}
+
+void handler_list(void){
+   int i;
+
+   init_builtins();
+   for(i = 0; i < ntable; i++) fprintf(stderr, "  %-10s %s\n", table[i]->name, table[i]->desc);
+}
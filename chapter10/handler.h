@@ -0,0 +1,72 @@
+#ifndef HANDLER_H
+#define HANDLER_H
+
+#include <stddef.h>
+
+/*
+ * handler: 要求を処理する関数の登録表（組み込み + dlopen のプラグイン）
+ *
+ * server_m_sockets.c の処理は n = strlen(buf) だけに決め打ちされていた。
+ * 別の処理をしたければサーバ自体を書き換える（フォークする）しかなかった。
+ *
+ * ここでは処理を「handler」として名前で登録しておき、起動時に -x name で選ぶ。
+ * サーバの I/O 部分（select ループ、送信キュー、タイムアウト、過負荷対策…）はそのまま使える。
+ *
+ * handler の形:
+ *
+ *   int fn(const char *req, size_t len, char *out, size_t cap);
+ *
+ *   req, len : 要求のバイト列。受信バッファそのもの（コピーしていない）で、読み取り専用。
+ *              req[len] は '\0' なので文字列としても扱える。
+ *   out, cap : 応答を書く場所。接続の送信キューの中に cap バイト分確保してある。
+ *              ここに書いたものがそのまま送信される（別のバッファから詰め替えない）。
+ *   戻り値   : out に書いたバイト数（0〜cap）。負ならその接続を切断する（要求が不正など）。
+ *
+ * 要求は recv 1回で受け取った分（TCP ではメッセージ境界が無いことに注意）。
+ * handler は1つのスレッドから順に呼ばれ、中で待ってはいけない（ループ全体が止まる）。
+ *
+ * --------------------------------------------------------------------
+ * 【プラグイン】
+ *
+ * -P path.so で共有ライブラリを dlopen し、その中の
+ *
+ *   const struct handler handlers[] = {
+ *      { "rev", "文字列を逆順にして返す", rev },
+ *      { NULL, NULL, NULL }
+ *   };
+ *
+ * という表（名前が NULL の要素で終わる）を登録する。例は plugin_rev.c。
+ *   $ gcc -shared -fPIC plugin_rev.c -o plugin_rev.so
+ *   $ ./server_m_sockets -P ./plugin_rev.so -x rev 5000
+ *
+ * 【コンパイル】
+ *   gcc prog.c handler.c -ldl -o prog
+ */
+
+#define HANDLER_OUT_MAX 256          // 1回の応答の最大バイト数（cap）
+
+typedef int (*handler_fn)(const char *req, size_t len, char *out, size_t cap);
+
+struct handler {
+   const char *name;
+   const char *desc;                 // 説明（一覧の表示用）
+   handler_fn fn;
+};
+
+/*
+ * 名前で handler を探す。無ければ NULL。
+ */
+const struct handler *handler_find(const char *name);
+
+/*
+ * 共有ライブラリを読み込み、handlers[] の表を登録する。登録した数を返す（失敗で -1）。
+ * 組み込みと同じ名前があれば、プラグインの方で置き換える。
+ */
+int handler_load(const char *path);
+
+/*
+ * 登録されている handler の一覧を表示する。
+ */
+void handler_list(void);
+
+#endif
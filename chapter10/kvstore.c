@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "kvstore.h"
+
+/*
+ * kvstore.h の実装。
+ */
+
+#define KV_MIN_BUCKETS 1024
+#define KV_RELATIVE_MAX (60 * 60 * 24 * 30)  // これ以下の exptime は今からの秒数
+
+/*
+ * FNV-1a（32ビット）。
+ */
+static uint32_t hash_key(const char *key, size_t nkey){
+   uint32_t h = 2166136261u;
+   size_t i;
+
+   for(i = 0; i < nkey; i++){
+      h ^= (unsigned char)key[i];
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static size_t item_size(const struct kv_item *it){
+   return sizeof(*it) + it->nkey + it->nbytes;
+}
+
+static void lru_unlink(struct kvstore *kv, struct kv_item *it){
+   if(it->prev != NULL) it->prev->next = it->next;
+   else kv->head = it->next;
+   if(it->next != NULL) it->next->prev = it->prev;
+   else kv->tail = it->prev;
+}
+
+static void lru_push(struct kvstore *kv, struct kv_item *it){
+   it->prev = NULL;
+   it->next = kv->head;
+   if(kv->head != NULL) kv->head->prev = it;
+   else kv->tail = it;
+   kv->head = it;
+}
+
+/*
+ * バケットの中で、キーの一致する塊を指しているポインタの場所を返す（無ければ NULL を指している場所）。
+ * 消すときに前の塊の hnext を書き換えられるよう、ポインタのポインタで返す。
+ */
+static struct kv_item **find(struct kvstore *kv, const char *key, size_t nkey, uint32_t h){
+   struct kv_item **pp = &kv->table[h & kv->mask];
+
+   while(*pp != NULL){
+      if((*pp)->hash == h && (*pp)->nkey == nkey && memcmp((*pp)->data, key, nkey) == 0) break;
+      pp = &(*pp)->hnext;
+   }
+   return pp;
+}
+
+/*
+ * 表とリストから外して解放する。
+ */
+static void unlink_item(struct kvstore *kv, struct kv_item **pp){
+   struct kv_item *it = *pp;
+
+   *pp = it->hnext;
+   lru_unlink(kv, it);
+   kv->used -= item_size(it);
+   kv->items--;
+   free(it);
+}
+
+static void remove_item(struct kvstore *kv, struct kv_item *it){
+   unlink_item(kv, find(kv, it->data, it->nkey, it->hash));
+}
+
+static int is_expired(const struct kv_item *it, time_t now){
+   return it->exptime != 0 && it->exptime <= now;
+}
+
+/*
+ * memcached の exptime を切れる時刻に直す。
+ */
+static time_t abs_time(long exptime, time_t now){
+   if(exptime == 0) return 0;
+   if(exptime < 0) return now - 1;
+   if(exptime <= KV_RELATIVE_MAX) return now + exptime;
+   return (time_t)exptime;
+}
+
+int kv_init(struct kvstore *kv, size_t limit){
+   size_t n = KV_MIN_BUCKETS;
+
+   while(n < limit / KV_AVG_ITEM) n *= 2;
+   memset(kv, 0, sizeof(*kv));
+   kv->table = calloc(n, sizeof(kv->table[0]));
+   if(kv->table == NULL) return -1;
+   kv->mask = n - 1;
+   kv->limit = limit;
+   return 0;
+}
+
+void kv_destroy(struct kvstore *kv){
+   struct kv_item *it, *next;
+
+   for(it = kv->head; it != NULL; it = next){
+      next = it->next;
+      free(it);
+   }
+   free(kv->table);
+   kv->table = NULL;
+   kv->head = kv->tail = NULL;
+   kv->used = 0;
+   kv->items = 0;
+}
+
+struct kv_item *kv_get(struct kvstore *kv, const char *key, size_t nkey){
+   uint32_t h = hash_key(key, nkey);
+   struct kv_item **pp = find(kv, key, nkey, h);
+   struct kv_item *it = *pp;
+
+   if(it != NULL && is_expired(it, time(NULL))){
+      unlink_item(kv, pp);
+      kv->expired++;
+      it = NULL;
+   }
+   if(it == NULL){
+      kv->misses++;
+      return NULL;
+   }
+   kv->hits++;
+   if(kv->head != it){
+      lru_unlink(kv, it);
+      lru_push(kv, it);
+   }
+   return it;
+}
+
+int kv_set(struct kvstore *kv, const char *key, size_t nkey, uint32_t flags, long exptime,
+           const void *data, size_t nbytes){
+   uint32_t h = hash_key(key, nkey);
+   size_t size = sizeof(struct kv_item) + nkey + nbytes;
+   struct kv_item **pp, *it;
+   time_t now = time(NULL);
+
+   if(nbytes > KV_ITEM_MAX || size > kv->limit) return -1;
+
+   /*
+    * 古い値を先に消してから、足りないぶんを LRU の末尾から追い出す。
+    * 末尾が期限切れなら、それは追い出しではなく期限切れとして数える。
+    */
+   pp = find(kv, key, nkey, h);
+   if(*pp != NULL) unlink_item(kv, pp);
+   while(kv->used + size > kv->limit && kv->tail != NULL){
+      if(is_expired(kv->tail, now)) kv->expired++;
+      else kv->evictions++;
+      remove_item(kv, kv->tail);
+   }
+
+   it = malloc(size);
+   if(it == NULL) return -2;
+   it->hash = h;
+   it->flags = flags;
+   it->exptime = abs_time(exptime, now);
+   it->nkey = nkey;
+   it->nbytes = nbytes;
+   memcpy(it->data, key, nkey);
+   memcpy(it->data + nkey, data, nbytes);
+
+   pp = &kv->table[h & kv->mask];
+   it->hnext = *pp;
+   *pp = it;
+   lru_push(kv, it);
+   kv->used += size;
+   kv->items++;
+   return 0;
+}
+
+int kv_delete(struct kvstore *kv, const char *key, size_t nkey){
+   struct kv_item **pp = find(kv, key, nkey, hash_key(key, nkey));
+
+   if(*pp == NULL) return 0;
+   unlink_item(kv, pp);
+   return 1;
+}
+
+int kv_incr(struct kvstore *kv, const char *key, size_t nkey, uint64_t delta, int decr, uint64_t *val){
+   struct kv_item *it;
+   char buf[24];
+   uint64_t v = 0;
+   uint32_t i;
+   int len;
+
+   it = kv_get(kv, key, nkey);
+   if(it == NULL) return -1;
+
+   /*
+    * memcached と同じく、値は 20 桁以下の10進数（64ビットの符号なし整数）でなければならない。
+    */
+   if(it->nbytes == 0 || it->nbytes > 20) return -2;
+   for(i = 0; i < it->nbytes; i++){
+      char ch = kv_value(it)[i];
+
+      if(ch < '0' || ch > '9') return -2;
+      if(v > (UINT64_MAX - (ch - '0')) / 10) return -2;
+      v = v * 10 + (ch - '0');
+   }
+
+   if(decr) v = v < delta ? 0 : v - delta;
+   else v += delta;                          // 桁あふれしたら 0 から回る（memcached と同じ）
+   *val = v;
+
+   len = snprintf(buf, sizeof(buf), "%" PRIu64, v);
+   if((uint32_t)len == it->nbytes){
+      memcpy(kv_value(it), buf, len);
+      return 0;
+   }
+   /*
+    * 桁数が変わったら塊を作り直す（kv_set() が古い塊を消す）。
+    * 期限は切れる時刻のまま引き継ぐ。
+    */
+   if(kv_set(kv, key, nkey, it->flags, (long)it->exptime, buf, len) < 0) return -3;
+   return 0;
+}
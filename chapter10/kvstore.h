@@ -0,0 +1,122 @@
+#ifndef KVSTORE_H
+#define KVSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * kvstore: メモリ上のキャッシュ（ハッシュ表 + LRU + メモリの上限）
+ *
+ * キーと値（どちらもバイト列）を1つの塊（struct kv_item）に入れて malloc し、
+ *   - ハッシュ表（チェイン法）で キー → 塊 を引く
+ *   - 双方向リストで使った順に並べる（先頭が最近使ったもの、末尾が一番使っていないもの）
+ * の2つにつなぐ。get / set のたびに塊をリストの先頭へ移す（O(1)）。
+ *
+ * 使っているメモリ（塊の大きさの合計）が上限を超えそうになったら、
+ * リストの末尾（一番長く使われていないもの）から捨てて空ける（LRU の追い出し）。
+ * 上限は「キャッシュに入れるデータ」のもので、ハッシュ表自体の大きさは含まない。
+ *
+ * --------------------------------------------------------------------
+ * 【ハッシュ表の大きさ】
+ *
+ * 要素が増えたら表を2倍にして全部入れ直す、という作り方だと、入れ直す1回で
+ * （100万個なら数十ミリ秒）ループ全体が止まり、その間の要求がすべて遅れる。
+ * ここではメモリの上限から入りうる個数を見積もり（塊の大きさを平均 KV_AVG_ITEM と仮定）、
+ * 最初からその大きさで作って、後から大きくしない。
+ * 小さな値ばかりだと鎖が少し長くなるが、要求ごとの時間は一定に保てる。
+ *
+ * --------------------------------------------------------------------
+ * 【有効期限】
+ *
+ * memcached と同じく exptime は
+ *   0                   : 期限なし
+ *   30 日（秒）以下      : 今からの秒数
+ *   それより大きい       : UNIX 時刻
+ *   負                   : すぐに切れる
+ * 切れたものは、次に引かれたとき（または LRU で末尾に来たとき）に捨てる。
+ *
+ * スレッドは考えない（server_m_sockets のループ1つから呼ぶ）ので、ロックは持たない。
+ *
+ * 使い方:
+ *   struct kvstore kv;
+ *   kv_init(&kv, 64 << 20);                  // 64 MB まで
+ *   kv_set(&kv, "k", 1, 0, 0, "v", 1);
+ *   it = kv_get(&kv, "k", 1);               // kv_value(it), it->nbytes
+ *   kv_delete(&kv, "k", 1);
+ *
+ * 【コンパイル】
+ *   gcc prog.c kvstore.c -o prog
+ */
+
+#define KV_KEY_MAX 250                      // キーの長さの上限（memcached と同じ）
+#define KV_ITEM_MAX (1024 * 1024)           // 値の長さの上限（memcached の既定と同じ）
+#define KV_AVG_ITEM 128                     // ハッシュ表の大きさを決めるときに仮定する塊の大きさ
+
+struct kv_item {
+   struct kv_item *hnext;                   // ハッシュの鎖
+   struct kv_item *prev, *next;             // LRU のリスト
+   uint32_t hash;
+   uint32_t flags;                          // クライアントが付ける値（そのまま返す）
+   time_t exptime;                          // 切れる時刻（0 なら期限なし）
+   uint32_t nkey;
+   uint32_t nbytes;
+   char data[];                             // キー（nkey バイト）、続けて値（nbytes バイト）
+};
+
+struct kvstore {
+   struct kv_item **table;
+   size_t mask;                             // バケット数 - 1（バケット数は2のべき乗）
+   struct kv_item *head, *tail;             // LRU（head が最近使ったもの）
+   size_t limit;                            // メモリの上限（バイト）
+   size_t used;                             // 使っているメモリ（塊の大きさの合計）
+   long items;
+   long hits, misses;                       // kv_get() で見つかった / 見つからなかった
+   long evictions;                          // 上限のために追い出した数
+   long expired;                            // 期限切れで捨てた数
+};
+
+static inline const char *kv_key(const struct kv_item *it){
+   return it->data;
+}
+
+static inline char *kv_value(struct kv_item *it){
+   return it->data + it->nkey;
+}
+
+/*
+ * limit バイトまで入れられる空のキャッシュを作る。失敗で -1。
+ */
+int kv_init(struct kvstore *kv, size_t limit);
+
+/*
+ * すべて捨てて、ハッシュ表も解放する。
+ */
+void kv_destroy(struct kvstore *kv);
+
+/*
+ * キーで引く。見つかれば LRU の先頭へ移して返す（期限切れや無ければ NULL）。
+ * 返した塊は、次に kv_set() / kv_delete() などを呼ぶまで使える（捨てられるかもしれないので）。
+ */
+struct kv_item *kv_get(struct kvstore *kv, const char *key, size_t nkey);
+
+/*
+ * 値を入れる（同じキーがあれば置き換える）。入りきらなければ LRU の末尾から追い出す。
+ * 成功で 0、値が大きすぎる（KV_ITEM_MAX 超、または上限より大きい）なら -1、メモリが無ければ -2。
+ */
+int kv_set(struct kvstore *kv, const char *key, size_t nkey, uint32_t flags, long exptime,
+           const void *data, size_t nbytes);
+
+/*
+ * 消す。あれば 1、無ければ 0。
+ */
+int kv_delete(struct kvstore *kv, const char *key, size_t nkey);
+
+/*
+ * 値を10進の符号なし整数とみなして delta を足す（decr なら引く。0 より小さくはしない）。
+ * 新しい値を *val に入れて 0、無ければ -1、数でなければ -2、メモリが無ければ -3。
+ * 足しても桁数が変わらなければ、塊をそのまま書き換える。
+ */
+int kv_incr(struct kvstore *kv, const char *key, size_t nkey, uint64_t delta, int decr, uint64_t *val);
+
+#endif
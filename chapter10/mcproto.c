@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "mcproto.h"
+
+/*
+ * mcproto.h の実装。
+ */
+
+#define MC_TOKENS 24                         // 1行のトークン数の上限（get のキーはこれを超えてもよい）
+#define MC_VERSION "1.6.0-strlen"
+
+#define OUT(s) do{ if(!noreply && out(arg, s, sizeof(s) - 1) < 0) return -1; }while(0)
+
+/*
+ * 行を空白で区切る（行の中身を書き換える）。トークン数を返す。
+ */
+static int tokenize(char *line, char **tok, int max){
+   int n = 0;
+   char *p = line;
+
+   while(n < max){
+      while(*p == ' ') p++;
+      if(*p == '\0') break;
+      tok[n++] = p;
+      while(*p != ' ' && *p != '\0') p++;
+      if(*p == '\0') break;
+      *p++ = '\0';
+   }
+   return n;
+}
+
+/*
+ * 10進数の文字列を数に直す（全体が数でなければ -1）。
+ */
+static int parse_u64(const char *s, uint64_t *v){
+   char *end;
+
+   if(*s == '-' || *s == '\0') return -1;
+   errno = 0;
+   *v = strtoull(s, &end, 10);
+   return *end != '\0' || errno != 0 ? -1 : 0;
+}
+
+static int parse_long(const char *s, long *v){
+   char *end;
+
+   if(*s == '\0') return -1;
+   errno = 0;
+   *v = strtol(s, &end, 10);
+   return *end != '\0' || errno != 0 ? -1 : 0;
+}
+
+/*
+ * キーの長さが上限以下か（空白と制御文字は tokenize で分かれるか、ここで弾く）。
+ */
+static int valid_key(const char *key, size_t nkey){
+   size_t i;
+
+   if(nkey == 0 || nkey > KV_KEY_MAX) return 0;
+   for(i = 0; i < nkey; i++){
+      if((unsigned char)key[i] < 0x21 || key[i] == 0x7f) return 0;
+   }
+   return 1;
+}
+
+/*
+ * get のキーを p から順に1つずつ取り出す（end まで。空白と tokenize が入れた '\0' が区切り）。
+ * キーの数は MC_TOKENS で切らずに、行に入るだけ引ける（memcached と同じ）。無くなったら NULL。
+ */
+static const char *next_key(const char *p, const char *end, size_t *nkey){
+   const char *q;
+
+   while(p < end && (*p == ' ' || *p == '\0')) p++;
+   if(p == end) return NULL;
+   for(q = p; q < end && *q != ' ' && *q != '\0'; q++)
+      ;
+   *nkey = q - p;
+   return p;
+}
+
+static int do_get(struct kvstore *kv, const char *keys, const char *end, mc_out_fn out, void *arg){
+   struct kv_item *it;
+   char hdr[KV_KEY_MAX + 64];
+   const char *key;
+   size_t nkey;
+   int n, noreply = 0;
+
+   for(key = keys; (key = next_key(key, end, &nkey)) != NULL; key += nkey){
+      if(!valid_key(key, nkey)){
+         OUT("CLIENT_ERROR bad command line format\r\n");
+         return 0;
+      }
+   }
+   for(key = keys; (key = next_key(key, end, &nkey)) != NULL; key += nkey){
+      it = kv_get(kv, key, nkey);
+      if(it == NULL) continue;
+      n = snprintf(hdr, sizeof(hdr), "VALUE %.*s %" PRIu32 " %" PRIu32 "\r\n", (int)nkey, key, it->flags, it->nbytes);
+      if(out(arg, hdr, n) < 0 || out(arg, kv_value(it), it->nbytes) < 0 || out(arg, "\r\n", 2) < 0) return -1;
+   }
+   OUT("END\r\n");
+   return 0;
+}
+
+/*
+ * set: 値のブロックがまだ揃っていなければ 1 を返す（行も処理しなかったことにして、続きを待つ）。
+ * data は行の直後、avail はそこから先に受け取っているバイト数。*used に値のブロックのバイト数を入れる。
+ */
+static int do_set(struct kvstore *kv, char **tok, int ntok, const char *data, size_t avail,
+                  size_t *used, size_t *skip, mc_out_fn out, void *arg){
+   uint64_t flags, bytes;
+   long exptime;
+   int noreply = 0, ret;
+
+   *used = 0;
+   if(ntok == 6 && strcmp(tok[5], "noreply") == 0) noreply = 1;
+   else if(ntok != 5){
+      OUT("ERROR\r\n");
+      return 0;
+   }
+   if(!valid_key(tok[1], strlen(tok[1])) || parse_u64(tok[2], &flags) < 0 || flags > UINT32_MAX ||
+      parse_long(tok[3], &exptime) < 0 || parse_u64(tok[4], &bytes) < 0){
+      /*
+       * 値の長さが分からないので、続く値のブロックは次の行として読まれる（memcached と同じ）。
+       */
+      noreply = 0;
+      OUT("CLIENT_ERROR bad command line format\r\n");
+      return 0;
+   }
+
+   /*
+    * 大きすぎる値は溜めずに読み捨てる（接続のバッファを KV_ITEM_MAX 以上に広げない）。
+    */
+   if(bytes > KV_ITEM_MAX){
+      *skip = bytes + 2;
+      noreply = 0;
+      OUT("SERVER_ERROR object too large for cache\r\n");
+      return 0;
+   }
+   if(avail < bytes + 2) return 1;
+   *used = bytes + 2;
+   if(data[bytes] != '\r' || data[bytes + 1] != '\n'){
+      noreply = 0;
+      OUT("CLIENT_ERROR bad data chunk\r\n");
+      return 0;
+   }
+
+   ret = kv_set(kv, tok[1], strlen(tok[1]), (uint32_t)flags, exptime, data, bytes);
+   if(ret == -1) OUT("SERVER_ERROR object too large for cache\r\n");
+   else if(ret < 0) OUT("SERVER_ERROR out of memory storing object\r\n");
+   else OUT("STORED\r\n");
+   return 0;
+}
+
+static int do_delete(struct kvstore *kv, char **tok, int ntok, mc_out_fn out, void *arg){
+   int noreply = 0;
+
+   if(ntok > 2 && strcmp(tok[ntok - 1], "noreply") == 0){
+      noreply = 1;
+      ntok--;
+   }
+   /*
+    * 古い書式の delete <key> <time> は、memcached と同じく time が 0 のときだけ受け付ける。
+    */
+   if(ntok == 3 && strcmp(tok[2], "0") == 0) ntok--;
+   if(ntok != 2 || !valid_key(tok[1], strlen(tok[1]))){
+      noreply = 0;
+      OUT("CLIENT_ERROR bad command line format.  Usage: delete <key> [noreply]\r\n");
+      return 0;
+   }
+   if(kv_delete(kv, tok[1], strlen(tok[1]))) OUT("DELETED\r\n");
+   else OUT("NOT_FOUND\r\n");
+   return 0;
+}
+
+static int do_incr(struct kvstore *kv, char **tok, int ntok, int decr, mc_out_fn out, void *arg){
+   uint64_t delta, v;
+   char buf[32];
+   int n, noreply = 0;
+
+   if(ntok == 4 && strcmp(tok[3], "noreply") == 0) noreply = 1;
+   else if(ntok != 3){
+      OUT("ERROR\r\n");
+      return 0;
+   }
+   if(!valid_key(tok[1], strlen(tok[1])) || parse_u64(tok[2], &delta) < 0){
+      OUT("CLIENT_ERROR invalid numeric delta argument\r\n");
+      return 0;
+   }
+   switch(kv_incr(kv, tok[1], strlen(tok[1]), delta, decr, &v)){
+   case 0:
+      if(noreply) return 0;
+      n = snprintf(buf, sizeof(buf), "%" PRIu64 "\r\n", v);
+      return out(arg, buf, n);
+   case -1:
+      OUT("NOT_FOUND\r\n");
+      break;
+   case -2:
+      OUT("CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+      break;
+   default:
+      OUT("SERVER_ERROR out of memory\r\n");
+      break;
+   }
+   return 0;
+}
+
+long mc_execute(struct kvstore *kv, const char *in, size_t len, size_t *skip,
+                mc_out_fn out, void *arg, long *ncmd){
+   char line[MC_LINE_MAX + 1], *tok[MC_TOKENS];
+   const char *eol;
+   size_t pos = 0, n, used;
+   int ntok, ret, noreply = 0;
+
+   while(pos < len){
+      /*
+       * 大きすぎた値の残りを読み捨てる。
+       */
+      if(*skip > 0){
+         n = len - pos < *skip ? len - pos : *skip;
+         pos += n;
+         *skip -= n;
+         continue;
+      }
+
+      eol = memchr(in + pos, '\n', len - pos);
+      if(eol == NULL){
+         if(len - pos > MC_LINE_MAX){
+            OUT("CLIENT_ERROR line too long\r\n");
+            return -1;
+         }
+         break;                               // 行の続きを待つ
+      }
+      n = eol - (in + pos);
+      if(n > MC_LINE_MAX){
+         OUT("CLIENT_ERROR line too long\r\n");
+         return -1;
+      }
+      memcpy(line, in + pos, n);
+      if(n > 0 && line[n - 1] == '\r') n--;
+      line[n] = '\0';
+      ntok = tokenize(line, tok, MC_TOKENS);
+
+      ret = 0;
+      used = 0;
+      if(ntok == 0){
+         ret = out(arg, "ERROR\r\n", 7);
+      }
+      else if(strcmp(tok[0], "get") == 0){
+         if(ntok < 2) ret = out(arg, "ERROR\r\n", 7);
+         else ret = do_get(kv, tok[1], line + n, out, arg);
+      }
+      else if(strcmp(tok[0], "set") == 0){
+         ret = do_set(kv, tok, ntok, eol + 1, len - (eol + 1 - in), &used, skip, out, arg);
+         if(ret == 1) break;                  // 値のブロックの続きを待つ（この行は次回もう一度読む）
+      }
+      else if(strcmp(tok[0], "delete") == 0){
+         ret = do_delete(kv, tok, ntok, out, arg);
+      }
+      else if(strcmp(tok[0], "incr") == 0 || strcmp(tok[0], "decr") == 0){
+         ret = do_incr(kv, tok, ntok, tok[0][0] == 'd', out, arg);
+      }
+      else if(strcmp(tok[0], "version") == 0){
+         ret = out(arg, "VERSION " MC_VERSION "\r\n", sizeof("VERSION " MC_VERSION "\r\n") - 1);
+      }
+      else if(strcmp(tok[0], "quit") == 0){
+         return -1;
+      }
+      else{
+         ret = out(arg, "ERROR\r\n", 7);
+      }
+      if(ret < 0) return -1;
+
+      pos = eol + 1 - in + used;
+      (*ncmd)++;
+   }
+   return pos;
+}
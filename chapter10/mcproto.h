@@ -0,0 +1,49 @@
+#ifndef MCPROTO_H
+#define MCPROTO_H
+
+#include <stddef.h>
+#include "kvstore.h"
+
+/*
+ * mcproto: memcached のテキストプロトコル（の一部）を kvstore.h のキャッシュで処理する
+ *
+ * 扱うコマンド（memcached と同じ書式と応答）:
+ *
+ *   get <key>*                                     → VALUE <key> <flags> <bytes>\r\n<data>\r\n ... END\r\n
+ *   set <key> <flags> <exptime> <bytes> [noreply]\r\n<data>\r\n   → STORED\r\n
+ *   delete <key> [0] [noreply]                     → DELETED\r\n / NOT_FOUND\r\n
+ *   incr <key> <value> [noreply]                   → 新しい値\r\n / NOT_FOUND\r\n
+ *   decr <key> <value> [noreply]                   → 同上（0 より小さくはならない）
+ *   version                                        → VERSION ...\r\n（クライアントの接続確認用）
+ *   quit                                           → 接続を閉じる
+ *
+ * それ以外のコマンドには ERROR\r\n を返す。
+ * get のキーの数に上限はない（行が MC_LINE_MAX に収まる分だけ）。キーは KV_KEY_MAX バイトまで。
+ * delete の後ろの数（古い書式の time）は memcached と同じく 0 だけ受け付け、ほかは CLIENT_ERROR にする。
+ * noreply を付けると応答を返さない（memtier_benchmark などが大量に set するときに使う）。
+ *
+ * 1回の recv で要求がちょうど1つ届くとは限らない（途中で切れている / いくつも続いている）ので、
+ * 呼び出し側は受け取ったバイト列を接続ごとのバッファに溜めて mc_execute() に渡し、
+ * 処理し終えた（返り値の）バイト数だけ先頭から捨てる。残りは次に届いたものの前につなげる。
+ * set の値が KV_ITEM_MAX より大きいときは、SERVER_ERROR を返してその値を読み捨てる（*skip に残りを入れる）。
+ *
+ * 応答は out(arg, data, len) で渡す（呼び出し側が送信キューに積み、最後にまとめて送る）。
+ *
+ * 【コンパイル】
+ *   gcc prog.c mcproto.c kvstore.c -o prog
+ */
+
+#define MC_LINE_MAX 2048                    // コマンドの行（値を除く）の長さの上限
+
+typedef int (*mc_out_fn)(void *arg, const void *data, size_t len);
+
+/*
+ * in の先頭 len バイトにある完全なコマンドを順に処理する。処理したバイト数を返す。
+ * *skip は読み捨てる残りのバイト数（接続ごとに持ち、最初は 0）。
+ * *ncmd に処理したコマンドの数を足す。
+ * quit / 行が長すぎる / out が失敗した場合は -1（接続を閉じる）。
+ */
+long mc_execute(struct kvstore *kv, const char *in, size_t len, size_t *skip,
+                mc_out_fn out, void *arg, long *ncmd);
+
+#endif
@@ -0,0 +1,150 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "outq.h"
+
+/*
+ * outq.h の実装。
+ *
+ * send には MSG_NOSIGNAL を付ける（相手が閉じていても SIGPIPE で落ちずに EPIPE が返る）。
+ * ソケットはノンブロッキングにしてある前提だが、念のため MSG_DONTWAIT も付けておく。
+ */
+
+#define SEND_FLAGS (MSG_NOSIGNAL | MSG_DONTWAIT)
+
+void outq_init(struct outq *q){
+   q->head = NULL;
+   q->tail = NULL;
+   q->bytes = 0;
+}
+
+/*
+ * 空のチャンクを1つ末尾につなぐ。
+ */
+static struct obuf *push_chunk(struct outq *q, struct slab_pool *pool){
+   struct obuf *b;
+
+   b = slab_alloc(pool);
+   if(b == NULL) return NULL;
+   b->next = NULL;
+   b->len = 0;
+   b->off = 0;
+   if(q->tail != NULL) q->tail->next = b;
+   else q->head = b;
+   q->tail = b;
+   return b;
+}
+
+/*
+ * buf をキューの末尾に積む。
+ */
+static int append(struct outq *q, struct slab_pool *pool, const char *buf, size_t len, int msg){
+   struct obuf *b = q->tail;
+   size_t room;
+
+   if(msg){
+      if(len > sizeof(b->data)) return -1;
+      b = push_chunk(q, pool);
+      if(b == NULL) return -1;
+      memcpy(b->data, buf, len);
+      b->len = len;
+      q->bytes += len;
+      return 0;
+   }
+
+   while(len > 0){
+      if(b == NULL || b->len == (int)sizeof(b->data)){
+         b = push_chunk(q, pool);
+         if(b == NULL) return -1;
+      }
+      room = sizeof(b->data) - b->len;
+      if(room > len) room = len;
+      memcpy(b->data + b->len, buf, room);
+      b->len += room;
+      q->bytes += room;
+      buf += room;
+      len -= room;
+   }
+   return 0;
+}
+
+int outq_send(struct outq *q, struct slab_pool *pool, int fd, const void *buf, size_t len, int msg){
+   ssize_t ret = 0;
+
+   if(outq_empty(q)){
+      /*
+       * よくある場合: キューが空で送信バッファにも空きがある → コピーせずにそのまま送れる。
+       */
+      ret = send(fd, buf, len, SEND_FLAGS);
+      if(ret < 0){
+         if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+         ret = 0;
+      }
+      if((size_t)ret == len) return 0;
+   }
+   /*
+    * メッセージ型では一部だけ送れることは無い（0 か len）。
+    */
+   return append(q, pool, (const char *)buf + ret, len - ret, msg);
+}
+
+int outq_append(struct outq *q, struct slab_pool *pool, const void *buf, size_t len){
+   return append(q, pool, buf, len, 0);
+}
+
+char *outq_reserve(struct outq *q, struct slab_pool *pool, size_t cap, int msg){
+   struct obuf *b = q->tail;
+
+   if(cap > sizeof(b->data)) return NULL;
+   /*
+    * メッセージ型では1通1チャンク。ストリームなら末尾のチャンクに cap バイト空いていればそこに書く。
+    * 空いていなければ新しいチャンクにする（境界をまたいで書かせない）。
+    */
+   if(msg || b == NULL || sizeof(b->data) - b->len < cap){
+      b = push_chunk(q, pool);
+      if(b == NULL) return NULL;
+   }
+   return b->data + b->len;
+}
+
+void outq_commit(struct outq *q, size_t len){
+   q->tail->len += len;
+   q->bytes += len;
+}
+
+int outq_flush(struct outq *q, struct slab_pool *pool, int fd){
+   struct obuf *b;
+   ssize_t ret;
+
+   while((b = q->head) != NULL){
+      if(b->off < b->len){
+         ret = send(fd, b->data + b->off, b->len - b->off, SEND_FLAGS);
+         if(ret < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+            return -1;
+         }
+         b->off += ret;
+         q->bytes -= ret;
+         if(b->off < b->len) return 0;           // 送信バッファが一杯になった
+      }
+
+      /*
+       * チャンクを送り終えた（メッセージ型では、send が成功すれば1通全部送れている）。
+       */
+      q->head = b->next;
+      if(q->head == NULL) q->tail = NULL;
+      slab_free(pool, b);
+   }
+   return 0;
+}
+
+void outq_clear(struct outq *q, struct slab_pool *pool){
+   struct obuf *b, *next;
+
+   for(b = q->head; b != NULL; b = next){
+      next = b->next;
+      slab_free(pool, b);
+   }
+   outq_init(q);
+}
@@ -0,0 +1,110 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include "slab.h"
+
+/*
+ * outq: 接続ごとの送信キュー（書き込みの背圧）
+ *
+ * ノンブロッキングのソケットに send すると、送信バッファが一杯のときは
+ *   - 一部だけ送れる（戻り値 < len）
+ *   - 全く送れない（-1 / EAGAIN）
+ * のどちらかになる。相手が受け取らない（recv しない）クライアントが1つでもいると、
+ *   - ブロッキングのソケットなら send で止まり、シングルスレッドのサーバ全体が止まる
+ *   - 戻り値を見ずに捨てれば、応答が欠ける
+ * ことになる。
+ *
+ * そこで、送りきれなかった分を接続ごとのキューに積んでおき、
+ * ソケットが書き込み可能になったら（select の writefds / EPOLLOUT）続きを送る。
+ * 書き込み可能の監視は「キューが空でない間だけ」行う。
+ * 空のソケットはほぼ常に書き込み可能なので、常に監視するとループが空回りする。
+ *
+ * キューは slab から借りるチャンク（OBUF_SIZE バイト）の連結リスト。
+ * ストリーム（TCP / SOCK_STREAM）なら末尾のチャンクの空きに詰めて入れ、
+ * 送るときも境界を気にせず続けて送る。
+ * メッセージ型（SOCK_SEQPACKET）では send 1回が1メッセージなので、
+ * 1メッセージを1チャンクに入れ、チャンク単位で送る（途中で分けない）。
+ *
+ * キューの長さ（bytes）が上限を超えたら、その接続からの読み込みを止めるのは呼び出し側の仕事
+ * （要求を読まなければ応答も増えない）。server_m_sockets.c / server_prefork.c を参照。
+ *
+ * 使い方:
+ *   struct slab_pool pool;
+ *   struct outq q;
+ *
+ *   slab_init(&pool, sizeof(struct obuf), 16);
+ *   outq_init(&q);
+ *   outq_send(&q, &pool, fd, &n, sizeof(n), 0);    // 送れなかった分はキューに残る
+ *   if(!outq_empty(&q)) → fd の書き込み可能を監視する
+ *   書き込み可能になったら outq_flush(&q, &pool, fd);
+ *   outq_clear(&q, &pool);                          // 切断時
+ *
+ * 【コンパイル】
+ *   gcc prog.c outq.c slab.c -o prog
+ */
+
+#define OBUF_SIZE 512                        // チャンクの大きさ（slab の 64 バイト境界に合わせる）
+
+struct obuf {
+   struct obuf *next;
+   int len;                                  // data に入っているバイト数
+   int off;                                  // そのうち送り終えたバイト数
+   char data[OBUF_SIZE - sizeof(void *) - 2 * sizeof(int)];
+};
+
+struct outq {
+   struct obuf *head, *tail;
+   size_t bytes;                             // まだ送っていないバイト数
+};
+
+/*
+ * 空のキューにする。
+ */
+void outq_init(struct outq *q);
+
+/*
+ * buf の len バイトを送る。キューが空ならまず直接 send し、送れなかった分をキューに積む。
+ * キューが空でなければ順番を守るため、すべてキューの後ろに積む。
+ * msg が 1 なら buf を1メッセージとして扱う（SOCK_SEQPACKET）。
+ * 成功（キューに積んだ場合も含む）で 0、相手が切断していた / メモリが無いなどで -1。
+ */
+int outq_send(struct outq *q, struct slab_pool *pool, int fd, const void *buf, size_t len, int msg);
+
+/*
+ * buf の len バイトをキューの末尾に積むだけで、送らない（ストリームのみ）。
+ * 応答をいくつかの部分に分けて作るときは、全部積んでから outq_flush() で1回に送る。
+ * 成功で 0、メモリが無ければ -1。
+ */
+int outq_append(struct outq *q, struct slab_pool *pool, const void *buf, size_t len);
+
+/*
+ * キューの中身を送れるだけ送る（EAGAIN になったらやめる）。
+ * 成功で 0（全部送れたかは outq_empty() で見る）、エラーで -1。
+ * メッセージ型のキューはチャンク = 1通なので、ストリームと同じ手順で送れる。
+ */
+int outq_flush(struct outq *q, struct slab_pool *pool, int fd);
+
+/*
+ * 応答を直接書き込むための場所を、キューの末尾に cap バイト（チャンクのデータ部以下）確保して返す。
+ * 書き終えたら outq_commit() で書いた長さを確定する（確定するまで送られない）。
+ * 応答を作ってから outq_send() でコピーする代わりに、作る側がここへ直接書けばコピーが1回減る。
+ * メモリが無ければ NULL。
+ */
+char *outq_reserve(struct outq *q, struct slab_pool *pool, size_t cap, int msg);
+
+/*
+ * outq_reserve() の場所に len バイト書いたことを確定する。
+ */
+void outq_commit(struct outq *q, size_t len);
+
+/*
+ * キューを捨てて、チャンクをプールへ返す。
+ */
+void outq_clear(struct outq *q, struct slab_pool *pool);
+
+static inline int outq_empty(const struct outq *q){
+   return q->head == NULL;
+}
+
+#endif
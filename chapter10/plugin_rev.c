@@ -0,0 +1,25 @@
+#include <stddef.h>
+#include "handler.h"
+
+/*
+ * handler.h のプラグインの例: 要求の文字列を逆順にして返す。
+ *
+ * 【コンパイル】
+ *   gcc -shared -fPIC plugin_rev.c -o plugin_rev.so
+ *
+ * 使い方:
+ *   $ ./server_m_sockets -P ./plugin_rev.so -x rev 5000
+ */
+
+static int rev(const char *req, size_t len, char *out, size_t cap){
+   size_t i;
+
+   if(len > cap) len = cap;
+   for(i = 0; i < len; i++) out[i] = req[len - 1 - i];
+   return len;
+}
+
+const struct handler handlers[] = {
+   { "rev", "文字列を逆順にして返す（plugin_rev.so）", rev },
+   { NULL, NULL, NULL }
+};
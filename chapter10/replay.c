@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "trace.h"
+
+#define BUF_SIZE 65536
+#define INFLIGHT 1024          // 1接続あたり、応答を待っている要求の数の上限（遅延の計測用）
+#define EV_MAX 64
+#define REPLY_WAIT_MS 1000     // 次の要求や切断の前に、残りの応答を待つ時間の上限
+
+/*
+ * server_m_sockets -w で記録したファイル（trace.h）を読み、
+ * 記録と同じ順番・同じ間隔で接続/要求/切断を別のサーバへ流し直す。
+ *
+ *   -s <倍率> : 1 なら記録と同じ間隔、10 なら 10 倍速、0 なら待たずに全速で流す（既定 1）
+ *   -r <バイト> : 応答1つの大きさ（既定 4 = strlen の int）。0 なら遅延を測らない
+ *   -u / -q <path> : TCP の代わりに Unix ドメインソケット（SOCK_STREAM / SOCK_SEQPACKET）に接続する
+ *
+ * 順番は記録どおりに守る（別の接続の要求どうしの前後関係も変えない）ので、
+ * 同じファイルを流せば、サーバには毎回同じ要求が同じ順で届く。
+ * 間隔（-s 0 以外）は「記録の開始からの時刻 / 倍率」の時刻まで待ってから送る。
+ * 送るのが予定より遅れた量（サーバやこのプログラムが追いつけていない量）も表示する。
+ *
+ * 応答は読み捨てるが、-r バイトごとに「1つの応答」として数え、
+ * 対応する要求を送ってからの時間を遅延として集計する（SOCK_SEQPACKET では1通 = 1応答）。
+ * 応答を読まずに送り続けると、サーバが読み込みを止める（送信キューの上限）ので、
+ * 送る前と待っている間に、届いている応答をすべて読んでおく。
+ *
+ * -r が 0 でなければ、同じ接続では前の要求の応答を受け取ってから次の要求を送る（記録したクライアントと同じ）。
+ * TCP では続けて送った要求がサーバの recv 1回にまとまってしまい（特に -s 0）、
+ * 記録と違う区切りの要求になるのを防ぐため。別の接続の要求は並行して流れる。
+ *
+ * 使い方:
+ *   $ ./server_m_sockets -w /tmp/prod.trace 5000      （本番の負荷を記録）
+ *   $ ./replay -s 1 /tmp/prod.trace 127.0.0.1 5001    （新しいビルドに同じ負荷をかける）
+ *   $ ./replay -s 0 /tmp/prod.trace 127.0.0.1 5001    （全速）
+ *
+ * 【コンパイル】
+ *   gcc replay.c trace.c -o replay
+ */
+
+struct rconn {
+   int fd;                        // 開いていなければ -1
+   uint64_t sent[INFLIGHT];       // 応答を待っている要求を送った時刻（リングバッファ）
+   int head, tail;
+   long rbytes;                   // まだ1つの応答にならない受信バイト数
+};
+
+struct rconn **conns;             // 接続の通し番号で引く
+uint32_t nconns_alloc;
+int efd;
+int utype;                        // 0 なら TCP
+char *upath;
+struct sockaddr_in s_addr;
+int reply_bytes = 4;
+uint64_t *lat;                    // 応答の遅延（ns）
+long nlat, lat_alloc;
+long n_req, n_open, n_err;
+uint64_t max_lag;                 // 予定より遅れて送った最大の時間
+
+/*
+ * サーバに接続する（client_socket.c と同じアドレスの作り方）。
+ */
+int connect_server(void){
+   int fd;
+   struct sockaddr_un u_addr;
+   socklen_t addr_len;
+
+   if(upath == NULL){
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      if(fd < 0) return -1;
+      if(connect(fd, (struct sockaddr *)&s_addr, sizeof(s_addr)) < 0){
+         close(fd);
+         return -1;
+      }
+      return fd;
+   }
+
+   fd = socket(AF_UNIX, utype, 0);
+   if(fd < 0) return -1;
+   memset(&u_addr, 0, sizeof(u_addr));
+   u_addr.sun_family = AF_UNIX;
+   if(upath[0] == '@'){
+      memcpy(u_addr.sun_path + 1, upath + 1, strlen(upath + 1));
+      addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(upath);
+   }
+   else{
+      strcpy(u_addr.sun_path, upath);
+      addr_len = sizeof(u_addr);
+   }
+   if(connect(fd, (struct sockaddr *)&u_addr, addr_len) < 0){
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/*
+ * 通し番号 id の接続（無ければ作る）。
+ */
+struct rconn *get_conn(uint32_t id){
+   uint32_t n;
+
+   if(id >= nconns_alloc){
+      n = nconns_alloc ? nconns_alloc : 64;
+      while(n <= id) n *= 2;
+      conns = realloc(conns, sizeof(conns[0]) * n);
+      if(conns == NULL){
+         perror("realloc");
+         exit(1);
+      }
+      memset(conns + nconns_alloc, 0, sizeof(conns[0]) * (n - nconns_alloc));
+      nconns_alloc = n;
+   }
+   if(conns[id] == NULL){
+      conns[id] = calloc(1, sizeof(struct rconn));
+      if(conns[id] == NULL){
+         perror("calloc");
+         exit(1);
+      }
+      conns[id]->fd = -1;
+   }
+   return conns[id];
+}
+
+void add_latency(uint64_t ns){
+   if(nlat == lat_alloc){
+      lat_alloc = lat_alloc ? lat_alloc * 2 : 4096;
+      lat = realloc(lat, sizeof(lat[0]) * lat_alloc);
+      if(lat == NULL){
+         perror("realloc");
+         exit(1);
+      }
+   }
+   lat[nlat++] = ns;
+}
+
+/*
+ * c に届いている応答をすべて読む。相手が閉じていたら -1。
+ */
+int drain(struct rconn *c){
+   static char buf[BUF_SIZE];
+   ssize_t ret;
+   uint64_t now;
+
+   while(1){
+      ret = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if(ret < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+      if(ret == 0) return -1;
+      if(reply_bytes == 0) continue;
+
+      /*
+       * 応答の区切り: SOCK_SEQPACKET なら1通、それ以外は reply_bytes バイトごと。
+       */
+      c->rbytes += utype == SOCK_SEQPACKET ? reply_bytes : ret;
+      now = trace_now_ns();
+      while(c->rbytes >= reply_bytes && c->head != c->tail){
+         add_latency(now - c->sent[c->tail]);
+         c->tail = (c->tail + 1) % INFLIGHT;
+         c->rbytes -= reply_bytes;
+      }
+   }
+}
+
+void close_conn(struct rconn *c){
+   close(c->fd);                  // epoll からも外れる
+   c->fd = -1;
+   c->head = c->tail = 0;
+   c->rbytes = 0;
+}
+
+/*
+ * 最大 ms ミリ秒（0 なら待たずに）応答を待って読む。
+ */
+void pump(int ms){
+   struct epoll_event evs[EV_MAX];
+   struct rconn *c;
+   int nev, i;
+
+   nev = epoll_wait(efd, evs, EV_MAX, ms);
+   for(i = 0; i < nev; i++){
+      c = evs[i].data.ptr;
+      if(c->fd >= 0 && drain(c) < 0){
+         n_err++;
+         close_conn(c);
+      }
+   }
+}
+
+/*
+ * c の応答待ちが無くなるまで（最大 REPLY_WAIT_MS）、応答を読みながら待つ。
+ */
+void wait_replies(struct rconn *c){
+   uint64_t end = trace_now_ns() + (uint64_t)REPLY_WAIT_MS * 1000000;
+
+   while(c->fd >= 0 && reply_bytes > 0 && c->head != c->tail && trace_now_ns() < end) pump(1);
+}
+
+/*
+ * 要求を1つ送る。送信バッファが一杯なら、応答を読みながら待つ。
+ */
+int send_req(struct rconn *c, const char *data, size_t len){
+   ssize_t ret;
+   size_t off = 0;
+
+   wait_replies(c);
+   if(c->fd < 0) return -1;
+
+   while(off < len){
+      ret = send(c->fd, data + off, len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if(ret < 0){
+         if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+         pump(10);
+         if(c->fd < 0) return -1;
+         continue;
+      }
+      off += ret;
+   }
+
+   if(reply_bytes > 0){
+      if((c->head + 1) % INFLIGHT == c->tail) c->tail = (c->tail + 1) % INFLIGHT;   // 溢れたら古いものを捨てる
+      c->sent[c->head] = trace_now_ns();
+      c->head = (c->head + 1) % INFLIGHT;
+   }
+   return 0;
+}
+
+int cmp_u64(const void *a, const void *b){
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]){
+   struct trace tr;
+   struct trace_rec r;
+   struct rconn *c;
+   struct epoll_event ev;
+   static char data[UINT16_MAX];
+   double speed = 1;
+   uint64_t start, due, now;
+   int opt, ret;
+   uint32_t i;
+
+   while((opt = getopt(argc, argv, "s:r:u:q:")) != -1){
+      if(opt == 's') speed = atof(optarg);
+      else if(opt == 'r') reply_bytes = atoi(optarg);
+      else if(opt == 'u'){
+         upath = optarg;
+         utype = SOCK_STREAM;
+      }
+      else if(opt == 'q'){
+         upath = optarg;
+         utype = SOCK_SEQPACKET;
+      }
+      else{
+         fprintf(stderr, "Usage: $ ./replay [-s speed] [-r reply_bytes] trace_file (ip port | -u path | -q path)\n");
+         exit(1);
+      }
+   }
+   if(argc - optind != (upath != NULL ? 1 : 3) || speed < 0 || reply_bytes < 0 ||
+      (upath != NULL && strlen(upath) >= sizeof(((struct sockaddr_un *)0)->sun_path))){
+      fprintf(stderr, "Usage: $ ./replay [-s speed] [-r reply_bytes] trace_file (ip port | -u path | -q path)\n");
+      exit(1);
+   }
+   if(upath == NULL){
+      memset(&s_addr, 0, sizeof(s_addr));
+      s_addr.sin_family = AF_INET;
+      s_addr.sin_port = htons((unsigned short)atoi(argv[optind + 2]));
+      s_addr.sin_addr.s_addr = inet_addr(argv[optind + 1]);
+   }
+
+   if(trace_open(&tr, argv[optind]) < 0){
+      fprintf(stderr, "%s: cannot open or not a trace file\n", argv[optind]);
+      exit(1);
+   }
+   efd = epoll_create1(0);
+   if(efd < 0){
+      perror("epoll_create1");
+      exit(1);
+   }
+
+   start = trace_now_ns();
+   while((ret = trace_read(&tr, &r, data, sizeof(data))) == 1){
+      /*
+       * 予定の時刻まで、応答を読みながら待つ。全速（-s 0）なら届いている分だけ読む。
+       */
+      if(speed > 0){
+         due = start + (uint64_t)(r.t_ns / speed);
+         while((now = trace_now_ns()) < due) pump((int)((due - now + 999999) / 1000000));
+         if(now - due > max_lag) max_lag = now - due;
+      }
+      else{
+         pump(0);
+      }
+
+      c = get_conn(r.conn);
+      if(r.type == TR_OPEN){
+         if(c->fd >= 0) close_conn(c);
+         c->fd = connect_server();
+         if(c->fd < 0){
+            perror("connect");
+            n_err++;
+            continue;
+         }
+         ev.events = EPOLLIN;
+         ev.data.ptr = c;
+         epoll_ctl(efd, EPOLL_CTL_ADD, c->fd, &ev);
+         n_open++;
+      }
+      else if(r.type == TR_DATA){
+         /*
+          * 記録の途中から始まった接続（ホットリスタートで引き継いだものなど）は、ここで接続する。
+          */
+         if(c->fd < 0){
+            c->fd = connect_server();
+            if(c->fd < 0){
+               n_err++;
+               continue;
+            }
+            ev.events = EPOLLIN;
+            ev.data.ptr = c;
+            epoll_ctl(efd, EPOLL_CTL_ADD, c->fd, &ev);
+            n_open++;
+         }
+         if(send_req(c, data, r.len) < 0){
+            n_err++;
+            if(c->fd >= 0) close_conn(c);
+            continue;
+         }
+         n_req++;
+      }
+      else if(r.type == TR_CLOSE && c->fd >= 0){
+         /*
+          * 記録ではクライアントは応答を受け取ってから切断しているはずなので、残りの応答を待ってから閉じる。
+          */
+         wait_replies(c);
+         if(c->fd >= 0) close_conn(c);
+      }
+   }
+   if(ret < 0) fprintf(stderr, "trace file is truncated or corrupt after %ld records\n", tr.nrec);
+
+   /*
+    * 切断の記録が無い接続（記録を止めたときに残っていたもの）の応答を待って閉じる。
+    */
+   for(i = 0; i < nconns_alloc; i++){
+      c = conns[i];
+      if(c == NULL || c->fd < 0) continue;
+      wait_replies(c);
+      if(c->fd >= 0) close_conn(c);
+   }
+   now = trace_now_ns();
+
+   printf("replayed %ld records: %ld connections, %ld requests, %ld errors in %.3f s (%.0f req/s)\n",
+          tr.nrec, n_open, n_req, n_err, (now - start) / 1e9, n_req / ((now - start) / 1e9));
+   if(speed > 0) printf("  max schedule lag %.3f ms\n", max_lag / 1e6);
+   if(nlat > 0){
+      qsort(lat, nlat, sizeof(lat[0]), cmp_u64);
+      printf("  latency (us, %ld replies): p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", nlat,
+             lat[nlat / 2] / 1e3, lat[nlat * 90 / 100] / 1e3, lat[nlat * 99 / 100] / 1e3, lat[nlat - 1] / 1e3);
+   }
+   trace_close(&tr);
+   return 0;
+}
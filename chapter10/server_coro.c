@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/signalfd.h>
+#include "coro.h"
+
+#define BUF_SIZE 256
+
+/*
+ * server_m_sockets.c と同じ strlen サービスを、coro.h のコルーチンで書いたもの。
+ *
+ * 接続ごとの処理 client() は、上から順に
+ *   読む → （"wait <ms> ..." なら ms ミリ秒待つ） → 文字数を書く → 次を読む
+ * と書いてあるだけで、どこで中断したかを覚える状態機械は出てこない。
+ * 待受ソケット（acceptor()）とシグナル（on_signal()）もそれぞれ1つのタスクにしている。
+ *
+ * 1つのスレッドですべてのタスクを動かす。接続ごとのメモリは
+ * struct task と struct cstate の合計（起動時に表示する）だけで、スタックは持たない。
+ *
+ * 要求:
+ *   "<文字列>"            : 文字数を返す
+ *   "wait <ms> <文字列>"  : ms ミリ秒後に、要求全体の文字数を返す
+ *                           （待っている間も他の接続には普通に答える）
+ *   "exit"                : 文字数を返して切断する
+ *
+ * 使い方:
+ *   $ ./server_coro <port>
+ *
+ * 【コンパイル】
+ *   gcc server_coro.c coro.c twheel.c -o server_coro
+ */
+
+/*
+ * 接続ごとの状態。中断をまたいで使う値とバッファはここに置く（coro.h の制約を参照）。
+ */
+struct cstate {
+   char buf[BUF_SIZE];
+   int n;
+};
+
+int nclients;
+
+/*
+ * クライアント1接続ぶんの処理。
+ */
+int client(struct task *t){
+   struct cstate *s = task_state(t);
+   long ms;
+
+   co_begin(t);
+   nclients++;
+
+   while(1){
+      async_read(t, s->buf, BUF_SIZE - 1);
+      if(t->result <= 0) break;                  // 切断またはエラー
+      s->buf[t->result] = '\0';
+      fprintf(stderr, "received: %s\n", s->buf);
+
+      s->n = strlen(s->buf);
+      if(strncmp(s->buf, "wait ", 5) == 0){
+         ms = atol(s->buf + 5);
+         async_sleep(t, ms);
+      }
+
+      async_write(t, &s->n, sizeof(s->n));
+      if(t->result < 0) break;
+      if(strcmp(s->buf, "exit") == 0) break;
+   }
+
+   nclients--;
+   fprintf(stderr, "socket=%d disconnected (clients=%d)\n", t->fd, nclients);
+   co_end(t);
+}
+
+/*
+ * 待受ソケット: 接続が来るたびに client() のタスクを作る。
+ */
+int acceptor(struct task *t){
+   int cfd;
+
+   co_begin(t);
+   while(1){
+      async_wait(t, EPOLLIN);
+
+      /*
+       * 溜まっている接続要求をまとめて受け付ける（空になれば EAGAIN）。
+       */
+      while((cfd = accept(t->fd, NULL, NULL)) >= 0){
+         if(task_spawn(t->loop, cfd, client, sizeof(struct cstate)) == NULL){
+            perror("task_spawn");
+            close(cfd);
+         }
+      }
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+         perror("accept");
+         if(errno != EMFILE && errno != ENFILE) break;
+      }
+   }
+   co_end(t);
+}
+
+/*
+ * SIGINT / SIGTERM を受けたらループを止める。
+ */
+int on_signal(struct task *t){
+   struct signalfd_siginfo si;
+
+   co_begin(t);
+   async_read(t, &si, sizeof(si));
+   fprintf(stderr, "received signal, %d clients\n", nclients);
+   coloop_stop(t->loop);
+   co_end(t);
+}
+
+int main(int argc, char *argv[]){
+   int sfd, sigfd, on = 1;
+   unsigned short port;
+   struct sockaddr_in s_addr;
+   struct coloop loop;
+   sigset_t mask;
+
+   if(argc != 2){
+      fprintf(stderr, "Usage: $ ./server_coro <port>\n");
+      exit(1);
+   }
+   port = (unsigned short)atoi(argv[1]);
+
+   sfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+   if(sfd < 0){
+      perror("socket");
+      exit(1);
+   }
+   if(setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0){
+      perror("setsockopt");
+      exit(1);
+   }
+   memset(&s_addr, 0, sizeof(s_addr));
+   s_addr.sin_family = AF_INET;
+   s_addr.sin_port = htons(port);
+   s_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+   if(bind(sfd, (struct sockaddr *)&s_addr, sizeof(s_addr)) < 0){
+      perror("bind");
+      exit(1);
+   }
+   if(listen(sfd, 128) < 0){
+      perror("listen");
+      exit(1);
+   }
+
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGINT);
+   sigaddset(&mask, SIGTERM);
+   sigprocmask(SIG_BLOCK, &mask, NULL);
+   sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+   if(sigfd < 0){
+      perror("signalfd");
+      exit(1);
+   }
+
+   if(coloop_init(&loop) < 0){
+      perror("coloop_init");
+      exit(1);
+   }
+   if(task_spawn(&loop, sfd, acceptor, 0) == NULL || task_spawn(&loop, sigfd, on_signal, 0) == NULL){
+      perror("task_spawn");
+      exit(1);
+   }
+
+   fprintf(stderr, "Port=%u, %zu bytes per connection\n", port,
+           sizeof(struct task) + sizeof(struct cstate));
+
+   coloop_run(&loop);
+   coloop_destroy(&loop);
+   fprintf(stderr, "bye\n");
+   return 0;
+}
@@ -8,19 +8,46 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include "twheel.h"
+#include "slab.h"
+#include "outq.h"
+#include "handler.h"
+#include "trace.h"
+#include "stats.h"
+#include "shmring.h"
+#include "kvstore.h"
+#include "mcproto.h"
 
 #define BUF_SIZE 256
 #define C_MAX 5
+#define TICK_MS 100           // タイマーホイールの刻み
+#define STATS_MS 10000        // 接続数などを表示する間隔
+#define HIGH_WM 65536         // 送信キューの上限の既定値（バイト）
+#define ADMIN_REQ_MAX 1024    // 管理用の口で受け取る問い合わせの長さの上限
+#define ADMIN_OUT_MAX 16384   // 管理用の口の応答の長さの上限
+#define ADMIN_CONNS 4         // 管理用の口で同時に相手をする問い合わせの数
+#define ADMIN_TIMEOUT_MS 1000 // 管理用の口の問い合わせを打ち切るまでの時間
+#define MC_BUF_INIT 4096      // -M: 接続ごとの受信バッファの最初の大きさ
+#define MC_BUF_MAX (KV_ITEM_MAX + MC_LINE_MAX + 3)   // -M: 受信バッファの上限（行 + \n + 値 + \r\n が入る）
+#define MC_RECV_MAX 16384     // -M: 1回の recv で読む上限（-w の記録の長さが 16 ビットなので）
 
 /*
  * このプログラムは TCP サーバを「select() による I/O 多重化」で実装した例である。
  *
  * 目的（高レベル）:
  *   - 1つの待受ソケット(sfd)で新規接続を受け付ける
- *   - 最大 C_MAX 個のクライアント接続を同時に扱う（スレッドは使わない）
+ *   - 最大 max_conns 個（既定 C_MAX）のクライアント接続を同時に扱う（スレッドは使わない）
  *   - 各クライアントから文字列を recv で受け取り、文字数 n=strlen(buf) を返す
  *   - "exit" を受け取ったクライアントは切断し、スロットを空ける
- *   - Ctrl+C(SIGINT) を受けたら全ソケットを close して終了する
+ *   - Ctrl+C(SIGINT) / SIGTERM を受けたら、処理中の要求に答え終えてから終了する（下記 -g）
  *
  * --------------------------------------------------------------------
  * 【select による多重化の考え方】
@@ -30,7 +57,7 @@
  *
  * ここで監視する FD は2種類:
  *   1) sfd : 待受ソケット（ここが readable になる = 新規接続が来て accept 可能）
- *   2) socketfds[i] : accept 後の通信ソケット（ここが readable になる = クライアントからデータ到着）
+ *   2) conns[i]->fd : accept 後の通信ソケット（ここが readable になる = クライアントからデータ到着）
  *
  * select ループの典型形:
  *
@@ -44,53 +71,519 @@
  * --------------------------------------------------------------------
  * 【重要な注意点（このコードにある不整合/改善点）】
  *
- * 1) send の送信サイズが不適切:
- *    send(socketfds[i], &n, ret_rcv, 0) となっているが、
- *    n は int なので本来は sizeof(n) を送るべきである。
+ * 1) send の送信サイズ（修正済み）:
+ *    元は send(socketfds[i], &n, ret_rcv, 0) となっていたが、
+ *    n は int なので sizeof(n) を送るべきである。
  *    ret_rcv は「受信した文字列バイト数」であり、int のサイズとは無関係。
- *
- *    正しくは概念的に:
+ *    SOCK_SEQPACKET に対応する際に
  *      send(socketfds[i], &n, sizeof(n), 0);
+ *    に直した。
  *
  * 2) recv の戻り値 ret_rcv は「受信したバイト数」であり、
  *    buf は必ず '\0' 終端されるとは限らない。
- *    ただしこのコードは memset(buf,0,BUF_SIZE) しているため短い入力では文字列化しやすい。
+ *    このコードは受信バッファを BUF_SIZE - 1 バイトまでしか受け取らず、
+ *    受信した長さの位置（rb->data[ret_rcv]）に '\0' を置いて文字列にしている。
  *
  * 3) accept の addr_len 型:
  *    accept の第3引数は socklen_t* が推奨。
- *    このコードは (socklen_t *)&addr_len とキャストしている。
+ *    Unix ドメインのアドレスも受けられるよう、addr_len を socklen_t にし、
+ *    c_addr は sockaddr_storage（どのアドレスファミリでも入る大きさ）にしている。
+ *    accept のたびに addr_len を sizeof(c_addr) に戻すこと（値結果引数）。
+ *
+ * 4) 元の版は SIGINT ハンドラ stop() の中で close/exit していた。
+ *    ハンドラはループのどこで割り込むか分からないので、
+ *    非同期シグナル安全でない関数を呼ぶと壊れることがある。
+ *    現在は signalfd でシグナルを「読めるFD」にして、select ループの中で処理している（下記 -g）。
+ *
+ * --------------------------------------------------------------------
+ * 【Unix ドメインソケットの待受（-u / -q）】
+ *
+ * 同じホスト上のクライアントが 127.0.0.1 に TCP で接続すると、
+ * データは TCP/IP スタック（シーケンス番号、ACK、チェックサム、輻輳制御…）を通る。
+ * AF_UNIX ソケットならカーネル内でバッファを相手のキューに付け替えるだけなので、
+ * 同じ要求/応答でも遅延が小さい。
+ *
+ *   -u <path> : AF_UNIX + SOCK_STREAM で待ち受ける（TCP と同じバイトストリーム）
+ *   -q <path> : AF_UNIX + SOCK_SEQPACKET で待ち受ける
+ *               接続型だがメッセージ境界が保たれる（send 1回 = recv 1回）
+ *
+ * path が '@' で始まる場合は Linux の抽象名前空間（abstract namespace）を使う。
+ *   例: -u @strlen
+ * ファイルシステム上にソケットファイルを作らないので、
+ * 終了時の unlink や、前回のファイルが残っていて bind に失敗する問題が無い。
+ *
+ * これらの待受ソケットも sfd と同じく select で監視し、
+ * accept した FD は TCP のクライアントと同じ conns[] に入れる。
+ * 以降の recv/send は TCP でも Unix でも同じコードで扱える。
+ *
+ * 使い方:
+ *   $ ./server_m_sockets [-u path] [-q path] <port>
+ *
+ * --------------------------------------------------------------------
+ * 【ホットリスタート（-r）: 接続を切らずにプロセスを入れ替える】
+ *
+ * 普通に再起動すると、
+ *   - 旧プロセスが終了時に全クライアントを close する → 接続が切れる
+ *   - 新プロセスが bind/listen するまでの間、接続要求は拒否される（ECONNREFUSED）
+ * という問題がある。
+ *
+ * そこで、ソケットそのもの（FD）を新プロセスへ渡す。
+ * Unix ドメインソケットでは sendmsg の補助データ SCM_RIGHTS で FD を送れる。
+ * 受け取った側には、同じソケット（カーネル内のオブジェクト）を指す新しい FD ができる。
+ *
+ *   旧プロセス: -r ctl で起動し、制御ソケット ctl を待ち受けている
+ *   新プロセス: 同じ -r ctl で起動する
+ *     1) ctl に connect できたら、旧プロセスが動いている
+ *     2) 旧プロセスは制御ソケットを閉じてから、
+ *        待受ソケット（TCP / Unix）と接続中クライアントの FD をまとめて SCM_RIGHTS で送る
+ *     3) 新プロセスは受け取った FD で select ループを始め、確認の1バイトを返す
+ *     4) 旧プロセスは確認を受け取ったら自分の FD を close して終了する
+ *        （新プロセスも同じソケットを持っているので、接続は切れない）
+ *   ctl に connect できなければ（旧プロセスがいなければ）、普通に bind/listen する。
+ *
+ * 待受ソケットは一度も閉じられないので accept の空白期間は無く、
+ * 受け渡し中に届いたデータや接続要求はカーネルのキューで待っている。
+ * このサーバは受信した要求にその場で応答するので、旧プロセスに「処理途中の要求」は残らない。
+ *
+ * 使い方:
+ *   $ ./server_m_sockets -r @strlen-ctl 5000 &
+ *   （新しいバイナリに入れ替えて）
+ *   $ ./server_m_sockets -r @strlen-ctl 5000 &     ← 旧プロセスは自動で終了する
+ *
+ * -u / -q も新旧で同じものを指定すること（待受ソケットは旧プロセスのものを引き継ぐ）。
+ *
+ * --------------------------------------------------------------------
+ * 【タイムアウト（-i / -f）: タイマーホイール】
+ *
+ * 元の版は select を5秒ごとに起こすだけで、接続ごとの締め切りが無かった。
+ * 何も送ってこないクライアントが C_MAX 個のスロットを占有し続けられる。
+ *
+ *   -i <秒> : アイドルタイムアウト。最後の要求からこの時間何も来なければ切断する（既定 60、0 で無効）
+ *   -f <秒> : 接続してから最初の要求までの締め切り（既定 10、0 ならアイドルと同じ）
+ *
+ * 締め切りは twheel.h のタイマーホイールで管理する。
+ *   - 要求が来るたびに締め切りを延ばす（取り消し + 登録）が O(1)
+ *   - 期限切れの確認も、全接続をなめずに「今の tick のスロット」だけを見る
+ *   - select のタイムアウトは「次にタイマーが発火しうる時刻まで」にする
+ * 接続とは関係ない定期処理（STATS_MS ごとに接続数を表示）も同じホイールに載せている。
+ *
+ * --------------------------------------------------------------------
+ * 【接続オブジェクトと受信バッファのプール（-c）】
+ *
+ * 元の版の接続ごとの状態は socketfds[C_MAX] の FD だけで、
+ * 受信には1つのスタック上の buf を使い、recv のたびに memset でゼロクリアしていた。
+ *
+ * ここでは接続ごとの状態を struct conn（128 バイト = キャッシュライン2本）にまとめ、
+ * slab.h のプールから確保する。要求のたびに触るもの（FD、タイマー、トークン）は先頭の1本に置き、
+ * 2本目には滅多に触らない送信キュー（下記 -H / -l）を置いている。conns[] は struct conn へのポインタの表で、
+ * 空きスロットは NULL。
+ *
+ * 受信バッファ（struct rbuf）は接続ごとには持たず、共有のプールから
+ * 「読めるデータがある間だけ」借りて、要求を処理したらすぐ返す。
+ *   - 何も送ってこない接続が使うメモリは struct conn の 128 バイトだけ
+ *   - recv で受け取った長さの位置に '\0' を置けば文字列になるので、memset は要らない
+ *
+ *   -c <数> : 同時接続数の上限（既定 C_MAX。select を使うので FD_SETSIZE 未満に制限する）
+ *
+ * --------------------------------------------------------------------
+ * 【signalfd による終了処理（-g）】
+ *
+ * SIGINT / SIGTERM は sigprocmask でブロックし、signalfd で受け取る。
+ * シグナルが届くと signalfd が readable になるので、他の FD と同じく select で待てる。
+ * ハンドラの中ではなくループの中で処理するので、どんな関数でも安全に呼べる。
+ *
+ * シグナルを受けたら、すぐに全部 close するのではなく「排出（drain）」する:
+ *   1) 待受ソケットを閉じる（新しい接続は受け付けない）
+ *   2) 受信キューに残っている要求には、いつも通り答える
+ *   3) 答え終えた接続は shutdown(SHUT_WR) で半分だけ閉じる
+ *      → クライアントは recv が 0 を返すので「サーバが終わった」と分かる
+ *   4) クライアントが close したら（recv が 0）こちらも close する
+ *   5) 全接続が閉じたら終了。-g 秒たっても残っていれば強制的に閉じて終了
+ *
+ *   -g <秒> : 排出の締め切り（既定 5）
+ *
+ * --------------------------------------------------------------------
+ * 【過負荷対策（アドミッション制御）】
+ *
+ * 元の版は C_MAX 個が埋まると accept を呼ばなくなり、新しいクライアントは
+ * カーネルのバックログ（listen(sfd, 5)）で何の応答も無く待たされていた。
+ * 全員を少しずつ遅くするより、受け入れた分だけは速く答え、残りははっきり断る方がよい。
+ *
+ *   1) 接続数の上限（-c）: 上限に達していても accept し、すぐに close する（即時拒否）
+ *   2) クライアントごとのトークンバケット（-R / -B）:
+ *        1秒あたり rate 個のトークンが貯まり（最大 burst 個）、要求1つで1個使う。
+ *        トークンが無ければ処理せずに -1 を返す。1つのクライアントが連打しても他に響かない。
+ *   3) 待ち行列の深さによる負荷遮断（-L）:
+ *        select が返した「読める FD の数」を、この周回で処理を待っている要求の数とみなす。
+ *        1周で depth 個を超えたら、超えた分は処理せずに -2 を返す（load shedding）。
+ *        毎回同じ接続が遮断されないよう、走査を始めるスロットを1周ごとにずらす。
+ *
+ *   -R <数>  : 1クライアントあたりの要求数/秒（既定 0 = 無制限）
+ *   -B <数>  : トークンバケットの容量（既定 10）
+ *   -L <数>  : 1周で処理する要求数の上限（既定 0 = 無制限）
+ *
+ * 応答の n が負なら処理されなかったことを表す（-1: 流量制限、-2: 負荷遮断）。
+ * 拒否/制限/遮断の件数は定期表示（stats）に出る。
+ *
+ * --------------------------------------------------------------------
+ * 【送信キューと背圧（-H / -l）】
+ *
+ * 元の版はブロッキングのソケットに send して、戻り値を見ていなかった。
+ * 応答を受け取らない（recv しない）クライアントがいると、相手の受信バッファと
+ * こちらの送信バッファが埋まったところで send がブロックし、
+ * シングルスレッドのこのサーバは他の全クライアントの処理も止まってしまう。
+ *
+ * 現在は:
+ *   1) クライアントのソケットはノンブロッキングにする
+ *   2) 応答は outq.h の送信キュー経由で送る。送れなかった分は接続ごとのキューに残る
+ *   3) キューが空でない接続だけを select の writefds に入れ、書き込み可能になったら続きを送る
+ *   4) キューが high バイト以上になったら、その接続を readfds から外す（読み込みを止める）。
+ *      要求を読まなければ応答も増えないので、キューはそれ以上伸びない。
+ *      キューが low バイト以下まで減ったら読み込みを再開する（ヒステリシス）。
+ *      上限と再開点を分けるのは、境目で止める/再開するを細かく繰り返さないため。
+ *
+ * 読み込みを止めた接続の要求はカーネルの受信バッファに溜まり、
+ * それも一杯になれば TCP のフロー制御でクライアントの send が止まる。
+ * 遅いクライアントは自分だけが待たされ、他のクライアントには影響しない。
+ * 全く受け取らないクライアントは、アイドルタイムアウト（-i）で切断される
+ * （送信が進んだときも締め切りを延ばすので、遅いだけのクライアントは切られない）。
+ *
+ *   -H <バイト> : 送信キューの上限（既定 HIGH_WM）
+ *   -l <バイト> : 読み込みを再開するキューの長さ（既定 上限の 1/4）
+ *
+ * 排出（-g）のときは、キューが空になってから shutdown(SHUT_WR) する。
+ * ホットリスタート（-r）ではキューの中身は渡せないので、渡す前に送れるだけ送り、
+ * 残った分は捨てる（捨てたバイト数を表示する）。
+ *
+ * --------------------------------------------------------------------
+ * 【要求の処理を差し替える（-x / -P）】
+ *
+ * 要求1つに対する処理は handler.h の handler として登録されていて、-x name で選ぶ（既定 strlen）。
+ *   -x name : 使う handler（-x list で一覧を表示して終了）
+ *   -P path : handler を入れた共有ライブラリを dlopen する（何回でも指定できる）
+ *
+ * handler には受信バッファ（rbuf）の中の要求をそのまま読み取り専用で渡し、
+ * 応答は送信キューの末尾に確保した場所（outq_reserve()）へ直接書かせる。
+ * 要求も応答も、サーバの中で別のバッファへ詰め替えることは無い。
+ *
+ * 流量制限（-1）と負荷遮断（-2）の応答は handler を呼ばずに int で返す。
+ *
+ * --------------------------------------------------------------------
+ * 【要求の記録（-w）】
+ *
+ *   -w <file> : クライアントの接続 / 要求 / 切断を、時刻と接続番号つきで file に記録する（trace.h）
+ *
+ * 記録したファイルは replay.c で別のサーバ（別のビルド）に同じ間隔、または N 倍速で流し直せる。
+ * 実際の要求の混ざり方で、変更前後の性能を比べるために使う。
+ * 記録は stdio のバッファに溜めて、定期処理（stats）と終了時に書き出す。
+ * ホットリスタートの新プロセスには別のファイル名を指定すること（同じ名前だと作り直して消してしまう）。
+ *
+ * --------------------------------------------------------------------
+ * 【統計と管理用の口（-a）】
+ *
+ * 接続数 / バイト数 / 要求数 / エラー数のカウンタ、handler ごとの遅延のヒストグラム、
+ * イベントループ1周の処理時間のヒストグラムを stats.h で数えている。
+ * 要求の遅延は「recv で受け取ってから、応答を送る（送信キューに積む）まで」、
+ * ループ1周の時間は「select から戻ってから、次に select を呼ぶまで」（待っている時間は含まない）。
+ * 数えるのはループのスレッドだけなので、カウンタはロック無しで更新している。
+ *
+ *   -a <port>  : 127.0.0.1 の port で問い合わせを受ける（外からは見えない）
+ *   -a <path>  : Unix ドメインソケット（SOCK_STREAM）で問い合わせを受ける（"@name" は抽象名前空間）
+ *
+ * 接続して1行送ると、統計を返して閉じる。"json" を含んでいれば JSON、それ以外はテキスト
+ * （1行に「名前 値」）。"GET " で始まっていれば HTTP の応答ヘッダを付けるので、curl でも取れる:
+ *
+ *   $ ./server_m_sockets -a 9000 5000
+ *   $ curl -s 127.0.0.1:9000/stats.json
+ *   $ echo text | nc -q1 127.0.0.1 9000
+ *
+ * 問い合わせの接続もノンブロッキングにして、ほかの接続と同じく select で待つ
+ * （1行揃うまで受け取り、応答を送りきったら閉じる）。問い合わせ側が遅くても、ループは止まらない。
+ * 同時に相手をするのは ADMIN_CONNS 本までで、ADMIN_TIMEOUT_MS 以内に済まなければ切る。
+ * 統計はプロセスごとなので、ホットリスタートすると 0 から数え直す。
+ * TCP の管理用ポートは SO_REUSEPORT を付けて作るので、新プロセスは旧プロセスが閉じる前に同じポートを作れる。
+ *
+ * --------------------------------------------------------------------
+ * 【TCP Fast Open（-F）】
  *
- * 4) SIGINT ハンドラ内で close/exit は教材としてはOKだが、
- *    非同期シグナル安全性など厳密には論点がある（学習段階では深追い不要）。
+ * 「接続して要求を1つ送り、応答を受け取って閉じる」クライアントでは、
+ * 3ウェイハンドシェイクの1往復が要求1つごとに上乗せされる。
+ * TCP Fast Open（TFO）では、以前の接続でサーバから受け取ったクッキーを SYN に付けると、
+ * 要求のデータも SYN に載せて送れ、サーバは SYN を受け取った時点で accept / recv できる
+ * （ハンドシェイクの完了を待たずに応答できるので、1往復減る）。
+ *
+ *   -F <数> : 待受ソケットに TCP_FASTOPEN を設定する。数は、ハンドシェイクが終わっていない
+ *             TFO の接続を同時にいくつまで受けるか（SYN に載ったデータで資源を使わせる攻撃への上限）
+ *
+ * サーバ側の TFO は sysctl net.ipv4.tcp_fastopen の 2 のビットで有効になる（既定は 1 = クライアントのみ）:
+ *   # echo 3 > /proc/sys/net/ipv4/tcp_fastopen
+ * 無効なら警告を出す。クライアント側は client_socket.c の -F / -C を参照。
+ * SYN に載ったデータは再送されたものが重複して届くことがあり得るので、
+ * TFO で受ける要求は何度処理しても同じ結果になるもの（strlen のような）に限るべきである。
+ * ホットリスタートで引き継いだ待受ソケットには、旧プロセスの設定がそのまま残る。
+ *
+ * --------------------------------------------------------------------
+ * 【同じホストのクライアント: 共有メモリへの切り替え】
+ *
+ * Unix ドメインソケットの接続で SHM_UPGRADE（shmring.h）を要求として受け取ると、
+ * memfd の共有メモリに要求と応答のリングを作り、eventfd 2つと一緒に SCM_RIGHTS で渡す。
+ * 以降その接続の要求はリングから読み、応答もリングに書く（ソケットの send / recv を通らない）。
+ * select では要求の eventfd を監視するが、クライアントは「サーバが寝ているとき」しか鳴らさないので、
+ * 要求が続いている間はリングを見るだけで済む。TCP の接続では -3 を返し、そのまま TCP で続ける。
+ *
+ * リングの要求にも流量制限（-R）・統計・記録（-w）・アイドルタイムアウトは同じように効く。
+ * 1周で処理する要求は -L の残り（無ければリング1周分の SHM_SLOTS）までで、超えた分は断らずに
+ * リングに残して次の周回で処理する（要求を積み続けるクライアントがいても、ほかの接続は待たされない）。
+ * 応答のリングが一杯なら、要求は読まずに残しておく（クライアントが応答を読むと、次の要求で鳴らされる）。
+ * 排出では、要求のリングが空になってから送信側を閉じる。
+ * ホットリスタートでは共有メモリを引き継げないので、切り替え済みの接続は渡す前に閉じる
+ * （クライアントはつなぎ直して、もう一度切り替える）。
+ *
+ *   $ ./server_m_sockets -q @strlen 5000
+ *   $ ./client_socket -m -q @strlen
+ *
+ * --------------------------------------------------------------------
+ * 【memcached 互換のキャッシュ（-M）】
+ *
+ *   -M <MB> : strlen の代わりに memcached のテキストプロトコル（get / set / delete / incr / decr）を話す
+ *             キャッシュになる。値は MB メガバイトまで持ち、超えたら使っていない順に追い出す
+ *
+ * キャッシュは kvstore.h（ハッシュ表 + LRU）、プロトコルは mcproto.h。
+ * memcached のクライアントや memtier_benchmark などの道具がそのまま使える:
+ *
+ *   $ ./server_m_sockets -c 200 -M 64 -a 9000 11211
+ *   $ printf 'set k 0 0 5\r\nhello\r\nget k\r\n' | nc -q1 127.0.0.1 11211
+ *   $ memtier_benchmark -s 127.0.0.1 -p 11211 -P memcache_text --ratio=1:10
+ *
+ * memcached のプロトコルは1行のコマンドと値のブロックからなり、要求が recv の区切りと揃わない
+ * （1回に複数届く / 途中で切れる、set の値は数 KB〜1 MB）。そこで -M では受信バッファを共有プールから借りず、
+ * 接続ごとに持つ（最初は MC_BUF_INIT、大きな値が来たら MC_BUF_MAX まで伸ばす）。
+ * 受け取ったものを溜めて、揃ったコマンドから順に処理し、処理しきれなかった残りは次回に回す。
+ * 応答は送信キューに積むだけにして、1回の recv の分を処理し終えてからまとめて送る
+ * （get の応答は VALUE 行・値・END に分かれるが、send は1回で済む）。
+ *
+ * ループは1スレッドなので、キャッシュにもロックは要らない（複数のスレッドで共有するなら
+ * バケットごとのロックなどが要るが、その分の競合と遅延も増える）。
+ * 1要求の時間はハッシュ表を引いて値をコピーするだけで、表を作り直すことも無いので、ばらつきは小さい
+ * （統計の handler 名は "memcache" で、-a で遅延の分布を見られる。-M では1回の recv で届いたコマンドを
+ * まとめて処理するので、遅延のヒストグラムは1コマンドではなく1回の recv の分の処理時間になる）。
+ *
+ * 流量制限（-R）と負荷遮断（-L）は handler の要求だけに効く（memcached のプロトコルには「断る」応答が無い）。
+ * ホットリスタートではキャッシュは引き継げず、新プロセスは空から始める。
+ * コマンドの途中まで受け取っている接続は、続きを新プロセスが解釈できないので渡す前に閉じる。
+ * -q（SOCK_SEQPACKET）はメッセージ境界のあるソケットなので、-M とは一緒に使えない。
+ *
+ * 【コンパイル】
+ *   gcc server_m_sockets.c twheel.c slab.c outq.c handler.c trace.c stats.c shmring.c kvstore.c mcproto.c -ldl -o server_m_sockets
  */
 
-void stop(int x);
+void start_drain(void);
+void close_listeners(void);
+int listen_unix(const char *path, int type);
+socklen_t unix_addr(const char *path, struct sockaddr_un *u_addr);
+int takeover(const char *path);
+void handoff(void);
+void on_client_timeout(struct twtimer *t, void *arg);
+void on_stats(struct twtimer *t, void *arg);
+int listen_admin(const char *arg);
+void admin_accept(void);
+void check_fastopen(void);
+
+/*
+ * 接続1本ぶんの状態。slab から確保する。
+ * 先頭のキャッシュラインに要求ごとに触るものを、2本目に送信キューを置く。
+ */
+struct conn {
+   int fd;
+   int slot;                   // conns[] の添字
+   struct twtimer timer;       // 締め切り（-i / -f）
+   int shut_wr;                // 排出中に shutdown(SHUT_WR) 済みなら 1
+   float tokens;               // トークンバケットの残り（-R）
+   uint32_t last_ms;           // トークンを最後に補充した時刻（下位32ビット）
+   uint32_t id;                // 接続の通し番号（-w の記録用）
+   struct outq out __attribute__((aligned(64)));   // 送りきれなかった応答（-H / -l）
+   unsigned char msg;          // SOCK_SEQPACKET なら 1（応答を1通ずつ送る）
+   unsigned char paused;       // 送信キューが上限を超えて、読み込みを止めていれば 1
+   struct shm_peer *shm;       // 共有メモリに切り替えていれば、そのリング（でなければ NULL）
+   struct mcbuf *in;           // -M: 処理しきれていない受信データ（最初の recv まで NULL）
+} __attribute__((aligned(64)));
+
+/*
+ * 共有プールから借りる受信バッファ。
+ */
+struct rbuf {
+   char data[BUF_SIZE];
+};
+
+_Static_assert(SHM_DATA_MAX < BUF_SIZE, "a ring request must fit in an rbuf with its '\\0'");
+
+/*
+ * -M: 接続ごとの受信バッファ。
+ */
+struct mcbuf {
+   char *data;
+   size_t len;                 // 溜まっているバイト数
+   size_t cap;
+   size_t skip;                // 大きすぎた値の、まだ読み捨てていないバイト数
+};
+
+/*
+ * 管理用の口の問い合わせ1本ぶんの状態。
+ */
+struct admin {
+   int fd;                     // -1 なら空き
+   struct twtimer timer;       // 締め切り（ADMIN_TIMEOUT_MS）
+   int in;                     // req に溜まったバイト数
+   int len, sent;              // 応答の長さと送ったバイト数（len が 0 なら問い合わせを待っている）
+   char req[ADMIN_REQ_MAX];
+   char out[128 + ADMIN_OUT_MAX];   // HTTP のヘッダ + 統計
+};
+
+void admin_read(struct admin *a);
+void admin_write(struct admin *a);
+void admin_close(struct admin *a);
+void on_admin_timeout(struct twtimer *t, void *arg);
+
+struct conn *conn_new(int fd);
+void conn_close(struct conn *c);
+void conn_drain(struct conn *c);
+int conn_reply(struct conn *c, int n);
+int conn_handle(struct conn *c, const char *req, size_t len);
+void conn_check_queue(struct conn *c);
+int conn_flush(struct conn *c);
+void on_drain_deadline(struct twtimer *t, void *arg);
+int take_token(struct conn *c, uint64_t now);
+int conn_upgrade(struct conn *c);
+int conn_shm_serve(struct conn *c, int rang, int budget);
+int conn_mc(struct conn *c);
+int mc_out(void *arg, const void *data, size_t len);
+int send_fds(int s, void *hdr, size_t hlen, int *fds, int n);
+int recv_fds(int s, void *hdr, size_t hlen, int *fds, int max);
 
 /*
  * グローバル変数:
- *   SIGINT ハンドラ stop() からも参照できるようにグローバルにしている。
+ *   タイマーのコールバックや排出処理からも参照できるようにグローバルにしている。
  */
 int sfd = -1;                 // 待受ソケットFD
-int socketfds[C_MAX];         // クライアント通信ソケットFDの配列（-1 は空きスロット）
+int ufd = -1;                 // Unix ドメイン（SOCK_STREAM）の待受ソケットFD
+int qfd = -1;                 // Unix ドメイン（SOCK_SEQPACKET）の待受ソケットFD
+char *upath, *qpath;          // 上の2つのパス（終了時にソケットファイルを消すため）
+int ctlfd = -1;               // ホットリスタート用の制御ソケットFD（-r）
+char *ctlpath;                // 制御ソケットのパス
+struct twheel wheel;          // タイマーホイール
+struct twtimer stats_timer;   // 定期処理
+long idle_ms = 60000;         // アイドルタイムアウト（-i）
+long first_ms = 10000;        // 最初の要求までの締め切り（-f）
+struct conn **conns;          // 接続の表（NULL は空きスロット）
+int max_conns = C_MAX;        // conns[] の大きさ（-c）
+int nconns;                   // 接続中の数
+struct slab_pool conn_pool;   // struct conn のプール
+struct slab_pool rbuf_pool;   // 受信バッファのプール
+int sigfd = -1;               // SIGINT / SIGTERM を受け取る signalfd
+int draining = 0;             // 排出中なら 1
+long drain_ms = 5000;         // 排出の締め切り（-g）
+struct twtimer drain_timer;
+double rate = 0;              // 1クライアントあたりの要求数/秒（-R、0 は無制限）
+double burst = 10;            // トークンバケットの容量（-B）
+int shed_depth = 0;           // 1周で処理する要求数の上限（-L、0 は無制限）
+struct slab_pool obuf_pool;   // 送信キューのチャンクのプール
+size_t high_wm = HIGH_WM;     // 送信キューの上限（-H）
+size_t low_wm;                // 読み込みを再開する長さ（-l、0 なら high_wm / 4）
+int npaused;                  // 読み込みを止めている接続の数
+int nshm;                     // 共有メモリに切り替えた接続の数
+const struct handler *handler;   // 要求を処理する handler（-x）
+struct trace tap;             // 要求の記録（-w、tap.fp が NULL なら記録しない）
+uint32_t next_id;             // 次の接続の通し番号
+struct stats *st;             // このループの統計（stats.h）
+struct stats_handler *hst;    // 使っている handler の統計
+int fastopen;                 // TCP_FASTOPEN の待ち行列の長さ（-F、0 なら使わない）
+int afd = -1;                 // 管理用の口（-a）
+struct admin admins[ADMIN_CONNS];   // 管理用の口の問い合わせ（fd が -1 なら空き）
+char *apath;                  // 管理用の口の Unix ドメインソケットのパス（ポート番号なら NULL）
+struct kvstore kv;            // -M のキャッシュ
+size_t kv_mb;                 // -M のメモリの上限（MB、0 なら strlen などの handler を使う）
 
 int main(int argc, char *argv[]){
    unsigned short port;
-   int ret, ret_rcv, on = 1, max = C_MAX, fd_max, i, n;
-   fd_set rfds;
-   struct sockaddr_in s_addr, c_addr;
+   int ret, ret_rcv, on = 1, max = C_MAX, fd_max, i, n, l, lfd, opt, cfd, k, rr = 0, served, shm_ready;
+   uint64_t t_loop, t_req;
+   int lfds[3];
+   long to;
+   fd_set rfds, wfds;
+   struct sockaddr_in s_addr;
+   struct sockaddr_storage c_addr;
    struct timeval tm;
-   int addr_len = sizeof(struct sockaddr_in);
-   char buf[BUF_SIZE];
+   socklen_t addr_len;
+   struct conn *c;
+   struct rbuf *rb;
+   sigset_t mask;
+   struct signalfd_siginfo si;
+   const char *hname = "strlen";
+   const char *admin = NULL;
 
    /*
     * 引数チェック:
-    *   argv[1] に待受ポート番号を指定。
+    *   最後の引数に待受ポート番号を指定。
+    *   -u / -q で Unix ドメインソケットの待受を追加できる。
+    *   -r でホットリスタート用の制御ソケットを指定する。
+    *   -i / -f でタイムアウト（秒）を指定する。
+    *   -c で同時接続数の上限を指定する。
+    *   -g で終了時の排出の締め切り（秒）を指定する。
+    *   -R / -B / -L で過負荷対策を指定する。
+    *   -H / -l で送信キューの上限と再開点（バイト）を指定する。
+    *   -x で要求を処理する handler を、-P で handler のプラグインを指定する。
+    *   -w で要求を記録するファイルを指定する。
+    *   -a で統計を問い合わせる管理用の口（ポート番号か Unix ドメインソケットのパス）を指定する。
+    *   -F で TCP Fast Open を受け付ける（値は待ち行列の長さ）。
+    *   -M で memcached 互換のキャッシュにする（値はメモリの上限、MB）。
     */
-   if(argc != 2){
-      fprintf(stderr, "Usage: $ server <port>\n");
+   while((opt = getopt(argc, argv, "u:q:r:i:f:c:g:R:B:L:H:l:x:P:w:a:F:M:")) != -1){
+      if(opt == 'u') upath = optarg;
+      else if(opt == 'q') qpath = optarg;
+      else if(opt == 'r') ctlpath = optarg;
+      else if(opt == 'i') idle_ms = atol(optarg) * 1000;
+      else if(opt == 'f') first_ms = atol(optarg) * 1000;
+      else if(opt == 'c') max_conns = atoi(optarg);
+      else if(opt == 'g') drain_ms = atol(optarg) * 1000;
+      else if(opt == 'R') rate = atof(optarg);
+      else if(opt == 'B') burst = atof(optarg);
+      else if(opt == 'L') shed_depth = atoi(optarg);
+      else if(opt == 'H') high_wm = atol(optarg);
+      else if(opt == 'l') low_wm = atol(optarg);
+      else if(opt == 'x') hname = optarg;
+      else if(opt == 'a') admin = optarg;
+      else if(opt == 'F') fastopen = atoi(optarg);
+      else if(opt == 'M') kv_mb = atol(optarg);
+      else if(opt == 'w'){
+         if(trace_create(&tap, optarg) < 0){
+            perror(optarg);
+            exit(1);
+         }
+      }
+      else if(opt == 'P'){
+         if(handler_load(optarg) < 0) exit(1);
+      }
+      else{
+         fprintf(stderr, "Usage: $ server [-u path] [-q path] [-r ctl_path] [-i idle_sec] [-f first_sec] [-c max_conns] [-g drain_sec] [-R rate] [-B burst] [-L depth] [-H high_bytes] [-l low_bytes] [-P plugin.so] [-x handler] [-w trace_file] [-a admin_port|path] [-F tfo_qlen] [-M cache_mb] <port>\n");
+         exit(1);
+      }
+   }
+   if(optind != argc - 1 || (kv_mb > 0 && qpath != NULL)){
+      fprintf(stderr, "Usage: $ server [-u path] [-q path] [-r ctl_path] [-i idle_sec] [-f first_sec] [-c max_conns] [-g drain_sec] [-R rate] [-B burst] [-L depth] [-H high_bytes] [-l low_bytes] [-P plugin.so] [-x handler] [-w trace_file] [-a admin_port|path] [-F tfo_qlen] [-M cache_mb] <port>\n");
+      exit(1);
+   }
+   port = (unsigned short)atoi(argv[optind]);
+
+   if(strcmp(hname, "list") == 0){
+      handler_list();
+      exit(0);
+   }
+   handler = handler_find(hname);
+   if(handler == NULL){
+      fprintf(stderr, "unknown handler: %s\n", hname);
+      handler_list();
       exit(1);
    }
-   port = (unsigned short)atoi(argv[1]);
 
    /*
     * sockaddr_in をゼロクリア（未初期化のゴミ値を避ける）。
@@ -98,15 +591,69 @@ int main(int argc, char *argv[]){
    memset(&s_addr, 0, sizeof(s_addr)); // 受信バッファの初期化（実際はアドレス構造体初期化）
 
    /*
-    * クライアントFD配列を -1 で初期化。
-    * -1 を「空きスロット」として扱う。
+    * 接続の表（NULL を「空きスロット」として扱う）と、2つのプールの準備。
+    * select で監視できる FD は FD_SETSIZE 未満なので、上限もそれに合わせる。
+    */
+   if(max_conns < 1) max_conns = 1;
+   if(max_conns > FD_SETSIZE - 16) max_conns = FD_SETSIZE - 16;
+   conns = calloc(max_conns, sizeof(conns[0]));
+   if(conns == NULL){
+      perror("calloc");
+      exit(1);
+   }
+   slab_init(&conn_pool, sizeof(struct conn), 64);
+   slab_init(&rbuf_pool, sizeof(struct rbuf), 16);
+   slab_init(&obuf_pool, sizeof(struct obuf), 16);
+   if(first_ms <= 0) first_ms = idle_ms;
+   if(high_wm < 1) high_wm = 1;
+   if(low_wm == 0 || low_wm >= high_wm) low_wm = high_wm / 4;
+
+   /*
+    * 統計の準備。
+    */
+   st = stats_register();
+   if(st == NULL){
+      perror("stats_register");
+      exit(1);
+   }
+   hst = stats_handler(st, kv_mb > 0 ? "memcache" : handler->name);
+
+   /*
+    * -M: キャッシュの準備（ハッシュ表はここで一度に確保する）。
+    */
+   if(kv_mb > 0 && kv_init(&kv, kv_mb << 20) < 0){
+      perror("kv_init");
+      exit(1);
+   }
+
+   /*
+    * タイマーホイールと定期処理の準備。
+    */
+   twheel_init(&wheel, TICK_MS, twheel_now_ms());
+   twtimer_init(&stats_timer, on_stats, NULL);
+   twheel_add(&wheel, &stats_timer, STATS_MS);
+
+   /*
+    * SIGINT / SIGTERM をブロックして、signalfd で受け取る。
+    * ブロックしたシグナルは保留され、signalfd から read できるようになる。
     */
-   for(i = 0; i < C_MAX; i++){
-      socketfds[i] = -1;
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGINT);
+   sigaddset(&mask, SIGTERM);
+   sigprocmask(SIG_BLOCK, &mask, NULL);
+   sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+   if(sigfd < 0){
+      perror("signalfd");
+      exit(1);
    }
 
-   // シグナルハンドラの設定（Ctrl+C で stop が呼ばれる）
-   signal(SIGINT, stop);
+   /*
+    * ホットリスタート: 旧プロセスがいれば、待受ソケットとクライアントを引き継ぐ。
+    * 引き継げたら socket/bind/listen は行わない。
+    */
+   if(ctlpath != NULL && takeover(ctlpath) == 0){
+      goto ready;
+   }
 
    // ソケットの生成（待受用）
    sfd = socket(PF_INET, SOCK_STREAM, 0);
@@ -140,56 +687,157 @@ int main(int argc, char *argv[]){
       exit(1);
    }
 
+   /*
+    * TCP Fast Open: SYN に載ってきたデータを受け付ける。
+    */
+   if(fastopen > 0){
+      ret = setsockopt(sfd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen));
+      if(ret < 0){
+         perror("setsockopt(TCP_FASTOPEN)");
+         exit(1);
+      }
+      check_fastopen();
+   }
+
    // listen: 接続待ち状態へ移行（受動オープン）
    ret = listen(sfd, 5);
    if(ret < 0){
       perror("listen");
       exit(1);
    }
+
+   /*
+    * Unix ドメインソケットの待受（指定があれば）。
+    */
+   if(upath != NULL){
+      ufd = listen_unix(upath, SOCK_STREAM);
+      fprintf(stderr, "Unix stream socket=%s\n", upath);
+   }
+   if(qpath != NULL){
+      qfd = listen_unix(qpath, SOCK_SEQPACKET);
+      fprintf(stderr, "Unix seqpacket socket=%s\n", qpath);
+   }
+
+ready:
+   /*
+    * 次の再起動に備えて制御ソケットを待ち受ける。
+    */
+   if(ctlpath != NULL){
+      ctlfd = listen_unix(ctlpath, SOCK_SEQPACKET);
+   }
+
+   /*
+    * 旧プロセスから引き継いだクライアントにも締め切りを付ける。
+    */
+   for(i = 0; i < max_conns; i++){
+      if(conns[i] != NULL && idle_ms > 0) twheel_add(&wheel, &conns[i]->timer, idle_ms);
+   }
+
+   /*
+    * 管理用の口（旧プロセスからは引き継がず、毎回作る）。
+    */
+   for(i = 0; i < ADMIN_CONNS; i++){
+      admins[i].fd = -1;
+      twtimer_init(&admins[i].timer, on_admin_timeout, &admins[i]);
+   }
+   if(admin != NULL){
+      afd = listen_admin(admin);
+      fprintf(stderr, "admin=%s\n", admin);
+   }
+
+   fprintf(stderr, "handler=%s\n", handler->name);
    fprintf(stderr, "Waiting for connection...\n");
 
    /*
     * select ループ:
     *   - 新規接続が来たか（sfd が readable になったか）
-    *   - 既存クライアントからデータが来たか（socketfds[i] が readable になったか）
+    *   - 既存クライアントからデータが来たか（conns[i]->fd が readable になったか）
     * を同時に監視する。
     */
    while(1){
       FD_ZERO(&rfds);
+      FD_ZERO(&wfds);
       /*
-       * rfds は「読み込み可否を監視する FD 集合」。
+       * rfds は「読み込み可否を監視する FD 集合」、wfds は「書き込み可否を監視する FD 集合」。
        * select のたびに作り直す必要がある（select が中身を書き換えるため）。
        */
 
-      FD_SET(sfd, &rfds);
+      fd_max = sigfd;
+      FD_SET(sigfd, &rfds);
+      /*
+       * select は “0〜fd_max まで” を走査するため、最大FD番号が必要。
+       * 監視対象の FD の最大値を求める。
+       */
+
       /*
-       * 待受ソケット sfd を監視対象へ追加。
-       * sfd が readable になる = accept 可能な新規接続が到着している可能性。
+       * 待受ソケットの一覧（使わないものは -1）。
+       * 排出を始めると閉じられて -1 になるので、毎回作り直す。
        */
+      lfds[0] = sfd;
+      lfds[1] = ufd;
+      lfds[2] = qfd;
 
-      fd_max = sfd;
+      for(l = 0; l < 3; l++){
+         if(lfds[l] != -1){
+            FD_SET(lfds[l], &rfds);
+            if(lfds[l] > fd_max) fd_max = lfds[l];
+         }
+      }
       /*
-       * select は “0〜fd_max まで” を走査するため、最大FD番号が必要。
-       * 監視対象の FD の最大値を求める。
+       * 待受ソケット（TCP / Unix）を監視対象へ追加。
+       * readable になる = accept 可能な新規接続が到着している可能性。
        */
 
-      for(i = 0; i < C_MAX; i++){
-         if(socketfds[i] != -1){
-            FD_SET(socketfds[i], &rfds);
-            if(socketfds[i] > fd_max) fd_max = socketfds[i];
+      shm_ready = 0;
+      for(i = 0; i < max_conns; i++){
+         c = conns[i];
+         if(c != NULL){
+            /*
+             * 送信キューが上限を超えている接続からは読まない。
+             * 書き込み可能を監視するのは、送信キューが空でない接続だけ。
+             */
+            if(!c->paused) FD_SET(c->fd, &rfds);
+            if(!outq_empty(&c->out)) FD_SET(c->fd, &wfds);
+            if(c->fd > fd_max) fd_max = c->fd;
+
+            /*
+             * 共有メモリの接続: 寝ることをクライアントに知らせてから、要求の eventfd を監視する。
+             * その間に要求が来ていれば select では待たない。
+             */
+            if(c->shm != NULL){
+               FD_SET(c->shm->efd_req, &rfds);
+               if(c->shm->efd_req > fd_max) fd_max = c->shm->efd_req;
+               if(shm_sleep(&c->shm->ch->req)) shm_ready = 1;
+            }
          }
       }
 
-      // select のタイムアウト設定（5秒）
-      tm.tv_sec = 5;
-      tm.tv_usec = 0;
+      if(ctlfd != -1){
+         FD_SET(ctlfd, &rfds);
+         if(ctlfd > fd_max) fd_max = ctlfd;
+      }
+      if(afd != -1){
+         FD_SET(afd, &rfds);
+         if(afd > fd_max) fd_max = afd;
+      }
+      for(i = 0; i < ADMIN_CONNS; i++){
+         if(admins[i].fd == -1) continue;
+         FD_SET(admins[i].fd, admins[i].len == 0 ? &rfds : &wfds);
+         if(admins[i].fd > fd_max) fd_max = admins[i].fd;
+      }
+
+      // select のタイムアウト設定（次にタイマーが発火しうる時刻まで。-1 なら無期限）
+      to = twheel_timeout(&wheel, twheel_now_ms());
+      if(shm_ready) to = 0;
+      tm.tv_sec = to / 1000;
+      tm.tv_usec = (to % 1000) * 1000;
 
       // 接続や受信の監視（読み込み可能になるまで待つ）
-      ret = select(fd_max + 1, &rfds, NULL, NULL, &tm);
+      ret = select(fd_max + 1, &rfds, &wfds, NULL, to < 0 ? NULL : &tm);
       /*
        * ret:
-       *   >0: readable になった FD の数
-       *    0: タイムアウト（今回は5秒で戻る）
+       *   >0: readable / writable になった FD の数（両方なら2つと数える）
+       *    0: タイムアウト（タイマーの期限が来た）
        *   -1: エラー（シグナル割り込みなど）
        */
 
@@ -197,48 +845,145 @@ int main(int argc, char *argv[]){
          perror("select");
          break;
       }
+      t_loop = stats_now_ns();
+
+      /*
+       * 0) 新プロセスが制御ソケットに接続してきたら、ソケットを渡して終了する。
+       *    （渡せなかった場合は handoff() から戻ってくるので、そのまま続ける）
+       */
+      if(ctlfd != -1 && FD_ISSET(ctlfd, &rfds)){
+         handoff();
+         continue;
+      }
+
+      /*
+       * 管理用の口への問い合わせ（受け取りかけ / 送りかけのものを進めてから、新しいものを受け付ける）。
+       */
+      for(i = 0; i < ADMIN_CONNS; i++){
+         if(admins[i].fd == -1) continue;
+         if(admins[i].len == 0 && FD_ISSET(admins[i].fd, &rfds)) admin_read(&admins[i]);
+         else if(admins[i].len > 0 && FD_ISSET(admins[i].fd, &wfds)) admin_write(&admins[i]);
+      }
+      if(afd != -1 && FD_ISSET(afd, &rfds)) admin_accept();
+
+      /*
+       * シグナルが届いていたら排出を始める。
+       * 待受ソケットはここで閉じられるので、下の accept には進まない。
+       */
+      if(FD_ISSET(sigfd, &rfds)){
+         while(read(sigfd, &si, sizeof(si)) == sizeof(si)){
+            fprintf(stderr, "received signal %u\n", si.ssi_signo);
+         }
+         start_drain();
+         lfds[0] = lfds[1] = lfds[2] = -1;
+      }
 
       /*
        * 1) 新規接続チェック:
-       *   sfd が readable なら accept できる接続要求が来ている。
+       *   待受ソケットが readable なら accept できる接続要求が来ている。
+       *   TCP でも Unix でも accept の使い方は同じ。
        */
-      ret = FD_ISSET(sfd, &rfds);
-      if(ret != 0){
-         fprintf(stderr, "Accept new connection\n");
+      for(l = 0; l < 3; l++){
+         lfd = lfds[l];
+         if(lfd == -1 || FD_ISSET(lfd, &rfds) == 0) continue;
 
-         // 空きスロットを探して accept した FD を保存する
-         for(i = 0; i < C_MAX; i++){
-            if(socketfds[i] == -1){
-               socketfds[i] = accept(sfd, (struct sockaddr *)&c_addr, (socklen_t *)&addr_len);
-               /*
-                * accept に成功すると、クライアントとの通信専用 FD が返る。
-                * これを socketfds[i] に格納して “接続中クライアント一覧” に登録する。
-                */
+         fprintf(stderr, "Accept new connection\n");
 
-               fprintf(stderr, "client accepted(%d) from %s\n", i, inet_ntoa(c_addr.sin_addr));
-               fprintf(stderr, "client fd number=%d\n", socketfds[i]);
-               break;
-            }
+         addr_len = sizeof(c_addr);
+         cfd = accept(lfd, (struct sockaddr *)&c_addr, &addr_len);
+         /*
+          * accept に成功すると、クライアントとの通信専用 FD が返る。
+          * これを conn_new() で “接続中クライアント一覧” に登録する。
+          */
+         if(cfd < 0){
+            perror("accept");
+            continue;
          }
+
          /*
-          * 注意:
-          *   C_MAX を超える接続が来た場合、空きがなく accept を呼ばないので、
-          *   クライアントは接続できない/待たされる可能性がある。
-          *   実務なら「空きが無い時は accept してすぐ close する」等の扱いも検討する。
+          * 空きスロットが無ければ即時拒否する。
+          * accept せずに放っておくと、クライアントはバックログで何の応答も無く待たされる。
+          * close すればクライアントの recv は 0 を返すので、すぐに断られたと分かる。
           */
+         if(nconns >= max_conns){
+            close(cfd);
+            STAT_INC(st->rejects);
+            continue;
+         }
+
+         c = conn_new(cfd);
+         STAT_INC(st->accepts);
+
+         if(c_addr.ss_family == AF_INET){
+            fprintf(stderr, "client accepted(%d) from %s\n", c->slot,
+                    inet_ntoa(((struct sockaddr_in *)&c_addr)->sin_addr));
+         }
+         else{
+            /*
+             * Unix ドメインのクライアントは通常 bind しないので名前が無い。
+             */
+            fprintf(stderr, "client accepted(%d) from unix %s\n", c->slot,
+                    lfd == qfd ? "seqpacket" : "stream");
+         }
+         fprintf(stderr, "client fd number=%d\n", c->fd);
+
+         // 最初の要求までの締め切り
+         if(first_ms > 0) twheel_add(&wheel, &c->timer, first_ms);
       }
 
       /*
-       * 2) 既存クライアントの受信チェック:
-       *   各 clientfd について FD_ISSET なら recv 可能。
+       * 2) 既存クライアントの送受信:
+       *   wfds に入っていれば、送信キューの続きを送る。
+       *   rfds に入っていれば recv 可能。
+       *   走査の開始位置 rr を1周ごとにずらす（負荷遮断が同じ接続に偏らないように）。
        */
-      for(i = 0; i < C_MAX; i++){
-         if(socketfds[i] != -1){
-            ret = FD_ISSET(socketfds[i], &rfds);
+      served = 0;
+      for(k = 0; k < max_conns; k++){
+         i = (rr + k) % max_conns;
+         c = conns[i];
+         if(c != NULL && FD_ISSET(c->fd, &wfds)){
+            if(conn_flush(c) < 0){
+               fprintf(stderr, "socket=%d disconnected: \n", c->fd);
+               conn_close(c);
+               continue;
+            }
+            // 受け取ってもらえているので締め切りを延ばす
+            if(idle_ms > 0) twheel_add(&wheel, &c->timer, idle_ms);
+         }
+         if(c != NULL && c->shm != NULL){
+            /*
+             * リングの要求も -L の1周の上限に数える（上限が無くても1回にリング1周分まで）。
+             */
+            n = shed_depth > 0 ? shed_depth - served : SHM_SLOTS;
+            if(n > SHM_SLOTS) n = SHM_SLOTS;
+            served += conn_shm_serve(c, FD_ISSET(c->shm->efd_req, &rfds), n);
+            if(draining) conn_drain(c);
+         }
+         if(c != NULL && kv_mb > 0){
+            /*
+             * -M: memcached のプロトコル。受信バッファは接続ごとに持つ。
+             */
+            if(FD_ISSET(c->fd, &rfds) && conn_mc(c) < 0){
+               fprintf(stderr, "socket=%d disconnected: \n", c->fd);
+               conn_close(c);
+            }
+            else if(draining) conn_drain(c);
+            continue;
+         }
+         if(c != NULL){
+            ret = FD_ISSET(c->fd, &rfds);
             if(ret != 0){
-               memset(buf, 0, BUF_SIZE);
+               /*
+                * 読めるデータがあるときだけ、共有プールから受信バッファを借りる。
+                * 末尾に '\0' を置くぶん、1バイト残して受け取る。
+                */
+               rb = slab_alloc(&rbuf_pool);
+               if(rb == NULL){
+                  perror("slab_alloc");
+                  continue;
+               }
 
-               ret_rcv = recv(socketfds[i], buf, BUF_SIZE, 0);
+               ret_rcv = recv(c->fd, rb->data, BUF_SIZE - 1, 0);
                /*
                 * recv の戻り値:
                 *   >0: 受信成功（バイト数）
@@ -247,72 +992,1079 @@ int main(int argc, char *argv[]){
                 */
 
                if(ret_rcv > 0){
-                  fprintf(stderr, "received: %s\n", buf);
+                  if(tap.fp != NULL) trace_write(&tap, c->id, TR_DATA, rb->data, ret_rcv);
+                  t_req = stats_now_ns();
+                  STAT_INC(st->requests);
+                  STAT_ADD(st->bytes_in, ret_rcv);
+                  rb->data[ret_rcv] = '\0';
+                  fprintf(stderr, "received: %s\n", rb->data);
+
+                  /*
+                   * 要求が来たので締め切りを延ばす（取り消して登録し直すだけ、O(1)）。
+                   */
+                  if(idle_ms > 0) twheel_add(&wheel, &c->timer, idle_ms);
+                  else twheel_cancel(&wheel, &c->timer);
 
-                  n = strlen(buf);
+                  if(shed_depth > 0 && served >= shed_depth){
+                     /*
+                      * この周回で既に depth 個処理した: 残りは処理せずに断る。
+                      */
+                     n = -2;
+                     STAT_INC(st->shed);
+                  }
+                  else if(rate > 0 && !take_token(c, twheel_now_ms())){
+                     /*
+                      * このクライアントのトークンが尽きている。
+                      */
+                     n = -1;
+                     STAT_INC(st->limited);
+                  }
+                  else{
+                     n = 0;              // 負でなければ handler に処理させる
+                     served++;
+                  }
                   /*
-                   * 受信した文字列の長さを計算。
-                   * buf はゼロクリア済みなので短い入力なら '\0' 終端が効きやすい。
-                   * ただし “本来” は ret_rcv を使って終端を入れる方が安全。
+                   * 要求の処理（既定は文字数を数える strlen）は handler に任せる。
+                   * 元の版は buf を毎回ゼロクリアして終端の代わりにしていたが、
+                   * ここでは受信した長さの位置に '\0' を置いている。
                    */
 
-                  send(socketfds[i], &n, ret_rcv, 0);
+                  /*
+                   * 半分閉じた後に届いた要求には、もう答えられない（読み捨てる）。
+                   * 応答は送信キュー経由で送る（送りきれなければ後で続きを送る）。
+                   */
+                  ret = 0;
+                  if(!c->shut_wr){
+                     if(n < 0) ret = conn_reply(c, n);      // 流量制限 / 負荷遮断
+                     else if(ret_rcv == sizeof(SHM_UPGRADE) - 1 && memcmp(rb->data, SHM_UPGRADE, ret_rcv) == 0){
+                        ret = conn_upgrade(c);
+                     }
+                     else ret = conn_handle(c, rb->data, ret_rcv);
+                  }
+                  if(ret < 0) STAT_INC(st->errors);
+                  if(n >= 0){
+                     STAT_INC(hst->requests);
+                     if(ret < 0) STAT_INC(hst->errors);
+                     hist_add(&hst->lat, stats_now_ns() - t_req);
+                  }
                   /*
                    * 注意（重要）:
-                   *   ここは send サイズが ret_rcv になっている。
-                   *   返したいのは int n なので本来は sizeof(n) を送るべき。
-                   *
-                   * 正しい概念:
-                   *   send(socketfds[i], &n, sizeof(n), 0);
+                   *   元の版は send サイズが ret_rcv になっていた。
+                   *   返したいのは int n なので sizeof(n) を送る。
+                   *   SOCK_SEQPACKET では送ったバイト数がそのまま1メッセージになるため、
+                   *   余計なバイトを送るとクライアント側で int として読めなくなる。
                    */
 
-                  if(strcmp(buf, "exit") == 0){
+                  if(ret < 0 || strcmp(rb->data, "exit") == 0){
                      /*
-                      * "exit" を受け取ったらそのクライアントを切断し、
-                      * スロットを空ける。
+                      * "exit" を受け取ったら（または相手が既に閉じていたら）
+                      * そのクライアントを切断し、スロットを空ける。
                       */
-                     close(socketfds[i]);
-                     socketfds[i] = -1;
+                     conn_close(c);
+                  }
+                  else if(draining){
+                     conn_drain(c);
                   }
                }
+               else if(ret_rcv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+                  /*
+                   * ノンブロッキングなので、まだ何も無ければ EAGAIN で戻る（次の select を待つ）。
+                   */
+               }
                else{
                   /*
                    * ret_rcv == 0（切断）または ret_rcv < 0（エラー）の場合
                    * クライアントを切断扱いにしてスロットを空ける。
                    */
-                  fprintf(stderr, "socket=%d disconnected: \n", socketfds[i]);
-                  close(socketfds[i]);
-                  socketfds[i] = -1;
+                  fprintf(stderr, "socket=%d disconnected: \n", c->fd);
+                  conn_close(c);
                }
+
+               // 処理し終えたので受信バッファをプールへ返す
+               slab_free(&rbuf_pool, rb);
             }
          }
       }
+      rr = (rr + 1) % max_conns;
+
+      /*
+       * 3) 期限の来たタイマーを実行する。
+       *   受信処理の後で行うのは、ここで close した FD の番号が
+       *   同じ周回の accept で再利用され、古い rfds の結果で誤って recv しないようにするため。
+       */
+      twheel_advance(&wheel, twheel_now_ms());
+
+      STAT_INC(st->loops);
+      hist_add(&st->loop, stats_now_ns() - t_loop);
+
+      /*
+       * 4) 排出中で、接続がすべて閉じたら終了。
+       */
+      if(draining && nconns == 0) break;
    } // select ループの最後
 
    // ソケットのクローズ（ループを抜けた場合の後始末）
-   close(sfd);
-   /*
-    * main 末尾に return が無いが、ここでは暗黙に終了する。
-    * 実務なら return 0; を入れるのが読みやすい。
-    */
+   close_listeners();
+   for(i = 0; i < max_conns; i++){
+      if(conns[i] != NULL) conn_close(conns[i]);
+   }
+   if(tap.fp != NULL){
+      fprintf(stderr, "trace: %ld records\n", tap.nrec);
+      trace_close(&tap);
+   }
+   for(i = 0; i < ADMIN_CONNS; i++){
+      if(admins[i].fd != -1) admin_close(&admins[i]);
+   }
+   if(afd != -1){
+      close(afd);
+      if(apath != NULL && apath[0] != '@') unlink(apath);
+   }
+   if(kv_mb > 0){
+      fprintf(stderr, "cache: %ld items, %zu bytes, %ld evictions\n", kv.items, kv.used, kv.evictions);
+      kv_destroy(&kv);
+   }
+   fprintf(stderr, "bye\n");
+   return 0;
 }
 
 /*
- * SIGINT（Ctrl+C）で呼ばれる終了処理。
- * 教材として「ソケットを全部 close して終了する」ことを示している。
+ * SIGINT / SIGTERM を受けたときの処理: 排出を始める。
  */
-void stop(int x){
+void start_drain(void){
    int i;
 
+   if(draining) return;
+   draining = 1;
+   fprintf(stderr, "shutting down: draining %d clients (deadline %ld ms)\n", nconns, drain_ms);
+
+   close_listeners();
+
+   /*
+    * 受信キューが空の接続は、この時点で半分閉じる。
+    * 残っている接続は、要求に答えたところで conn_drain() が半分閉じる。
+    */
+   for(i = 0; i < max_conns; i++){
+      if(conns[i] != NULL) conn_drain(conns[i]);
+   }
+
+   twtimer_init(&drain_timer, on_drain_deadline, NULL);
+   twheel_add(&wheel, &drain_timer, drain_ms);
+}
+
+/*
+ * 待受ソケット（TCP / Unix / 制御ソケット）を閉じ、ソケットファイルを消す。
+ */
+void close_listeners(void){
    if(sfd != -1){
       close(sfd);
+      sfd = -1;
+   }
+   if(ufd != -1){
+      close(ufd);
+      ufd = -1;
+      if(upath[0] != '@') unlink(upath);
+   }
+   if(qfd != -1){
+      close(qfd);
+      qfd = -1;
+      if(qpath[0] != '@') unlink(qpath);
+   }
+   if(ctlfd != -1){
+      close(ctlfd);
+      ctlfd = -1;
+      if(ctlpath[0] != '@') unlink(ctlpath);
+   }
+}
+
+/*
+ * AF_UNIX の待受ソケットを作り、bind / listen まで行う。
+ * path の書き方は unix_addr() を参照。
+ */
+int listen_unix(const char *path, int type){
+   int fd, ret;
+   struct sockaddr_un u_addr;
+   socklen_t addr_len;
+   struct stat sb;
+
+   fd = socket(AF_UNIX, type, 0);
+   if(fd < 0){
+      perror("socket");
+      exit(1);
    }
 
-   for(i = 0; i < C_MAX; i++){
-      if(socketfds[i] != -1){
-         close(socketfds[i]);
+   addr_len = unix_addr(path, &u_addr);
+   if(path[0] != '@' && lstat(path, &sb) == 0){
+      /*
+       * 前回のソケットファイルが残っていると bind が EADDRINUSE になるので消しておく。
+       * ただしソケットでなければ消さない（パスを間違えて普通のファイルを消さないように）。
+       */
+      if(!S_ISSOCK(sb.st_mode)){
+         fprintf(stderr, "%s: exists and is not a socket\n", path);
+         exit(1);
       }
+      unlink(path);
    }
 
-   exit(1);
+   ret = bind(fd, (struct sockaddr *)&u_addr, addr_len);
+   if(ret < 0){
+      perror("bind");
+      exit(1);
+   }
+   ret = listen(fd, 5);
+   if(ret < 0){
+      perror("listen");
+      exit(1);
+   }
+   return fd;
+}
+
+/*
+ * path から sockaddr_un を作り、アドレス長を返す。
+ *
+ *   path が "@name" なら抽象名前空間の name を表す。
+ *   抽象名前空間では sun_path[0] が '\0' で、その後ろが名前になる。
+ *   名前の長さはアドレス長（addr_len）で表すので、末尾の '\0' は含めない。
+ */
+socklen_t unix_addr(const char *path, struct sockaddr_un *u_addr){
+   if(strlen(path) >= sizeof(u_addr->sun_path)){
+      fprintf(stderr, "socket path too long: %s\n", path);
+      exit(1);
+   }
+
+   memset(u_addr, 0, sizeof(*u_addr));
+   u_addr->sun_family = AF_UNIX;
+   if(path[0] == '@'){
+      memcpy(u_addr->sun_path + 1, path + 1, strlen(path + 1));
+      return offsetof(struct sockaddr_un, sun_path) + strlen(path);
+   }
+   strcpy(u_addr->sun_path, path);
+   return sizeof(*u_addr);
+}
+
+/*
+ * ホットリスタートで受け渡すメッセージ（制御ソケットは SOCK_SEQPACKET なので1通ずつ区切られる）。
+ *
+ *   1通目    : 本文 hdr[0..2] = sfd / ufd / qfd を送ったか（1 or 0）
+ *                   hdr[3]    = クライアントの数
+ *              補助データ（SCM_RIGHTS）= 待受ソケットの FD（sfd, ufd, qfd の順）
+ *   2通目以降: 本文 = この通に入っている FD の数
+ *              補助データ = クライアントの FD
+ *
+ * 1回の SCM_RIGHTS で送れる FD は 253 本まで（カーネルの SCM_MAX_FD）なので、
+ * クライアントは FD_BATCH 本ずつに分けて送る。
+ */
+#define FD_BATCH 200
+
+/*
+ * 本文 hdr（hlen バイト）と FD n 本を1通で送る。成功で 0、失敗で -1。
+ */
+int send_fds(int s, void *hdr, size_t hlen, int *fds, int n){
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cm;
+   union {                       // cmsg 用のバッファ（cmsghdr に合わせたアライメントにする）
+      char buf[CMSG_SPACE(sizeof(int) * FD_BATCH)];
+      struct cmsghdr align;
+   } ctl;
+
+   memset(&msg, 0, sizeof(msg));
+   memset(&ctl, 0, sizeof(ctl));
+   iov.iov_base = hdr;
+   iov.iov_len = hlen;
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   if(n > 0){
+      msg.msg_control = ctl.buf;
+      msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+      cm = CMSG_FIRSTHDR(&msg);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_RIGHTS;
+      cm->cmsg_len = CMSG_LEN(sizeof(int) * n);
+      memcpy(CMSG_DATA(cm), fds, sizeof(int) * n);
+   }
+   return sendmsg(s, &msg, MSG_NOSIGNAL) == (ssize_t)hlen ? 0 : -1;
+}
+
+/*
+ * 1通受け取り、本文を hdr に、FD を fds に入れる。受け取った FD の数を返す（失敗で -1）。
+ */
+int recv_fds(int s, void *hdr, size_t hlen, int *fds, int max){
+   int n = 0;
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cm;
+   union {
+      char buf[CMSG_SPACE(sizeof(int) * FD_BATCH)];
+      struct cmsghdr align;
+   } ctl;
+
+   memset(&msg, 0, sizeof(msg));
+   iov.iov_base = hdr;
+   iov.iov_len = hlen;
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = ctl.buf;
+   msg.msg_controllen = sizeof(ctl.buf);
+
+   if(recvmsg(s, &msg, 0) != (ssize_t)hlen || (msg.msg_flags & MSG_CTRUNC)) return -1;
+
+   for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+      if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS){
+         n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         if(n > max) return -1;
+         memcpy(fds, CMSG_DATA(cm), sizeof(int) * n);
+      }
+   }
+   return n;
+}
+
+/*
+ * 新プロセス側: 旧プロセスの制御ソケットに接続して FD を受け取る。
+ * 受け取れたら 0、旧プロセスがいなければ -1 を返す。
+ */
+int takeover(const char *path){
+   int fd, i, k, n, cnt, got;
+   int hdr[4], fds[FD_BATCH];
+   char ack = 'k';
+   struct sockaddr_un u_addr;
+   socklen_t addr_len;
+
+   fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+   if(fd < 0){
+      perror("socket");
+      exit(1);
+   }
+   addr_len = unix_addr(path, &u_addr);
+   if(connect(fd, (struct sockaddr *)&u_addr, addr_len) < 0){
+      /*
+       * ENOENT / ECONNREFUSED: 旧プロセスがいない → 普通に起動する。
+       */
+      close(fd);
+      return -1;
+   }
+
+   /*
+    * 1通目: 待受ソケット。送られてきた順に取り出す。
+    */
+   n = recv_fds(fd, hdr, sizeof(hdr), fds, 3);
+   if(n < 0 || n != hdr[0] + hdr[1] + hdr[2]){
+      fprintf(stderr, "takeover: bad message from old process\n");
+      exit(1);
+   }
+   k = 0;
+   sfd = hdr[0] ? fds[k++] : -1;
+   ufd = hdr[1] ? fds[k++] : -1;
+   qfd = hdr[2] ? fds[k++] : -1;
+
+   /*
+    * 2通目以降: クライアント。表に入りきらない分は閉じる。
+    */
+   for(got = 0; got < hdr[3]; got += n){
+      n = recv_fds(fd, &cnt, sizeof(cnt), fds, FD_BATCH);
+      if(n < 0 || n != cnt || n == 0){
+         fprintf(stderr, "takeover: bad message from old process\n");
+         exit(1);
+      }
+      for(i = 0; i < n; i++){
+         if(nconns < max_conns) conn_new(fds[i]);
+         else close(fds[i]);
+      }
+   }
+
+   /*
+    * 確認を返す。これを受け取った旧プロセスは終了する。
+    */
+   send(fd, &ack, 1, MSG_NOSIGNAL);
+   close(fd);
+
+   fprintf(stderr, "took over listeners and %d clients from old process\n", hdr[3]);
+   return 0;
+}
+
+/*
+ * 旧プロセス側: 制御ソケットに来た接続へ FD を渡し、確認を待って終了する。
+ * 渡せなかった場合は制御ソケットを作り直して戻る（サービスは続ける）。
+ */
+void handoff(void){
+   int fd, i, n, hdr[4], fds[FD_BATCH];
+   char ack;
+   struct timeval tm;
+
+   fd = accept(ctlfd, NULL, NULL);
+   if(fd < 0){
+      perror("accept");
+      return;
+   }
+   /*
+    * 新プロセスが応答しないまま固まっても、こちらが止まり続けないように受信タイムアウトを付ける。
+    */
+   tm.tv_sec = 5;
+   tm.tv_usec = 0;
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tm, sizeof(tm));
+
+   /*
+    * 新プロセスが同じ名前で制御ソケットを作れるよう、先に閉じておく。
+    */
+   close(ctlfd);
+   ctlfd = -1;
+   if(ctlpath[0] != '@') unlink(ctlpath);
+
+   /*
+    * 共有メモリの接続は渡せない（新プロセスはリングを知らない）ので、先に閉じる。
+    * -M でコマンドの途中まで受け取っている接続も、続きを新プロセスが解釈できないので閉じる。
+    */
+   for(i = 0; i < max_conns; i++){
+      if(conns[i] != NULL && conns[i]->shm != NULL){
+         fprintf(stderr, "socket=%d: closing shared memory client\n", conns[i]->fd);
+         conn_close(conns[i]);
+      }
+      else if(conns[i] != NULL && conns[i]->in != NULL && (conns[i]->in->len > 0 || conns[i]->in->skip > 0)){
+         fprintf(stderr, "socket=%d: closing client in the middle of a command\n", conns[i]->fd);
+         conn_close(conns[i]);
+      }
+   }
+
+   fprintf(stderr, "handing off listeners and %d clients\n", nconns);
+
+   n = 0;
+   hdr[0] = sfd != -1;
+   hdr[1] = ufd != -1;
+   hdr[2] = qfd != -1;
+   hdr[3] = nconns;
+   if(sfd != -1) fds[n++] = sfd;
+   if(ufd != -1) fds[n++] = ufd;
+   if(qfd != -1) fds[n++] = qfd;
+   if(send_fds(fd, hdr, sizeof(hdr), fds, n) < 0) goto fail;
+
+   /*
+    * 送信キューは新プロセスへ渡せないので、送れるだけ送って残りは捨てる。
+    */
+   for(i = 0; i < max_conns; i++){
+      if(conns[i] == NULL || outq_empty(&conns[i]->out)) continue;
+      outq_flush(&conns[i]->out, &obuf_pool, conns[i]->fd);
+      if(!outq_empty(&conns[i]->out)){
+         fprintf(stderr, "socket=%d: dropping %zu queued bytes\n", conns[i]->fd, conns[i]->out.bytes);
+      }
+   }
+
+   n = 0;
+   for(i = 0; i < max_conns; i++){
+      if(conns[i] == NULL) continue;
+      fds[n++] = conns[i]->fd;
+      if(n == FD_BATCH){
+         if(send_fds(fd, &n, sizeof(n), fds, n) < 0) goto fail;
+         n = 0;
+      }
+   }
+   if(n > 0 && send_fds(fd, &n, sizeof(n), fds, n) < 0) goto fail;
+
+   /*
+    * 新プロセスの確認を待つ。確認が来なければ（新プロセスが途中で落ちたなど）、
+    * 引き続き自分がサービスを続ける。
+    */
+   if(recv(fd, &ack, 1, 0) != 1) goto fail;
+   close(fd);
+
+   /*
+    * 引き継ぎ完了。自分の FD を閉じても、新プロセスが同じソケットを持っているので接続は切れない。
+    * ソケットファイルは新プロセスが使い続けるので unlink しない。
+    */
+   if(sfd != -1) close(sfd);
+   if(ufd != -1) close(ufd);
+   if(qfd != -1) close(qfd);
+   for(i = 0; i < max_conns; i++){
+      if(conns[i] != NULL) close(conns[i]->fd);
+   }
+   fprintf(stderr, "handoff done, exiting\n");
+   exit(0);
+
+fail:
+   fprintf(stderr, "handoff failed, keep serving\n");
+   close(fd);
+   ctlfd = listen_unix(ctlpath, SOCK_SEQPACKET);
+}
+
+/*
+ * 空きスロットに接続オブジェクトを作る。呼ぶ前に nconns < max_conns を確かめること。
+ */
+struct conn *conn_new(int fd){
+   int i, type = SOCK_STREAM;
+   socklen_t len = sizeof(type);
+   struct conn *c;
+
+   c = slab_alloc(&conn_pool);
+   if(c == NULL){
+      perror("slab_alloc");
+      exit(1);
+   }
+   for(i = 0; i < max_conns; i++){
+      if(conns[i] == NULL) break;
+   }
+   /*
+    * 送信でブロックしないよう、ノンブロッキングにする。
+    * ソケットの種類（引き継いだ FD では分からない）は SO_TYPE で調べる。
+    */
+   if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0){
+      perror("fcntl");
+   }
+   getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len);
+
+   c->fd = fd;
+   c->slot = i;
+   c->shut_wr = 0;
+   c->msg = type == SOCK_SEQPACKET;
+   c->paused = 0;
+   c->shm = NULL;
+   c->in = NULL;
+   c->id = next_id++;
+   outq_init(&c->out);
+   if(tap.fp != NULL) trace_write(&tap, c->id, TR_OPEN, NULL, 0);
+   c->tokens = burst;
+   c->last_ms = (uint32_t)twheel_now_ms();
+   twtimer_init(&c->timer, on_client_timeout, c);
+   conns[i] = c;
+   nconns++;
+   return c;
+}
+
+/*
+ * 排出中の接続: 受信キューにまだ要求が残っておらず、送信キューも空なら、送信側だけ閉じる。
+ * FIONREAD は受信キューにあるバイト数を返す。
+ */
+void conn_drain(struct conn *c){
+   int queued = 0;
+
+   if(c->shut_wr) return;
+   if(!outq_empty(&c->out)) return;          // 送り終えたところで conn_flush() から呼ばれる
+   if(c->shm != NULL && shm_front(&c->shm->ch->req) != NULL) return;
+   if(c->in != NULL && c->in->len > 0) return;     // -M: コマンドの続きを待っている
+   if(ioctl(c->fd, FIONREAD, &queued) == 0 && queued > 0) return;
+   shutdown(c->fd, SHUT_WR);
+   c->shut_wr = 1;
+}
+
+/*
+ * 応答 n を送る（送りきれなければ送信キューに積む）。
+ * キューが上限を超えたら、この接続からの読み込みを止める。
+ * 相手が既に閉じていたなどで送れなければ -1。
+ */
+int conn_reply(struct conn *c, int n){
+   if(outq_send(&c->out, &obuf_pool, c->fd, &n, sizeof(n), c->msg) < 0) return -1;
+   STAT_ADD(st->bytes_out, sizeof(n));
+   conn_check_queue(c);
+   return 0;
+}
+
+/*
+ * 要求 req（受信バッファの中、len バイト）を handler に渡し、
+ * 送信キューの末尾に確保した場所へ応答を直接書かせて送る。
+ * handler が失敗した / 送れないなら -1。
+ */
+int conn_handle(struct conn *c, const char *req, size_t len){
+   char *out;
+   int n;
+
+   out = outq_reserve(&c->out, &obuf_pool, HANDLER_OUT_MAX, c->msg);
+   if(out == NULL) return -1;
+   n = handler->fn(req, len, out, HANDLER_OUT_MAX);
+   if(n < 0 || n > HANDLER_OUT_MAX){
+      outq_commit(&c->out, 0);
+      return -1;
+   }
+   outq_commit(&c->out, n);
+   STAT_ADD(st->bytes_out, n);
+
+   /*
+    * キューが空だった（よくある場合）なら、ここでそのまま送れる。
+    */
+   if(outq_flush(&c->out, &obuf_pool, c->fd) < 0) return -1;
+   conn_check_queue(c);
+   return 0;
+}
+
+/*
+ * SHM_UPGRADE を受け取った: 共有メモリのリングを作り、応答 0 と一緒に FD を渡す。
+ * Unix ドメインでない / 既に切り替え済み / 送信キューに応答が残っている / 作れないなら -3 を返す
+ * （応答の順序が入れ替わらないよう、ソケットで返すものが残っていれば切り替えない）。
+ * 送れなければ -1。
+ */
+int conn_upgrade(struct conn *c){
+   struct sockaddr_storage a;
+   socklen_t len = sizeof(a);
+   struct shm_peer *p;
+   int n = 0, fds[3];
+
+   if(c->shm != NULL || !outq_empty(&c->out) || getsockname(c->fd, (struct sockaddr *)&a, &len) < 0 ||
+      a.ss_family != AF_UNIX){
+      return conn_reply(c, -3);
+   }
+   p = malloc(sizeof(*p));
+   if(p == NULL || shm_create(p) < 0){
+      perror("shm_create");
+      free(p);
+      return conn_reply(c, -3);
+   }
+   /*
+    * select で監視するのは efd_req だけだが、それも FD_SETSIZE 未満でなければならない。
+    */
+   if(p->efd_req >= FD_SETSIZE){
+      shm_destroy(p);
+      free(p);
+      return conn_reply(c, -3);
+   }
+   fds[0] = p->memfd;
+   fds[1] = p->efd_req;
+   fds[2] = p->efd_resp;
+   if(send_fds(c->fd, &n, sizeof(n), fds, 3) < 0){
+      shm_destroy(p);
+      free(p);
+      return -1;
+   }
+   STAT_ADD(st->bytes_out, sizeof(n));
+
+   /*
+    * mmap した後は memfd 自体は要らない（クライアントに渡したので、こちらでは閉じて FD を節約する）。
+    */
+   close(p->memfd);
+   p->memfd = -1;
+   c->shm = p;
+   nshm++;
+   fprintf(stderr, "socket=%d: switched to shared memory\n", c->fd);
+   return 0;
+}
+
+/*
+ * 共有メモリの接続: 要求のリングにある要求を処理し、応答のリングに書く。
+ * rang は要求の eventfd が鳴っていれば 1（そのときだけ read して読み捨てる）。
+ * 要求のスロットはクライアントも書けるので、handler に渡す前に受信バッファ（rbuf）へコピーして
+ * '\0' を付ける（handler.h の約束どおり、処理の途中で書き換えられず、req[len] が '\0' になる）。
+ * 応答は handler に応答のスロットへ直接書かせる（コピーしない）。
+ *
+ * 1回に処理するのは budget 個まで（処理した数を返す）。別の CPU のクライアントが要求を積み続けると
+ * リングが空にならず、ほかの接続が待たされるので、残りは次の周回に回す
+ * （リングに要求が残っていれば select はタイムアウト 0 で戻ってくる）。
+ */
+int conn_shm_serve(struct conn *c, int rang, int budget){
+   struct shm_ring *req = &c->shm->ch->req, *resp = &c->shm->ch->resp;
+   const struct shm_slot *s;
+   struct shm_slot *o;
+   struct rbuf *rb;
+   uint32_t len;
+   uint64_t t_req;
+   int n, served = 0;
+
+   shm_awake(req, rang ? c->shm->efd_req : -1);
+   if(budget <= 0) return 0;
+   rb = slab_alloc(&rbuf_pool);
+   if(rb == NULL){
+      perror("slab_alloc");
+      return 0;                 // 要求はリングに残っているので、次の周回でもう一度
+   }
+   while(served < budget && (s = shm_front(req)) != NULL){
+      o = shm_reserve(resp);
+      if(o == NULL) break;      // 応答のリングが一杯: クライアントが読むまで待つ
+      /*
+       * len はクライアントが書いた値なので、スロットの大きさを超えないか確かめる。
+       */
+      len = s->len;
+      if(len > SHM_DATA_MAX) len = SHM_DATA_MAX;
+      memcpy(rb->data, s->data, len);
+      rb->data[len] = '\0';
+      if(tap.fp != NULL) trace_write(&tap, c->id, TR_DATA, rb->data, len);
+      t_req = stats_now_ns();
+      STAT_INC(st->requests);
+      STAT_ADD(st->bytes_in, len);
+
+      if(rate > 0 && !take_token(c, twheel_now_ms())){
+         n = -1;
+         memcpy(o->data, &n, sizeof(n));
+         n = sizeof(n);
+         STAT_INC(st->limited);
+      }
+      else{
+         n = handler->fn(rb->data, len, o->data, SHM_DATA_MAX);
+         STAT_INC(hst->requests);
+         if(n < 0 || n > SHM_DATA_MAX){
+            /*
+             * 応答の数を要求と合わせるため、失敗しても空の応答を返す。
+             */
+            n = 0;
+            STAT_INC(st->errors);
+            STAT_INC(hst->errors);
+         }
+         hist_add(&hst->lat, stats_now_ns() - t_req);
+      }
+      shm_publish(resp, n);
+      shm_pop(req);
+      STAT_ADD(st->bytes_out, n);
+      served++;
+   }
+   slab_free(&rbuf_pool, rb);
+   if(served > 0){
+      shm_kick(resp, c->shm->efd_resp);
+      if(idle_ms > 0) twheel_add(&wheel, &c->timer, idle_ms);
+      else twheel_cancel(&wheel, &c->timer);
+   }
+   return served;
+}
+
+/*
+ * -M: mc_execute() の応答を送信キューに積む（送るのは conn_mc() の最後にまとめて）。
+ */
+int mc_out(void *arg, const void *data, size_t len){
+   struct conn *c = arg;
+
+   if(outq_append(&c->out, &obuf_pool, data, len) < 0) return -1;
+   STAT_ADD(st->bytes_out, len);
+   return 0;
+}
+
+/*
+ * -M: 読めるだけ受け取って接続のバッファに足し、揃ったコマンドを処理して応答を送る。
+ * 切断された / quit / プロトコルの誤りで閉じるなら -1。
+ */
+int conn_mc(struct conn *c){
+   struct mcbuf *b = c->in;
+   size_t room;
+   long used, ncmd = 0;
+   uint64_t t_req;
+   char *p;
+   int ret;
+
+   if(b == NULL){
+      b = calloc(1, sizeof(*b));
+      if(b == NULL || (b->data = malloc(MC_BUF_INIT)) == NULL){
+         perror("malloc");
+         free(b);
+         return -1;
+      }
+      b->cap = MC_BUF_INIT;
+      c->in = b;
+   }
+   /*
+    * 一杯なら伸ばす（set の大きな値の途中）。MC_BUF_MAX あれば必ずコマンドが1つ揃うので、それ以上は要らない。
+    */
+   if(b->len == b->cap){
+      if(b->cap >= MC_BUF_MAX) return -1;
+      room = b->cap * 2 < MC_BUF_MAX ? b->cap * 2 : MC_BUF_MAX;
+      p = realloc(b->data, room);
+      if(p == NULL){
+         perror("realloc");
+         return -1;
+      }
+      b->data = p;
+      b->cap = room;
+   }
+   room = b->cap - b->len;
+   if(room > MC_RECV_MAX) room = MC_RECV_MAX;
+
+   ret = recv(c->fd, b->data + b->len, room, 0);
+   if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+   if(ret <= 0) return -1;
+   if(tap.fp != NULL) trace_write(&tap, c->id, TR_DATA, b->data + b->len, ret);
+   STAT_ADD(st->bytes_in, ret);
+   if(idle_ms > 0) twheel_add(&wheel, &c->timer, idle_ms);
+   else twheel_cancel(&wheel, &c->timer);
+   if(c->shut_wr) return 0;                  // 半分閉じた後の要求には答えられない（読み捨てる）
+   b->len += ret;
+
+   t_req = stats_now_ns();
+   used = mc_execute(&kv, b->data, b->len, &b->skip, mc_out, c, &ncmd);
+   STAT_ADD(st->requests, ncmd);
+   STAT_ADD(hst->requests, ncmd);
+   if(ncmd > 0) hist_add(&hst->lat, stats_now_ns() - t_req);
+   if(used < 0){
+      /*
+       * quit やエラーでも、それまでの応答は送ってから閉じる（送れる分だけ）。
+       */
+      outq_flush(&c->out, &obuf_pool, c->fd);
+      return -1;
+   }
+
+   /*
+    * 処理し終えた分を捨てて、残り（コマンドの途中）を先頭へ寄せる。
+    * 大きな値のために伸ばしたバッファは、空になったら元の大きさに戻す。
+    */
+   b->len -= used;
+   if(b->len > 0) memmove(b->data, b->data + used, b->len);
+   else if(b->cap > MC_BUF_INIT && (p = realloc(b->data, MC_BUF_INIT)) != NULL){
+      b->data = p;
+      b->cap = MC_BUF_INIT;
+   }
+
+   if(outq_flush(&c->out, &obuf_pool, c->fd) < 0) return -1;
+   conn_check_queue(c);
+   return 0;
+}
+
+/*
+ * 送信キューが上限を超えたら、この接続からの読み込みを止める。
+ */
+void conn_check_queue(struct conn *c){
+   if(!c->paused && c->out.bytes >= high_wm){
+      c->paused = 1;
+      npaused++;
+      fprintf(stderr, "socket=%d: %zu bytes queued, pause reading\n", c->fd, c->out.bytes);
+   }
+}
+
+/*
+ * 書き込み可能になった接続: 送信キューの続きを送る。
+ * 再開点まで減ったら読み込みを再開し、排出中で空になったら送信側を閉じる。
+ */
+int conn_flush(struct conn *c){
+   if(outq_flush(&c->out, &obuf_pool, c->fd) < 0) return -1;
+   if(c->paused && c->out.bytes <= low_wm){
+      c->paused = 0;
+      npaused--;
+      fprintf(stderr, "socket=%d: %zu bytes queued, resume reading\n", c->fd, c->out.bytes);
+   }
+   if(draining && outq_empty(&c->out)) conn_drain(c);
+   return 0;
+}
+
+/*
+ * 排出の締め切りが来た: 残っている接続を閉じる（この後ループを抜けて終了する）。
+ */
+void on_drain_deadline(struct twtimer *t, void *arg){
+   int i;
+
+   (void)t;
+   (void)arg;
+   fprintf(stderr, "drain deadline: closing %d clients\n", nconns);
+   for(i = 0; i < max_conns; i++){
+      if(conns[i] != NULL) conn_close(conns[i]);
+   }
+}
+
+/*
+ * トークンバケット: 前回からの経過時間ぶんトークンを補充し、1個取れれば 1 を返す。
+ * 時刻は下位32ビットだけ持っているが、差を uint32_t で取れば桁あふれしても正しい
+ * （約 49 日以上間が空かない限り）。
+ */
+int take_token(struct conn *c, uint64_t now){
+   uint32_t elapsed = (uint32_t)now - c->last_ms;
+
+   c->last_ms = (uint32_t)now;
+   c->tokens += elapsed * rate / 1000.0;
+   if(c->tokens > burst) c->tokens = burst;
+   if(c->tokens < 1) return 0;
+   c->tokens -= 1;
+   return 1;
+}
+
+/*
+ * 切断して、タイマーを取り消し、接続オブジェクトをプールへ返す。
+ */
+void conn_close(struct conn *c){
+   if(tap.fp != NULL) trace_write(&tap, c->id, TR_CLOSE, NULL, 0);
+   STAT_INC(st->closes);
+   close(c->fd);
+   twheel_cancel(&wheel, &c->timer);
+   outq_clear(&c->out, &obuf_pool);
+   if(c->paused) npaused--;
+   if(c->shm != NULL){
+      shm_destroy(c->shm);
+      free(c->shm);
+      nshm--;
+   }
+   if(c->in != NULL){
+      free(c->in->data);
+      free(c->in);
+   }
+   conns[c->slot] = NULL;
+   nconns--;
+   slab_free(&conn_pool, c);
+}
+
+/*
+ * クライアントの締め切りが来た: 切断してスロットを空ける。
+ */
+void on_client_timeout(struct twtimer *t, void *arg){
+   struct conn *c = arg;
+
+   (void)t;
+   fprintf(stderr, "socket=%d timed out\n", c->fd);
+   conn_close(c);
+}
+
+/*
+ * 定期処理: 接続数、登録中のタイマー数、プールの使用数 / 確保数を表示し、次回を登録する。
+ */
+void on_stats(struct twtimer *t, void *arg){
+   (void)arg;
+   fprintf(stderr, "stats: clients=%d timers=%ld conn_pool=%ld/%ld rbuf_pool=%ld/%ld"
+           " obuf_pool=%ld/%ld paused=%d rejected=%ld limited=%ld shed=%ld\n",
+           nconns, wheel.count, conn_pool.inuse, conn_pool.total,
+           rbuf_pool.inuse, rbuf_pool.total, obuf_pool.inuse, obuf_pool.total,
+           npaused, (long)st->rejects, (long)st->limited, (long)st->shed);
+   if(tap.fp != NULL) trace_flush(&tap);
+   twheel_add(&wheel, t, STATS_MS);
+}
+
+/*
+ * sysctl でサーバ側の TFO が有効になっているか確かめ、無効なら警告する。
+ */
+void check_fastopen(void){
+   FILE *fp;
+   int v = 0;
+
+   fp = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+   if(fp == NULL) return;
+   if(fscanf(fp, "%i", &v) != 1) v = 0;
+   fclose(fp);
+   if(!(v & 2)){
+      fprintf(stderr, "warning: net.ipv4.tcp_fastopen=%d, server side TFO is disabled (set bit 2)\n", v);
+   }
+}
+
+/*
+ * 管理用の口を作る。arg が数字だけならループバックの TCP ポート、それ以外は Unix ドメインソケットのパス。
+ */
+int listen_admin(const char *arg){
+   int fd, on = 1;
+   struct sockaddr_in a_addr;
+
+   if(strspn(arg, "0123456789") != strlen(arg)){
+      apath = (char *)arg;
+      return listen_unix(arg, SOCK_STREAM);
+   }
+
+   fd = socket(AF_INET, SOCK_STREAM, 0);
+   if(fd < 0){
+      perror("socket");
+      exit(1);
+   }
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+   setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on));
+
+   memset(&a_addr, 0, sizeof(a_addr));
+   a_addr.sin_family = AF_INET;
+   a_addr.sin_port = htons((unsigned short)atoi(arg));
+   a_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if(bind(fd, (struct sockaddr *)&a_addr, sizeof(a_addr)) < 0){
+      perror("bind");
+      exit(1);
+   }
+   if(listen(fd, 5) < 0){
+      perror("listen");
+      exit(1);
+   }
+   return fd;
+}
+
+/*
+ * 管理用の口: 問い合わせを受け付ける。空きが無ければすぐ閉じる。
+ * 問い合わせは接続と一緒に届いていることが多いので、すぐに読んでみる。
+ */
+void admin_accept(void){
+   struct admin *a = NULL;
+   int fd, i;
+
+   fd = accept(afd, NULL, NULL);
+   if(fd < 0){
+      perror("accept");
+      return;
+   }
+   if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0){
+      perror("fcntl");
+      close(fd);
+      return;
+   }
+   for(i = 0; i < ADMIN_CONNS; i++){
+      if(admins[i].fd == -1){
+         a = &admins[i];
+         break;
+      }
+   }
+   if(a == NULL){
+      close(fd);
+      return;
+   }
+   a->fd = fd;
+   a->in = 0;
+   a->len = 0;
+   a->sent = 0;
+   twheel_add(&wheel, &a->timer, ADMIN_TIMEOUT_MS);
+   admin_read(a);
+}
+
+/*
+ * 管理用の口: 受け取れるだけ受け取り、1行揃ったら（または相手が送信側を閉じたら）統計を作って送り始める。
+ */
+void admin_read(struct admin *a){
+   char hdr[128];
+   int n, len, json;
+   struct stats_gauge g[] = {
+      { "clients", nconns },
+      { "timers", wheel.count },
+      { "conn_pool", conn_pool.inuse },
+      { "rbuf_pool", rbuf_pool.inuse },
+      { "obuf_pool", obuf_pool.inuse },
+      { "paused", npaused },
+      { "shm_clients", nshm },
+      { "kv_items", kv.items },
+      { "kv_bytes", (long)kv.used },
+      { "kv_limit", (long)kv.limit },
+      { "kv_hits", kv.hits },
+      { "kv_misses", kv.misses },
+      { "kv_evictions", kv.evictions },
+      { "kv_expired", kv.expired },
+      { "draining", draining },
+   };
+
+   n = recv(a->fd, a->req + a->in, sizeof(a->req) - 1 - a->in, 0);
+   if(n < 0){
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) admin_close(a);
+      return;
+   }
+   a->in += n;
+   a->req[a->in] = '\0';
+   if(n > 0 && memchr(a->req, '\n', a->in) == NULL && a->in < (int)sizeof(a->req) - 1) return;
+
+   json = strstr(a->req, "json") != NULL;
+   len = stats_report(a->out + 128, ADMIN_OUT_MAX, json, g, sizeof(g) / sizeof(g[0]));
+   if(strncmp(a->req, "GET ", 4) == 0){
+      /*
+       * HTTP のヘッダは統計の直前に書いて、1回の send で送れるようにする。
+       */
+      n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n",
+                   json ? "application/json" : "text/plain", len);
+      memcpy(a->out + 128 - n, hdr, n);
+      a->sent = 128 - n;
+   }
+   else{
+      a->sent = 128;
+   }
+   a->len = 128 + len;
+   admin_write(a);
+}
+
+/*
+ * 管理用の口: 応答の続きを送る。送りきったら閉じる。
+ */
+void admin_write(struct admin *a){
+   ssize_t n;
+
+   n = send(a->fd, a->out + a->sent, a->len - a->sent, MSG_NOSIGNAL);
+   if(n < 0){
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) admin_close(a);
+      return;
+   }
+   a->sent += n;
+   if(a->sent == a->len) admin_close(a);
+}
+
+void admin_close(struct admin *a){
+   twheel_cancel(&wheel, &a->timer);
+   close(a->fd);
+   a->fd = -1;
+}
+
+/*
+ * 管理用の口: 締め切りまでに済まなかった問い合わせを切る。
+ */
+void on_admin_timeout(struct twtimer *t, void *arg){
+   (void)t;
+   admin_close(arg);
 }
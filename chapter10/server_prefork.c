@@ -0,0 +1,691 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include "slab.h"
+#include "outq.h"
+
+#define BUF_SIZE 256
+#define W_MAX 64             // ワーカー数の上限
+#define EV_MAX 64            // epoll_wait 1回で受け取るイベント数
+#define HIGH_WM 65536        // 送信キューの上限の既定値（バイト）
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+/*
+ * server_socket.c と同じ strlen サービスを、
+ * chapter02 の fork() を使って「プリフォーク型」のマルチプロセスサーバにしたもの。
+ *
+ * --------------------------------------------------------------------
+ * 【構造】
+ *
+ *   マスター（親プロセス）
+ *     1) socket / bind / listen で待受ソケットを作る
+ *     2) fork() でワーカーを N 個作る（待受ソケットの FD は子に引き継がれる）
+ *     3) 以降は waitpid() でワーカーの終了を見張り、
+ *        落ちたワーカーがいれば同じ番号で作り直す（respawn）
+ *
+ *   ワーカー（子プロセス）
+ *     各自が epoll で「共有の待受ソケット」と「自分が accept したクライアント」を監視し、
+ *     accept / recv / send を行う。ワーカー同士は何も共有しない。
+ *
+ * スレッドではなくプロセスなので、
+ *   - あるワーカーがクラッシュ（SEGV など）しても、落ちるのはそのワーカーの接続だけ
+ *   - メモリを共有しないので、ロックやデータ競合のバグが入り込む余地が無い
+ * という利点がある。CPU コア数ぶんワーカーを作れば、全コアで並列に処理できる。
+ *
+ * --------------------------------------------------------------------
+ * 【EPOLLEXCLUSIVE: thundering herd 対策】
+ *
+ * 全ワーカーが同じ待受ソケットを epoll で監視していると、
+ * 接続が1本来ただけで全ワーカーが起こされ、
+ * 1つだけが accept に成功し、残りは EAGAIN で空振りする（thundering herd）。
+ * ワーカー数が多いほど無駄な起床（コンテキストスイッチ）が増える。
+ *
+ * epoll_ctl(EPOLL_CTL_ADD) で EPOLLEXCLUSIVE を付けると、
+ * カーネルは待っているワーカーのうち1つ（または少数）だけを起こす。
+ * それでも空振りはあり得るので、待受ソケットはノンブロッキングにしておき、
+ * accept の EAGAIN は無視する。
+ * なお、負荷が軽いうちは同じワーカーばかりが起こされることが多い
+ * （接続が偏るのは正常な動作。負荷が上がると他のワーカーにも回る）。
+ *
+ * --------------------------------------------------------------------
+ * 【クラッシュの実験】
+ *
+ * クライアントから "crash" を送ると、それを受け取ったワーカーは abort() する。
+ * マスターが新しいワーカーを作り直し、他のワーカーの接続は影響を受けないことを確かめられる。
+ *
+ * --------------------------------------------------------------------
+ * 【終了処理（-g）】
+ *
+ * マスターもワーカーもシグナルはハンドラではなく signalfd で受け取る。
+ *
+ *   マスター: SIGINT / SIGTERM / SIGCHLD を signalfd で待つ。
+ *             SIGCHLD なら waitpid(WNOHANG) で終わったワーカーを回収して作り直す。
+ *             SIGINT / SIGTERM なら全ワーカーに SIGTERM を送り、全員の終了を待つ
+ *             （-g 秒 + 1 秒たっても残っていれば SIGKILL）。
+ *   ワーカー: SIGTERM を signalfd で受け、epoll ループの中で排出する。
+ *             1) 待受ソケットを epoll から外して閉じる（新しい接続は他のワーカーも受けない）
+ *             2) 受信キューに残っている要求には答え、答え終えた接続は shutdown(SHUT_WR)
+ *             3) クライアントが close したら close。全部閉じるか -g 秒たったら終了
+ *
+ * ワーカーを1つずつ SIGTERM で入れ替えても（ローリングリスタート）、
+ * 処理中の要求が失敗することは無い。
+ *
+ * --------------------------------------------------------------------
+ * 【送信キューと EPOLLOUT（-H / -l）】
+ *
+ * 応答を受け取らないクライアントがいると、ブロッキングの send はそこで止まり、
+ * そのワーカーが持つ他の接続もすべて止まる。
+ * server_m_sockets.c と同じく、クライアントのソケットはノンブロッキングにして
+ * 応答は outq.h の送信キュー経由で送る。
+ *
+ * epoll に登録するイベントは接続の状態から決める（update_events()）:
+ *   EPOLLIN  : 送信キューが high バイト未満のとき（上限を超えたら読み込みを止める）
+ *   EPOLLOUT : 送信キューが空でないときだけ
+ * 空のソケットはほぼ常に書き込み可能なので、EPOLLOUT を付けっぱなしにすると
+ * epoll_wait が毎回すぐ戻って空回りする。
+ * 止めた読み込みは、キューが low バイト以下に減ったところで再開する。
+ *
+ *   -H <バイト> : 送信キューの上限（既定 HIGH_WM）
+ *   -l <バイト> : 読み込みを再開するキューの長さ（既定 上限の 1/4）
+ *
+ * --------------------------------------------------------------------
+ * 【受信した CPU への振り分け（-c）】
+ *
+ * NIC の割り込みとソフト割り込み（TCP の受信処理）は、RSS などで決まる CPU で動く。
+ * その接続を別の CPU のワーカーが recv すると、ソケットやバッファのキャッシュラインが
+ * CPU 間を行き来する（受信のたびにキャッシュミス）。
+ * -c を付けると、受信処理をした CPU と同じ CPU のワーカーが接続を受け持つようにする:
+ *
+ *   1) ワーカー i を CPU i に固定する（sched_setaffinity）
+ *   2) 共有の待受ソケット1つではなく、SO_REUSEPORT で同じポートの待受ソケットを
+ *      ワーカーの数だけ作り、ワーカー i はソケット i だけを accept する
+ *   3) 待受ソケットのグループに SO_ATTACH_REUSEPORT_CBPF で
+ *      「SYN を受信した CPU 番号 % ワーカー数」を返す BPF プログラムを付ける。
+ *      カーネルは新しい接続を、その番号の（= bind した順で i 番目の）ソケットに入れる
+ *
+ * ソケットはマスターが fork の前に作って持ち続けるので、
+ * ワーカーが落ちても番号はずれない（作り直すまでの接続はそのソケットの backlog で待つ）。
+ * CPU がワーカーより多いと、CPU i + ワーカー数 の接続もワーカー i に来る（その分は別の CPU）。
+ *
+ * どちらのモードでも、accept した接続の SO_INCOMING_CPU（最後にこの接続のパケットを
+ * 受信処理した CPU）と、accept したときにワーカーが動いていた CPU を比べて数え、
+ * ワーカーの終了時に一致した割合（locality）を表示する。-c 無しと比べれば効果が分かる。
+ * BPF を付けられなければ警告して、カーネルのハッシュでの振り分けのまま動く。
+ *
+ * 使い方:
+ *   $ ./server_prefork [-n workers] [-g drain_sec] [-H high_bytes] [-l low_bytes] [-c] <port>
+ *     workers の既定値は CPU 数、drain_sec の既定値は 5
+ *
+ * 【コンパイル】
+ *   gcc server_prefork.c slab.c outq.c -o server_prefork
+ */
+
+int worker(int id, int sfd);
+pid_t spawn(int id, int sfd);
+void drain_client(int fd);
+void close_client(int fd);
+void update_events(int fd);
+int reply(int fd, int n);
+int listen_socket(unsigned short port, int reuseport);
+int attach_cpu_steering(int sfd, int nworkers);
+
+long drain_ms = 5000;             // 排出の締め切り（-g）
+int sigfd = -1;                   // マスターの signalfd（ワーカーでは閉じる）
+size_t high_wm = HIGH_WM;         // 送信キューの上限（-H）
+size_t low_wm;                    // 読み込みを再開する長さ（-l、0 なら high_wm / 4）
+int steer;                        // -c: ワーカーを CPU に固定し、受信した CPU で振り分ける
+int lsocks[W_MAX];                // -c のときのワーカーごとの待受ソケット（マスターが持ち続ける）
+int nlsocks;
+
+/*
+ * ワーカーが持っているクライアントの状態（FD 番号で引く）。
+ * 排出のときに全クライアントをたどるために使う。
+ */
+#define CL_NONE 0
+#define CL_OPEN 1
+#define CL_SHUT 2                 // shutdown(SHUT_WR) 済み
+struct client {
+   unsigned char state;           // CL_NONE / CL_OPEN / CL_SHUT
+   unsigned char paused;          // 送信キューが上限を超えて、読み込みを止めていれば 1
+   uint32_t events;               // 今 epoll に登録しているイベント
+   struct outq out;               // 送りきれなかった応答
+};
+struct client *clients;
+int clients_len;
+int nclients;
+int efd = -1;                     // ワーカーの epoll
+int draining;                     // ワーカーが排出中なら 1
+struct slab_pool obuf_pool;       // 送信キューのチャンクのプール
+
+int main(int argc, char *argv[]){
+   unsigned short port;
+   int sfd = -1, ret, opt, nworkers, ncpu, i, status, quit = 0, alive;
+   pid_t pids[W_MAX], pid;
+   time_t last[W_MAX];
+   sigset_t mask;
+   struct signalfd_siginfo si;
+   struct pollfd pfd;
+
+   ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   nworkers = ncpu;
+   while((opt = getopt(argc, argv, "n:g:H:l:c")) != -1){
+      if(opt == 'n') nworkers = atoi(optarg);
+      else if(opt == 'g') drain_ms = atol(optarg) * 1000;
+      else if(opt == 'H') high_wm = atol(optarg);
+      else if(opt == 'l') low_wm = atol(optarg);
+      else if(opt == 'c') steer = 1;
+      else{
+         fprintf(stderr, "Usage: $ ./server_prefork [-n workers] [-g drain_sec] [-H high_bytes] [-l low_bytes] [-c] <port>\n");
+         exit(1);
+      }
+   }
+   if(optind != argc - 1){
+      fprintf(stderr, "Usage: $ ./server_prefork [-n workers] [-g drain_sec] [-H high_bytes] [-l low_bytes] [-c] <port>\n");
+      exit(1);
+   }
+   if(high_wm < 1) high_wm = 1;
+   if(low_wm == 0 || low_wm >= high_wm) low_wm = high_wm / 4;
+   if(nworkers < 1) nworkers = 1;
+   if(nworkers > W_MAX) nworkers = W_MAX;
+   if(steer && nworkers > ncpu) nworkers = ncpu;     // CPU 番号 % ワーカー数 に当たらないワーカーができる
+   port = (unsigned short)atoi(argv[optind]);
+
+   fprintf(stderr, "Address=0.0.0.0, Port=%u, workers=%d%s\n", port, nworkers, steer ? ", cpu steering" : "");
+
+   /*
+    * 待受ソケットはマスターが1回だけ作る（-c ならワーカーの数だけ、ワーカーの番号順に）。
+    */
+   if(steer){
+      for(i = 0; i < nworkers; i++){
+         lsocks[i] = listen_socket(port, 1);
+         if(lsocks[i] < 0) exit(1);
+      }
+      nlsocks = nworkers;
+      if(attach_cpu_steering(lsocks[0], nworkers) < 0){
+         perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+         fprintf(stderr, "cpu steering unavailable, connections are spread by hash\n");
+      }
+   }
+   else{
+      sfd = listen_socket(port, 0);
+      if(sfd < 0) exit(1);
+   }
+
+   /*
+    * SIGINT / SIGTERM / SIGCHLD をブロックし、signalfd で受け取る。
+    * ブロックしたマスクは fork したワーカーにも引き継がれる。
+    */
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGINT);
+   sigaddset(&mask, SIGTERM);
+   sigaddset(&mask, SIGCHLD);
+   sigprocmask(SIG_BLOCK, &mask, NULL);
+   sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+   if(sigfd < 0){
+      perror("signalfd");
+      exit(1);
+   }
+
+   for(i = 0; i < nworkers; i++){
+      pids[i] = spawn(i, steer ? lsocks[i] : sfd);
+      last[i] = time(NULL);
+   }
+   alive = nworkers;
+
+   /*
+    * マスターのループ: シグナルを待ち、終わったワーカーを回収して作り直す。
+    */
+   pfd.fd = sigfd;
+   pfd.events = POLLIN;
+   while(alive > 0){
+      /*
+       * 終了中はワーカーの排出の締め切り + 1 秒まで待ち、それでも残っていれば SIGKILL。
+       */
+      ret = poll(&pfd, 1, quit == 1 ? (int)drain_ms + 1000 : -1);
+      if(ret == 0){
+         fprintf(stderr, "workers did not exit in time, killing\n");
+         for(i = 0; i < nworkers; i++){
+            if(pids[i] > 0) kill(pids[i], SIGKILL);
+         }
+         quit = 2;                  // 次は無期限に待つ（SIGKILL なら必ず終わる）
+         continue;
+      }
+      if(ret < 0){
+         if(errno == EINTR) continue;
+         perror("poll");
+         break;
+      }
+      if(read(sigfd, &si, sizeof(si)) != sizeof(si)) continue;
+
+      if(si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM){
+         if(quit) continue;
+         quit = 1;
+         fprintf(stderr, "stopping workers\n");
+         for(i = 0; i < nworkers; i++){
+            if(pids[i] > 0) kill(pids[i], SIGTERM);
+         }
+         continue;
+      }
+
+      /*
+       * SIGCHLD: 複数の子が同時に終わっても SIGCHLD は1つにまとめられることがあるので、
+       * WNOHANG で回収できるだけ回収する。
+       */
+      while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+         for(i = 0; i < nworkers; i++){
+            if(pids[i] == pid) break;
+         }
+         if(i == nworkers) continue;
+
+         if(WIFSIGNALED(status)){
+            fprintf(stderr, "worker %d (pid %d) killed by signal %d\n", i, (int)pid, WTERMSIG(status));
+         }
+         else{
+            fprintf(stderr, "worker %d (pid %d) exited with %d\n", i, (int)pid, WEXITSTATUS(status));
+         }
+         pids[i] = -1;
+         alive--;
+         if(quit) continue;
+
+         /*
+          * 起動直後に落ち続けるワーカーを全速で作り直し続けないよう、
+          * 前回の起動から1秒経っていなければ1秒待つ。
+          */
+         if(time(NULL) - last[i] < 1) sleep(1);
+         pids[i] = spawn(i, steer ? lsocks[i] : sfd);
+         last[i] = time(NULL);
+         if(pids[i] > 0) alive++;
+      }
+   }
+
+   if(sfd >= 0) close(sfd);
+   for(i = 0; i < nlsocks; i++) close(lsocks[i]);
+   fprintf(stderr, "bye\n");
+   return 0;
+}
+
+/*
+ * 待受ソケットを作る。失敗で -1。
+ * ノンブロッキングにしておくのは、起こされたのに他のワーカーに先に accept された場合に
+ * accept でブロックしないため。
+ */
+int listen_socket(unsigned short port, int reuseport){
+   int sfd, on = 1;
+   struct sockaddr_in s_addr;
+
+   sfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+   if(sfd < 0){
+      perror("socket");
+      return -1;
+   }
+   if(setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on)) < 0
+      || (reuseport && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on)) < 0)){
+      perror("setsockopt");
+      close(sfd);
+      return -1;
+   }
+
+   memset(&s_addr, 0, sizeof(s_addr));
+   s_addr.sin_port = htons(port);
+   s_addr.sin_family = AF_INET;
+   s_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+   if(bind(sfd, (struct sockaddr *)&s_addr, sizeof(s_addr)) < 0){
+      perror("bind");
+      close(sfd);
+      return -1;
+   }
+   if(listen(sfd, 128) < 0){
+      perror("listen");
+      close(sfd);
+      return -1;
+   }
+   return sfd;
+}
+
+/*
+ * SO_REUSEPORT のグループに、接続を「受信した CPU 番号 % nworkers」番目のソケットに入れる
+ * classic BPF のプログラムを付ける（グループのどれか1つに付ければよい）。
+ *
+ *   A = 今動いている CPU の番号（SYN の受信処理をしている CPU）
+ *   A = A % nworkers
+ *   return A                     （グループの中の、bind した順の番号）
+ */
+int attach_cpu_steering(int sfd, int nworkers){
+   struct sock_filter code[] = {
+      { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+      { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)nworkers },
+      { BPF_RET | BPF_A, 0, 0, 0 },
+   };
+   struct sock_fprog prog;
+
+   prog.len = sizeof(code) / sizeof(code[0]);
+   prog.filter = code;
+   return setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+/*
+ * ワーカーを1つ fork する。子プロセスは worker() から戻らない。
+ */
+pid_t spawn(int id, int sfd){
+   pid_t pid;
+
+   pid = fork();
+   if(pid < 0){
+      perror("fork");
+      return -1;
+   }
+   if(pid == 0){
+      /*
+       * 子プロセス: マスターの signalfd は使わない。
+       * マスターが（kill -9 などで）死んだら自分にも SIGTERM が来るようにする（排出して終わる）。
+       */
+      close(sigfd);
+      signal(SIGINT, SIG_IGN);          // Ctrl+C はマスターだけが受けて、順に止める
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      if(getppid() == 1) exit(0);        // fork 直後にマスターが死んでいた
+      exit(worker(id, sfd));
+   }
+   fprintf(stderr, "worker %d started (pid %d)\n", id, (int)pid);
+   return pid;
+}
+
+/*
+ * ワーカーのイベントループ。
+ */
+int worker(int id, int sfd){
+   int cfd, nev, i, fd, ret, n, wsfd, timeout = -1, rx_cpu;
+   long n_local = 0, n_seen = 0;     // 受信した CPU と同じ CPU で accept した接続の数 / 調べられた数
+   struct epoll_event ev, evs[EV_MAX];
+   struct sockaddr_in c_addr;
+   socklen_t addr_len;
+   char buf[BUF_SIZE];
+   sigset_t mask;
+   struct signalfd_siginfo si;
+   struct timespec deadline, now;
+   socklen_t len;
+   cpu_set_t cpus;
+
+   /*
+    * -c: 自分の番号の CPU に固定し、他のワーカーの待受ソケットは閉じる
+    * （マスターが持っているので、グループからは外れない）。
+    */
+   if(steer){
+      CPU_ZERO(&cpus);
+      CPU_SET(id, &cpus);
+      if(sched_setaffinity(0, sizeof(cpus), &cpus) < 0) perror("sched_setaffinity");
+      for(i = 0; i < nlsocks; i++){
+         if(lsocks[i] != sfd) close(lsocks[i]);
+      }
+   }
+
+   efd = epoll_create1(0);
+   if(efd < 0){
+      perror("epoll_create1");
+      return 1;
+   }
+   slab_init(&obuf_pool, sizeof(struct obuf), 16);
+
+   /*
+    * SIGTERM は（マスターから引き継いだマスクで）ブロック済みなので、signalfd で受け取る。
+    */
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGTERM);
+   wsfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+   if(wsfd < 0){
+      perror("signalfd");
+      return 1;
+   }
+   ev.events = EPOLLIN;
+   ev.data.fd = wsfd;
+   if(epoll_ctl(efd, EPOLL_CTL_ADD, wsfd, &ev) < 0){
+      perror("epoll_ctl");
+      return 1;
+   }
+
+   /*
+    * 待受ソケットは EPOLLEXCLUSIVE 付きで登録する（ワーカーごとに別の epoll インスタンス）。
+    */
+   ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+   ev.data.fd = sfd;
+   if(epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev) < 0){
+      perror("epoll_ctl");
+      return 1;
+   }
+
+   while(sfd != -1 || nclients > 0){
+      if(sfd == -1){
+         /*
+          * 排出中: 締め切りまでの残り時間だけ待つ。
+          */
+         clock_gettime(CLOCK_MONOTONIC, &now);
+         timeout = (int)((deadline.tv_sec - now.tv_sec) * 1000
+                         + (deadline.tv_nsec - now.tv_nsec) / 1000000);
+         if(timeout <= 0){
+            fprintf(stderr, "worker %d (pid %d) drain deadline: closing %d clients\n",
+                    id, (int)getpid(), nclients);
+            break;
+         }
+      }
+
+      nev = epoll_wait(efd, evs, EV_MAX, timeout);
+      if(nev < 0){
+         if(errno == EINTR) continue;
+         perror("epoll_wait");
+         return 1;
+      }
+
+      for(i = 0; i < nev; i++){
+         fd = evs[i].data.fd;
+
+         if(fd == wsfd){
+            /*
+             * SIGTERM: 待受ソケットを閉じて排出を始める。
+             * （close すればこのワーカーの epoll からは外れる。マスターと他のワーカーの FD は開いたまま）
+             */
+            while(read(wsfd, &si, sizeof(si)) == sizeof(si)){
+            }
+            if(sfd == -1) continue;
+            fprintf(stderr, "worker %d (pid %d) draining %d clients\n", id, (int)getpid(), nclients);
+            epoll_ctl(efd, EPOLL_CTL_DEL, sfd, NULL);
+            close(sfd);
+            sfd = -1;
+            draining = 1;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += drain_ms / 1000;
+            deadline.tv_nsec += (drain_ms % 1000) * 1000000;
+            if(deadline.tv_nsec >= 1000000000){
+               deadline.tv_sec++;
+               deadline.tv_nsec -= 1000000000;
+            }
+            for(fd = 0; fd < clients_len; fd++){
+               if(clients[fd].state == CL_OPEN) drain_client(fd);
+            }
+            continue;
+         }
+
+         if(fd == sfd){
+            /*
+             * 新規接続。他のワーカーに先を越されていれば EAGAIN になる。
+             */
+            addr_len = sizeof(c_addr);
+            cfd = accept4(sfd, (struct sockaddr *)&c_addr, &addr_len, SOCK_NONBLOCK);
+            if(cfd < 0){
+               if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+               continue;
+            }
+
+            /*
+             * この接続のパケットを受信処理した CPU と、今自分が動いている CPU を比べる。
+             */
+            len = sizeof(rx_cpu);
+            if(getsockopt(cfd, SOL_SOCKET, SO_INCOMING_CPU, &rx_cpu, &len) < 0) rx_cpu = -1;
+            if(rx_cpu >= 0){
+               n_seen++;
+               if(rx_cpu == sched_getcpu()) n_local++;
+            }
+            fprintf(stderr, "worker %d (pid %d) accepted %s (rx cpu %d, on cpu %d)\n", id, (int)getpid(),
+                    inet_ntoa(c_addr.sin_addr), rx_cpu, sched_getcpu());
+
+            ev.events = EPOLLIN;
+            ev.data.fd = cfd;
+            if(epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &ev) < 0){
+               perror("epoll_ctl");
+               close(cfd);
+               continue;
+            }
+
+            /*
+             * 状態表を必要なだけ広げて登録する。
+             */
+            if(cfd >= clients_len){
+               n = clients_len ? clients_len : 64;
+               while(n <= cfd) n *= 2;
+               clients = realloc(clients, sizeof(clients[0]) * n);
+               if(clients == NULL){
+                  perror("realloc");
+                  return 1;
+               }
+               memset(clients + clients_len, 0, sizeof(clients[0]) * (n - clients_len));
+               clients_len = n;
+            }
+            clients[cfd].state = CL_OPEN;
+            clients[cfd].paused = 0;
+            clients[cfd].events = EPOLLIN;
+            outq_init(&clients[cfd].out);
+            nclients++;
+            continue;
+         }
+
+         /*
+          * 書き込み可能: 送信キューの続きを送る。
+          * EPOLLERR / EPOLLHUP は登録しなくても報告されるので、ここで send の失敗として拾う。
+          */
+         if(evs[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)){
+            if(outq_flush(&clients[fd].out, &obuf_pool, fd) < 0){
+               close_client(fd);
+               continue;
+            }
+            if(clients[fd].paused && clients[fd].out.bytes <= low_wm) clients[fd].paused = 0;
+            if(draining && clients[fd].state == CL_OPEN) drain_client(fd);
+            update_events(fd);
+         }
+         if(!(evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) || clients[fd].paused) continue;
+
+         /*
+          * クライアントからの受信。buf は末尾に '\0' を置くぶん1バイト残して受け取る。
+          */
+         ret = recv(fd, buf, BUF_SIZE - 1, 0);
+         if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+         if(ret <= 0){
+            close_client(fd);
+            continue;
+         }
+         buf[ret] = '\0';
+
+         if(strcmp(buf, "crash") == 0){
+            fprintf(stderr, "worker %d (pid %d) crashing on request\n", id, (int)getpid());
+            abort();
+         }
+
+         /*
+          * 半分閉じた後に届いた要求には答えられないので読み捨てる。
+          */
+         if(clients[fd].state == CL_SHUT) continue;
+
+         n = strlen(buf);
+         if(reply(fd, n) < 0 || strcmp(buf, "exit") == 0){
+            close_client(fd);
+         }
+         else if(draining){
+            drain_client(fd);
+         }
+      }
+   }
+
+   /*
+    * 締め切りを過ぎて残っている接続を閉じて終了する。
+    */
+   for(fd = 0; fd < clients_len; fd++){
+      if(clients[fd].state != CL_NONE) close_client(fd);
+   }
+   fprintf(stderr, "worker %d (pid %d) done: locality %ld/%ld (%.1f%%)\n", id, (int)getpid(),
+           n_local, n_seen, n_seen ? 100.0 * n_local / n_seen : 0.0);
+   return 0;
+}
+
+/*
+ * 排出中のクライアント: 受信キューに要求が残っておらず、送信キューも空なら、送信側だけ閉じる。
+ * クライアントの recv は 0 を返すので、サーバが終わることが分かる。
+ */
+void drain_client(int fd){
+   int queued = 0;
+
+   if(!outq_empty(&clients[fd].out)) return;    // 送り終えたところでもう一度呼ばれる
+   if(ioctl(fd, FIONREAD, &queued) == 0 && queued > 0) return;
+   shutdown(fd, SHUT_WR);
+   clients[fd].state = CL_SHUT;
+}
+
+/*
+ * クライアントを閉じて、送信キューを捨てる。
+ */
+void close_client(int fd){
+   close(fd);                     // close すると epoll からも自動で外れる
+   outq_clear(&clients[fd].out, &obuf_pool);
+   clients[fd].state = CL_NONE;
+   nclients--;
+}
+
+/*
+ * 応答 n を送る（送りきれなければ送信キューに積む）。送れなければ -1。
+ * キューが上限を超えたら読み込みを止める。
+ */
+int reply(int fd, int n){
+   struct client *cl = &clients[fd];
+
+   if(outq_send(&cl->out, &obuf_pool, fd, &n, sizeof(n), 0) < 0) return -1;
+   if(cl->out.bytes >= high_wm) cl->paused = 1;
+   update_events(fd);
+   return 0;
+}
+
+/*
+ * 接続の状態に合わせて epoll のイベントを登録し直す。変わらなければ何もしない。
+ */
+void update_events(int fd){
+   struct client *cl = &clients[fd];
+   struct epoll_event ev;
+
+   ev.events = 0;
+   if(!cl->paused) ev.events |= EPOLLIN;
+   if(!outq_empty(&cl->out)) ev.events |= EPOLLOUT;
+   if(ev.events == cl->events) return;
+
+   ev.data.fd = fd;
+   if(epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev) < 0) perror("epoll_ctl");
+   cl->events = ev.events;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -7,8 +8,25 @@
 #include <netdb.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <time.h>
 
 #define BUF_SIZE 256
+#define BUSY_POLL_US 50          // SO_BUSY_POLL に渡す時間（マイクロ秒）
+
+#define REQ_MAX 512              // 要求1行の長さの上限（-d）
+#define FCACHE_MAX 64            // 開いたままにしておくファイルの数（-d）
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69   // Linux 5.11 以降。古いヘッダには無い
+#endif
 
 /*
  * このプログラムは TCP ソケットを使った “サーバ側” の最小例である。
@@ -48,31 +66,427 @@
  *   - cfd は “通信専用ソケット”（accept 後の接続ごとにできる）
  *
  * --------------------------------------------------------------------
- * 注意点（このコードに特有）:
- *   - send(cfd, &n, ret, 0) は「送るバイト数」が ret（=受信バイト数）になっているが、
- *     n は int なので本来は sizeof(n) を送るべきである（バグの可能性）。
- *   - recv の戻り値 ret は「受信したバイト数」。buf はヌル終端されない可能性があるため、
- *     文字列として扱うなら ret を使って終端を入れる設計が安全。
- *   - bind/listen/accept のエラーチェックが無い（教材として簡略化されている）。
+ * 注意点（このコードに特有。いずれも元のコードにあった問題で、今は直してある）:
+ *   - send(cfd, &n, ret, 0) は「送るバイト数」が ret（=受信バイト数）になっていたが、
+ *     n は int なので sizeof(n) を送るようにした。
+ *   - recv の戻り値 ret は「受信したバイト数」。buf はヌル終端されないので、
+ *     ret の位置に '\0' を入れてから文字列として扱う。
+ *   - bind/listen/accept のエラーチェックを入れた。
+ *
+ * --------------------------------------------------------------------
+ * 【低遅延モード（-b / -k / -p / -s）】
+ *
+ * 既定の動作では recv でブロックする。要求が来ていないとスレッドは眠り、
+ * パケットが届くと割り込み → softirq → ソケットのキューに入れる → スレッドを起こす、
+ * という順に進む。起床（スケジューラ + コンテキストスイッチ + キャッシュの冷え）に
+ * マイクロ秒単位の時間がかかり、これが往復遅延のばらつきの主な原因になる。
+ *
+ * -b を付けると、受け付けたソケットに次を設定して、眠らずに回り続ける。
+ *
+ *   O_NONBLOCK            : recv は EAGAIN ですぐ戻る。戻ったらそのまま recv し直す（スピン）
+ *   SO_BUSY_POLL          : ソケットが空のとき、カーネルが NIC のキュー（NAPI）を
+ *                           直接見に行く時間。割り込みを待たずに受信できる
+ *   SO_PREFER_BUSY_POLL   : busy poll 中は NIC 割り込みを抑えて、ポーリングに任せる
+ *   TCP_NODELAY           : Nagle アルゴリズムを切る（小さな応答をすぐ送る）
+ *
+ * -k を付けると recv のたびに TCP_QUICKACK を設定し直す（遅延 ACK をやめる）。
+ * 1回の設定は次の ACK までしか効かないので、毎回設定する必要がある。
+ *
+ * -p cpu でこのプロセスを指定した CPU に固定する。
+ * スピンするスレッドは CPU を1つ使い切るので、isolcpus や nohz_full で
+ * 他のタスクや割り込みを追い出した CPU を指定するのが本来の使い方。
+ * 同じ CPU に他のタスクが乗ると、スピンがそのタスクの時間を奪って逆に遅くなる。
+ *
+ * 注意:
+ *   - SO_BUSY_POLL を既定値より大きくするには CAP_NET_ADMIN が要る（EPERM なら警告だけ出して続ける）。
+ *   - ループバック（127.0.0.1）には NIC も NAPI も無いので、busy poll の設定自体は効かない。
+ *     ループバックで測れるのは「眠らずにスピンする」ことと NODELAY/QUICKACK の効果である。
+ *   - 1要求ごとに stderr へ表示すると、それだけで数マイクロ秒かかる。測定時は -s で表示を止める。
+ *
+ * ループバックでの往復遅延の例（client_socket -l 100000、サーバ/クライアントを別 CPU に固定）:
+ *
+ *   ※ CPU が1つしか無い環境での測定。-b は本来の使い方ではない（下の説明を参照）。
+ *
+ *     既定（ブロッキング）        : p50 12.0us  p99 15.6us  p99.9 108us
+ *     両側 -b -k（同じ CPU でスピン）: p50 7990us  p99 12644us
+ *
+ *   スピンする側は CPU を手放さないので、相手はタイムスライスが切れるまで走れず、
+ *   1往復がスケジューラの1周期（ミリ秒）になる。busy poll で速くなるのは
+ *   サーバとクライアント（あるいは NIC の割り込み処理）がそれぞれ専用の CPU を持つときだけで、
+ *   そのときは眠りと起床が無くなる分、p50 も裾（p99 以上）も縮む。
+ *   CPU が1つしか無い場合は警告を出す。
+ *
+ * --------------------------------------------------------------------
+ * 【静的ファイルの配信（-d root）】
+ *
+ * -d root を付けると strlen の代わりに、root の下のファイルを返すサーバになる。
+ * 接続を1つずつ順に受け付け（1つ終わったら次を accept する）、1つの接続で何回でも要求できる。
+ *
+ *   要求: GET <path> [<range>]\n
+ *           path  : root からの相対パス
+ *           range : start-end（両端を含むバイト位置）、start-（最後まで）、-n（最後の n バイト）
+ *   応答: OK <start> <len> <size>\n の後に len バイトの中身
+ *         ERR <理由>\n
+ *
+ * 中身は read/send で送らず sendfile() で送る。
+ *
+ *   read + send : ページキャッシュ → ユーザ空間のバッファ → ソケットの送信バッファ（コピー2回、
+ *                 システムコールもバッファの大きさごとに2回）
+ *   sendfile    : ページキャッシュのページをそのままソケットに渡す（ユーザ空間を通らない）
+ *
+ * ヘッダ（OK ...）は TCP_CORK を付けてから send し、sendfile の後で外す。
+ * CORK 中は満杯にならないセグメントを送らずに溜めるので、短いヘッダが1つのパケットで
+ * 先に出て行かず、中身の先頭と一緒のセグメントにまとまる。
+ *
+ * よく要求されるファイルは FD を開いたまま FCACHE_MAX 個まで覚えておく（一番長く使われていないものから閉じる）。
+ * 要求のたびに fstatat で i-node と更新時刻を確かめ、置き換えられていたら開き直す。
+ * open / close とパス名の解決が毎回は要らなくなる。
+ *
+ * path は root の外を指せない。openat2() の RESOLVE_BENEATH で、".." や絶対パス、
+ * root の外を指すシンボリックリンクを含むパスの解決をカーネルに拒否させる。
+ * openat2 が無いカーネル（5.6 より前）では、途中のシンボリックリンクで外へ出るのを防げないので、
+ * ファイルは返さずに ERR で断る。
+ *
+ * 要求は1行ずつ（'\n' まで）処理する。1回の recv に複数の要求が入っていれば順に全部答え、
+ * 行の途中で切れていれば、残りを次の recv で受け取ったものの前につなげる。
+ * REQ_MAX バイトを超えても '\n' が来なければ、ERR を返して接続を閉じる。
+ *
+ * 使い方:
+ *   $ ./server_socket 5000
+ *   $ ./server_socket -b -k -s -p 2 5000
+ *   $ ./server_socket -d /srv/artifacts 5000
+ *   $ printf 'GET build/app.tar.gz 0-1048575\n' | nc 127.0.0.1 5000
  */
 
+/*
+ * 呼び出したプロセスを cpu 番の CPU に固定する。
+ */
+static void pin_cpu(int cpu){
+   cpu_set_t set;
+
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   if(sched_setaffinity(0, sizeof(set), &set) < 0){
+      perror("sched_setaffinity");
+      exit(1);
+   }
+}
+
+/*
+ * 受け付けたソケットに低遅延用の設定をする（-b）。
+ */
+static void set_busy(int fd){
+   int on = 1, us = BUSY_POLL_US;
+
+   if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0){
+      perror("fcntl");
+      exit(1);
+   }
+   if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0){
+      perror("setsockopt(TCP_NODELAY)");
+      exit(1);
+   }
+   /*
+    * busy poll の2つは、権限やカーネルの版によっては失敗する。
+    * スピンそのものは無くても動くので、警告だけにする。
+    */
+   if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0){
+      perror("setsockopt(SO_BUSY_POLL)");
+   }
+   if(setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0){
+      perror("setsockopt(SO_PREFER_BUSY_POLL)");
+   }
+}
+
+/*
+ * 非ブロッキングのソケットから、何か届くまで recv を繰り返す。
+ * 戻り値は recv と同じ。
+ */
+static int recv_spin(int fd, char *buf, int len){
+   int ret;
+
+   while(1){
+      ret = recv(fd, buf, len, 0);
+      if(ret >= 0) return ret;
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+   }
+}
+
+/*
+ * 開いたままにしているファイル。
+ */
+struct fcache {
+   char path[BUF_SIZE];
+   int fd;                       // 空きなら -1
+   dev_t dev;
+   ino_t ino;
+   struct timespec mtime;
+   off_t size;
+   unsigned long used;           // 最後に使った順番（LRU）
+};
+
+struct fcache fcache[FCACHE_MAX];
+unsigned long fcache_clock;
+long fcache_hits, fcache_misses;
+
+/*
+ * root の下の path を開く。root の外へ出るパスは EXDEV などで失敗する。
+ * openat2 が無いカーネルでは ENOSYS で失敗する（openat + O_NOFOLLOW は最後の要素しか確かめないので、
+ * 途中のディレクトリがシンボリックリンクなら root の外を開けてしまう。代わりには使わない）。
+ */
+static int open_beneath(int rootfd, const char *path){
+   struct open_how how;
+   int fd;
+
+   memset(&how, 0, sizeof(how));
+   how.flags = O_RDONLY | O_CLOEXEC;
+   how.resolve = RESOLVE_BENEATH;
+   fd = syscall(SYS_openat2, rootfd, path, &how, sizeof(how));
+   return fd;
+}
+
+/*
+ * path の FD をキャッシュから探す（無ければ開いて入れる）。
+ * 見つかったエントリを返す。失敗で NULL（errno）。
+ */
+static struct fcache *fcache_get(int rootfd, const char *path){
+   struct stat st;
+   struct fcache *e, *victim = &fcache[0];
+   int i, fd;
+
+   if(strlen(path) >= BUF_SIZE){
+      errno = ENAMETOOLONG;
+      return NULL;
+   }
+
+   for(i = 0; i < FCACHE_MAX; i++){
+      e = &fcache[i];
+      if(e->fd >= 0 && strcmp(e->path, path) == 0){
+         /*
+          * 開いた後に置き換えられて（別の i-node になって）いないか、更新されていないかを確かめる。
+          */
+         if(fstatat(rootfd, path, &st, 0) == 0 && st.st_dev == e->dev && st.st_ino == e->ino
+            && st.st_mtim.tv_sec == e->mtime.tv_sec && st.st_mtim.tv_nsec == e->mtime.tv_nsec){
+            e->size = st.st_size;
+            e->used = ++fcache_clock;
+            fcache_hits++;
+            return e;
+         }
+         close(e->fd);
+         e->fd = -1;
+      }
+      if(e->fd < 0) victim = e;
+      else if(victim->fd >= 0 && e->used < victim->used) victim = e;
+   }
+
+   fcache_misses++;
+   fd = open_beneath(rootfd, path);
+   if(fd < 0) return NULL;
+   if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+      close(fd);
+      errno = EISDIR;
+      return NULL;
+   }
+
+   if(victim->fd >= 0) close(victim->fd);
+   strcpy(victim->path, path);
+   victim->fd = fd;
+   victim->dev = st.st_dev;
+   victim->ino = st.st_ino;
+   victim->mtime = st.st_mtim;
+   victim->size = st.st_size;
+   victim->used = ++fcache_clock;
+   return victim;
+}
+
+/*
+ * range（start-end / start- / -n）を解釈して、送る範囲 [*start, *start + *len) を決める。
+ * 範囲がファイルの外なら -1。
+ */
+static int parse_range(const char *range, off_t size, off_t *start, off_t *len){
+   char *end;
+   long long a, b;
+
+   if(range == NULL){
+      *start = 0;
+      *len = size;
+      return 0;
+   }
+   if(range[0] == '-'){
+      b = strtoll(range + 1, &end, 10);
+      if(*end != '\0' || b <= 0) return -1;
+      if(b > size) b = size;
+      *start = size - b;
+      *len = b;
+      return 0;
+   }
+   a = strtoll(range, &end, 10);
+   if(*end != '-' || a < 0 || a >= size) return -1;
+   if(end[1] == '\0') b = size - 1;
+   else{
+      b = strtoll(end + 1, &end, 10);
+      if(*end != '\0' || b < a) return -1;
+      if(b >= size) b = size - 1;
+   }
+   *start = a;
+   *len = b - a + 1;
+   return 0;
+}
+
+/*
+ * 要求1行（'\n' と '\r' は取り除いてある）に答える。接続を終えるなら -1。
+ */
+static int serve_request(int cfd, int rootfd, char *line){
+   char hdr[128], *cmd, *path, *range, *save;
+   const char *why;
+   struct fcache *e;
+   off_t start, len, off;
+   ssize_t ret;
+   int on = 1, off_flag = 0;
+
+   cmd = strtok_r(line, " ", &save);
+   path = strtok_r(NULL, " ", &save);
+   range = strtok_r(NULL, " ", &save);
+   if(cmd == NULL || strcmp(cmd, "GET") != 0 || path == NULL){
+      return send(cfd, "ERR bad request\n", 16, MSG_NOSIGNAL) < 0 ? -1 : 0;
+   }
+
+   e = fcache_get(rootfd, path);
+   if(e == NULL){
+      if(errno == EXDEV) why = "outside root";
+      else if(errno == ENOSYS) why = "cannot confine path without openat2";
+      else why = strerror(errno);
+      ret = snprintf(hdr, sizeof(hdr), "ERR %s\n", why);
+      return send(cfd, hdr, ret, MSG_NOSIGNAL) < 0 ? -1 : 0;
+   }
+   if(parse_range(range, e->size, &start, &len) < 0){
+      return send(cfd, "ERR bad range\n", 14, MSG_NOSIGNAL) < 0 ? -1 : 0;
+   }
+   fprintf(stderr, "GET %s %lld+%lld\n", path, (long long)start, (long long)len);
+
+   /*
+    * ヘッダと中身の先頭を同じセグメントにまとめる。
+    */
+   setsockopt(cfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+   ret = snprintf(hdr, sizeof(hdr), "OK %lld %lld %lld\n",
+                  (long long)start, (long long)len, (long long)e->size);
+   if(send(cfd, hdr, ret, MSG_NOSIGNAL) < 0) return -1;
+
+   /*
+    * sendfile は offset を進めてくれる（ファイルの読み書き位置は動かさない）。
+    * 1回で送れる量には上限があるので、送り終えるまで繰り返す。
+    */
+   off = start;
+   while(off < start + len){
+      ret = sendfile(cfd, e->fd, &off, start + len - off);
+      if(ret <= 0){
+         if(ret < 0 && errno == EINTR) continue;
+         if(ret < 0) perror("sendfile");
+         return -1;                  // 途中で切れたら、長さが合わないので接続ごと終える
+      }
+   }
+   setsockopt(cfd, IPPROTO_TCP, TCP_CORK, &off_flag, sizeof(off_flag));
+   return 0;
+}
+
+/*
+ * 1つの接続の要求を、切断されるまで順に処理する。
+ * buf には行の途中（まだ '\n' が来ていない分）を残し、次に受け取ったものをその後ろに足す。
+ */
+static void serve_files(int cfd, int rootfd){
+   char buf[REQ_MAX + 1], *line, *nl;
+   size_t len = 0, used;
+   ssize_t ret;
+
+   while((ret = recv(cfd, buf + len, REQ_MAX - len, 0)) > 0){
+      len += ret;
+      buf[len] = '\0';
+
+      /*
+       * 揃っている行を全部処理する。
+       */
+      used = 0;
+      while((nl = memchr(buf + used, '\n', len - used)) != NULL){
+         line = buf + used;
+         *nl = '\0';
+         used = nl + 1 - buf;
+         line[strcspn(line, "\r")] = '\0';
+         if(serve_request(cfd, rootfd, line) < 0) return;
+      }
+
+      /*
+       * 残り（行の途中）を先頭へ寄せる。一杯なのに '\n' が無ければ、長すぎる行。
+       */
+      len -= used;
+      memmove(buf, buf + used, len);
+      if(len == REQ_MAX){
+         send(cfd, "ERR line too long\n", 18, MSG_NOSIGNAL);
+         return;
+      }
+   }
+}
+
+/*
+ * -d のとき: 接続を1つずつ受け付けてファイルを返し続ける（戻らない）。
+ */
+static void file_server(int sfd, const char *root){
+   int rootfd, cfd, i;
+
+   rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if(rootfd < 0){
+      perror(root);
+      exit(1);
+   }
+   for(i = 0; i < FCACHE_MAX; i++) fcache[i].fd = -1;
+   fprintf(stderr, "serving files under %s\n", root);
+
+   while(1){
+      cfd = accept(sfd, NULL, NULL);
+      if(cfd < 0){
+         perror("accept");
+         continue;
+      }
+      serve_files(cfd, rootfd);
+      close(cfd);
+      fprintf(stderr, "fd cache: hits=%ld misses=%ld\n", fcache_hits, fcache_misses);
+   }
+}
+
 int main(int argc, char *argv[]){
    unsigned short port;
    int sfd = -1, cfd = -1; // サーバ用ソケット（待受用）とクライアント用ソケット（通信専用）
-   int ret, n, on = 1;
+   int ret, n, on = 1, opt;
+   int busy = 0, quickack = 0, quiet = 0, cpu = -1;
+   char *root = NULL;
    struct sockaddr_in s_addr, c_addr;
-   int addr_len = sizeof(struct sockaddr_in);
+   socklen_t addr_len = sizeof(struct sockaddr_in);
    char buf[BUF_SIZE];
 
+   while((opt = getopt(argc, argv, "bkp:sd:")) != -1){
+      if(opt == 'b') busy = 1;
+      else if(opt == 'k') quickack = 1;
+      else if(opt == 'p') cpu = atoi(optarg);
+      else if(opt == 's') quiet = 1;
+      else if(opt == 'd') root = optarg;
+      else{
+         fprintf(stderr, "Usage: $ ./server_socket [-b] [-k] [-s] [-p cpu] [-d root] [port]\n");
+         exit(1);
+      }
+   }
+
    /*
     * 引数チェック:
-    *   argv[1] にポート番号を指定する。
+    *   オプションの後ろにポート番号を指定する。
     */
-   if(argc != 2){
-      fprintf(stderr, "Usage: $ ./server_socket [port]\n");
+   if(argc - optind != 1){
+      fprintf(stderr, "Usage: $ ./server_socket [-b] [-k] [-s] [-p cpu] [-d root] [port]\n");
       exit(1);
    }
-   port = (unsigned short)atoi(argv[1]);
+   port = (unsigned short)atoi(argv[optind]);
+   if(cpu >= 0) pin_cpu(cpu);
+   if(busy && sysconf(_SC_NPROCESSORS_ONLN) < 2){
+      fprintf(stderr, "warning: only one CPU online; busy polling will fight the peer for it\n");
+   }
    /*
     * atoi で数値に変換してポートとして使う。
     * 実務なら範囲チェック（1〜65535）や atoi の失敗検出が欲しい。
@@ -145,16 +559,22 @@ int main(int argc, char *argv[]){
     */
 
    // ソケットの bind
-   bind(sfd, (struct sockaddr *)&s_addr, sizeof(s_addr));
+   if(bind(sfd, (struct sockaddr *)&s_addr, sizeof(s_addr)) < 0){
+      perror("bind");
+      exit(1);
+   }
    /*
     * bind(fd, addr, addrlen):
     *   作ったソケット sfd に「待ち受けるIP/ポート」を紐づける。
     *
-    * 本来は ret=bind(...) としてエラーチェック（-1なら perror）を入れるのが安全。
+    * 失敗（ポートが使用中など）したら -1 が返るので、perror して終了する。
     */
 
    // 接続を待つ
-   listen(sfd, 5);
+   if(listen(sfd, 5) < 0){
+      perror("listen");
+      exit(1);
+   }
    /*
     * listen(fd, backlog):
     *   接続待ち状態にする（受動オープン）。
@@ -167,6 +587,8 @@ int main(int argc, char *argv[]){
 
    fprintf(stderr, "Waiting for connection...\n");
 
+   if(root != NULL) file_server(sfd, root);
+
    // 接続要求を受け付ける
    cfd = accept(sfd, (struct sockaddr *)&c_addr, &addr_len);
    /*
@@ -184,17 +606,18 @@ int main(int argc, char *argv[]){
     * クライアントは1接続のみ対応（単発サーバ）。
     */
 
+   if(cfd < 0){
+      perror("accept");
+      exit(1);
+   }
+
    fprintf(stderr, "Connected from %s\n", inet_ntoa(c_addr.sin_addr));
+   if(busy) set_busy(cfd);
 
    // クライアントとの送受信ループ
    while(1){
-      memset(buf, 0, BUF_SIZE);
-      /*
-       * バッファをゼロクリアしておくと、受信後に文字列として扱いやすい。
-       * ただし recv はヌル終端を保証しないので、本来は ret を見て終端を入れるべき。
-       */
-
-      ret = recv(cfd, buf, BUF_SIZE, 0);
+      if(busy) ret = recv_spin(cfd, buf, BUF_SIZE - 1);
+      else ret = recv(cfd, buf, BUF_SIZE - 1, 0);
       /*
        * recv(fd, buf, len, flags):
        *   TCP は “バイトストリーム” なので、1回の recv でメッセージ単位が保たれるとは限らない。
@@ -212,11 +635,17 @@ int main(int argc, char *argv[]){
           */
          break;
       }
+      buf[ret] = '\0';
+      /*
+       * recv はヌル終端しないので、受信したバイト数の位置に '\0' を入れて文字列にする。
+       * そのために recv には BUF_SIZE - 1 までしか読ませていない。
+       */
 
-      fprintf(stderr, "received: %s\n", buf);
+      if(quickack) setsockopt(cfd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+
+      if(!quiet) fprintf(stderr, "received: %s\n", buf);
       /*
-       * 受信データを表示。
-       * buf はゼロクリアしているので、短い入力なら文字列として表示できやすい。
+       * 受信データを表示（-s のときは表示しない）。
        */
 
       n = strlen(buf);
@@ -225,21 +654,18 @@ int main(int argc, char *argv[]){
        * ここでも '\0' 終端が前提になる。
        */
 
-      send(cfd, &n, ret, 0);
+      if(send(cfd, &n, sizeof(n), MSG_NOSIGNAL) < 0){
+         perror("send");
+         break;
+      }
       /*
        * send(fd, buf, len, flags):
-       *   ここは注意が必要。
-       *
-       * 本来送りたいのは int n のバイト列なので、len は sizeof(n) が自然。
-       * しかしこのコードでは len=ret（=受信バイト数）になっている。
+       *   int n のバイト列をそのまま送る。
        *
-       * 例:
-       *   "Apple" を受信 → ret=5
-       *   send(&n, 5) → int(4バイト) を超えて 5バイト送ろうとしてしまい、余計な1バイトを送る可能性がある。
+       * 元は len=ret（=受信バイト数）になっていて、"Apple"（5バイト）なら
+       * int（4バイト）を越えて5バイト送っていた。sizeof(n) に直した。
        *
-       * 教材として “動いてしまう” 場合もあるが、正しくは:
-       *   send(cfd, &n, sizeof(n), 0);
-       * または、n を文字列化して send(buf, strlen(buf)) に統一する設計が安全。
+       * 非ブロッキングでも、4バイトなら送信バッファが詰まっていない限りそのまま送れる。
        */
 
       ret = strcmp(buf, "exit");
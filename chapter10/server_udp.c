@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#define BATCH 64             // recvmmsg / sendmmsg 1回で扱う最大データグラム数
+#define SEG_MAX 64           // GRO で1つにまとめられて届く最大セグメント数
+#define DGRAM_MAX 65536      // GRO 有効時の受信バッファ（まとめられたデータグラム全体）
+
+/*
+ * このプログラムは server_socket.c の「文字列を受け取り、文字数を返す」サービスを
+ * UDP（データグラム）で実装したサーバである。
+ *
+ * TCP 版との違い:
+ *   - 接続（accept）が無い。1つのソケットで全クライアントからのデータグラムを受ける
+ *   - データグラム1個 = 要求1個（メッセージ境界が保たれる）
+ *   - 返信先は、受信時に得た送信元アドレス
+ *   - 届かなかったデータグラムは再送されない（取りこぼしは起こりうる）
+ *
+ * --------------------------------------------------------------------
+ * 【バッチ処理: recvmmsg / sendmmsg】
+ *
+ * recvfrom/sendto は 1回のシステムコールで 1データグラムしか扱えない。
+ * 小さなメッセージを毎秒何百万個も処理すると、
+ * 処理時間のほとんどが「ユーザ空間 ⇔ カーネル」の行き来になってしまう。
+ *
+ *   recvmmsg(fd, msgs, BATCH, ...) : 最大 BATCH 個をまとめて受信
+ *   sendmmsg(fd, msgs, n, ...)     : n 個をまとめて送信
+ *
+ * これにより、システムコール1回あたり最大 64 個の要求を処理できる。
+ *
+ * --------------------------------------------------------------------
+ * 【UDP GRO / GSO】（Linux 4.18 / 5.0 以降。使えなければ自動的に使わない）
+ *
+ * GRO (Generic Receive Offload, setsockopt UDP_GRO):
+ *   同じ送信元から届いた「同じ長さのデータグラム」の列を、
+ *   カーネルが1つの大きなバッファにまとめて渡してくれる。
+ *   cmsg の UDP_GRO に「1個あたりの長さ（セグメント長）」が入るので、
+ *   それで切り分ければ元のデータグラム列に戻る。
+ *
+ * GSO (Generic Segmentation Offload, cmsg UDP_SEGMENT):
+ *   送信側の逆。同じ宛先への同じ長さの返信（ここでは int = 4バイト）を
+ *   1つのバッファに並べて sendmsg 1個で渡すと、カーネルが 4バイトずつの
+ *   データグラムに切り分けて送ってくれる。
+ *
+ *   GRO で 20個まとめて届いた要求 → 返信 20個を GSO で sendmmsg の1要素にできる。
+ *
+ * --------------------------------------------------------------------
+ * 【応答形式】
+ *   要求: 文字列（'\0' 終端は不要。データグラムの長さが文字列の長さになる）
+ *   応答: int n（4バイト、ホストのバイトオーダ。TCP 版と同じ）
+ *
+ *   -q を付けると返信しない（投げっぱなしのテレメトリ受信用）。
+ *
+ * 1秒ごとに「受信数 / 秒」「recvmmsg 1回あたりの受信数」を表示する。
+ *
+ * 使い方:
+ *   $ ./server_udp [-q] <port>
+ *
+ * 【コンパイル】
+ *   gcc -O2 server_udp.c -o server_udp
+ */
+
+/*
+ * 返信の送信。カーネルが GSO を拒否した場合は -1 を返す。
+ */
+int send_replies(int sfd, struct mmsghdr *out, int n);
+
+int main(int argc, char *argv[]){
+   unsigned short port;
+   int sfd, ret, on = 1, i, j, k, opt, quiet = 0, gro = 1, gso = 1;
+   int nseg, seg, nout, segs_total;
+   long rx_n = 0, rx_calls = 0;
+   time_t last;
+   struct sockaddr_in s_addr;
+   struct sockaddr_in peers[BATCH];
+   struct mmsghdr msgs[BATCH], out[BATCH * SEG_MAX];
+   struct iovec iov[BATCH], oiov[BATCH * SEG_MAX];
+   char *bufs;
+   int (*rep)[SEG_MAX];      // 返信（入力データグラム i のセグメント j への返信が rep[i][j]）
+   struct cmsghdr *cm;
+   /*
+    * 受信用・送信用の制御メッセージ（cmsg）領域。
+    * CMSG_SPACE(sizeof(int)) で int 1個ぶんの cmsg が入る大きさになる。
+    */
+   char rctl[BATCH][CMSG_SPACE(sizeof(int))];
+   char sctl[BATCH][CMSG_SPACE(sizeof(uint16_t))];
+
+   while((opt = getopt(argc, argv, "q")) != -1){
+      if(opt == 'q') quiet = 1;
+      else{
+         fprintf(stderr, "Usage: $ ./server_udp [-q] <port>\n");
+         exit(1);
+      }
+   }
+   if(optind != argc - 1){
+      fprintf(stderr, "Usage: $ ./server_udp [-q] <port>\n");
+      exit(1);
+   }
+   port = (unsigned short)atoi(argv[optind]);
+
+   bufs = malloc((size_t)BATCH * DGRAM_MAX);
+   rep = malloc(sizeof(*rep) * BATCH);
+   if(bufs == NULL || rep == NULL){
+      perror("malloc");
+      exit(1);
+   }
+
+   // ソケットの生成（SOCK_DGRAM = UDP）
+   sfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+   if(sfd < 0){
+      perror("socket");
+      exit(1);
+   }
+
+   ret = setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+   if(ret < 0){
+      perror("setsockopt");
+      exit(1);
+   }
+
+   /*
+    * UDP_GRO を有効にする。古いカーネルでは失敗するので、その場合は使わない。
+    */
+   if(setsockopt(sfd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) < 0){
+      gro = 0;
+   }
+
+   memset(&s_addr, 0, sizeof(s_addr));
+   s_addr.sin_port = htons(port);
+   s_addr.sin_family = AF_INET;
+   s_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+   fprintf(stderr, "Address=%s, Port=%u (udp, gro=%d)\n", inet_ntoa(s_addr.sin_addr), port, gro);
+
+   ret = bind(sfd, (struct sockaddr *)&s_addr, sizeof(s_addr));
+   if(ret < 0){
+      perror("bind");
+      exit(1);
+   }
+
+   last = time(NULL);
+
+   while(1){
+      /*
+       * mmsghdr 配列の準備:
+       *   msgs[i].msg_hdr は recvmsg に渡す msghdr と同じもの。
+       *   送信元アドレスは peers[i] に、データは bufs の i 番目の区画に入る。
+       *   recvmmsg はバッチのたびに msg_namelen / msg_controllen を書き換えるので毎回設定し直す。
+       */
+      memset(msgs, 0, sizeof(msgs));
+      for(i = 0; i < BATCH; i++){
+         iov[i].iov_base = bufs + (size_t)i * DGRAM_MAX;
+         iov[i].iov_len = DGRAM_MAX;
+         msgs[i].msg_hdr.msg_iov = &iov[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+         msgs[i].msg_hdr.msg_name = &peers[i];
+         msgs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+         msgs[i].msg_hdr.msg_control = rctl[i];
+         msgs[i].msg_hdr.msg_controllen = sizeof(rctl[i]);
+      }
+
+      /*
+       * recvmmsg(fd, msgs, vlen, flags, timeout):
+       *   MSG_WAITFORONE: 最初の1個が届くまではブロックし、
+       *   その後はすでに届いている分だけを（最大 vlen 個）まとめて返す。
+       *   戻り値は受信したデータグラム数で、各長さは msgs[i].msg_len に入る。
+       */
+      ret = recvmmsg(sfd, msgs, BATCH, MSG_WAITFORONE, NULL);
+      if(ret < 0){
+         if(errno == EINTR) continue;
+         perror("recvmmsg");
+         break;
+      }
+      rx_calls++;
+
+      nout = 0;
+      segs_total = 0;
+      for(i = 0; i < ret; i++){
+         /*
+          * GRO でまとめられていれば、cmsg の UDP_GRO にセグメント長が入っている。
+          * 無ければデータグラム1個ぶん（= 全長）がセグメント長。
+          */
+         seg = msgs[i].msg_len;
+         for(cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm != NULL;
+             cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)){
+            if(cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO){
+               memcpy(&seg, CMSG_DATA(cm), sizeof(int));
+            }
+         }
+         if(seg <= 0) seg = msgs[i].msg_len > 0 ? (int)msgs[i].msg_len : 1;
+
+         /*
+          * セグメントごとに「文字数」を計算する。
+          * データグラムは '\0' 終端されていないので strlen ではなく、
+          * 長さ上限付きの strnlen を使う（途中に '\0' があればそこまで）。
+          */
+         nseg = 0;
+         for(k = 0; k < (int)msgs[i].msg_len && nseg < SEG_MAX; k += seg){
+            j = (int)msgs[i].msg_len - k < seg ? (int)msgs[i].msg_len - k : seg;
+            rep[i][nseg++] = (int)strnlen((char *)iov[i].iov_base + k, j);
+         }
+         if(msgs[i].msg_len == 0){
+            rep[i][nseg++] = 0;    // 空のデータグラムにも 0 を返す
+         }
+         segs_total += nseg;
+
+         if(quiet) continue;
+
+         if(gso && nseg > 1){
+            /*
+             * GSO: nseg 個の返信（各4バイト）を1つのバッファに並べ、
+             * UDP_SEGMENT = 4 を付けて1要素で送る。
+             */
+            memset(&out[nout], 0, sizeof(out[nout]));
+            oiov[nout].iov_base = rep[i];
+            oiov[nout].iov_len = sizeof(int) * nseg;
+            out[nout].msg_hdr.msg_iov = &oiov[nout];
+            out[nout].msg_hdr.msg_iovlen = 1;
+            out[nout].msg_hdr.msg_name = &peers[i];
+            out[nout].msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+            out[nout].msg_hdr.msg_control = sctl[i];
+            out[nout].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cm = CMSG_FIRSTHDR(&out[nout].msg_hdr);
+            cm->cmsg_level = IPPROTO_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *)CMSG_DATA(cm) = sizeof(int);
+            nout++;
+         }
+         else{
+            for(j = 0; j < nseg; j++){
+               memset(&out[nout], 0, sizeof(out[nout]));
+               oiov[nout].iov_base = &rep[i][j];
+               oiov[nout].iov_len = sizeof(int);
+               out[nout].msg_hdr.msg_iov = &oiov[nout];
+               out[nout].msg_hdr.msg_iovlen = 1;
+               out[nout].msg_hdr.msg_name = &peers[i];
+               out[nout].msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+               nout++;
+            }
+         }
+      }
+      rx_n += segs_total;
+
+      if(nout > 0 && send_replies(sfd, out, nout) < 0 && gso){
+         /*
+          * GSO を拒否された（古いカーネル、チェックサムオフロード無しの経路など）。
+          * 以降は GSO を使わない。今回のバッチの返信は諦める（UDP なので再送はクライアント次第）。
+          */
+         fprintf(stderr, "UDP GSO unavailable, falling back to one datagram per reply\n");
+         gso = 0;
+      }
+
+      /*
+       * 1秒ごとの統計表示。メッセージごとに fprintf すると、それだけで遅くなるため。
+       */
+      if(time(NULL) != last){
+         if(rx_calls > 0){
+            fprintf(stderr, "%ld msgs/s, %.1f msgs per recvmmsg\n",
+                    rx_n, (double)rx_n / rx_calls);
+         }
+         rx_n = 0;
+         rx_calls = 0;
+         last = time(NULL);
+      }
+   }
+
+   close(sfd);
+   free(rep);
+   free(bufs);
+   return 0;
+}
+
+int send_replies(int sfd, struct mmsghdr *out, int n){
+   int done = 0, ret;
+
+   /*
+    * sendmmsg は一度に全部送れるとは限らない（戻り値 = 送れた個数）ので、
+    * 残りを送り直す。1個目でエラーになった場合は -1 が返る。
+    */
+   while(done < n){
+      ret = sendmmsg(sfd, out + done, n - done, 0);
+      if(ret < 0){
+         if(errno == EINTR) continue;
+         if(errno == EAGAIN || errno == ENOBUFS){
+            /*
+             * 送信バッファが一杯。UDP なので落としてよい（クライアントから見れば取りこぼし）。
+             */
+            return 0;
+         }
+         if(errno == EIO || errno == EINVAL) return -1;
+         perror("sendmmsg");
+         return 0;
+      }
+      done += ret;
+   }
+   return 0;
+}
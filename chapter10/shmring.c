@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "shmring.h"
+
+/*
+ * shmring.h の実装。
+ */
+
+int shm_create(struct shm_peer *p){
+   p->ch = NULL;
+   p->efd_req = p->efd_resp = -1;
+   p->memfd = memfd_create("strlen-ring", MFD_CLOEXEC);
+   if(p->memfd < 0) return -1;
+   if(ftruncate(p->memfd, sizeof(struct shm_chan)) < 0) goto fail;
+
+   /*
+    * ftruncate で伸ばした部分は 0 で埋まっているので、head / tail / waiting の初期化は要らない。
+    */
+   p->ch = mmap(NULL, sizeof(struct shm_chan), PROT_READ | PROT_WRITE, MAP_SHARED, p->memfd, 0);
+   if(p->ch == MAP_FAILED){
+      p->ch = NULL;
+      goto fail;
+   }
+   p->efd_req = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   p->efd_resp = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if(p->efd_req < 0 || p->efd_resp < 0) goto fail;
+   return 0;
+
+fail:
+   shm_destroy(p);
+   return -1;
+}
+
+int shm_attach(struct shm_peer *p, const int fds[3]){
+   p->memfd = fds[0];
+   p->efd_req = fds[1];
+   p->efd_resp = fds[2];
+   p->ch = mmap(NULL, sizeof(struct shm_chan), PROT_READ | PROT_WRITE, MAP_SHARED, p->memfd, 0);
+   if(p->ch == MAP_FAILED){
+      p->ch = NULL;
+      return -1;
+   }
+   return 0;
+}
+
+void shm_destroy(struct shm_peer *p){
+   if(p->ch != NULL) munmap(p->ch, sizeof(struct shm_chan));
+   if(p->memfd >= 0) close(p->memfd);
+   if(p->efd_req >= 0) close(p->efd_req);
+   if(p->efd_resp >= 0) close(p->efd_resp);
+   p->ch = NULL;
+   p->memfd = p->efd_req = p->efd_resp = -1;
+}
+
+struct shm_slot *shm_reserve(struct shm_ring *r){
+   uint32_t head = r->head;                                      // 自分しか書かない
+   uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);  // 読み手が読み終えたスロットだけ使う
+
+   if(head - tail >= SHM_SLOTS) return NULL;
+   return &r->slot[head % SHM_SLOTS];
+}
+
+void shm_publish(struct shm_ring *r, uint32_t len){
+   r->slot[r->head % SHM_SLOTS].len = len;
+   __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);     // 中身を書いてから head を進める
+}
+
+void shm_kick(struct shm_ring *r, int efd){
+   uint64_t one = 1;
+
+   /*
+    * head の書き込みと waiting の読み込みの順序を入れ替えさせない（shm_sleep() と対になる）。
+    */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if(__atomic_load_n(&r->waiting, __ATOMIC_RELAXED)){
+      if(write(efd, &one, sizeof(one)) < 0){
+         // 溢れる（2^64 - 1 回）ことは無いので無視してよい
+      }
+   }
+}
+
+const struct shm_slot *shm_front(struct shm_ring *r){
+   uint32_t tail = r->tail;                                      // 自分しか書かない
+
+   if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) return NULL;
+   return &r->slot[tail % SHM_SLOTS];
+}
+
+void shm_pop(struct shm_ring *r){
+   __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);     // 読み終えてからスロットを返す
+}
+
+int shm_sleep(struct shm_ring *r){
+   __atomic_store_n(&r->waiting, 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail;
+}
+
+void shm_awake(struct shm_ring *r, int efd){
+   uint64_t v;
+
+   __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+   if(efd >= 0 && read(efd, &v, sizeof(v)) < 0){
+      // 鳴っていなければ EAGAIN（ノンブロッキング）
+   }
+}
@@ -0,0 +1,131 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+
+/*
+ * shmring: 同じホストのクライアントとサーバが、共有メモリのリングで要求と応答をやり取りする
+ *
+ * 同じホストにいても、ソケットで送れば要求1つごとに
+ *   send → カーネルのソケット層（TCP ならループバックの TCP/IP 処理も）→ recv
+ * を通る。ここでは memfd（名前の無い共有メモリのファイル）に2本のリングを置き、
+ *
+ *   要求のリング（req） : クライアントが書き、サーバが読む
+ *   応答のリング（resp）: サーバが書き、クライアントが読む
+ *
+ * 要求と応答はメモリに書くだけで渡す。どちらのリングも書き手と読み手が1つずつ（SPSC）なので、
+ * ロックは要らず、head（書き手だけが進める）と tail（読み手だけが進める）を
+ * acquire / release で読み書きするだけでよい。
+ *
+ * --------------------------------------------------------------------
+ * 【doorbell（eventfd）と、それを鳴らさずに済ませる工夫】
+ *
+ * 読み手が寝ている（select / poll で待っている）ときは、書き手が eventfd に書いて起こす（doorbell）。
+ * ただし毎回鳴らすと要求ごとに write / read のシステムコールが増えるので、
+ * 読み手は寝る前にリングの waiting を 1 にし、書き手は waiting が 1 のときだけ鳴らす:
+ *
+ *   読み手: waiting = 1 → リングをもう一度見る → 空なら寝る（eventfd を待つ）
+ *   書き手: head を進める → waiting を見る → 1 なら eventfd に書く
+ *
+ * 両側の「書いてから相手の値を読む」の間に完全なフェンス（seq_cst）を入れているので、
+ * 「読み手は空だと思って寝たのに、書き手は waiting = 0 を見て鳴らさなかった」は起きない。
+ * 読み手が起きていて（処理中や、少しスピンしている間に）次の要求が来れば、システムコールは0回で済む。
+ *
+ * --------------------------------------------------------------------
+ * 【つなぎ方（アップグレード）】
+ *
+ * FD は SCM_RIGHTS でしか渡せないので、共有メモリへの切り替えは Unix ドメインソケットの接続でだけできる。
+ *   1) クライアントが既存の接続で SHM_UPGRADE を要求として送る
+ *   2) サーバは memfd と eventfd 2つを作り、応答 int 0 と一緒に SCM_RIGHTS で渡す
+ *      （TCP の接続なら -3 を返す。リモートのクライアントはそのまま TCP を使い続ける）
+ *   3) 以降の要求と応答はリングを通る。ソケットは開いたままにして、相手の終了を知るのに使う
+ *      （どちらかが閉じれば、もう一方は recv / poll で分かる）
+ *
+ * 使い方（サーバ側）:
+ *   struct shm_peer p;
+ *   shm_create(&p);                                 // memfd + eventfd を作って mmap
+ *   send_fds(fd, &zero, sizeof(int), (int[]){ p.memfd, p.efd_req, p.efd_resp }, 3);
+ *   要求: while((s = shm_front(&p.ch->req)) != NULL){ ...; shm_pop(&p.ch->req); }
+ *   応答: slot = shm_reserve(&p.ch->resp); 書く; shm_publish(&p.ch->resp, len); shm_kick(&p.ch->resp, p.efd_resp);
+ *
+ * 使い方（クライアント側）:
+ *   shm_attach(&p, fds);                            // 受け取った FD を mmap
+ *
+ * 【コンパイル】
+ *   gcc prog.c shmring.c -o prog
+ */
+
+#define SHM_UPGRADE "\x7fSHM-UPGRADE"      // アップグレードの要求（普通の要求と区別するため表示できない文字で始める）
+#define SHM_SLOTS 64                        // リングのスロット数（2のべき乗）
+#define SHM_SLOT_SIZE 256                   // スロット1つの大きさ（len を含む）
+#define SHM_DATA_MAX (SHM_SLOT_SIZE - (int)sizeof(uint32_t))
+
+struct shm_slot {
+   uint32_t len;
+   char data[SHM_DATA_MAX];
+};
+
+/*
+ * head と tail（と waiting）は書く側が違うので、別のキャッシュラインに置く
+ * （同じ行だと、書くたびに相手の CPU のキャッシュからその行が追い出される）。
+ */
+struct shm_ring {
+   uint32_t head __attribute__((aligned(64)));    // 次に書くスロット（書き手だけが進める）
+   uint32_t tail __attribute__((aligned(64)));    // 次に読むスロット（読み手だけが進める）
+   uint32_t waiting;                               // 読み手が doorbell を待って寝ていれば 1
+   struct shm_slot slot[SHM_SLOTS] __attribute__((aligned(64)));
+};
+
+struct shm_chan {
+   struct shm_ring req;
+   struct shm_ring resp;
+};
+
+struct shm_peer {
+   struct shm_chan *ch;
+   int memfd;
+   int efd_req;                             // 要求の doorbell（サーバが待つ）
+   int efd_resp;                            // 応答の doorbell（クライアントが待つ）
+};
+
+/*
+ * サーバ側: memfd と eventfd を作り、リングを初期化する。失敗で -1。
+ */
+int shm_create(struct shm_peer *p);
+
+/*
+ * クライアント側: 受け取った FD（memfd, efd_req, efd_resp の順）を使う。失敗で -1。
+ */
+int shm_attach(struct shm_peer *p, const int fds[3]);
+
+/*
+ * munmap して FD を閉じる。
+ */
+void shm_destroy(struct shm_peer *p);
+
+/*
+ * 書き手: 次に書くスロット（満杯なら NULL）。書いたら shm_publish() で見えるようにする。
+ */
+struct shm_slot *shm_reserve(struct shm_ring *r);
+void shm_publish(struct shm_ring *r, uint32_t len);
+
+/*
+ * 書き手: 読み手が寝ていれば eventfd で起こす。
+ */
+void shm_kick(struct shm_ring *r, int efd);
+
+/*
+ * 読み手: 先頭のスロット（空なら NULL）。読み終えたら shm_pop() で返す。
+ */
+const struct shm_slot *shm_front(struct shm_ring *r);
+void shm_pop(struct shm_ring *r);
+
+/*
+ * 読み手: これから寝る（waiting = 1）。寝る前にもう一度リングを見て、空でなければ 1 を返す（寝ないこと）。
+ * 起きたら shm_awake() で waiting を戻す。efd が -1 でなければ、eventfd に溜まった通知も読み捨てる
+ * （鳴っていないと分かっているときは -1 にして、read を省く）。
+ */
+int shm_sleep(struct shm_ring *r);
+void shm_awake(struct shm_ring *r, int efd);
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include "slab.h"
+
+/*
+ * slab.h の実装。
+ *
+ * slab のメモリ配置:
+ *
+ *   [ヘッダ 64 バイト][obj 0][obj 1] ... [obj per_slab-1]
+ *
+ * ヘッダの先頭の語に「次の slab」へのポインタを入れて、破棄用のリストにする。
+ * ヘッダを 64 バイトにしているのは、obj 0 もキャッシュライン境界から始めるため。
+ */
+
+void slab_init(struct slab_pool *p, size_t size, int per_slab){
+   if(size < sizeof(void *)) size = sizeof(void *);
+   p->size = (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+   p->per_slab = per_slab > 0 ? per_slab : 1;
+   p->free = NULL;
+   p->slabs = NULL;
+   p->inuse = 0;
+   p->total = 0;
+}
+
+/*
+ * slab を1つ確保して、中のオブジェクトをすべてフリーリストにつなぐ。
+ */
+static int slab_grow(struct slab_pool *p){
+   char *s, *obj;
+   int i;
+
+   s = aligned_alloc(SLAB_ALIGN, SLAB_ALIGN + p->size * p->per_slab);
+   if(s == NULL) return -1;
+
+   *(void **)s = p->slabs;
+   p->slabs = s;
+
+   /*
+    * 後ろから順につなぐと、フリーリストがアドレス順になる（先頭から使われる）。
+    */
+   for(i = p->per_slab - 1; i >= 0; i--){
+      obj = s + SLAB_ALIGN + p->size * i;
+      *(void **)obj = p->free;
+      p->free = obj;
+   }
+   p->total += p->per_slab;
+   return 0;
+}
+
+void *slab_alloc(struct slab_pool *p){
+   void *obj;
+
+   if(p->free == NULL && slab_grow(p) < 0) return NULL;
+
+   obj = p->free;
+   p->free = *(void **)obj;
+   p->inuse++;
+   return obj;
+}
+
+void slab_free(struct slab_pool *p, void *obj){
+   *(void **)obj = p->free;
+   p->free = obj;
+   p->inuse--;
+}
+
+void slab_destroy(struct slab_pool *p){
+   void *s, *next;
+
+   for(s = p->slabs; s != NULL; s = next){
+      next = *(void **)s;
+      free(s);
+   }
+   p->free = NULL;
+   p->slabs = NULL;
+   p->inuse = 0;
+   p->total = 0;
+}
@@ -0,0 +1,63 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/*
+ * slab: 同じ大きさのオブジェクト用のプールアロケータ
+ *
+ * 接続オブジェクトや受信バッファのように「同じ大きさのものを頻繁に確保/解放する」場合、
+ * malloc/free を毎回呼ぶ代わりに、
+ *
+ *   1) まとめて大きな塊（slab）を確保し、オブジェクトの大きさに切り分けておく
+ *   2) 解放されたオブジェクトはフリーリストにつなぎ、次の確保でそのまま再利用する
+ *
+ * とすると、確保も解放もポインタの付け替えだけで済む（O(1)、システムコールなし）。
+ *
+ * オブジェクトの大きさはキャッシュライン（64 バイト）の倍数に切り上げ、
+ * slab の先頭も 64 バイト境界に揃える。
+ * 2つのオブジェクトが1本のキャッシュラインを共有しないので、
+ * 隣の接続の更新で自分のキャッシュラインが追い出されることが無い。
+ *
+ * slab はプールを破棄するまで OS には返さない（最大同時使用数ぶんは手元に残る）。
+ *
+ * 使い方:
+ *   struct slab_pool pool;
+ *   slab_init(&pool, sizeof(struct conn), 64);   // 64 個ずつ slab を確保する
+ *   struct conn *c = slab_alloc(&pool);
+ *   slab_free(&pool, c);
+ *   slab_destroy(&pool);
+ */
+
+#define SLAB_ALIGN 64
+
+struct slab_pool {
+   size_t size;              // 1オブジェクトの大きさ（SLAB_ALIGN の倍数に切り上げ済み）
+   int per_slab;             // 1つの slab に入るオブジェクト数
+   void *free;               // フリーリスト（空きオブジェクトの先頭の語に次へのポインタを入れる）
+   void *slabs;              // 確保した slab のリスト（破棄用）
+   long inuse;               // 使用中のオブジェクト数
+   long total;               // 確保済みのオブジェクト数
+};
+
+/*
+ * size バイトのオブジェクト用プールを初期化する。slab は per_slab 個ずつ確保する。
+ */
+void slab_init(struct slab_pool *p, size_t size, int per_slab);
+
+/*
+ * オブジェクトを1つ確保する（中身は不定）。メモリが無ければ NULL。
+ */
+void *slab_alloc(struct slab_pool *p);
+
+/*
+ * slab_alloc() で確保したオブジェクトを返す。
+ */
+void slab_free(struct slab_pool *p, void *obj);
+
+/*
+ * すべての slab を解放する。使用中のオブジェクトも無効になる。
+ */
+void slab_destroy(struct slab_pool *p);
+
+#endif
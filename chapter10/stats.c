@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "stats.h"
+
+/*
+ * stats.h の実装。
+ */
+
+static struct stats *all;            // 登録されたもの（先頭に追加するだけで、外さない）
+static uint64_t t_start;             // 最初に登録した時刻（稼働時間の表示用）
+
+uint64_t stats_now_ns(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct stats *stats_register(void){
+   struct stats *st;
+   uint64_t zero = 0;
+
+   st = calloc(1, sizeof(*st));
+   if(st == NULL) return NULL;
+   __atomic_compare_exchange_n(&t_start, &zero, stats_now_ns(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+   /*
+    * 複数のスレッドが同時に登録しても壊れないよう、一覧の先頭へは CAS で追加する。
+    */
+   st->next = __atomic_load_n(&all, __ATOMIC_RELAXED);
+   while(!__atomic_compare_exchange_n(&all, &st->next, st, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+   }
+   return st;
+}
+
+struct stats_handler *stats_handler(struct stats *st, const char *name){
+   int i;
+
+   for(i = 0; i < st->nh; i++){
+      if(strcmp(st->h[i].name, name) == 0) return &st->h[i];
+   }
+   if(st->nh == STATS_HANDLERS) return NULL;
+   st->h[i].name = name;
+   __atomic_store_n(&st->nh, i + 1, __ATOMIC_RELEASE);   // name を書いてから見えるようにする
+   return &st->h[i];
+}
+
+void hist_add(struct hist *h, uint64_t ns){
+   uint64_t us = ns / 1000;
+   int k = 0;
+
+   /*
+    * バケットの番号 = 2 を底とするマイクロ秒の対数（切り捨て）。
+    */
+   if(us > 1) k = 63 - __builtin_clzll(us);
+   if(k >= STATS_BUCKETS) k = STATS_BUCKETS - 1;
+   STAT_INC(h->b[k]);
+   STAT_INC(h->count);
+   STAT_ADD(h->sum_ns, ns);
+   if(ns > h->max_ns) __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * 読み手の側: 書き手が更新中の値を relaxed で読んで足す。
+ */
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+static void hist_sum(struct hist *dst, struct hist *src){
+   int k;
+   uint64_t max = LOAD(src->max_ns);
+
+   dst->count += LOAD(src->count);
+   dst->sum_ns += LOAD(src->sum_ns);
+   if(max > dst->max_ns) dst->max_ns = max;
+   for(k = 0; k < STATS_BUCKETS; k++) dst->b[k] += LOAD(src->b[k]);
+}
+
+/*
+ * q（0〜1）のパーセンタイル（マイクロ秒）。その値を含むバケットの上端で近似し、最大値を超えないようにする。
+ */
+static double hist_pct(const struct hist *h, double q){
+   uint64_t need, seen = 0;
+   double top;
+   int k;
+
+   if(h->count == 0) return 0;
+   need = (uint64_t)(q * h->count);
+   if(need < 1) need = 1;
+   for(k = 0; k < STATS_BUCKETS - 1; k++){
+      seen += h->b[k];
+      if(seen >= need) break;
+   }
+   top = (double)(2ULL << k);
+   if(top > h->max_ns / 1000.0) top = h->max_ns / 1000.0;
+   return top;
+}
+
+/*
+ * buf に追記する（あふれたら打ち切る）。
+ */
+struct out {
+   char *buf;
+   size_t cap;
+   size_t len;
+};
+
+static void put(struct out *o, const char *fmt, ...){
+   va_list ap;
+   int n;
+
+   if(o->len + 1 >= o->cap) return;
+   va_start(ap, fmt);
+   n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, ap);
+   va_end(ap);
+   if(n < 0) return;
+   o->len += n;
+   if(o->len >= o->cap) o->len = o->cap - 1;
+}
+
+static void put_hist(struct out *o, const char *prefix, const struct hist *h, int json){
+   static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+   static const char *qn[] = { "p50", "p90", "p99", "p999" };
+   double mean = h->count ? h->sum_ns / 1000.0 / h->count : 0;
+   int i, last;
+
+   if(json){
+      put(o, "\"%s\":{\"count\":%llu,\"mean\":%.1f", prefix, (unsigned long long)h->count, mean);
+      for(i = 0; i < 4; i++) put(o, ",\"%s\":%.1f", qn[i], hist_pct(h, qs[i]));
+      put(o, ",\"max\":%.1f,\"buckets\":[", h->max_ns / 1000.0);
+      for(last = STATS_BUCKETS - 1; last > 0 && h->b[last] == 0; last--){
+      }
+      for(i = 0; i <= last; i++) put(o, "%s%llu", i ? "," : "", (unsigned long long)h->b[i]);
+      put(o, "]}");
+      return;
+   }
+   put(o, "%s.count %llu\n%s.mean %.1f\n", prefix, (unsigned long long)h->count, prefix, mean);
+   for(i = 0; i < 4; i++) put(o, "%s.%s %.1f\n", prefix, qn[i], hist_pct(h, qs[i]));
+   put(o, "%s.max %.1f\n", prefix, h->max_ns / 1000.0);
+}
+
+int stats_report(char *buf, size_t cap, int json, const struct stats_gauge *gauges, int ngauges){
+   struct stats sum, *st;
+   struct stats_handler *sh;
+   struct out o = { buf, cap, 0 };
+   char name[64];
+   const char *sep = "";
+   int i, j, nh;
+   uint64_t up;
+
+   /*
+    * すべてのループの値を足す。handler は名前でまとめる。
+    */
+   memset(&sum, 0, sizeof(sum));
+   for(st = __atomic_load_n(&all, __ATOMIC_ACQUIRE); st != NULL; st = st->next){
+      sum.accepts += LOAD(st->accepts);
+      sum.rejects += LOAD(st->rejects);
+      sum.closes += LOAD(st->closes);
+      sum.bytes_in += LOAD(st->bytes_in);
+      sum.bytes_out += LOAD(st->bytes_out);
+      sum.requests += LOAD(st->requests);
+      sum.errors += LOAD(st->errors);
+      sum.limited += LOAD(st->limited);
+      sum.shed += LOAD(st->shed);
+      sum.loops += LOAD(st->loops);
+      hist_sum(&sum.loop, &st->loop);
+
+      nh = __atomic_load_n(&st->nh, __ATOMIC_ACQUIRE);
+      for(i = 0; i < nh; i++){
+         sh = stats_handler(&sum, st->h[i].name);
+         if(sh == NULL) continue;
+         sh->requests += LOAD(st->h[i].requests);
+         sh->errors += LOAD(st->h[i].errors);
+         hist_sum(&sh->lat, &st->h[i].lat);
+      }
+   }
+   up = t_start ? (stats_now_ns() - t_start) / 1000000 : 0;
+
+#define COUNTERS(X) X(accepts) X(rejects) X(closes) X(bytes_in) X(bytes_out) \
+                    X(requests) X(errors) X(limited) X(shed) X(loops)
+
+   if(json){
+      put(&o, "{\"uptime_ms\":%llu,\"gauges\":{", (unsigned long long)up);
+      for(j = 0; j < ngauges; j++) put(&o, "%s\"%s\":%ld", j ? "," : "", gauges[j].name, gauges[j].value);
+      put(&o, "},\"counters\":{");
+#define PUT_JSON(f) put(&o, "%s\"" #f "\":%llu", sep, (unsigned long long)sum.f); sep = ",";
+      COUNTERS(PUT_JSON)
+      put(&o, "},");
+      put_hist(&o, "loop_us", &sum.loop, 1);
+      put(&o, ",\"handlers\":{");
+      for(i = 0; i < sum.nh; i++){
+         sh = &sum.h[i];
+         put(&o, "%s\"%s\":{\"requests\":%llu,\"errors\":%llu,", i ? "," : "", sh->name,
+             (unsigned long long)sh->requests, (unsigned long long)sh->errors);
+         put_hist(&o, "latency_us", &sh->lat, 1);
+         put(&o, "}");
+      }
+      put(&o, "}}\n");
+      return o.len;
+   }
+
+   put(&o, "uptime_ms %llu\n", (unsigned long long)up);
+   for(j = 0; j < ngauges; j++) put(&o, "%s %ld\n", gauges[j].name, gauges[j].value);
+#define PUT_TEXT(f) put(&o, #f " %llu\n", (unsigned long long)sum.f);
+   COUNTERS(PUT_TEXT)
+   put_hist(&o, "loop_us", &sum.loop, 0);
+   for(i = 0; i < sum.nh; i++){
+      sh = &sum.h[i];
+      put(&o, "handler.%s.requests %llu\nhandler.%s.errors %llu\n", sh->name,
+          (unsigned long long)sh->requests, sh->name, (unsigned long long)sh->errors);
+      snprintf(name, sizeof(name), "handler.%s.latency_us", sh->name);
+      put_hist(&o, name, &sh->lat, 0);
+   }
+   return o.len;
+}
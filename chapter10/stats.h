@@ -0,0 +1,102 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * stats: サーバの統計（カウンタとヒストグラム）
+ *
+ * イベントループ（スレッド）ごとに struct stats を1つ持ち、stats_register() で登録する。
+ * 書き込むのはそのループだけ、読むのは管理用の問い合わせ（stats_report()）で、
+ * 登録されたすべての struct stats を足し合わせて表示する。
+ *
+ * 書き手が1つなので、カウンタの更新にロックも不可分な加算（lock 付きの命令）も要らない。
+ * STAT_ADD は「読んで足して書く」だけで、書き込みを __atomic_store_n（relaxed）にしているのは、
+ * 別のスレッドから読んだときに値が途中で千切れない（64 ビットが一度に書かれる）ことを保証するため。
+ * 読み手は少し古い値を見るかもしれないが、統計なので構わない。
+ *
+ * 遅延は2のべき乗のバケットのヒストグラムに数える（バケット k は 2^k 〜 2^(k+1) マイクロ秒未満、
+ * バケット 0 は 2 マイクロ秒未満）。記録は O(1) で、メモリも固定。
+ * パーセンタイルはバケットの上端で近似する（最大で2倍の誤差）。
+ *
+ * 使い方:
+ *   struct stats *st = stats_register();
+ *   STAT_INC(st->accepts);
+ *   t = stats_now_ns(); ... ; hist_add(&st->loop, stats_now_ns() - t);
+ *   n = stats_report(buf, sizeof(buf), 0, gauges, ngauges);    // 1 なら JSON
+ */
+
+#define STATS_BUCKETS 32
+#define STATS_HANDLERS 16            // 1つの struct stats で数えられる handler の数
+
+#define STAT_ADD(x, v) __atomic_store_n(&(x), (x) + (v), __ATOMIC_RELAXED)
+#define STAT_INC(x) STAT_ADD(x, 1)
+
+struct hist {
+   uint64_t count;
+   uint64_t sum_ns;
+   uint64_t max_ns;
+   uint64_t b[STATS_BUCKETS];
+};
+
+struct stats_handler {
+   const char *name;
+   uint64_t requests;
+   uint64_t errors;
+   struct hist lat;                  // 要求を受け取ってから応答を送る（キューに積む）まで
+};
+
+struct stats {
+   uint64_t accepts;                 // 受け付けた接続
+   uint64_t rejects;                 // 接続数の上限で断った接続
+   uint64_t closes;                  // 閉じた接続
+   uint64_t bytes_in;                // 受信したバイト数
+   uint64_t bytes_out;               // 応答のバイト数（送信キューに積んだ分を含む）
+   uint64_t requests;                // 受け取った要求
+   uint64_t errors;                  // 処理や送信に失敗した要求
+   uint64_t limited;                 // 流量制限で断った要求
+   uint64_t shed;                    // 負荷遮断で断った要求
+   uint64_t loops;                   // イベントループの周回数
+   struct hist loop;                 // 1周の処理時間（待ちから戻ってから次に待つまで）
+   struct stats_handler h[STATS_HANDLERS];
+   int nh;
+   struct stats *next;               // 登録されたものの一覧
+};
+
+/*
+ * 現在の値を表示に添えるもの（接続数やプールの使用数など、足し合わせない値）。
+ */
+struct stats_gauge {
+   const char *name;
+   long value;
+};
+
+/*
+ * 呼んだループ（スレッド）用の struct stats を確保して登録する。メモリが無ければ NULL。
+ */
+struct stats *stats_register(void);
+
+/*
+ * name の handler の統計（無ければ作る）。作れなければ NULL。
+ * 書き手のループからだけ呼ぶこと。
+ */
+struct stats_handler *stats_handler(struct stats *st, const char *name);
+
+/*
+ * 遅延 ns をヒストグラムに加える（書き手のループからだけ呼ぶ）。
+ */
+void hist_add(struct hist *h, uint64_t ns);
+
+/*
+ * 登録されたすべての struct stats を足し合わせ、gauges と一緒に buf に書く。
+ * json が 0 ならテキスト（1行に「名前 値」）、1 なら JSON。書いた長さを返す（cap - 1 で打ち切り）。
+ */
+int stats_report(char *buf, size_t cap, int json, const struct stats_gauge *gauges, int ngauges);
+
+/*
+ * CLOCK_MONOTONIC の現在時刻（ns）。
+ */
+uint64_t stats_now_ns(void);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * trace: 要求の記録（キャプチャ）ファイルの読み書き
+ *
+ * サーバ側のタップ（server_m_sockets -w）が、クライアントの接続/要求/切断を
+ * 時刻つきで記録し、replay.c がそれを読んで同じ順番・同じ間隔で別のサーバに流し直す。
+ * 合成した負荷ではなく、実際のクライアントの要求の混ざり方で性能を比べられる。
+ *
+ * ファイルの形式（数値はすべてホストのバイト順）:
+ *
+ *   ヘッダ 16 バイト: "STRC" / 版（uint32_t、TRACE_VERSION）/ 記録を始めた時刻（uint64_t、UNIX 時刻 ns）
+ *   レコードの並び  : struct trace_rec（16 バイト）+ len バイトのペイロード
+ *
+ *   t_ns : 記録を始めてからの時刻（CLOCK_MONOTONIC、ns）
+ *   conn : 接続の通し番号（サーバが接続ごとに振る。スロット番号と違って使い回さない）
+ *   type : TR_OPEN（接続）/ TR_DATA（要求。ペイロードは受信したバイト列）/ TR_CLOSE（切断）
+ *
+ * 要求1つが recv 1回分なので、ペイロードは小さい。ヘッダを 16 バイトに抑えてある。
+ */
+
+#define TRACE_MAGIC "STRC"
+#define TRACE_VERSION 1
+
+#define TR_OPEN 1
+#define TR_DATA 2
+#define TR_CLOSE 3
+
+struct trace_rec {
+   uint64_t t_ns;
+   uint32_t conn;
+   uint16_t type;
+   uint16_t len;
+};
+
+struct trace {
+   FILE *fp;
+   uint64_t t0;                      // 記録を始めた時刻（CLOCK_MONOTONIC、ns）
+   long nrec;                        // 読み書きしたレコード数
+};
+
+/*
+ * 記録用にファイルを作る。失敗で -1。
+ */
+int trace_create(struct trace *tr, const char *path);
+
+/*
+ * 今の時刻でレコードを1つ書く（stdio でバッファリングされる）。
+ */
+void trace_write(struct trace *tr, uint32_t conn, int type, const void *data, size_t len);
+
+/*
+ * バッファを書き出す。
+ */
+void trace_flush(struct trace *tr);
+
+/*
+ * 読み込み用に開き、ヘッダを確かめる。失敗で -1。
+ */
+int trace_open(struct trace *tr, const char *path);
+
+/*
+ * レコードを1つ読む。ペイロードは data（cap バイト以上）に入れる。
+ * 読めたら 1、ファイルの終わりなら 0、壊れていれば -1。
+ */
+int trace_read(struct trace *tr, struct trace_rec *r, char *data, size_t cap);
+
+void trace_close(struct trace *tr);
+
+/*
+ * CLOCK_MONOTONIC の現在時刻（ns）。
+ */
+uint64_t trace_now_ns(void);
+
+#endif
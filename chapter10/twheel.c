@@ -0,0 +1,180 @@
+#include <stddef.h>
+#include <time.h>
+#include "twheel.h"
+
+/*
+ * twheel.h の実装。
+ *
+ * 各スロットは、pprev を使った双方向リスト（Linux の hlist と同じ形）。
+ * pprev は「自分を指しているポインタ」のアドレスなので、
+ * 先頭の要素でも途中の要素でも同じ手順で O(1) で外せる。
+ */
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_SPAN(l) ((uint64_t)1 << (TW_BITS * (l)))     // 段 l の1スロットが表す tick 数
+
+static void link_slot(struct twtimer **head, struct twtimer *t){
+   t->next = *head;
+   if(t->next != NULL) t->next->pprev = &t->next;
+   t->pprev = head;
+   *head = t;
+}
+
+static void unlink_timer(struct twtimer *t){
+   *t->pprev = t->next;
+   if(t->next != NULL) t->next->pprev = t->pprev;
+   t->next = NULL;
+   t->pprev = NULL;
+}
+
+/*
+ * t->expires に合った段とスロットに入れる。t->expires >= w->now であること。
+ *
+ *   あと diff tick なら、diff < 64^(l+1) となる最小の段 l に入れる。
+ *   スロット番号は expires の (6*l) ビット目からの6ビット。
+ */
+static void place(struct twheel *w, struct twtimer *t){
+   uint64_t diff = t->expires - w->now;
+   int l;
+
+   for(l = 0; l < TW_LEVELS - 1; l++){
+      if(diff < TW_SPAN(l + 1)) break;
+   }
+   if(diff >= TW_SPAN(TW_LEVELS)){
+      /*
+       * ホイールで表せるより先: 表せる最も遠い時刻に丸める。
+       */
+      t->expires = w->now + TW_SPAN(TW_LEVELS) - 1;
+   }
+   link_slot(&w->slots[l][(t->expires >> (TW_BITS * l)) & TW_MASK], t);
+}
+
+/*
+ * 段 l のスロット idx の中身を取り出して、入れ直す。
+ */
+static void cascade(struct twheel *w, int l, int idx){
+   struct twtimer *t, *list = w->slots[l][idx];
+
+   w->slots[l][idx] = NULL;
+   while(list != NULL){
+      t = list;
+      list = t->next;
+      t->next = NULL;
+      place(w, t);
+   }
+}
+
+void twheel_init(struct twheel *w, long tick_ms, uint64_t now_ms){
+   int l, i;
+
+   w->now = 0;
+   w->base_ms = now_ms;
+   w->tick_ms = tick_ms > 0 ? tick_ms : 1;
+   w->count = 0;
+   for(l = 0; l < TW_LEVELS; l++){
+      for(i = 0; i < TW_SLOTS; i++) w->slots[l][i] = NULL;
+   }
+}
+
+void twtimer_init(struct twtimer *t, void (*cb)(struct twtimer *t, void *arg), void *arg){
+   t->next = NULL;
+   t->pprev = NULL;
+   t->expires = 0;
+   t->cb = cb;
+   t->arg = arg;
+}
+
+void twheel_add(struct twheel *w, struct twtimer *t, long delay_ms){
+   uint64_t ticks = 0;
+
+   if(delay_ms > 0) ticks = ((uint64_t)delay_ms + w->tick_ms - 1) / w->tick_ms;
+
+   twheel_cancel(w, t);
+   /*
+    * w->now は「処理し終えた tick」で、実際の時刻はその tick の途中にいる。
+    * 早く発火しないよう、1 tick 足しておく（遅れは最大 1 tick）。
+    */
+   t->expires = w->now + ticks + 1;
+   place(w, t);
+   w->count++;
+}
+
+void twheel_cancel(struct twheel *w, struct twtimer *t){
+   if(t->pprev == NULL) return;
+   unlink_timer(t);
+   w->count--;
+}
+
+int twheel_advance(struct twheel *w, uint64_t now_ms){
+   uint64_t target;
+   struct twtimer *t, *pending;
+   int l, idx, fired = 0;
+
+   if(now_ms < w->base_ms) return 0;
+   target = (now_ms - w->base_ms) / w->tick_ms;
+
+   while(w->now < target){
+      if(w->count == 0){
+         /*
+          * タイマーが無ければ、空の tick を1つずつ回す必要は無い。
+          */
+         w->now = target;
+         break;
+      }
+
+      w->now++;
+
+      /*
+       * 下の段が1周したところで、1つ上の段の次のスロットを下ろしてくる。
+       */
+      for(l = 1; l < TW_LEVELS; l++){
+         if((w->now & (TW_SPAN(l) - 1)) != 0) break;
+         cascade(w, l, (int)((w->now >> (TW_BITS * l)) & TW_MASK));
+      }
+
+      /*
+       * 段0 の今の tick のスロットを丸ごと取り出して実行する。
+       * 取り出したリストの先頭を局所変数 pending に付け替えておくと、
+       * コールバックが同じリストの別のタイマーを取り消しても正しく外れる。
+       */
+      idx = (int)(w->now & TW_MASK);
+      pending = w->slots[0][idx];
+      w->slots[0][idx] = NULL;
+      if(pending != NULL) pending->pprev = &pending;
+
+      while(pending != NULL){
+         t = pending;
+         unlink_timer(t);
+         w->count--;
+         fired++;
+         t->cb(t, t->arg);          // この中で t を登録し直してもよい
+      }
+   }
+   return fired;
+}
+
+long twheel_timeout(struct twheel *w, uint64_t now_ms){
+   uint64_t t, at;
+
+   if(w->count == 0) return -1;
+
+   /*
+    * 段0 を先へ見ていき、最初に空でないスロットか、
+    * カスケードが起きる tick（段0 が1周するところ）まで。
+    * 高々 64 スロットしか見ない。
+    */
+   for(t = w->now + 1; ; t++){
+      if(w->slots[0][t & TW_MASK] != NULL) break;
+      if((t & TW_MASK) == 0) break;
+   }
+
+   at = w->base_ms + t * w->tick_ms;
+   return at > now_ms ? (long)(at - now_ms) : 0;
+}
+
+uint64_t twheel_now_ms(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
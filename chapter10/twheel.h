@@ -0,0 +1,124 @@
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#include <stdint.h>
+
+/*
+ * twheel: 階層型タイマーホイール（hierarchical timing wheel）
+ *
+ * 接続ごとのアイドルタイムアウトや要求の締め切りのように、
+ * 「大量にあって、ほとんどは発火する前に取り消される / 延長される」タイマーを扱う。
+ *
+ * 素朴な方法:
+ *   - 全接続の締め切りを毎回なめる            → 1回の確認が O(接続数)
+ *   - 締め切り順のヒープ（優先度キュー）に入れる → 追加/取り消しが O(log n)
+ *
+ * タイマーホイールは、時刻を tick（例: 100ms）単位に区切り、
+ * 「何 tick 後に発火するか」で決まるスロット（双方向リスト）にタイマーを入れる。
+ * 追加も取り消しも、リストへの挿入/削除だけなので O(1)。
+ *
+ * --------------------------------------------------------------------
+ * 【階層】
+ *
+ * 1段だけだと、遠い未来のタイマーのために巨大な配列が要る。
+ * そこで時計の針のように 64 スロットの輪を4段重ねる。
+ *
+ *   段0: 1 tick  刻み × 64 （〜64 tick 先）
+ *   段1: 64 tick 刻み × 64 （〜4096 tick 先）
+ *   段2: 4096 tick 刻み × 64
+ *   段3: 262144 tick 刻み × 64 （tick = 100ms なら約 19 日先まで。それより先は最後に丸める）
+ *
+ * 段0 が1周するたびに、段1 の次のスロットの中身を取り出して入れ直す（カスケード）。
+ * 入れ直すときには締め切りが近づいているので、下の段に落ちていく。
+ * 1 tick ごとの処理は「段0 のスロット1つ」と、ときどきのカスケードだけで、
+ * タイマーの総数には依存しない。
+ *
+ * --------------------------------------------------------------------
+ * 【使い方】
+ *
+ *   struct twheel w;
+ *   struct twtimer t;
+ *
+ *   twheel_init(&w, 100, twheel_now_ms());       // tick = 100ms
+ *   twtimer_init(&t, on_timeout, conn);
+ *   twheel_add(&w, &t, 30000);                    // 30 秒後に on_timeout(&t, conn)
+ *
+ *   イベントループでは
+ *     timeout = twheel_timeout(&w, twheel_now_ms());   // 次に見に来るべき時刻まで（ミリ秒）
+ *     poll / select / epoll_wait(..., timeout);
+ *     twheel_advance(&w, twheel_now_ms());             // 期限の来たタイマーを実行
+ *
+ * struct twtimer は呼び出し側の構造体（接続など）に埋め込んで使う。
+ * コールバックの中で、そのタイマー自身や他のタイマーを追加/取り消ししてもよい。
+ *
+ * 【コンパイル】
+ *   gcc prog.c twheel.c -o prog
+ */
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)        // 1段あたりのスロット数
+#define TW_LEVELS 4                    // 段数
+
+struct twtimer {
+   struct twtimer *next;
+   struct twtimer **pprev;             // 前の要素の next（またはスロットの先頭）を指す。NULL なら未登録
+   uint64_t expires;                   // 発火する tick
+   void (*cb)(struct twtimer *t, void *arg);
+   void *arg;
+};
+
+struct twheel {
+   uint64_t now;                       // 処理し終えた tick
+   uint64_t base_ms;                   // tick 0 の時刻
+   long tick_ms;
+   long count;                         // 登録されているタイマーの数
+   struct twtimer *slots[TW_LEVELS][TW_SLOTS];
+};
+
+/*
+ * tick_ms ミリ秒刻みのホイールを初期化する。now_ms は現在時刻（twheel_now_ms()）。
+ */
+void twheel_init(struct twheel *w, long tick_ms, uint64_t now_ms);
+
+/*
+ * タイマーを初期化する（未登録の状態になる）。
+ */
+void twtimer_init(struct twtimer *t, void (*cb)(struct twtimer *t, void *arg), void *arg);
+
+/*
+ * delay_ms ミリ秒後に発火するよう登録する。
+ * 既に登録されていれば取り消してから登録し直す（締め切りの延長に使う）。
+ * 実際に発火するのは、tick の刻みに切り上げた時刻。
+ */
+void twheel_add(struct twheel *w, struct twtimer *t, long delay_ms);
+
+/*
+ * 登録を取り消す。登録されていなければ何もしない。
+ */
+void twheel_cancel(struct twheel *w, struct twtimer *t);
+
+/*
+ * 登録されていれば 1。
+ */
+static inline int twtimer_pending(const struct twtimer *t){
+   return t->pprev != NULL;
+}
+
+/*
+ * 時刻 now_ms までに期限の来たタイマーをすべて実行する。実行した数を返す。
+ */
+int twheel_advance(struct twheel *w, uint64_t now_ms);
+
+/*
+ * 次に twheel_advance() を呼ぶべき時刻までのミリ秒数。
+ * タイマーが1つも無ければ -1（いつまで待ってもよい）。
+ * poll / epoll_wait のタイムアウトにそのまま渡せる。
+ */
+long twheel_timeout(struct twheel *w, uint64_t now_ms);
+
+/*
+ * CLOCK_MONOTONIC の現在時刻（ミリ秒）。
+ */
+uint64_t twheel_now_ms(void);
+
+#endif
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define COUNT 1000000
+#define CACHE_LINE 64
+
+/*
+ * このプログラムは、thread_counter.c / thread_counter_mutex.c と同じ
+ * 「複数スレッドで1つのカウンタを COUNT 回ずつ増やす」仕事を、
+ * いくつかの同期方式で実行し、スループット（ops/sec）を比べるベンチマークである。
+ *
+ * thread_counter.c      : 同期なし → 速いが値が欠ける（data race）
+ * thread_counter_mutex.c: 毎回 mutex → 正しいが非常に遅い
+ *
+ * では「正しくて速い」カウンタはどう作ればよいか、を数字で確認するのが目的。
+ *
+ * --------------------------------------------------------------------
+ * 【比較する方式】
+ *
+ *   mutex   : 毎回 pthread_mutex_lock/unlock して c++（thread_counter_mutex.c と同じ）
+ *   spin    : 毎回 pthread_spin_lock/unlock して c++
+ *             眠らずに回って待つので、臨界区間が短ければ mutex より軽いことが多い
+ *   atomic  : 共有カウンタに atomic_fetch_add（lock 付き命令1つ）
+ *             ロックは不要だが、全スレッドが同じキャッシュラインを奪い合う
+ *   packed  : スレッドごとのカウンタ（シャード）を配列に詰めて並べる
+ *             別々の変数なのに同じキャッシュラインに乗るため、
+ *             「偽共有（false sharing）」で遅くなる様子を見るための比較用
+ *   shard   : シャードを 1 キャッシュライン（64バイト）ずつ離して配置し、
+ *             自分のシャードに relaxed の fetch_add。最後に全シャードを合計する
+ *   relaxed : シャードは shard と同じだが、書き込むのは所有スレッドだけなので
+ *             fetch_add（RMW）すら使わず relaxed の load + store で増やす。
+ *             途中で他スレッドが合計を読んでも壊れた値にはならない
+ *             （統計カウンタの典型的な作り方）
+ *
+ * どの方式でも最終的な合計は スレッド数 × COUNT になることを検証する。
+ *
+ * --------------------------------------------------------------------
+ * 【キャッシュラインと偽共有】
+ *
+ *   CPU はメモリを 64 バイト単位（キャッシュライン）でやり取りする。
+ *   あるコアが書き込むと、そのラインは他コアのキャッシュから追い出される。
+ *
+ *   packed:  [c0 c1 c2 c3 c4 ...]  ← 1本のラインを全スレッドで取り合う
+ *   shard:   [c0 ......][c1 ......][c2 ......]  ← ラインが分かれて取り合わない
+ *
+ * --------------------------------------------------------------------
+ * 使い方:
+ *   $ ./counter_bench [-t max_threads] [-c count] [方式 ...]
+ *     -t : 1 から max_threads までスレッド数を変えて測る（既定: CPU 数）
+ *     -c : 1スレッドあたりのインクリメント回数（既定: COUNT）
+ *     方式を省略するとすべての方式を測る
+ *
+ * 【コンパイル】
+ *   gcc -O2 counter_bench.c -o counter_bench -pthread
+ */
+
+/*
+ * キャッシュライン1本ぶんに揃えたシャード。
+ * aligned(64) によって、配列の各要素が別のキャッシュラインに置かれる。
+ */
+struct shard {
+   atomic_long v;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct bench {
+   const char *name;
+   void *(*body)(void *x);
+};
+
+struct worker {
+   int id;                   // 0 から始まるスレッド番号（シャードの添字）
+   double t0, t1;            // このスレッドが走り始めた時刻 / 終えた時刻
+};
+
+long count = COUNT;          // 1スレッドあたりの回数
+pthread_barrier_t start;     // 全スレッドを同時に走らせるためのバリア
+
+pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
+pthread_spinlock_t spin;
+long c_plain;                // mutex / spin で保護する普通のカウンタ
+atomic_long c_atomic;        // atomic 用の共有カウンタ
+atomic_long *packed;         // 詰めて並べたシャード（偽共有あり）
+struct shard *shards;        // キャッシュライン単位のシャード（偽共有なし）
+
+void *run_mutex(void *x);
+void *run_spin(void *x);
+void *run_atomic(void *x);
+void *run_packed(void *x);
+void *run_shard(void *x);
+void *run_relaxed(void *x);
+void *run_worker(void *x);
+long collect(const char *name, int th_n);
+double now_sec(void);
+
+struct bench *current;       // いま測っている方式
+
+struct bench benches[] = {
+   { "mutex",   run_mutex },
+   { "spin",    run_spin },
+   { "atomic",  run_atomic },
+   { "packed",  run_packed },
+   { "shard",   run_shard },
+   { "relaxed", run_relaxed },
+};
+#define BENCH_N ((int)(sizeof(benches) / sizeof(benches[0])))
+
+int main(int argc, char *argv[]){
+   int i, b, t, opt, th_max, selected[BENCH_N], any = 0;
+   long total;
+   double t0, t1;
+   pthread_t *th;
+   struct worker *w;
+
+   th_max = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if(th_max < 1) th_max = 1;
+
+   while((opt = getopt(argc, argv, "t:c:")) != -1){
+      if(opt == 't') th_max = atoi(optarg);
+      else if(opt == 'c') count = atol(optarg);
+      else{
+         fprintf(stderr, "Usage: $ ./counter_bench [-t max_threads] [-c count] [mutex|spin|atomic|packed|shard|relaxed ...]\n");
+         exit(1);
+      }
+   }
+   if(th_max < 1 || count < 1){
+      fprintf(stderr, "invalid -t or -c\n");
+      exit(1);
+   }
+
+   /*
+    * 引数で方式が指定されていればそれだけ、無ければ全部を測る。
+    */
+   for(b = 0; b < BENCH_N; b++){
+      selected[b] = (optind == argc);
+   }
+   for(i = optind; i < argc; i++){
+      for(b = 0; b < BENCH_N; b++){
+         if(strcmp(argv[i], benches[b].name) == 0){
+            selected[b] = 1;
+            any = 1;
+         }
+      }
+      if(!any){
+         fprintf(stderr, "unknown strategy: %s\n", argv[i]);
+         exit(1);
+      }
+      any = 0;
+   }
+
+   th = malloc(sizeof(pthread_t) * th_max);
+   w = malloc(sizeof(struct worker) * th_max);
+   packed = calloc(th_max, sizeof(atomic_long));
+   shards = aligned_alloc(CACHE_LINE, sizeof(struct shard) * th_max);
+   if(th == NULL || w == NULL || packed == NULL || shards == NULL){
+      perror("malloc");
+      exit(1);
+   }
+   pthread_spin_init(&spin, PTHREAD_PROCESS_PRIVATE);
+
+   printf("%-8s %7s %14s %10s\n", "strategy", "threads", "ops/sec", "ns/op");
+
+   for(b = 0; b < BENCH_N; b++){
+      if(!selected[b]) continue;
+
+      current = &benches[b];
+      for(t = 1; t <= th_max; t++){
+         /*
+          * 毎回カウンタを 0 に戻してから測る。
+          */
+         c_plain = 0;
+         atomic_store(&c_atomic, 0);
+         for(i = 0; i < th_max; i++){
+            atomic_store(&packed[i], 0);
+            atomic_store(&shards[i].v, 0);
+         }
+
+         /*
+          * スレッド生成のコストを計測に含めないよう、
+          * t 本全員がバリアにそろってから一斉に走らせる。
+          *
+          * 時刻は main ではなく各スレッド自身が取り、
+          * 「最も早い開始」から「最も遅い終了」までを経過時間とする。
+          * （CPU が少ないと main はスレッドが終わるまで動けないことがあるため）
+          */
+         pthread_barrier_init(&start, NULL, t);
+         for(i = 0; i < t; i++){
+            w[i].id = i;
+            pthread_create(&th[i], NULL, run_worker, &w[i]);
+         }
+         for(i = 0; i < t; i++){
+            pthread_join(th[i], NULL);
+         }
+         pthread_barrier_destroy(&start);
+
+         t0 = w[0].t0;
+         t1 = w[0].t1;
+         for(i = 1; i < t; i++){
+            if(w[i].t0 < t0) t0 = w[i].t0;
+            if(w[i].t1 > t1) t1 = w[i].t1;
+         }
+
+         /*
+          * 最後に合計して、値が欠けていないことを確認する。
+          */
+         total = collect(benches[b].name, t);
+         if(total != (long)t * count){
+            fprintf(stderr, "%s: wrong total %ld (expected %ld)\n",
+                    benches[b].name, total, (long)t * count);
+            exit(1);
+         }
+
+         printf("%-8s %7d %14.0f %10.2f\n", benches[b].name, t,
+                total / (t1 - t0), (t1 - t0) * 1e9 / total);
+      }
+   }
+
+   pthread_spin_destroy(&spin);
+   free(shards);
+   free(packed);
+   free(w);
+   free(th);
+   return 0;
+}
+
+/*
+ * 各スレッドの入口: バリアで待ち合わせてから方式ごとの本体を実行し、
+ * 前後の時刻を記録する。
+ */
+void *run_worker(void *x){
+   struct worker *w = x;
+
+   pthread_barrier_wait(&start);
+   w->t0 = now_sec();
+   current->body(x);
+   w->t1 = now_sec();
+   return NULL;
+}
+
+void *run_mutex(void *x){
+   long i;
+
+   for(i = 0; i < count; i++){
+      pthread_mutex_lock(&mut);
+      c_plain++;
+      pthread_mutex_unlock(&mut);
+   }
+   return NULL;
+}
+
+void *run_spin(void *x){
+   long i;
+
+   for(i = 0; i < count; i++){
+      pthread_spin_lock(&spin);
+      c_plain++;
+      pthread_spin_unlock(&spin);
+   }
+   return NULL;
+}
+
+void *run_atomic(void *x){
+   long i;
+
+   for(i = 0; i < count; i++){
+      /*
+       * 既定のメモリオーダー（seq_cst）の fetch_add。
+       * x86 では lock xadd 1命令になる。
+       */
+      atomic_fetch_add(&c_atomic, 1);
+   }
+   return NULL;
+}
+
+void *run_packed(void *x){
+   long i;
+   atomic_long *c = &packed[((struct worker *)x)->id];
+
+   for(i = 0; i < count; i++){
+      atomic_fetch_add_explicit(c, 1, memory_order_relaxed);
+   }
+   return NULL;
+}
+
+void *run_shard(void *x){
+   long i;
+   atomic_long *c = &shards[((struct worker *)x)->id].v;
+
+   for(i = 0; i < count; i++){
+      atomic_fetch_add_explicit(c, 1, memory_order_relaxed);
+   }
+   return NULL;
+}
+
+void *run_relaxed(void *x){
+   long i;
+   atomic_long *c = &shards[((struct worker *)x)->id].v;
+
+   for(i = 0; i < count; i++){
+      /*
+       * 書き込むのは自分だけなので、読んで +1 して書き戻すだけで良い。
+       * relaxed の load/store は普通の mov 命令になり、lock も付かない。
+       * それでも atomic なので、他スレッドが読んでも「途中の値」は見えない。
+       */
+      atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + 1,
+                            memory_order_relaxed);
+   }
+   return NULL;
+}
+
+/*
+ * 方式ごとの最終的な合計値を求める（シャード方式はここで合算する）。
+ */
+long collect(const char *name, int th_n){
+   int i;
+   long sum = 0;
+
+   if(strcmp(name, "mutex") == 0 || strcmp(name, "spin") == 0){
+      return c_plain;
+   }
+   if(strcmp(name, "atomic") == 0){
+      return atomic_load(&c_atomic);
+   }
+   for(i = 0; i < th_n; i++){
+      if(strcmp(name, "packed") == 0) sum += atomic_load(&packed[i]);
+      else sum += atomic_load(&shards[i].v);
+   }
+   return sum;
+}
+
+double now_sec(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
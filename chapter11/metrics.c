@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "metrics.h"
+
+/*
+ * metrics.h の実装（初期化と eventfd まわり）。
+ * 頻繁に呼ばれる add / publish / read はヘッダ側の inline 関数になっている。
+ */
+
+int mcounter_init(struct mcounter *c, int n){
+   int i;
+
+   c->s = aligned_alloc(METRICS_CACHE_LINE, sizeof(struct mshard) * n);
+   if(c->s == NULL) return -1;
+   for(i = 0; i < n; i++){
+      atomic_init(&c->s[i].v, 0);
+   }
+   c->n = n;
+   return 0;
+}
+
+void mcounter_destroy(struct mcounter *c){
+   free(c->s);
+   c->s = NULL;
+   c->n = 0;
+}
+
+void mseq_init(struct mseq *q, int n){
+   int i;
+
+   if(n > MSEQ_MAX) n = MSEQ_MAX;
+   atomic_init(&q->seq, 0);
+   q->n = n;
+   for(i = 0; i < MSEQ_MAX; i++){
+      atomic_init(&q->v[i], 0);
+   }
+}
+
+int mdone_init(struct mdone *d){
+   /*
+    * eventfd:
+    *   カーネル内の 64bit カウンタを FD として扱う仕組み。
+    *   write で加算され、値が 0 でなければ「読み込み可能」になる。
+    *   完了通知だけなので、値は読み出さずに残しておく（何度待っても即座に戻る）。
+    */
+   d->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+   if(d->efd < 0) return -1;
+   atomic_init(&d->flag, 0);
+   return 0;
+}
+
+void mdone_destroy(struct mdone *d){
+   if(d->efd >= 0) close(d->efd);
+   d->efd = -1;
+}
+
+void mdone_signal(struct mdone *d){
+   uint64_t one = 1;
+
+   atomic_store_explicit(&d->flag, 1, memory_order_release);
+   if(write(d->efd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+      perror("eventfd write");
+   }
+}
+
+int mdone_wait(struct mdone *d, int timeout_ms){
+   int ret;
+   struct pollfd pfd;
+
+   if(mdone_test(d)) return 1;
+
+   pfd.fd = d->efd;
+   pfd.events = POLLIN;
+   do{
+      ret = poll(&pfd, 1, timeout_ms);
+   }while(ret < 0 && errno == EINTR);
+
+   return ret > 0 ? 1 : mdone_test(d);
+}
@@ -0,0 +1,149 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+
+/*
+ * metrics: スレッド間で進捗や統計値を安全に受け渡すための小さな部品集
+ *
+ * thread_input.c では count を、thread_sleep.c では flag を
+ * 同期なしの普通の変数で共有していた（data race）。
+ * かといって毎回 mutex を取ると、計算スレッドが遅くなる（counter_bench.c 参照）。
+ *
+ * ここでは用途ごとに3つの仕組みを用意する。
+ *
+ *   mcounter : スレッドごとのカウンタ（シャード）。
+ *              書くのは持ち主のスレッドだけなので relaxed の load + store で足せる。
+ *              読む側は全シャードを合計する。ロックも lock 命令も使わない。
+ *
+ *   mseq     : seqlock で公開するスナップショット（複数の値の組）。
+ *              書き手は「奇数にする → 値を書く → 偶数にする」。
+ *              読み手は前後で番号が同じ偶数なら成功、違えば読み直す。
+ *              書き手は決して待たされないので、計算スレッドが遅くならない。
+ *              読み手は「done は新しいのに total は古い」ような食い違いを見ない。
+ *
+ *   mdone    : 完了通知。eventfd を使うので poll()/select() で他の FD と一緒に待てる。
+ *              sleep(1) で旗を見に行くのと違い、完了した瞬間に起きられる。
+ *
+ * 【コンパイル】
+ *   gcc prog.c metrics.c -o prog -pthread
+ */
+
+#define METRICS_CACHE_LINE 64
+#define MSEQ_MAX 8           // mseq で公開できる値の数
+
+struct mshard {
+   atomic_long v;
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+
+struct mcounter {
+   int n;                    // シャード数（= 書き込むスレッドの数）
+   struct mshard *s;
+};
+
+struct mseq {
+   atomic_uint seq;          // 奇数: 書き込み中
+   int n;                    // 公開している値の数
+   atomic_long v[MSEQ_MAX];
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+
+struct mdone {
+   int efd;                  // eventfd
+   atomic_int flag;          // 1: 完了済み（FD を使わず確かめたいとき用）
+};
+
+/*
+ * mcounter: n 個のシャードを用意する。成功 0、失敗 -1。
+ */
+int mcounter_init(struct mcounter *c, int n);
+void mcounter_destroy(struct mcounter *c);
+
+/*
+ * シャード slot に v を足す。slot を書くスレッドは1本だけであること。
+ */
+static inline void mcounter_add(struct mcounter *c, int slot, long v){
+   atomic_long *p = &c->s[slot].v;
+
+   atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) + v,
+                         memory_order_relaxed);
+}
+
+/*
+ * 全シャードの合計。どのスレッドからいつ呼んでもよい。
+ */
+static inline long mcounter_read(struct mcounter *c){
+   int i;
+   long sum = 0;
+
+   for(i = 0; i < c->n; i++){
+      sum += atomic_load_explicit(&c->s[i].v, memory_order_relaxed);
+   }
+   return sum;
+}
+
+/*
+ * mseq: n 個（MSEQ_MAX 以下）の値を公開する器を初期化する。
+ */
+void mseq_init(struct mseq *q, int n);
+
+/*
+ * 書き手（1本だけ）: v[0..n-1] をまとめて公開する。
+ */
+static inline void mseq_publish(struct mseq *q, const long *v){
+   int i;
+   unsigned int s = atomic_load_explicit(&q->seq, memory_order_relaxed);
+
+   atomic_store_explicit(&q->seq, s + 1, memory_order_relaxed);   // 奇数: 書き込み中
+   atomic_thread_fence(memory_order_release);
+   for(i = 0; i < q->n; i++){
+      atomic_store_explicit(&q->v[i], v[i], memory_order_relaxed);
+   }
+   atomic_store_explicit(&q->seq, s + 2, memory_order_release);   // 偶数: 書き終わり
+}
+
+/*
+ * 読み手（何本でも）: 一貫した組を v[0..n-1] に読み出す。
+ */
+static inline void mseq_read(struct mseq *q, long *v){
+   int i;
+   unsigned int s0, s1;
+
+   do{
+      s0 = atomic_load_explicit(&q->seq, memory_order_acquire);
+      for(i = 0; i < q->n; i++){
+         v[i] = atomic_load_explicit(&q->v[i], memory_order_relaxed);
+      }
+      atomic_thread_fence(memory_order_acquire);
+      s1 = atomic_load_explicit(&q->seq, memory_order_relaxed);
+   }while((s0 & 1) || s0 != s1);
+}
+
+/*
+ * mdone: 完了通知を作る。成功 0、失敗 -1。
+ */
+int mdone_init(struct mdone *d);
+void mdone_destroy(struct mdone *d);
+
+/*
+ * 完了を知らせる（何回呼んでもよい）。
+ */
+void mdone_signal(struct mdone *d);
+
+/*
+ * 完了を最大 timeout_ms ミリ秒待つ（-1 なら無期限）。
+ * 完了していれば 1、タイムアウトなら 0 を返す。
+ */
+int mdone_wait(struct mdone *d, int timeout_ms);
+
+/*
+ * poll()/select() に登録するための FD（完了すると読み込み可能になる）。
+ */
+static inline int mdone_fd(struct mdone *d){
+   return d->efd;
+}
+
+static inline int mdone_test(struct mdone *d){
+   return atomic_load_explicit(&d->flag, memory_order_acquire);
+}
+
+#endif
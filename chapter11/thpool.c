@@ -0,0 +1,570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "thpool.h"
+
+/*
+ * thpool.h の実装。
+ *
+ * Chase-Lev deque は
+ *   N. M. Lê, A. Pop, A. Cohen, F. Zappa Nardelli,
+ *   "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013)
+ * の C11 atomics 版をそのまま写したものである。
+ */
+
+#define CACHE_LINE 64
+#define DEQUE_INIT 256       // deque の初期容量（2のべき乗）
+#define SPIN_N 64            // 眠る前に仕事を探し直す回数
+#define SPLIT_MAX 64         // parallel_for の分割の深さの上限
+
+/*
+ * タスク。future はタスクそのものを指す。
+ */
+struct thfuture {
+   void *(*fn)(void *);
+   void *arg;
+   void *result;
+   int detached;             // 1: thpool_spawn で投入（実行後にワーカーが解放する）
+   atomic_int done;          // 1: 実行が終わった
+   struct thpool *pool;      // 投入先のプール
+   struct thfuture *next;    // 投入キュー用
+};
+
+/*
+ * deque のリングバッファ。容量が足りなくなったら2倍の配列に作り直す。
+ * 古い配列はまだ steal 中のスレッドが読んでいるかもしれないので、
+ * prev につないでおき、プール破棄時にまとめて解放する。
+ */
+struct ring {
+   long size;                // 2のべき乗
+   struct ring *prev;
+   _Atomic(struct thfuture *) buf[];
+};
+
+struct deque {
+   atomic_long top;          // steal する側（他ワーカー）が進める
+   char pad[CACHE_LINE - sizeof(atomic_long)];
+   atomic_long bottom;       // 所有ワーカーだけが動かす
+   _Atomic(struct ring *) ring;
+};
+
+struct worker {
+   struct thpool *pool;
+   int id;
+   pthread_t th;
+   unsigned int seed;        // steal 先を選ぶ乱数の種
+   struct deque dq;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct thpool {
+   int n;
+   struct worker *w;
+
+   pthread_mutex_t lock;     // 投入キューと sleep/wakeup を守る
+   pthread_cond_t wake;      // 仕事が来たらワーカーを起こす
+   pthread_cond_t done;      // future を待っている外部スレッドを起こす
+   struct thfuture *head, *tail;  // 共有の投入キュー（ワーカー以外からの投入）
+   atomic_long inject_n;     // 投入キューの長さ（ロックなしで覗くため）
+   atomic_int sleepers;      // 眠っているワーカーの数
+   atomic_int waiters;       // future を待って眠っている外部スレッドの数
+   atomic_int stop;
+};
+
+/*
+ * このスレッドがプールのワーカーなら、そのワーカー（それ以外は NULL）。
+ */
+static __thread struct worker *self;
+
+/* ------------------------------------------------------------------ */
+/* Chase-Lev deque                                                    */
+/* ------------------------------------------------------------------ */
+
+static struct ring *ring_new(long size){
+   struct ring *r = malloc(sizeof(struct ring) + sizeof(r->buf[0]) * size);
+
+   if(r == NULL){
+      perror("malloc");
+      exit(1);
+   }
+   r->size = size;
+   r->prev = NULL;
+   return r;
+}
+
+static void deque_init(struct deque *d){
+   atomic_init(&d->top, 0);
+   atomic_init(&d->bottom, 0);
+   atomic_init(&d->ring, ring_new(DEQUE_INIT));
+}
+
+/*
+ * 所有ワーカーだけが呼ぶ: bottom 側に積む。
+ */
+static void deque_push(struct deque *d, struct thfuture *t){
+   long b, t0, i;
+   struct ring *r, *nr;
+
+   b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+   t0 = atomic_load_explicit(&d->top, memory_order_acquire);
+   r = atomic_load_explicit(&d->ring, memory_order_relaxed);
+
+   if(b - t0 > r->size - 1){
+      /*
+       * 満杯なので2倍に広げる。中身は top..bottom をそのまま写す。
+       */
+      nr = ring_new(r->size * 2);
+      for(i = t0; i < b; i++){
+         atomic_store_explicit(&nr->buf[i & (nr->size - 1)],
+               atomic_load_explicit(&r->buf[i & (r->size - 1)], memory_order_relaxed),
+               memory_order_relaxed);
+      }
+      nr->prev = r;
+      atomic_store_explicit(&d->ring, nr, memory_order_release);
+      r = nr;
+   }
+   atomic_store_explicit(&r->buf[b & (r->size - 1)], t, memory_order_relaxed);
+   /*
+    * release: タスクの中身を書き終えてから bottom を進める
+    * （論文では release フェンス + relaxed ストア。x86 ではどちらも普通の mov）。
+    */
+   atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+}
+
+/*
+ * 所有ワーカーだけが呼ぶ: bottom 側から取り出す（LIFO）。
+ * 最後の1個を steal と取り合った場合だけ CAS で決着をつける。
+ */
+static struct thfuture *deque_take(struct deque *d){
+   long b, t;
+   struct ring *r;
+   struct thfuture *x = NULL;
+
+   b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+   r = atomic_load_explicit(&d->ring, memory_order_relaxed);
+   atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+   atomic_thread_fence(memory_order_seq_cst);
+   t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+   if(t <= b){
+      x = atomic_load_explicit(&r->buf[b & (r->size - 1)], memory_order_relaxed);
+      if(t == b){
+         if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                  memory_order_seq_cst, memory_order_relaxed)){
+            x = NULL;        // 他のワーカーに盗られた
+         }
+         atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+      }
+   }
+   else{
+      atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+   }
+   return x;
+}
+
+/*
+ * 他のワーカーが呼ぶ: top 側から1個盗む（FIFO）。
+ * 取り合いに負けたら NULL を返す（呼び出し側は別の場所を探せばよい）。
+ */
+static struct thfuture *deque_steal(struct deque *d){
+   long t, b;
+   struct ring *r;
+   struct thfuture *x;
+
+   t = atomic_load_explicit(&d->top, memory_order_acquire);
+   atomic_thread_fence(memory_order_seq_cst);
+   b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+   if(t < b){
+      r = atomic_load_explicit(&d->ring, memory_order_acquire);
+      x = atomic_load_explicit(&r->buf[t & (r->size - 1)], memory_order_relaxed);
+      if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+               memory_order_seq_cst, memory_order_relaxed)){
+         return NULL;
+      }
+      return x;
+   }
+   return NULL;
+}
+
+static int deque_empty(struct deque *d){
+   return atomic_load(&d->bottom) <= atomic_load(&d->top);
+}
+
+/* ------------------------------------------------------------------ */
+/* スケジューリング                                                     */
+/* ------------------------------------------------------------------ */
+
+/*
+ * どこかに実行できるタスクが残っているか。
+ */
+static int has_work(struct thpool *pool){
+   int i;
+
+   if(atomic_load(&pool->inject_n) > 0) return 1;
+   for(i = 0; i < pool->n; i++){
+      if(!deque_empty(&pool->w[i].dq)) return 1;
+   }
+   return 0;
+}
+
+/*
+ * 眠っているワーカーがいれば1本起こす。
+ *
+ * 「積む → sleepers を読む」と「sleepers++ → has_work() で確認」は
+ * どちらも seq_cst なので、少なくとも片方が相手の書き込みを見る。
+ * よって起こし損ね（タスクがあるのに全員眠る）は起きない。
+ */
+static void notify(struct thpool *pool){
+   atomic_thread_fence(memory_order_seq_cst);
+   if(atomic_load(&pool->sleepers) > 0){
+      pthread_mutex_lock(&pool->lock);
+      pthread_cond_signal(&pool->wake);
+      pthread_mutex_unlock(&pool->lock);
+   }
+}
+
+static struct thfuture *inject_pop(struct thpool *pool){
+   struct thfuture *t;
+
+   if(atomic_load(&pool->inject_n) == 0) return NULL;
+
+   pthread_mutex_lock(&pool->lock);
+   t = pool->head;
+   if(t != NULL){
+      pool->head = t->next;
+      if(pool->head == NULL) pool->tail = NULL;
+      atomic_fetch_sub(&pool->inject_n, 1);
+   }
+   pthread_mutex_unlock(&pool->lock);
+   return t;
+}
+
+static void enqueue(struct thpool *pool, struct thfuture *t){
+   if(self != NULL && self->pool == pool){
+      /*
+       * ワーカー上で作られたタスクは自分の deque へ（ロック不要）。
+       */
+      deque_push(&self->dq, t);
+   }
+   else{
+      t->next = NULL;
+      pthread_mutex_lock(&pool->lock);
+      if(pool->tail != NULL) pool->tail->next = t;
+      else pool->head = t;
+      pool->tail = t;
+      atomic_fetch_add(&pool->inject_n, 1);
+      pthread_mutex_unlock(&pool->lock);
+   }
+   notify(pool);
+}
+
+/*
+ * 次に実行するタスクを探す: 自分の deque → 投入キュー → 他人の deque。
+ */
+static struct thfuture *find_task(struct worker *w){
+   int i, v;
+   struct thfuture *t;
+   struct thpool *pool = w->pool;
+
+   t = deque_take(&w->dq);
+   if(t != NULL) return t;
+
+   t = inject_pop(pool);
+   if(t != NULL) return t;
+
+   /*
+    * steal 先は乱数で選んだワーカーから順に一周する。
+    * 全員が worker0 から探すと、そこに steal が集中してしまうため。
+    */
+   v = rand_r(&w->seed) % pool->n;
+   for(i = 0; i < pool->n; i++, v = (v + 1) % pool->n){
+      if(v == w->id) continue;
+      t = deque_steal(&pool->w[v].dq);
+      if(t != NULL) return t;
+   }
+   return NULL;
+}
+
+static void run_task(struct thpool *pool, struct thfuture *t){
+   t->result = t->fn(t->arg);
+
+   if(t->detached){
+      free(t);
+      return;
+   }
+   atomic_store(&t->done, 1);
+   if(atomic_load(&pool->waiters) > 0){
+      pthread_mutex_lock(&pool->lock);
+      pthread_cond_broadcast(&pool->done);
+      pthread_mutex_unlock(&pool->lock);
+   }
+}
+
+static void *worker_main(void *x){
+   int spin = 0;
+   struct worker *w = x;
+   struct thpool *pool = w->pool;
+   struct thfuture *t;
+
+   self = w;
+   while(1){
+      t = find_task(w);
+      if(t != NULL){
+         run_task(pool, t);
+         spin = 0;
+         continue;
+      }
+
+      /*
+       * すぐに次の仕事が来ることも多いので、少しだけ探し直してから眠る。
+       */
+      if(spin++ < SPIN_N){
+         sched_yield();
+         continue;
+      }
+      spin = 0;
+
+      pthread_mutex_lock(&pool->lock);
+      atomic_fetch_add(&pool->sleepers, 1);
+      if(!has_work(pool)){
+         if(atomic_load(&pool->stop)){
+            atomic_fetch_sub(&pool->sleepers, 1);
+            pthread_mutex_unlock(&pool->lock);
+            break;
+         }
+         pthread_cond_wait(&pool->wake, &pool->lock);
+      }
+      atomic_fetch_sub(&pool->sleepers, 1);
+      pthread_mutex_unlock(&pool->lock);
+   }
+   return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* 公開 API                                                            */
+/* ------------------------------------------------------------------ */
+
+struct thpool *thpool_create(int n){
+   int i;
+   struct thpool *pool;
+
+   if(n <= 0) n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if(n <= 0) n = 1;
+
+   pool = calloc(1, sizeof(*pool));
+   if(pool == NULL) return NULL;
+   pool->w = aligned_alloc(CACHE_LINE, sizeof(struct worker) * n);
+   if(pool->w == NULL){
+      free(pool);
+      return NULL;
+   }
+   pool->n = n;
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->wake, NULL);
+   pthread_cond_init(&pool->done, NULL);
+
+   for(i = 0; i < n; i++){
+      pool->w[i].pool = pool;
+      pool->w[i].id = i;
+      pool->w[i].seed = (unsigned int)i * 2654435761u + 1;
+      deque_init(&pool->w[i].dq);
+   }
+   /*
+    * 全ワーカーの deque を用意してからスレッドを起動する
+    * （起動直後のワーカーが他人の deque を steal しに行くため）。
+    */
+   for(i = 0; i < n; i++){
+      if(pthread_create(&pool->w[i].th, NULL, worker_main, &pool->w[i]) != 0){
+         perror("pthread_create");
+         exit(1);
+      }
+   }
+   return pool;
+}
+
+void thpool_destroy(struct thpool *pool){
+   int i;
+   struct ring *r, *prev;
+
+   pthread_mutex_lock(&pool->lock);
+   atomic_store(&pool->stop, 1);
+   pthread_cond_broadcast(&pool->wake);
+   pthread_mutex_unlock(&pool->lock);
+
+   for(i = 0; i < pool->n; i++){
+      pthread_join(pool->w[i].th, NULL);
+   }
+   for(i = 0; i < pool->n; i++){
+      for(r = atomic_load(&pool->w[i].dq.ring); r != NULL; r = prev){
+         prev = r->prev;
+         free(r);
+      }
+   }
+   pthread_cond_destroy(&pool->done);
+   pthread_cond_destroy(&pool->wake);
+   pthread_mutex_destroy(&pool->lock);
+   free(pool->w);
+   free(pool);
+}
+
+int thpool_size(struct thpool *pool){
+   return pool->n;
+}
+
+int thpool_self_id(void){
+   return self != NULL ? self->id : -1;
+}
+
+static struct thfuture *task_new(struct thpool *pool, void *(*fn)(void *), void *arg,
+                                 int detached){
+   struct thfuture *t = malloc(sizeof(*t));
+
+   if(t == NULL) return NULL;
+   t->pool = pool;
+   t->fn = fn;
+   t->arg = arg;
+   t->result = NULL;
+   t->detached = detached;
+   atomic_init(&t->done, 0);
+   t->next = NULL;
+   return t;
+}
+
+struct thfuture *thpool_submit(struct thpool *pool, void *(*fn)(void *), void *arg){
+   struct thfuture *t = task_new(pool, fn, arg, 0);
+
+   if(t == NULL) return NULL;
+   enqueue(pool, t);
+   return t;
+}
+
+int thpool_spawn(struct thpool *pool, void *(*fn)(void *), void *arg){
+   struct thfuture *t = task_new(pool, fn, arg, 1);
+
+   if(t == NULL) return -1;
+   enqueue(pool, t);
+   return 0;
+}
+
+void *thfuture_get(struct thfuture *f){
+   void *result;
+   struct thfuture *t;
+   struct thpool *pool = f->pool;
+
+   if(self != NULL && self->pool == pool){
+      /*
+       * ワーカー上で待つ場合: 眠ってしまうと、待っている相手のタスクを
+       * 実行するワーカーがいなくなる（全員が待ち合ってデッドロックする）可能性がある。
+       * そこで、終わるまで他のタスクを拾って実行し続ける。
+       */
+      while(!atomic_load(&f->done)){
+         t = find_task(self);
+         if(t != NULL) run_task(pool, t);
+         else sched_yield();
+      }
+   }
+   else if(!atomic_load(&f->done)){
+      /*
+       * ワーカー以外から待つ場合: 条件変数で眠る。
+       * waiters と done の関係は notify() の sleepers と同じ考え方で、
+       * 起こし損ねが起きないようになっている。
+       */
+      pthread_mutex_lock(&pool->lock);
+      atomic_fetch_add(&pool->waiters, 1);
+      while(!atomic_load(&f->done)){
+         pthread_cond_wait(&pool->done, &pool->lock);
+      }
+      atomic_fetch_sub(&pool->waiters, 1);
+      pthread_mutex_unlock(&pool->lock);
+   }
+
+   result = f->result;
+   free(f);
+   return result;
+}
+
+/*
+ * parallel_for の1区間ぶんのタスク引数。
+ */
+struct pfor {
+   struct thpool *pool;
+   long lo, hi, grain;
+   void (*body)(long lo, long hi, void *arg);
+   void *arg;
+};
+
+/*
+ * 区間 [lo, hi) を半分ずつに割り、右半分をタスクとして自分の deque に積み、
+ * 左半分は自分で続けて割っていく（再帰的分割）。
+ *
+ *   [0 ............................ 1024)
+ *   [0 ........ 512) 自分   [512 ... 1024) → deque（暇なワーカーが盗む）
+ *   [0 . 256) 自分 [256 . 512) → deque
+ *   ...
+ *
+ * 盗まれるのは top 側 = 早く積んだ大きな区間なので、
+ * 一度の steal でまとまった量の仕事が移り、steal の回数が少なくて済む。
+ * 誰にも盗まれなかった区間は、最後に自分で take して実行することになる。
+ * 戻り値は引数の pf そのもの。区間を積んだ側が結果を受け取ったときに free する。
+ */
+static void *pfor_task(void *x){
+   int i, n = 0;
+   long mid;
+   struct pfor *pf = x, *sub;
+   struct thfuture *f[SPLIT_MAX];
+
+   while(pf->hi - pf->lo > pf->grain && n < SPLIT_MAX){
+      mid = pf->lo + (pf->hi - pf->lo) / 2;
+      sub = malloc(sizeof(*sub));
+      if(sub == NULL) break;
+      *sub = *pf;
+      sub->lo = mid;
+      f[n] = thpool_submit(pf->pool, pfor_task, sub);
+      if(f[n] == NULL){
+         free(sub);
+         break;
+      }
+      n++;
+      pf->hi = mid;
+   }
+
+   pf->body(pf->lo, pf->hi, pf->arg);
+
+   /*
+    * 積んだ順と逆に待つ（LIFO なので、盗まれていなければ自分ですぐ実行できる）。
+    */
+   for(i = n - 1; i >= 0; i--){
+      free(thfuture_get(f[i]));
+   }
+   return pf;                  // 引数は呼び出し側（待った側）が free する
+}
+
+void thpool_parallel_for(struct thpool *pool, long begin, long end, long grain,
+                         void (*body)(long lo, long hi, void *arg), void *arg){
+   struct pfor *pf;
+
+   if(begin >= end) return;
+   if(grain < 1) grain = 1;
+
+   pf = malloc(sizeof(*pf));
+   if(pf == NULL){
+      body(begin, end, arg);   // 分割できなければ呼び出し元でまとめて実行する
+      return;
+   }
+   pf->pool = pool;
+   pf->lo = begin;
+   pf->hi = end;
+   pf->grain = grain;
+   pf->body = body;
+   pf->arg = arg;
+
+   if(self != NULL && self->pool == pool){
+      free(pfor_task(pf));
+   }
+   else{
+      free(thfuture_get(thpool_submit(pool, pfor_task, pf)));
+   }
+}
@@ -0,0 +1,98 @@
+#ifndef THPOOL_H
+#define THPOOL_H
+
+/*
+ * thpool: ワークスティーリング方式のスレッドプール
+ *
+ * chapter11 の各プログラムは、仕事ごとに pthread_create でスレッドを作っていた。
+ * スレッドの生成/破棄はカーネルを呼ぶ重い処理（数十マイクロ秒）なので、
+ * 細かい仕事を大量にこなすには向かない。
+ *
+ * スレッドプールは、あらかじめ作っておいたワーカースレッドに
+ * 「タスク（関数 + 引数）」を渡して実行させる仕組みである。
+ * タスクの投入はキューへの push だけなので、ナノ秒単位で済む。
+ *
+ * --------------------------------------------------------------------
+ * 【構造】
+ *
+ *   ワーカーごとに Chase-Lev 両端キュー（deque）を1本持つ。
+ *
+ *     worker0: [t t t t]  ← 自分は bottom 側で push/pop（LIFO、ロックなし）
+ *     worker1: [t t]
+ *     worker2: []         ← 暇なワーカーは他人の top 側から盗む（steal）
+ *
+ *   - ワーカーが実行中のタスクから投入したタスクは、自分の deque に積まれる
+ *   - ワーカー以外（main など）から投入したタスクは、共有の投入キューに入る
+ *   - 自分の deque が空になったワーカーは、投入キュー → 他ワーカーの deque の順に探す
+ *   - それでも無ければ条件変数で眠り、新しいタスクが来たら起こされる
+ *
+ * --------------------------------------------------------------------
+ * 【使い方】
+ *
+ *   struct thpool *pool = thpool_create(4);
+ *
+ *   struct thfuture *f = thpool_submit(pool, func, arg);  // func(arg) を非同期に実行
+ *   void *ret = thfuture_get(f);                           // 終了を待って戻り値を受け取る
+ *
+ *   thpool_parallel_for(pool, 0, N, 1024, body, arg);     // body(lo, hi, arg) を並列に
+ *
+ *   thpool_destroy(pool);
+ *
+ * 【コンパイル】
+ *   gcc prog.c thpool.c -o prog -pthread
+ */
+
+struct thpool;
+struct thfuture;
+
+/*
+ * ワーカーを n 本持つプールを作る。n <= 0 なら CPU 数。
+ * 失敗したら NULL を返す。
+ */
+struct thpool *thpool_create(int n);
+
+/*
+ * 残っているタスクをすべて実行し終えてから、ワーカーを止めてプールを破棄する。
+ */
+void thpool_destroy(struct thpool *pool);
+
+/*
+ * プールのワーカー数を返す。
+ */
+int thpool_size(struct thpool *pool);
+
+/*
+ * 呼び出したスレッドがワーカーなら、その番号（0 .. thpool_size()-1）を返す。
+ * ワーカー以外（main など）なら -1。
+ * スレッドごとのカウンタ（metrics.h の mcounter など）の添字に使う。
+ */
+int thpool_self_id(void);
+
+/*
+ * fn(arg) をタスクとして投入し、結果を受け取るための future を返す。
+ * 返された future は必ず1回だけ thfuture_get() すること（そこで解放される）。
+ */
+struct thfuture *thpool_submit(struct thpool *pool, void *(*fn)(void *), void *arg);
+
+/*
+ * fn(arg) をタスクとして投入する（戻り値は捨てる、待つこともできない）。
+ * 成功で 0、失敗で -1。
+ */
+int thpool_spawn(struct thpool *pool, void *(*fn)(void *), void *arg);
+
+/*
+ * タスクの終了を待って fn の戻り値を返し、future を解放する。
+ * ワーカー自身が呼んだ場合は、眠らずに他のタスクを実行しながら待つ
+ * （待っている間にワーカーが止まってデッドロックするのを防ぐ）。
+ */
+void *thfuture_get(struct thfuture *f);
+
+/*
+ * [begin, end) を grain 個以下の区間に分割し、
+ * 各区間 [lo, hi) について body(lo, hi, arg) をプール上で並列に実行する。
+ * すべての区間が終わるまで戻らない。
+ */
+void thpool_parallel_for(struct thpool *pool, long begin, long end, long grain,
+                         void (*body)(long lo, long hi, void *arg), void *arg);
+
+#endif
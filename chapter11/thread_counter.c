@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <pthread.h>
+#include "thpool.h"
 
 #define COUNT 1000000
 #define TH_N 5
@@ -53,6 +54,16 @@
  * - atomic（stdatomic.h）を使って原子的にインクリメントする
  *
  * このコードは “わざと同期しない” ことで問題を見せる教材になっている。
+ *
+ * --------------------------------------------------------------------
+ * 【スレッドプール版】
+ *
+ * スレッドを pthread_create で直接作る代わりに、thpool（thpool.h）に
+ * TH_N 本のワーカーを用意し、counter をタスクとして TH_N 個投入している。
+ * ワーカーは別々のスレッドなので、競合の起き方は元の版と同じである。
+ *
+ * 【コンパイル】
+ *   gcc thread_counter.c thpool.c -o thread_counter -pthread
  */
 
 void *counter(void *x);
@@ -60,28 +71,36 @@ void *counter(void *x);
 int main(){
    int i = 0;
    int c = 0;                // 複数スレッドで共有して更新するカウンタ
-   pthread_t th[TH_N];       // スレッドID配列（TH_N本分）
+   struct thpool *pool;      // ワーカー TH_N 本のスレッドプール
+   struct thfuture *f[TH_N]; // 投入したタスクの完了を待つための future
+
+   pool = thpool_create(TH_N);
+   if(pool == NULL){
+      perror("thpool_create");
+      return 1;
+   }
 
    /*
-    * TH_N 個のスレッドを作成する。
-    * 第4引数に &c を渡すことで、全スレッドが同じカウンタを更新する。
+    * TH_N 個のタスクを投入する。
+    * 引数に &c を渡すことで、全タスクが同じカウンタを更新する。
     *
-    * pthread_create(&th[i], attr, start_routine, arg)
-    *   - th[i] にスレッドIDが返る
-    *   - start_routine は counter
+    * thpool_submit(pool, func, arg)
+    *   - func は counter（pthread_create に渡していた関数と同じ形）
     *   - arg は &c（void*として渡される）
+    *   - 戻り値の future で、あとから完了を待てる
     */
    for(i = 0; i < TH_N; i++){
-      pthread_create(&th[i], NULL, counter, &c);
+      f[i] = thpool_submit(pool, counter, &c);
    }
 
    /*
-    * 作成したスレッドが終了するまで待つ（join）。
-    * join しないと main が先に終わってプロセス終了し、スレッドも巻き添えで終わる。
+    * 投入したタスクが終了するまで待つ（pthread_join の代わり）。
+    * 待たずに main が終わるとプロセス終了し、タスクも巻き添えで終わる。
     */
    for(i = 0; i < TH_N; i++){
-      pthread_join(th[i], NULL);
+      thfuture_get(f[i]);
    }
+   thpool_destroy(pool);
 
    /*
     * 最終的な c を表示する。
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <pthread.h>
+#include "thpool.h"
 
 #define COUNT 1000000
 #define TH_N 5
@@ -52,6 +53,12 @@
  * 学習的には:
  * - 「正しさを得ると遅くなる」ことを体験する良い例
  * - 次の改善として “ローカルに数えて最後に足す” などの設計が考えられる
+ *   （各方式の速さは counter_bench.c で比較できる）
+ *
+ * スレッドは thread_counter.c と同じく thpool（thpool.h）のワーカーを使う。
+ *
+ * 【コンパイル】
+ *   gcc thread_counter_mutex.c thpool.c -o thread_counter_mutex -pthread
  */
 
 pthread_mutex_t mut; // 全スレッドで共有するミューテックス（臨界区間の門番）
@@ -61,7 +68,8 @@ void *counter(void *x);
 int main(){
    int i = 0;
    int c = 0;                 // 共有カウンタ（全スレッドで同じ &c を参照）
-   pthread_t th[TH_N];
+   struct thpool *pool;
+   struct thfuture *f[TH_N];
 
    /*
     * pthread_mutex_init(&mut, attr):
@@ -72,21 +80,28 @@ int main(){
     */
    pthread_mutex_init(&mut, NULL);
 
+   pool = thpool_create(TH_N);
+   if(pool == NULL){
+      perror("thpool_create");
+      return 1;
+   }
+
    /*
-    * TH_N 個のスレッドを生成する。
-    * 引数として &c を渡すので、全スレッドが同じ共有変数を更新する。
+    * TH_N 個のタスクをプールに投入する。
+    * 引数として &c を渡すので、全タスクが同じ共有変数を更新する。
     */
    for(i = 0; i < TH_N; i++){
-      pthread_create(&th[i], NULL, counter, &c);
+      f[i] = thpool_submit(pool, counter, &c);
    }
 
    /*
-    * 全スレッドが終了するまで待つ（合流）。
-    * join 後には c の更新がすべて終わっていることが保証される。
+    * 全タスクが終了するまで待つ（合流）。
+    * thfuture_get から戻った後は c の更新がすべて終わっていることが保証される。
     */
    for(i = 0; i < TH_N; i++){
-      pthread_join(th[i], NULL);
+      thfuture_get(f[i]);
    }
+   thpool_destroy(pool);
 
    /*
     * 結果表示:
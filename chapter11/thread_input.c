@@ -1,10 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include "thpool.h"
+#include "metrics.h"
+#include "vfill.h"
 
 #define DATA_N 100000
 #define LOOP_N DATA_N/10
+#define CHUNK 8192       // 並列化と進捗通知の単位（要素数。64KB = L2 に収まる大きさ）
 
 /*
  * このプログラムは pthread を用いて、
@@ -40,6 +47,7 @@
  *    本来は
  *      ((double *)x)[j] = 0.0;
  *    のように double* として扱うべき。
+ *    （現在の版では vfill.h のカーネルに double* のまま渡している）
  *
  * 2) count は共有変数だが同期していない:
  *    input が count++ を行い、query が count を読む。
@@ -51,52 +59,113 @@
  *    ただし th1 が終わると main は return するため、プロセスが終了し、
  *    query スレッドもまとめて終了する（強制終了）形になる。
  *    「最後まで query を生かす」なら th2 も join するか、終了条件を作る必要がある。
+ *
+ * --------------------------------------------------------------------
+ * 【スレッドプール版】
+ *
+ * input と query は thpool（thpool.h）のワーカー2本の上でタスクとして動く。
+ *
+ * --------------------------------------------------------------------
+ * 【進捗の受け渡し（metrics.h）】
+ *
+ * 上の 2) の data race をなくすため、進捗は metrics.h の部品で受け渡す。
+ *
+ *   count    : mcounter（シャードごとに書き手は1スレッド）。relaxed の load + store なので
+ *              mutex も lock 命令も使わず、計算スレッドをほとんど遅くしない。
+ *              1要素ごとではなく、区間（CHUNK 要素）ごとにまとめて足す。
+ *   snapshot : mseq（seqlock）。{終えた行数, 要素数, 経過ミリ秒} の組を1行ごとに公開する。
+ *              query はいつ読んでも食い違いのない組を受け取る。
+ *   done     : mdone（eventfd）。input が終わったら通知する。
+ *
+ * query は getchar() でブロックする代わりに、poll() で
+ *   標準入力 と done の eventfd
+ * を同時に待つ。これにより input が終わった瞬間に query も終了でき、
+ * main は query を置き去りにせず thpool_destroy() でプールを片付けられる
+ * （上の 3) の問題も解消する）。
+ *
+ * --------------------------------------------------------------------
+ * 【一括初期化カーネル（vfill.h）】
+ *
+ * 内側のループ（1要素ずつ 0.0 を書く）は vfill_parallel() に置き換えた。
+ *   - AVX-512 / AVX2 / SSE2 のうち CPU が対応する最も広い SIMD 命令で書く
+ *   - 配列が大きければ非テンポラルストアでキャッシュを汚さずに書く
+ *   - 行を CHUNK 要素ずつの区間に分け、プールのワーカーで並列に書く
+ *   - 進捗は1区間書き終わるごとに、そのワーカー専用のシャードへ足す
+ *
+ * 区間は別々のワーカーで書かれるので、count のシャードはワーカー数ぶん用意する
+ * （添字は thpool_self_id()、ワーカー以外から呼ばれた場合は最後のシャード）。
+ * query が getchar ならぬ poll() でワーカーを1本占有するので、
+ * プールは CPU 数 + 1 本で作る。
+ *
+ * 【コンパイル】
+ *   gcc -O2 thread_input.c thpool.c metrics.c vfill.c -o thread_input -pthread
  */
 
-long count;              // 進捗（作業量）を表す共有カウンタ
+struct mcounter count;   // 進捗（作業量）を表すカウンタ（シャードはワーカーごと）
+struct thpool *pool;     // input / query と、初期化カーネルの区間を動かすワーカー
+struct mseq snapshot;    // {行数, 要素数, 経過ミリ秒} のスナップショット
+struct mdone done;       // input の完了通知
 void *input(void *x);    // 重い処理（計算/初期化）担当
 void *query(void *x);    // 途中経過を表示する UI 担当
+void progress(long n, void *arg);  // 区間を書き終えるたびに呼ばれる
 
 int main(int argc, char *argv[]){
   int i, j;              // 未使用（名残変数）
   double data[DATA_N];   // input スレッドが触る大きな配列（スタック上に確保）
-  pthread_t th1, th2;    // スレッドID
+  struct thfuture *f;    // input タスクの完了待ち用
 
   /*
-   * count はグローバル（共有）で、input が増やし、query が読む。
+   * count / snapshot / done はグローバル（共有）で、input が書き、query が読む。
    */
-  count = 0;
+  pool = thpool_create((int)sysconf(_SC_NPROCESSORS_ONLN) + 1);
+  if(pool == NULL){
+    perror("thpool_create");
+    return 1;
+  }
+
+  if(mcounter_init(&count, thpool_size(pool) + 1) < 0 || mdone_init(&done) < 0){
+    perror("metrics");
+    return 1;
+  }
+  mseq_init(&snapshot, 3);
 
   /*
-   * input スレッド起動:
-   *   第4引数に data を渡すことで、input 側が data を操作できる。
+   * input タスク投入:
+   *   引数に data を渡すことで、input 側が data を操作できる。
    */
-  pthread_create(&th1, NULL, input, data);
+  f = thpool_submit(pool, input, data);
 
   /*
-   * query スレッド起動:
-   *   引数は使わないので NULL を渡す。
-   *   getchar() でブロッキングしながら、Enter のたびに count を表示する。
+   * query タスク投入:
+   *   引数は使わないので NULL を渡す。結果も待たないので spawn で投げっぱなしにする。
+   *   標準入力と完了通知を poll() で待ちながら、Enter のたびに進捗を表示する。
    */
-  pthread_create(&th2, NULL, query, NULL);
+  thpool_spawn(pool, query, NULL);
 
   /*
-   * pthread_join(th1):
-   *   input スレッド（重い処理）が終わるまで main を待機させる。
-   *   th1 が終わると main は return するため、プロセスが終了し th2 も終了する。
+   * thfuture_get(f):
+   *   input タスク（重い処理）が終わるまで main を待機させる。
+   *   input は最後に done を通知するので、query もすぐに終わる。
+   *   thpool_destroy() は残ったタスク（query）が終わるのを待ってからプールを片付ける。
    */
-  pthread_join(th1, NULL);
+  thfuture_get(f);
+  thpool_destroy(pool);
 
+  mdone_destroy(&done);
+  mcounter_destroy(&count);
   return 0;
 }
 
 void *input(void *x){
-  int i, j;
+  int i;
+  long snap[3];
+  struct timespec t0, t1;
 
   /*
    * “重い処理” の開始表示。
    */
   fprintf(stderr, "Calculating...");
+  clock_gettime(CLOCK_MONOTONIC, &t0);
 
   /*
    * 二重ループ:
@@ -111,53 +180,104 @@ void *input(void *x){
    * DATA_N=100000なら、かなり大きい回数になる（教材として“重い”）。
    */
   for(i = 0; i < LOOP_N; i++){
-     for(j = 0; j < DATA_N; j++){
-        /*
-         * 本来の意図:
-         *   data[j] を 0.0 に初期化する（または計算結果を書き込む）
-         *
-         * ただし現状コードは int* にキャストしているので不整合。
-         * 正しくは:
-         *   ((double *)x)[j] = 0.0;
-         *
-         * 現状:
-         *   ((int *)x)[j] = 0.0;
-         * は double 配列を int 配列として書き換えるため、メモリ破壊になり得る。
-         */
-        ((int *)x)[j] = 0.0;
+     /*
+      * data[0..DATA_N-1] を 0.0 で埋める。
+      *
+      * 元の版は1要素ずつ ((int *)x)[j] = 0.0; と count++ をしていた
+      * （型の不整合と、1要素ごとの共有変数の更新）。
+      * ここでは double* のまま一括初期化カーネルに渡し、
+      * CHUNK 要素ずつワーカーで並列に SIMD 命令で書かせる。
+      * 進捗は区間ごとに progress() で count に足される。
+      *
+      * vfill_parallel() は全区間が終わるまで戻らない。
+      * 待っている間、このワーカーも区間の書き込みを手伝う。
+      */
+     vfill_parallel(pool, (double *)x, DATA_N, 0.0, CHUNK, progress, NULL);
 
-        /*
-         * 進捗カウンタを1増やす。
-         * query スレッドがこれを読むことで進捗表示ができる。
-         *
-         * 注意:
-         *   同期なしなので厳密には data race の可能性がある。
-         */
-        count++;
-     }
+     /*
+      * {行数, 要素数, 経過ミリ秒} を seqlock で公開する。
+      * 書き手は待たされない（読み手がいてもいなくても一定のコスト）。
+      */
+     clock_gettime(CLOCK_MONOTONIC, &t1);
+     snap[0] = i + 1;
+     snap[1] = mcounter_read(&count);
+     snap[2] = (t1.tv_sec - t0.tv_sec) * 1000L + (t1.tv_nsec - t0.tv_nsec) / 1000000L;
+     mseq_publish(&snapshot, snap);
   }
 
   fprintf(stderr, "\ndone.\n");
+
+  /*
+   * 完了を通知する。query は poll() でこれを待っているので即座に終了する。
+   */
+  mdone_signal(&done);
   return NULL;
 }
 
+/*
+ * 区間を1つ書き終えるたびに、その区間を書いたワーカーから呼ばれる。
+ * 各ワーカーは自分のシャードにだけ書くので、mcounter_add の条件
+ * （1シャードの書き手は1スレッド）を満たす。
+ */
+void progress(long n, void *arg){
+  int id = thpool_self_id();
+
+  mcounter_add(&count, id >= 0 ? id : thpool_size(pool), n);
+}
+
 void *query(void *x){
+  char buf[256];
+  long snap[3];
+  ssize_t n, i;
+  struct pollfd pfd[2];
+
   /*
-   * このスレッドは無限ループで待ち続ける。
-   * getchar() は入力が来るまでブロックするので、
+   * このタスクは「標準入力」と「input の完了通知」の2つを poll() で待つ。
+   * どちらも来なければブロックしたままなので、
    * CPU を無駄に回すビジーループにはならない。
    *
-   * Enter が押されるたびに現在の count を表示する。
+   * Enter が押されるたびに現在の進捗を表示し、
+   * 完了通知が来たら（Enter を待たずに）すぐ終了する。
    */
+  pfd[0].fd = 0;                // 標準入力
+  pfd[0].events = POLLIN;
+  pfd[1].fd = mdone_fd(&done);  // 完了通知（eventfd）
+  pfd[1].events = POLLIN;
+
   while(1){
-     getchar(); // 何かキー入力（主に Enter）を待つ
+     if(poll(pfd, 2, -1) < 0){
+        if(errno == EINTR) continue;      // シグナルで起こされただけなら待ち直す
+        perror("poll");
+        break;
+     }
 
-     /*
-      * 現在の count を表示。
-      * 改行が無いので、表示が続けて上書きされるように見える場合がある。
-      * 見やすくするなら "\n" を付けるのも手。
-      */
-     fprintf(stderr, "count=%ld", count);
+     if(pfd[1].revents & POLLIN) break;   // input が終わった
+
+     if(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)){
+        /*
+         * fgets() だと、まとめて届いた複数の行が stdio のバッファに入ってしまい、
+         * poll() からは残りの行が見えなくなる（答えないまま待ち続ける）。
+         * read() で届いた分を全部受け取り、その中の改行の数だけ答える。
+         */
+        n = read(0, buf, sizeof(buf));
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+           pfd[0].fd = -1;                // EOF / エラー: 以降は完了通知だけ待つ
+           continue;
+        }
+
+        for(i = 0; i < n; i++){
+           if(buf[i] != '\n') continue;
+
+           /*
+            * seqlock から一貫した組を読む。
+            * 行数と要素数が必ず「要素数 = 行数 × DATA_N」の関係になっている。
+            */
+           mseq_read(&snapshot, snap);
+           fprintf(stderr, "count=%ld (%ld/%d rows, %ldms)\n",
+                   snap[1], snap[0], LOOP_N, snap[2]);
+        }
+     }
   }
 
   return NULL;
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#include "thpool.h"
+#include "metrics.h"
 
 /*
  * このプログラムは pthread を使って、
@@ -10,15 +12,17 @@
  * 高レベルの流れ:
  *
  *   mainスレッド:
- *     1) flag=0 を用意
- *     2) processing スレッドを作成し、flag のアドレスを渡す
- *     3) flag が 1 になるまで、1秒おきに "." を表示し続ける
- *     4) flag==1 になったらループを抜け、pthread_join でスレッド終了を待つ
+ *     1) 完了通知 done を用意
+ *     2) processing タスクを投入し、done のアドレスを渡す
+ *     3) done が通知されるまで、1秒おきに "." を表示し続ける
+ *     4) 通知されたらループを抜け、thfuture_get でタスク終了を待つ
  *
  *   processingスレッド:
  *     1) sleep(20) で “重い処理” を模擬
- *     2) flag（x が指す int）に 1 を書き込む（完了通知）
- *     3) "done." を出力して終了
+ *     2) "done." を出力する
+ *     3) done（x が指す mdone）に完了を通知して終了
+ *
+ * （元の版は int flag を共有して完了を知らせていた。下の重要ポイントはその版の解説）
  *
  * --------------------------------------------------------------------
  * 重要ポイント（スレッドと共有変数）:
@@ -38,40 +42,65 @@
  * - pthread_join(th,NULL) は
  *   「作成したスレッドが終わるまで待つ（合流する）」操作であり、
  *   join しないとスレッド資源の回収（スレッドの終了処理）ができずリークになる。
+ *
+ * --------------------------------------------------------------------
+ * 【スレッドプール版】
+ *
+ * processing は pthread_create で作ったスレッドではなく、
+ * thpool（thpool.h）のワーカー上のタスクとして実行する。
+ * pthread_join の代わりに thfuture_get でタスクの完了を待つ。
+ *
+ * --------------------------------------------------------------------
+ * 【完了通知（metrics.h の mdone）】
+ *
+ * int flag を同期なしで共有する代わりに、mdone（eventfd）で完了を知らせる。
+ * main は sleep(1) してから旗を見るのではなく、
+ *   mdone_wait(&done, 1000)
+ * で「最大1秒、ただし完了したら即座に」起きる。
+ * 表示の間隔は今までと同じ1秒のまま、完了の検出が最大1秒遅れる問題がなくなる。
+ *
+ * 【コンパイル】
+ *   gcc thread_sleep.c thpool.c metrics.c -o thread_sleep -pthread
  */
 
 void *processing(void *x);
 
 int main(){
-   pthread_t th;
-   int i, flag = 0;
+   struct thpool *pool;
+   struct thfuture *f;
+   struct mdone done;
+   int i;
+
+   if(mdone_init(&done) < 0){
+      perror("mdone_init");
+      return 1;
+   }
+
+   pool = thpool_create(1);
+   if(pool == NULL){
+      perror("thpool_create");
+      return 1;
+   }
 
    /*
-    * pthread_create(&th, attr, start_routine, arg):
-    *   - th: 作成したスレッドIDが入る
-    *   - attr: NULL ならデフォルト属性
-    *   - start_routine: スレッドが実行する関数（processing）
+    * thpool_submit(pool, func, arg):
+    *   - func: ワーカーが実行する関数（processing）
     *   - arg: processing に渡す引数（void*）
+    *   - 戻り値: 完了を待つための future
     *
-    * ここでは flag のアドレス (&flag) を渡して、
-    * processing 側から「完了したら flag=1」にできるようにしている。
+    * ここでは done のアドレス (&done) を渡して、
+    * processing 側から「完了したら通知」できるようにしている。
     */
-   pthread_create(&th, NULL, processing, &flag);
+   f = thpool_submit(pool, processing, &done);
 
    /*
     * ここからメインスレッドは “処理中表示” を行う。
-    * processing スレッドが 20秒後に flag を 1 にするまで回り続ける。
+    * processing が 20秒後に done を通知するまで回り続ける。
     */
    fprintf(stderr, "processing");
 
    i = 1;
    while(1){
-      /*
-       * processing スレッドが *(int*)x = 1 を実行すると、
-       * ここで flag == 1 となりループを抜ける。
-       */
-      if(flag == 1) break;
-
       /*
        * 表示の工夫:
        *   i が 4 の倍数のときだけ "\r"（キャリッジリターン）を使って
@@ -86,24 +115,26 @@ int main(){
       else fprintf(stderr, ".");
 
       /*
-       * 1秒待つことで表示が速すぎず、人間に見える速度になる。
-       * 同時に CPU を無駄に回し続ける “ビジーループ” を多少緩和している。
+       * 最大1秒待つことで表示が速すぎず、人間に見える速度になる。
+       * ただし待っている途中で processing が mdone_signal() を呼ぶと、
+       * その瞬間に 1 が返ってループを抜ける（sleep(1) のような遅れが無い）。
        */
-      sleep(1);
+      if(mdone_wait(&done, 1000)) break;
 
       i++;
    }
 
    /*
-    * pthread_join(th, retval):
-    *   指定スレッドが終了するまで待つ（合流）。
-    *   ここで join することで、スレッドの終了を確実に待ち、
-    *   スレッドが持つ資源を回収できる。
+    * thfuture_get(f):
+    *   タスクが終了するまで待つ（pthread_join に相当）。
+    *   ここで待つことで、タスクの終了を確実に待ち、future の資源を回収できる。
     *
-    * ※このコードは flag==1 になってから join するので、
-    *   通常はすでにスレッドが終わっており、すぐ戻る。
+    * ※このコードは完了通知を受けてから待つので、
+    *   通常はすでにタスクが終わっており、すぐ戻る。
     */
-   pthread_join(th, NULL);
+   thfuture_get(f);
+   thpool_destroy(pool);
+   mdone_destroy(&done);
 
    return 0;
 }
@@ -112,22 +143,11 @@ void *processing(void *x){
    /*
     * この関数は別スレッドで動く。
     * 引数 x は void* なので、元の型にキャストして使う。
-    * ここでは &flag（int*）が渡されているため、(int*) にキャストする。
+    * ここでは &done（struct mdone*）が渡されている。
     */
 
    sleep(20); // 重い処理に見立てる（20秒かかる計算などを模擬）
 
-   /*
-    * *(int *)x = 1;
-    *   x が指す int（つまり main の flag）に 1 を書き込む。
-    *   これが main スレッドへの “完了通知” になっている。
-    *
-    * 注意:
-    *   厳密にはこの共有書き込みは同期が無いのでデータ競合になり得る。
-    *   学習段階では「共有メモリで通信できる」例として捉える。
-    */
-   *(int *)x = 1;
-
    /*
     * 改行して done を表示。
     * メインスレッドが "." を出している途中でも割り込むため、
@@ -135,5 +155,13 @@ void *processing(void *x){
     */
    fprintf(stderr, "\ndone.\n");
 
+   /*
+    * mdone_signal():
+    *   eventfd に書き込んで main スレッドへ “完了通知” を送る。
+    *   flag への書き込みと違い、同期が取れているのでデータ競合にならない。
+    *   main は mdone_wait() の中で即座に起こされる。
+    */
+   mdone_signal((struct mdone *)x);
+
    return NULL;
 }
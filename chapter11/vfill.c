@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "vfill.h"
+#if defined(__x86_64__) || defined(__i386__)
+#define VFILL_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * vfill.h の実装。
+ *
+ * どの版も「先頭（アライメントが合うまで）→ 本体（SIMD）→ 末尾（端数）」の3段構成。
+ * stream 命令は書き込み先がベクトル幅に揃っている必要があるため、
+ * 先頭の端数をスカラーで書いてから本体に入る。
+ *
+ * SIMD の版は x86 でだけコンパイルする。ほかのアーキテクチャ（と SSE2 の無い古い x86）では
+ * スカラーの版を使う（-O2 ならコンパイラがその CPU のベクトル命令に直すこともある）。
+ */
+
+static void fill_scalar(double *p, long n, double v, int nt);
+static void axpb_scalar(double *dst, const double *src, long n, double a, double b);
+#ifdef VFILL_X86
+static void fill_sse2(double *p, long n, double v, int nt);
+static void fill_avx2(double *p, long n, double v, int nt);
+static void fill_avx512(double *p, long n, double v, int nt);
+static void axpb_sse2(double *dst, const double *src, long n, double a, double b);
+static void axpb_avx2(double *dst, const double *src, long n, double a, double b);
+static void axpb_avx512(double *dst, const double *src, long n, double a, double b);
+#endif
+
+/*
+ * 実行時に選ばれた版（初回呼び出し時に pthread_once で1回だけ決める）。
+ */
+static pthread_once_t isa_once = PTHREAD_ONCE_INIT;
+static void (*fill_impl)(double *p, long n, double v, int nt);
+static void (*axpb_impl)(double *dst, const double *src, long n, double a, double b);
+static const char *isa_name;
+
+static void select_isa(void){
+#ifdef VFILL_X86
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx512f")){
+      fill_impl = fill_avx512;
+      axpb_impl = axpb_avx512;
+      isa_name = "avx512f";
+   }
+   else if(__builtin_cpu_supports("avx2")){
+      fill_impl = fill_avx2;
+      axpb_impl = axpb_avx2;
+      isa_name = "avx2";
+   }
+   else if(__builtin_cpu_supports("sse2")){
+      fill_impl = fill_sse2;      // x86-64 なら SSE2 は必ずある
+      axpb_impl = axpb_sse2;
+      isa_name = "sse2";
+   }
+   else
+#endif
+   {
+      fill_impl = fill_scalar;
+      axpb_impl = axpb_scalar;
+      isa_name = "scalar";
+   }
+}
+
+/* ------------------------------------------------------------------ */
+/* スカラー（SIMD が使えないとき）                                     */
+/* ------------------------------------------------------------------ */
+
+static void fill_scalar(double *p, long n, double v, int nt){
+   long i;
+
+   (void)nt;
+   for(i = 0; i < n; i++) p[i] = v;
+}
+
+static void axpb_scalar(double *dst, const double *src, long n, double a, double b){
+   long i;
+
+   for(i = 0; i < n; i++) dst[i] = a * src[i] + b;
+}
+
+#ifdef VFILL_X86
+/*
+ * 書き込み先が align バイト境界に揃うまでの要素数。
+ */
+static long head_len(const double *p, long n, long align){
+   long h = (long)(((align - ((uintptr_t)p & (align - 1))) & (align - 1)) / sizeof(double));
+
+   return h < n ? h : n;
+}
+
+/* ------------------------------------------------------------------ */
+/* fill                                                               */
+/* ------------------------------------------------------------------ */
+
+__attribute__((target("sse2")))
+static void fill_sse2(double *p, long n, double v, int nt){
+   long i, h = head_len(p, n, 16);
+   __m128d x = _mm_set1_pd(v);
+
+   for(i = 0; i < h; i++) p[i] = v;
+   if(nt){
+      for(; i + 2 <= n; i += 2) _mm_stream_pd(p + i, x);
+      _mm_sfence();
+   }
+   else{
+      for(; i + 2 <= n; i += 2) _mm_store_pd(p + i, x);
+   }
+   for(; i < n; i++) p[i] = v;
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(double *p, long n, double v, int nt){
+   long i, h = head_len(p, n, 32);
+   __m256d x = _mm256_set1_pd(v);
+
+   for(i = 0; i < h; i++) p[i] = v;
+   if(nt){
+      /*
+       * 1周で 128 バイト（キャッシュライン2本）ずつ書く。
+       */
+      for(; i + 16 <= n; i += 16){
+         _mm256_stream_pd(p + i, x);
+         _mm256_stream_pd(p + i + 4, x);
+         _mm256_stream_pd(p + i + 8, x);
+         _mm256_stream_pd(p + i + 12, x);
+      }
+      for(; i + 4 <= n; i += 4) _mm256_stream_pd(p + i, x);
+      /*
+       * stream 命令は書き込みが後回しにされる（write-combining バッファに溜まる）。
+       * sfence で、関数から戻る前にすべての書き込みを完了させる。
+       */
+      _mm_sfence();
+   }
+   else{
+      for(; i + 16 <= n; i += 16){
+         _mm256_store_pd(p + i, x);
+         _mm256_store_pd(p + i + 4, x);
+         _mm256_store_pd(p + i + 8, x);
+         _mm256_store_pd(p + i + 12, x);
+      }
+      for(; i + 4 <= n; i += 4) _mm256_store_pd(p + i, x);
+   }
+   for(; i < n; i++) p[i] = v;
+}
+
+__attribute__((target("avx512f")))
+static void fill_avx512(double *p, long n, double v, int nt){
+   long i, h = head_len(p, n, 64);
+   __m512d x = _mm512_set1_pd(v);
+
+   for(i = 0; i < h; i++) p[i] = v;
+   if(nt){
+      for(; i + 8 <= n; i += 8) _mm512_stream_pd(p + i, x);
+      _mm_sfence();
+   }
+   else{
+      for(; i + 32 <= n; i += 32){
+         _mm512_store_pd(p + i, x);
+         _mm512_store_pd(p + i + 8, x);
+         _mm512_store_pd(p + i + 16, x);
+         _mm512_store_pd(p + i + 24, x);
+      }
+      for(; i + 8 <= n; i += 8) _mm512_store_pd(p + i, x);
+   }
+   for(; i < n; i++) p[i] = v;
+}
+
+/* ------------------------------------------------------------------ */
+/* axpb: dst = a * src + b                                            */
+/* ------------------------------------------------------------------ */
+
+__attribute__((target("sse2")))
+static void axpb_sse2(double *dst, const double *src, long n, double a, double b){
+   long i;
+   __m128d va = _mm_set1_pd(a), vb = _mm_set1_pd(b);
+
+   for(i = 0; i + 2 <= n; i += 2){
+      _mm_storeu_pd(dst + i, _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(src + i), va), vb));
+   }
+   for(; i < n; i++) dst[i] = a * src[i] + b;
+}
+
+__attribute__((target("avx2")))
+static void axpb_avx2(double *dst, const double *src, long n, double a, double b){
+   long i;
+   __m256d va = _mm256_set1_pd(a), vb = _mm256_set1_pd(b);
+
+   for(i = 0; i + 4 <= n; i += 4){
+      _mm256_storeu_pd(dst + i,
+            _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(src + i), va), vb));
+   }
+   for(; i < n; i++) dst[i] = a * src[i] + b;
+}
+
+__attribute__((target("avx512f")))
+static void axpb_avx512(double *dst, const double *src, long n, double a, double b){
+   long i;
+   __m512d va = _mm512_set1_pd(a), vb = _mm512_set1_pd(b);
+
+   for(i = 0; i + 8 <= n; i += 8){
+      _mm512_storeu_pd(dst + i,
+            _mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(src + i), va), vb));
+   }
+   for(; i < n; i++) dst[i] = a * src[i] + b;
+}
+#endif
+
+/* ------------------------------------------------------------------ */
+/* 公開 API                                                            */
+/* ------------------------------------------------------------------ */
+
+void vfill(double *p, long n, double v){
+   pthread_once(&isa_once, select_isa);
+   fill_impl(p, n, v, n * (long)sizeof(double) >= VFILL_NT_BYTES);
+}
+
+void vaxpb(double *dst, const double *src, long n, double a, double b){
+   pthread_once(&isa_once, select_isa);
+   axpb_impl(dst, src, n, a, b);
+}
+
+const char *vfill_isa(void){
+   pthread_once(&isa_once, select_isa);
+   return isa_name;
+}
+
+/*
+ * parallel_for に渡す引数。
+ */
+struct vfill_job {
+   double *p;
+   double v;
+   int nt;                   // 配列全体の大きさで決める（区間ごとには決めない）
+   long chunk;
+   void (*progress)(long n, void *arg);
+   void *arg;
+};
+
+static void vfill_body(long lo, long hi, void *x){
+   long i, end;
+   struct vfill_job *job = x;
+
+   /*
+    * parallel_for が渡す区間は chunk 以下だが、
+    * 分割のしかたによっては chunk より短くなる。
+    * 進捗は「書き終えたところまで」を chunk 単位で通知する。
+    */
+   for(i = lo; i < hi; i = end){
+      end = i + job->chunk < hi ? i + job->chunk : hi;
+      fill_impl(job->p + i, end - i, job->v, job->nt);
+      if(job->progress != NULL) job->progress(end - i, job->arg);
+   }
+}
+
+void vfill_parallel(struct thpool *pool, double *p, long n, double v, long chunk,
+                    void (*progress)(long n, void *arg), void *arg){
+   struct vfill_job job;
+
+   pthread_once(&isa_once, select_isa);
+   if(chunk < 1) chunk = 1;
+
+   job.p = p;
+   job.v = v;
+   job.nt = n * (long)sizeof(double) >= VFILL_NT_BYTES;
+   job.chunk = chunk;
+   job.progress = progress;
+   job.arg = arg;
+
+   thpool_parallel_for(pool, 0, n, chunk, vfill_body, &job);
+}
@@ -0,0 +1,70 @@
+#ifndef VFILL_H
+#define VFILL_H
+
+#include "thpool.h"
+
+/*
+ * vfill: double 配列を一括で埋める / 変換するカーネル
+ *
+ * thread_input.c の input() は1要素ずつ「スカラーの書き込み + 共有カウンタの更新」
+ * をしていた。これを
+ *
+ *   1) SIMD 命令でまとめて書く
+ *        SSE2    : 1命令で 16 バイト（double 2個）
+ *        AVX2    : 1命令で 32 バイト（double 4個）
+ *        AVX-512 : 1命令で 64 バイト（double 8個 = キャッシュライン1本）
+ *      どれを使うかは実行時に CPU を調べて決める（__builtin_cpu_supports）。
+ *      関数ごとに __attribute__((target("avx2"))) を付けてあるので、
+ *      -mavx2 などを付けずにコンパイルしても全部の版が入る。
+ *      x86 以外ではスカラーの版だけになる（vfill_isa() は "scalar"）。
+ *
+ *   2) 大きな配列には非テンポラルストア（_mm*_stream_pd）を使う
+ *      普通の書き込みは「キャッシュラインを読み込んでから書き換える」ので、
+ *      書くだけの配列でもメモリ帯域を読み + 書きの2倍使い、
+ *      キャッシュにある他のデータも追い出してしまう。
+ *      stream 命令はキャッシュを経由せずにメモリへ直接書く。
+ *      ただし配列がキャッシュに収まる大きさなら、普通に書いた方が速い
+ *      （直後に読むならキャッシュに残っている方が良い）ので、
+ *      VFILL_NT_BYTES 以上のときだけ使う。
+ *
+ *   3) スレッドプール（thpool.h）で区間を分けて並列に書く
+ *      1コアでは DRAM の帯域を使い切れないことが多いため、複数コアで書く。
+ *      進捗は1要素ごとではなく1区間（chunk）ごとにコールバックで通知する。
+ *
+ * 【コンパイル】
+ *   gcc -O2 prog.c vfill.c thpool.c -o prog -pthread
+ */
+
+/*
+ * これ以上の大きさ（バイト）なら非テンポラルストアを使う。
+ * 最終レベルキャッシュ（数MB〜数十MB）より十分大きい値にしておく。
+ */
+#define VFILL_NT_BYTES (8L * 1024 * 1024)
+
+/*
+ * p[0..n-1] = v
+ */
+void vfill(double *p, long n, double v);
+
+/*
+ * dst[i] = a * src[i] + b  (i = 0..n-1)
+ * dst と src は同じ配列でもよい（その場で変換）。
+ */
+void vaxpb(double *dst, const double *src, long n, double a, double b);
+
+/*
+ * vfill をプール上で並列に実行する。
+ * chunk 要素ずつの区間に分け、1区間書き終わるごとに
+ * progress(その区間の要素数, arg) を呼ぶ（progress は NULL でもよい）。
+ * progress は複数のワーカーから同時に呼ばれるので、
+ * スレッドごとのカウンタ（thpool_self_id() を添字にする）などで受けること。
+ */
+void vfill_parallel(struct thpool *pool, double *p, long n, double v, long chunk,
+                    void (*progress)(long n, void *arg), void *arg);
+
+/*
+ * 実際に使われる命令セットの名前（"avx512f", "avx2", "sse2"）。
+ */
+const char *vfill_isa(void);
+
+#endif